@@ -0,0 +1,377 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Times the main libconcord operations against each emulated remote family
+ * at a range of link latencies, and writes what it measured as JSON. It has
+ * to be linked against a libconcord configured with --enable-emulator.
+ */
+
+#include "libconcord.h"
+#include "emulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <chrono>
+#include <vector>
+
+struct TFamily {
+    const char *name;
+    const char *spec;
+};
+
+static const TFamily families[] = {
+    { "classic-proto0", "classic,arch=2" },
+    { "classic-proto1", "classic,arch=8" },
+    { "zhid",           "zhid" },
+    { "usbnet",         "usbnet" },
+    { "mh",             "mh" },
+};
+static const int num_families = sizeof(families) / sizeof(families[0]);
+
+static const char *default_latencies = "0,500,2000";
+
+/* what we're measuring at the moment, for each line of output */
+struct TScenario {
+    const TFamily *family;
+    uint32_t latency;
+    char spec[128];
+};
+
+static FILE *out;
+static bool first_result = true;
+static char tmp_dir[] = "/tmp/concordance-bench-XXXXXX";
+
+static void noop_cb(uint32_t stage_id, uint32_t count, uint32_t curr,
+                    uint32_t total, uint32_t type, void *arg,
+                    const uint32_t *stages)
+{
+}
+
+/*
+ * One result. writes and reads count the reports, packets or messages each
+ * way; with several writes in flight at once they needn't pair up, so
+ * round_trips is libconcord's own count of commands and their first answer
+ * (see lc_get_transfer_stats()).
+ */
+static void report(const TScenario &sc, const char *op, int err,
+                   double seconds, const TEmuStats &stats,
+                   uint64_t round_trips)
+{
+    const uint64_t bytes = stats.bytes_out + stats.bytes_in;
+
+    fprintf(out, "%s\n    {\"family\": \"%s\", \"spec\": \"%s\", "
+            "\"latency_us\": %u, \"op\": \"%s\",\n", first_result ? "" : ",",
+            sc.family->name, sc.spec, sc.latency, op);
+    first_result = false;
+
+    if (err == LC_ERROR_UNSUPP) {
+        fprintf(out, "     \"result\": \"unsupported\"}");
+        return;
+    }
+    if (err) {
+        fprintf(out, "     \"result\": \"error\", \"error\": \"%s\"}",
+                lc_strerror(err));
+        return;
+    }
+    fprintf(out, "     \"result\": \"ok\", \"seconds\": %.6f, "
+            "\"round_trips\": %llu, \"writes\": %llu, \"reads\": %llu,\n"
+            "     \"bytes_out\": %llu, \"bytes_in\": %llu, "
+            "\"timeouts\": %llu, \"bytes_per_sec\": %.0f}", seconds,
+            (unsigned long long)round_trips,
+            (unsigned long long)stats.writes, (unsigned long long)stats.reads,
+            (unsigned long long)stats.bytes_out,
+            (unsigned long long)stats.bytes_in,
+            (unsigned long long)stats.timeouts,
+            seconds > 0 ? bytes / seconds : 0.0);
+}
+
+/*
+ * The operations we time. Anything they need set up first is done by
+ * run_scenario(), outside the timed part.
+ */
+static int op_get_identity()
+{
+    return get_identity(noop_cb, NULL);
+}
+
+static uint8_t *config_data;
+static uint32_t config_size;
+
+static int op_read_config()
+{
+    return read_config_from_remote(&config_data, &config_size, noop_cb, NULL);
+}
+
+static int op_update_config()
+{
+    return update_configuration(noop_cb, NULL, 0);
+}
+
+static int fw_direct;
+
+static int op_update_firmware()
+{
+    return update_firmware(noop_cb, NULL, 0, fw_direct);
+}
+
+static int op_set_time()
+{
+    return set_time(noop_cb, NULL);
+}
+
+static int op_learn()
+{
+    uint32_t carrier_clock;
+    uint32_t *ir_signal = NULL;
+    uint32_t ir_signal_length;
+
+    int err = learn_from_remote(&carrier_clock, &ir_signal, &ir_signal_length,
+                                noop_cb, NULL);
+    if (ir_signal)
+        delete_ir_signal(ir_signal);
+    return err;
+}
+
+static int measure(const TScenario &sc, const char *op, int (*fn)())
+{
+    static struct lc_transfer_stats transfer;
+    TEmuStats stats;
+
+    Emu_ResetStats();
+    lc_reset_transfer_stats();
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    int err = fn();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    Emu_GetStats(stats);
+    lc_get_transfer_stats(&transfer);
+
+    report(sc, op, err, elapsed.count(), stats, transfer.total.round_trips);
+    return err;
+}
+
+/* A firmware image in the XML the website hands out, for update_firmware() */
+static int make_firmware_file(char *file_name, uint32_t seed)
+{
+    std::vector<uint8_t> fw(32 * 1024);
+    uint32_t x = seed;
+
+    for (unsigned int i = 0; i < fw.size(); i++) {
+        x = x * 1103515245 + 12345;
+        fw[i] = x >> 16;
+    }
+    /* blank checksum, so libconcord fills in the magic bytes */
+    fw[0] = fw[1] = 0xFF;
+
+    return write_firmware_to_file(&fw[0], fw.size(), file_name, 0);
+}
+
+static int run_scenario(TScenario &sc, uint32_t seed)
+{
+    int err;
+    int type;
+    char config_file[sizeof(tmp_dir) + 16];
+    char firmware_file[sizeof(tmp_dir) + 16];
+
+    snprintf(config_file, sizeof(config_file), "%s/config", tmp_dir);
+    snprintf(firmware_file, sizeof(firmware_file), "%s/firmware", tmp_dir);
+
+    /* a fresh seed is a remote libconcord hasn't cached anything about */
+    snprintf(sc.spec, sizeof(sc.spec), "%s,latency=%u,seed=%u",
+             sc.family->spec, sc.latency, seed);
+    if ((err = Emu_Configure(sc.spec))) {
+        fprintf(stderr, "Bad emulator spec: %s\n", sc.spec);
+        return err;
+    }
+    if ((err = init_concord())) {
+        fprintf(stderr, "%s: failed to connect: %s\n", sc.spec,
+                lc_strerror(err));
+        return err;
+    }
+
+    if ((err = measure(sc, "get_identity", op_get_identity)))
+        goto out;
+
+    /*
+     * Whatever we read back is what we upload, so the config is one the
+     * emulated remote will take.
+     */
+    config_data = NULL;
+    if (!measure(sc, "read_config_from_remote", op_read_config)) {
+        err = write_config_to_file(config_data, config_size, config_file, 0);
+        delete_blob(config_data);
+        if (!err)
+            err = read_and_parse_file(config_file, &type);
+        if (!err && type == LC_FILE_TYPE_CONFIGURATION)
+            measure(sc, "update_configuration", op_update_config);
+        else
+            fprintf(stderr, "%s: couldn't reload the config read\n",
+                    sc.spec);
+    }
+
+    /* these return 0 when the update is supported */
+    if (!is_fw_update_supported(0) || !is_fw_update_supported(1)) {
+        fw_direct = is_fw_update_supported(0) != 0;
+        err = make_firmware_file(firmware_file, seed);
+        if (!err)
+            err = read_and_parse_file(firmware_file, &type);
+        if (!err && type == LC_FILE_TYPE_FIRMWARE)
+            measure(sc, "update_firmware", op_update_firmware);
+        else
+            fprintf(stderr, "%s: couldn't load a firmware image\n", sc.spec);
+    } else {
+        TEmuStats stats = TEmuStats();
+        report(sc, "update_firmware", LC_ERROR_UNSUPP, 0, stats, 0);
+    }
+
+    measure(sc, "set_time", op_set_time);
+    measure(sc, "learn_from_remote", op_learn);
+    err = 0;
+
+out:
+    delete_opfile_obj();
+    deinit_concord();
+    return err;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int parse_latencies(const char *list, std::vector<uint32_t> &latencies)
+{
+    const char *p = list;
+
+    while (*p) {
+        char *end;
+        unsigned long us = strtoul(p, &end, 10);
+        if (end == p || (*end && *end != ','))
+            return LC_ERROR;
+        latencies.push_back(us);
+        p = *end ? end + 1 : end;
+    }
+    return latencies.empty() ? LC_ERROR : 0;
+}
+
+static bool wanted(const char *list, const char *name)
+{
+    if (!list)
+        return true;
+
+    const size_t len = strlen(name);
+    for (const char *p = list; (p = strstr(p, name)); p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || !p[len]))
+            return true;
+    }
+    return false;
+}
+
+static void help()
+{
+    printf("Usage: concordance-bench <options>\n\n");
+
+    printf("Options:\n");
+    printf("\t-f <list>\tFamilies to run, comma-separated (default all):\n");
+    printf("\t\t\t");
+    for (int i = 0; i < num_families; i++)
+        printf("%s%s", families[i].name, i + 1 < num_families ? " " : "\n");
+    printf("\t-l <list>\tLatencies in us, comma-separated (default %s).\n",
+           default_latencies);
+    printf("\t-o <file>\tWrite the results to <file> (default stdout).\n");
+    printf("\t-h\t\tThis help.\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int tmpint;
+    const char *family_list = NULL;
+    const char *latency_list = default_latencies;
+    const char *out_name = NULL;
+    std::vector<uint32_t> latencies;
+    int failures = 0;
+
+    while ((tmpint = getopt(argc, argv, "f:hl:o:")) != EOF) {
+        switch (tmpint) {
+        case 'f':
+            family_list = optarg;
+            break;
+        case 'l':
+            latency_list = optarg;
+            break;
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'h':
+            help();
+            exit(0);
+        default:
+            help();
+            exit(1);
+        }
+    }
+
+    if (parse_latencies(latency_list, latencies)) {
+        fprintf(stderr, "Bad latency list: %s\n", latency_list);
+        exit(1);
+    }
+
+    out = stdout;
+    if (out_name && !(out = fopen(out_name, "w"))) {
+        perror(out_name);
+        exit(1);
+    }
+
+    /*
+     * libconcord keeps identities and upload journals under the config
+     * directory; keep ours out of the user's.
+     */
+    if (!mkdtemp(tmp_dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    setenv("XDG_CONFIG_HOME", tmp_dir, 1);
+
+    fprintf(out, "{\"results\": [");
+
+    uint32_t seed = 1;
+    for (int i = 0; i < num_families; i++) {
+        if (!wanted(family_list, families[i].name))
+            continue;
+        for (unsigned int j = 0; j < latencies.size(); j++) {
+            TScenario sc;
+            sc.family = &families[i];
+            sc.latency = latencies[j];
+            if (run_scenario(sc, seed++))
+                failures++;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    if (out != stdout)
+        fclose(out);
+
+    nftw(tmp_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return failures ? 1 : 0;
+}
@@ -22,9 +22,11 @@
 /* Platform-agnostic includes */
 #include <getopt.h>
 #include <libconcord.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #ifdef _WIN32
 /* Windows includes*/
@@ -98,6 +100,16 @@ struct options_t {
     int direct;
     int noreset;
     int force;
+    int delta;
+    int resume;
+    int stats;
+    /* where to capture the traffic to, with --capture */
+    char *capture;
+    int all;
+    int jobs;
+    /* the remotes asked for with --device, by path or serial */
+    char **devices;
+    int num_devices;
 };
 
 enum {
@@ -114,7 +126,8 @@ enum {
     MODE_GET_TIME,
     MODE_SET_TIME,
     MODE_PRINT_INFO,
-    MODE_VERSION
+    MODE_VERSION,
+    MODE_CALIBRATE
 };
 
 /*
@@ -350,18 +363,26 @@ void parse_options(struct options_t *options, int *mode, char **file_name,
 
     static struct option long_options[] = {
         {"binary", no_argument, 0, 'b'},
+        {"calibrate", no_argument, 0, 0},
+        {"capture", required_argument, 0, 0},
+        {"all", no_argument, 0, 0},
         {"dump-config", optional_argument, 0, 'c'},
         {"write-config", required_argument, 0, 'C'},
+        {"delta", no_argument, 0, 0},
         {"direct", no_argument, 0, 'd'},
+        {"device", required_argument, 0, 0},
         {"force", no_argument, 0, 0},
         {"dump-firmware", optional_argument, 0, 'f'},
         {"write-firmware", required_argument, 0, 'F'},
         {"help", no_argument, 0, 'h'},
         {"print-remote-info", no_argument, 0, 'i'},
+        {"jobs", required_argument, 0, 'j'},
         {"learn-ir", required_argument, 0, 'l'},
         {"reset", no_argument, 0, 'r'},
         {"no-reset", no_argument, 0, 'R'},
+        {"resume", no_argument, 0, 0},
         {"dump-safemode", optional_argument, 0, 's'},
+        {"stats", no_argument, 0, 0},
         {"connectivity-test", required_argument, 0, 't'},
         {"get-time", no_argument, 0, 'k' },
         {"set-time", no_argument, 0, 'K' },
@@ -377,13 +398,21 @@ void parse_options(struct options_t *options, int *mode, char **file_name,
     (*options).direct = 0;
     (*options).force = 0;
     (*options).noreset = 0;
+    (*options).delta = 0;
+    (*options).resume = 0;
+    (*options).stats = 0;
+    (*options).capture = NULL;
+    (*options).all = 0;
+    (*options).jobs = 0;
+    (*options).devices = NULL;
+    (*options).num_devices = 0;
 
     *mode = MODE_UNSET;
 
     tmpint = 0;
     option_index = 0;
 
-    while ((tmpint = getopt_long(argc, argv, "bc::C:df::F:hil:rs::t:kKvVw",
+    while ((tmpint = getopt_long(argc, argv, "bc::C:df::F:hij:l:rs::t:kKvVw",
                 long_options, &option_index)) != EOF) {
         switch (tmpint) {
         case 0:
@@ -392,6 +421,36 @@ void parse_options(struct options_t *options, int *mode, char **file_name,
                 (*options).force = 1;
                 break;
             }
+            if (!strcmp(long_options[option_index].name, "calibrate")) {
+                set_mode(mode, MODE_CALIBRATE);
+                break;
+            }
+            if (!strcmp(long_options[option_index].name, "all")) {
+                (*options).all = 1;
+                break;
+            }
+            if (!strcmp(long_options[option_index].name, "delta")) {
+                (*options).delta = 1;
+                break;
+            }
+            if (!strcmp(long_options[option_index].name, "resume")) {
+                (*options).resume = 1;
+                break;
+            }
+            if (!strcmp(long_options[option_index].name, "stats")) {
+                (*options).stats = 1;
+                break;
+            }
+            if (!strcmp(long_options[option_index].name, "capture")) {
+                (*options).capture = optarg;
+                break;
+            }
+            if (!strcmp(long_options[option_index].name, "device")) {
+                (*options).devices = (char **) realloc((*options).devices,
+                    ((*options).num_devices + 1) * sizeof(char *));
+                (*options).devices[(*options).num_devices++] = optarg;
+                break;
+            }
             break;
         case 'b':
             (*options).binary = 1;
@@ -432,6 +491,13 @@ void parse_options(struct options_t *options, int *mode, char **file_name,
         case 'i':
             set_mode(mode, MODE_PRINT_INFO);
             break;
+        case 'j':
+            (*options).jobs = atoi(optarg);
+            if ((*options).jobs < 1) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                exit(1);
+            }
+            break;
         case 'l':
             if (optarg == NULL) {
                 fprintf(stderr, "Missing config file to read from.\n");
@@ -490,6 +556,12 @@ void parse_options(struct options_t *options, int *mode, char **file_name,
         *file_name = argv[optind];
     }
 
+    if ((*options).all && (*options).num_devices) {
+        fprintf(stderr, "Please specify either --all or --device,");
+        fprintf(stderr, " not both.\n");
+        exit(1);
+    }
+
 }
 
 void help()
@@ -503,6 +575,9 @@ void help()
 
     printf("When specifying options, you must first choose a mode:\n\n");
 
+    printf("   --calibrate\n");
+    printf("\tFind the fastest flash transfer size the remote handles and");
+    printf(" use it\n\tfrom now on for all remotes of its kind.\n\n");
     printf("   -c, --dump-config [<filename>]\n");
     printf("\tRead the config from the remote and write it to a file.");
     printf("\n\tIf no filename is specified, config.EZHex is used.\n\n");
@@ -545,6 +620,10 @@ void help()
     printf("Additionally, you can specify options to adjust the behavior");
     printf(" of the software:\n\n");
 
+    printf("   --all\n");
+    printf("\tWrite the config or firmware to every attached remote at");
+    printf(" once.\n\tOnly valid when writing a config or firmware.\n\n");
+
     printf("  -b, --binary-only\n");
     printf("\tWhen dumping a config or firmware, this specifies to dump");
     printf(" only the\n\tbinary portion. When use without a specific");
@@ -554,16 +633,44 @@ void help()
     printf(" filename\n\tpassed in has just the binary blob, not the");
     printf(" XML.\n\n");
 
+    printf("   --capture <file>\n");
+    printf("\tWrite everything sent to and received from the remote to");
+    printf(" <file>,\n\twith timestamps, for consnoop to decode.\n\n");
+
+    printf("   --delta\n");
+    printf("\tWhen writing a config, only rewrite the parts of flash that");
+    printf(" change.\n\tMuch faster for small edits. Not all remotes");
+    printf(" support this; the\n\tothers get a full update.\n\n");
+
+    printf("   --device <path|serial>\n");
+    printf("\tUse the remote with this USB path or serial number instead");
+    printf(" of the\n\tfirst one found. May be given more than once to");
+    printf(" write a config\n\tor firmware to several remotes at once.\n\n");
+
     printf("   --force\n");
     printf("\tForce. This forces concordance to use the file the way\n");
     printf("\tyou specified, even if it doesn't think that's the kind\n");
     printf("\tof file it is. This is necessary for files dumped by\n");
     printf("\tconcordance.\n\n");
 
+    printf("  -j, --jobs <n>\n");
+    printf("\tWith --all or several --device options, update at most <n>");
+    printf(" remotes\n\tat a time. The default is all of them.\n\n");
+
     printf("  -R, --no-reset\n");
     printf("\tFor config or firmware updates, do not reboot the device");
     printf(" when done.\n\tThis is generally only for debugging.\n\n");
 
+    printf("   --resume\n");
+    printf("\tWhen writing a config or firmware, pick up where an");
+    printf(" interrupted\n\twrite of the same file to the same remote");
+    printf(" left off, instead of\n\tstarting over.\n\n");
+
+    printf("   --stats\n");
+    printf("\tWhen done, print what went to and from the remote for each");
+    printf(" command:\n\tround trips, bytes, timeouts, retries and");
+    printf(" latency. With -v, also\n\thistograms of the latency.\n\n");
+
     printf("  -v, --verbose\n");
     printf("\tEnable verbose output.\n\n");
 
@@ -759,7 +866,13 @@ int upload_config(struct options_t *options, lc_callback cb, void *cb_arg)
             return err;
     }
 
-    if ((err = update_configuration(cb, cb_arg, (*options).noreset))) {
+    lc_set_resume((*options).resume);
+    if ((*options).delta) {
+        err = update_configuration_delta(cb, cb_arg, (*options).noreset);
+    } else {
+        err = update_configuration(cb, cb_arg, (*options).noreset);
+    }
+    if (err) {
         return err;
     }
 
@@ -817,6 +930,7 @@ int upload_firmware(struct options_t *options, lc_callback cb, void *cb_arg)
         }
     }
 
+    lc_set_resume((*options).resume);
     if ((err = update_firmware(cb, cb_arg, (*options).noreset,
                                (*options).direct)))
         return err;
@@ -919,6 +1033,362 @@ int print_version_info(struct options_t *options)
     return 0;
 }
 
+void print_command_stats(const struct lc_command_stats *cs, const char *name,
+                         int verbose)
+{
+    int i, last;
+    uint64_t limit;
+
+    printf("  %-22.22s %6llu %10llu %10llu %4llu %5llu", name,
+           (unsigned long long)cs->round_trips,
+           (unsigned long long)cs->bytes_out,
+           (unsigned long long)cs->bytes_in,
+           (unsigned long long)cs->timeouts,
+           (unsigned long long)cs->retries);
+    if (cs->round_trips) {
+        printf(" %7.2f %8.2f\n",
+               cs->latency_total / 1000.0 / cs->round_trips,
+               cs->latency_max / 1000.0);
+    } else {
+        printf(" %7s %8s\n", "-", "-");
+    }
+
+    if (!verbose || !cs->round_trips)
+        return;
+
+    last = LC_STATS_LATENCY_BUCKETS - 1;
+    limit = LC_STATS_LATENCY_BASE_US;
+    printf("   ");
+    for (i = 0; i < last; i++, limit <<= 1) {
+        if (cs->latency[i])
+            printf(" <%gms: %llu", limit / 1000.0,
+                   (unsigned long long)cs->latency[i]);
+    }
+    if (cs->latency[last])
+        printf(" >=%gms: %llu", (limit >> 1) / 1000.0,
+               (unsigned long long)cs->latency[last]);
+    printf("\n");
+}
+
+/*
+ * For --stats: what the session sent and received, for each command and in
+ * total. A round trip is a command and the first answer to it.
+ */
+void print_transfer_stats(lc_session *s, const char *title, int verbose)
+{
+    struct lc_transfer_stats *stats;
+    int i;
+
+    stats = (struct lc_transfer_stats *) malloc(sizeof(*stats));
+    if (!stats || lc_get_transfer_stats_s(s, stats)) {
+        free(stats);
+        return;
+    }
+
+    printf("%s:\n", title);
+    printf("  %-22s %6s %10s %10s %4s %5s %7s %8s\n", "Command", "Trips",
+           "Bytes out", "Bytes in", "T/O", "Retry", "Avg ms", "Max ms");
+    for (i = 0; i < stats->num_commands; i++)
+        print_command_stats(&stats->command[i], stats->command[i].name,
+                            verbose);
+    print_command_stats(&stats->total, "Total", verbose);
+    printf("\n");
+
+    free(stats);
+}
+
+/*
+ * Find an attached remote by USB path or serial number.
+ */
+int lookup_device(const char *name, struct lc_device_info *dev)
+{
+    struct lc_device_info *devs;
+    int num_devs, i, err;
+
+    if (!strcmp(name, LC_USBNET_PATH)) {
+        memset(dev, 0, sizeof(*dev));
+        dev->transport = LC_TRANSPORT_USBNET;
+        strcpy(dev->path, LC_USBNET_PATH);
+        return 0;
+    }
+
+    if ((err = lc_enumerate_remotes(&devs, &num_devs, 0)))
+        return err;
+
+    err = LC_ERROR_CONNECT;
+    for (i = 0; i < num_devs; i++) {
+        if (!strcmp(devs[i].path, name) ||
+            (devs[i].serial[0] && !strcmp(devs[i].serial, name))) {
+            *dev = devs[i];
+            err = 0;
+            break;
+        }
+    }
+
+    lc_delete_device_list(devs);
+    return err;
+}
+
+/*
+ * Fleet mode: write the same config or firmware to several remotes at
+ * once. The file is read once, into the default session, and every remote
+ * gets its own session sharing it. A pool of threads works through the
+ * remotes, one remote per thread at a time.
+ */
+struct fleet_job_t {
+    int num;
+    struct lc_device_info dev;
+    int err;
+    uint32_t stage;
+    uint32_t last_pct;
+    double secs;
+};
+
+struct fleet_t {
+    struct options_t *options;
+    int mode;
+    struct fleet_job_t *jobs;
+    int num_jobs;
+    int next_job;
+    pthread_mutex_t lock;
+};
+
+pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double now_secs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * The percentage display of cb_print_percent_status() can't work with
+ * several remotes reporting at once, so instead we print a line each time a
+ * remote starts a stage, gets another quarter of the way through it, or
+ * finishes it.
+ */
+void cb_print_fleet_status(uint32_t stage_id, uint32_t count, uint32_t curr,
+    uint32_t total, uint32_t counter_type, void *arg,
+    const uint32_t *stages)
+{
+    struct fleet_job_t *job = (struct fleet_job_t *)arg;
+    uint32_t pct;
+
+    if (stage_id == LC_CB_STAGE_NUM_STAGES)
+        return;
+
+    pct = total ? (uint64_t)curr*100/total : 100;
+    if (count != 0 && stage_id == job->stage && pct/25 == job->last_pct/25)
+        return;
+
+    job->stage = stage_id;
+    job->last_pct = pct;
+
+    pthread_mutex_lock(&print_lock);
+    printf("[%i] ", job->num);
+    print_stage_name(stage_id);
+    printf("%3i%%%s\n", pct, curr == total ? "   done" : "");
+    fflush(stdout);
+    pthread_mutex_unlock(&print_lock);
+}
+
+int fleet_update_one(struct fleet_t *fleet, struct fleet_job_t *job)
+{
+    struct options_t *options = fleet->options;
+    lc_callback cb = cb_print_fleet_status;
+    int web = !(*options).binary && !(*options).noweb;
+    lc_session *s;
+    int err;
+
+    s = lc_session_new();
+    if ((err = lc_session_share_file(s, lc_default_session())))
+        goto out;
+
+    if ((err = init_concord_path_s(s, job->dev.path)))
+        goto out;
+    lc_set_resume_s(s, (*options).resume);
+
+    err = get_identity_s(s, cb, job);
+    if (err != 0 && err != LC_ERROR_INVALID_CONFIG)
+        goto out;
+
+    if (fleet->mode == MODE_WRITE_CONFIG) {
+        if (web && (err = post_preconfig_s(s, cb, job)))
+            goto out;
+        if ((*options).delta)
+            err = update_configuration_delta_s(s, cb, job,
+                                               (*options).noreset);
+        else
+            err = update_configuration_s(s, cb, job, (*options).noreset);
+        if (err)
+            goto out;
+        if (web)
+            err = post_postconfig_s(s, cb, job);
+    } else {
+        if ((err = is_fw_update_supported_s(s, (*options).direct)))
+            goto out;
+        if ((err = update_firmware_s(s, cb, job, (*options).noreset,
+                                     (*options).direct)))
+            goto out;
+        if (web)
+            err = post_postfirmware_s(s, cb, job);
+    }
+
+out:
+    if ((*options).stats) {
+        char title[64];
+        snprintf(title, sizeof(title), "[%i] Transfer statistics", job->num);
+        pthread_mutex_lock(&print_lock);
+        print_transfer_stats(s, title, (*options).verbose);
+        pthread_mutex_unlock(&print_lock);
+    }
+    lc_session_free(s);
+    return err;
+}
+
+void *fleet_worker(void *arg)
+{
+    struct fleet_t *fleet = (struct fleet_t *)arg;
+    struct fleet_job_t *job;
+    double start;
+
+    while (1) {
+        pthread_mutex_lock(&fleet->lock);
+        job = NULL;
+        if (fleet->next_job < fleet->num_jobs)
+            job = &fleet->jobs[fleet->next_job++];
+        pthread_mutex_unlock(&fleet->lock);
+        if (!job)
+            break;
+
+        start = now_secs();
+        job->err = fleet_update_one(fleet, job);
+        job->secs = now_secs() - start;
+
+        pthread_mutex_lock(&print_lock);
+        if (job->err) {
+            printf("[%i] Failed: %s\n", job->num, lc_strerror(job->err));
+        } else {
+            printf("[%i] Success!\n", job->num);
+        }
+        pthread_mutex_unlock(&print_lock);
+    }
+
+    return NULL;
+}
+
+int fleet_update(struct options_t *options, int mode)
+{
+    struct fleet_t fleet;
+    struct lc_device_info *devs;
+    pthread_t *threads;
+    int num_devs, num_threads, failed, i, err;
+    double start;
+
+    if (mode != MODE_WRITE_CONFIG && mode != MODE_WRITE_FIRMWARE) {
+        fprintf(stderr, "ERROR: Only config and firmware updates can be");
+        fprintf(stderr, " done on several remotes at once.\n");
+        return LC_ERROR;
+    }
+
+    if ((*options).all) {
+        if ((err = lc_enumerate_remotes(&devs, &num_devs, 1))) {
+            fprintf(stderr, "ERROR: Couldn't list remotes: %s\n",
+                    lc_strerror(err));
+            return err;
+        }
+        fleet.num_jobs = num_devs;
+    } else {
+        fleet.num_jobs = (*options).num_devices;
+    }
+
+    if (fleet.num_jobs == 0) {
+        fprintf(stderr, "ERROR: No remotes found.\n");
+        return LC_ERROR_CONNECT;
+    }
+
+    fleet.jobs = (struct fleet_job_t *)
+        calloc(fleet.num_jobs, sizeof(struct fleet_job_t));
+    for (i = 0; i < fleet.num_jobs; i++) {
+        fleet.jobs[i].num = i + 1;
+        if ((*options).all) {
+            fleet.jobs[i].dev = devs[i];
+        } else if (lookup_device((*options).devices[i],
+                                 &fleet.jobs[i].dev)) {
+            fprintf(stderr, "ERROR: No remote at %s\n",
+                    (*options).devices[i]);
+            free(fleet.jobs);
+            return LC_ERROR_CONNECT;
+        }
+    }
+    if ((*options).all)
+        lc_delete_device_list(devs);
+
+    printf("Updating %i remotes:\n", fleet.num_jobs);
+    for (i = 0; i < fleet.num_jobs; i++) {
+        printf("  [%i] %s %s\n", fleet.jobs[i].num, fleet.jobs[i].dev.path,
+               fleet.jobs[i].dev.serial);
+    }
+    printf("\n");
+
+    if (mode == MODE_WRITE_FIRMWARE) {
+        if ((*options).direct) {
+            direct_warning();
+        } else {
+            printf("NOTE: On some remotes, a firmware upgrade will erase");
+            printf(" the config and you\nwill need to update it.\n");
+            printf("Press <enter> to continue.\n");
+            getchar();
+        }
+    }
+
+    num_threads = fleet.num_jobs;
+    if ((*options).jobs && (*options).jobs < num_threads)
+        num_threads = (*options).jobs;
+
+    fleet.options = options;
+    fleet.mode = mode;
+    fleet.next_job = 0;
+    pthread_mutex_init(&fleet.lock, NULL);
+
+    start = now_secs();
+    threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    for (i = 0; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, fleet_worker, &fleet);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&fleet.lock);
+
+    /*
+     * Summary
+     */
+    err = 0;
+    failed = 0;
+    printf("\n%-4s %-24s %-20s %9s  %s\n", "#", "Path", "Serial", "Time",
+           "Result");
+    for (i = 0; i < fleet.num_jobs; i++) {
+        struct fleet_job_t *job = &fleet.jobs[i];
+        printf("%-4i %-24.24s %-20.20s %8.1fs  ", job->num, job->dev.path,
+               job->dev.serial, job->secs);
+        if (job->err) {
+            printf("%s: %s\n", lc_cb_stage_str(job->stage),
+                   lc_strerror(job->err));
+            if (!err)
+                err = job->err;
+            failed++;
+        } else {
+            printf("OK\n");
+        }
+    }
+    printf("\n%i of %i remotes updated in %.1fs\n\n",
+           fleet.num_jobs - failed, fleet.num_jobs, now_secs() - start);
+
+    free(fleet.jobs);
+    return err;
+}
+
 /*
  * MAIN
  */
@@ -926,7 +1396,7 @@ int main(int argc, char *argv[])
 {
     struct options_t options;
     char *file_name;
-    int mode, file_mode, err;
+    int mode, file_mode, err, fleet;
 
     printf("Concordance %s\n", VERSION);
     printf("Copyright 2007 Kevin Timmerman and Phil Dibowitz\n");
@@ -956,13 +1426,29 @@ int main(int argc, char *argv[])
      * need to know what type of remote we're dealing with early on.
      */
 
-    err = init_concord();
-    if (err != 0) {
-        fprintf(stderr, "ERROR: Couldn't initializing libconcord: %s\n",
-                lc_strerror(err));
+    if (options.capture && (err = lc_start_capture(options.capture))) {
+        fprintf(stderr, "ERROR: Couldn't start capturing to %s: %s\n",
+                options.capture, lc_strerror(err));
         exit(1);
     }
 
+    fleet = options.all || options.num_devices > 1;
+    if (!fleet) {
+        if (options.num_devices == 1) {
+            struct lc_device_info dev;
+            err = lookup_device(options.devices[0], &dev);
+            if (err == 0)
+                err = init_concord_path_s(lc_default_session(), dev.path);
+        } else {
+            err = init_concord();
+        }
+        if (err != 0) {
+            fprintf(stderr, "ERROR: Couldn't initializing libconcord: %s\n",
+                    lc_strerror(err));
+            exit(1);
+        }
+    }
+
     /*
       * Alright, at this point, if there's going to be a filename,
       * we have one, so lets read the file.
@@ -1018,6 +1504,15 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    /*
+     * Several remotes get their own sessions, the default session only
+     * holds the file they share.
+     */
+    if (fleet) {
+        err = fleet_update(&options, mode);
+        goto cleanup;
+    }
+
     /*
      * The is..supported() functions return 0 for yes, so 1 is NO
      */
@@ -1137,6 +1632,13 @@ int main(int argc, char *argv[])
             print_time(1);
             break;
 
+        case MODE_CALIBRATE:
+            err = lc_calibrate_chunk_sizes(cb_print_percent_status, NULL);
+            if (err != 0) {
+                printf("Failed to calibrate: %s\n", lc_strerror(err));
+            }
+            break;
+
         default:
             fprintf(stderr,
                 "ERROR: Got to a place I don't understand!\n");
@@ -1145,10 +1647,16 @@ int main(int argc, char *argv[])
             
 cleanup:
 
+    if (options.stats && !fleet)
+        print_transfer_stats(lc_default_session(), "Transfer statistics",
+                             options.verbose);
+
     delete_opfile_obj();
 
     deinit_concord();
 
+    free(options.devices);
+
     if (err) {
         printf("Failed with error %i\n", err);
     } else {
@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <stdint.h>
+#include <map>
+#include <vector>
 
 // TODO: Once we figure this stuff out, move it to someplace more useful.
 #define TYPE_TCP_ACK 0x40
@@ -35,6 +37,7 @@ using namespace std;
 
 #include "../libconcord/protocol.h"
 #include "../libconcord/protocol_z.h"
+#include "../libconcord/capture.h"
 
 static const unsigned int rxlenmap0[16] =
 	{  0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14 };
@@ -484,6 +487,110 @@ void decode_z(int *mode, const uint8_t * const data)
 	}
 }
 
+uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | get16(p + 2) << 16;
+}
+
+uint64_t get64(const uint8_t *p)
+{
+	return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+void print_hex(const uint8_t * const data, unsigned int len)
+{
+	printf("   DATA:");
+	for (unsigned int i = 0; i < len; i++) {
+		printf(" %02X", data[i]);
+	}
+	printf("\n");
+}
+
+/*
+ * Decode a capture written by libconcord (see lc_start_capture()). Unlike a
+ * USB sniffer log it says what kind of remote each report is for, so -z
+ * isn't needed; each channel is a separate session, with its own Z-Wave
+ * HID mode.
+ */
+int decode_capture(ifstream &infile, int proto)
+{
+	uint8_t hdr[CAPTURE_RECORD_HEADER_SIZE];
+	map<uint16_t, int> zwave_hid_modes;
+
+	infile.read(reinterpret_cast<char*>(hdr), 2);
+	if (!infile || get16(hdr) != CAPTURE_VERSION) {
+		fprintf(stderr, "Unsupported capture version.\n");
+		return 1;
+	}
+
+	while (infile.read(reinterpret_cast<char*>(hdr), sizeof(hdr))) {
+		const uint64_t time = get64(hdr);
+		const uint8_t type = hdr[8];
+		const uint8_t rproto = hdr[9];
+		const uint16_t channel = get16(hdr + 10);
+		const uint16_t orig_len = get16(hdr + 12);
+		const uint16_t len = get16(hdr + 14);
+
+		// the decoders may look past a short report, as with the logs
+		vector<uint8_t> data(len > 260 ? len : 260, 0xcd);
+		if (len && !infile.read(reinterpret_cast<char*>(&data[0]),
+					len)) {
+			fprintf(stderr, "Capture cut short.\n");
+			return 1;
+		}
+
+		printf("%4u.%06u [%u] ", (unsigned int)(time / 1000000),
+			(unsigned int)(time % 1000000), channel);
+		switch (type) {
+		case CAPTURE_DROPPED:
+			printf("*** %u reports dropped\n", get32(&data[0]));
+			continue;
+		case CAPTURE_TIMEOUT:
+			printf("--- Timeout\n");
+			continue;
+		case CAPTURE_OUT:
+			printf(">>> ");
+			break;
+		case CAPTURE_IN:
+			printf("<<< ");
+			break;
+		default:
+			printf("??? Unknown record type %02X\n", type);
+			continue;
+		}
+
+		if (debug) {
+			for (unsigned int i = 0; i < len; ++i) {
+				printf("%02X", data[i]);
+			}
+			if (len < orig_len) {
+				printf("... (%u bytes)", orig_len);
+			}
+			printf("\n");
+		}
+		switch (rproto) {
+		case CAPTURE_PROTO_CLASSIC:
+			decode(&data[0], proto);
+			break;
+		case CAPTURE_PROTO_ZHID:
+			decode_z(&zwave_hid_modes[channel], &data[0]);
+			break;
+		case CAPTURE_PROTO_USBNET:
+			decode_z_net_tcp(&zwave_hid_modes[channel], &data[0]);
+			break;
+		default:
+			printf("%u bytes\n", orig_len);
+			print_hex(&data[0], len);
+			break;
+		}
+	}
+	return 0;
+}
 
 void help()
 {
@@ -492,7 +599,9 @@ void help()
 	printf("Options:\n");
 	printf("\t-v\tVerbose. Print bytes we write.\n");
 	printf("\t-d\tDebug. Print full data for all decoded packets.\n");
-	printf("\t-f <file>\tFilename to parse.\n");
+	printf("\t-f <file>\tFilename to parse: a USB sniffer log or a "
+		"libconcord\n\t\tcapture.\n");
+	printf("\t-0\tDecode classic remotes using protocol 0.\n");
 	printf("\t-h\tThis help.\n\n");
 	printf("\t-z\tDecode using z-wave HID.\n\n");
 }
@@ -505,7 +614,7 @@ int main(int argc, char *argv[])
 	// 0 - UDP, 1 - transitioning to TCP, 2 - TCP
 	int zwave_hid_mode = 0;
 	char *file_name = NULL;
-	while ((tmpint = getopt(argc, argv, "dhf:vz")) != EOF) {
+	while ((tmpint = getopt(argc, argv, "0dhf:vz")) != EOF) {
 		switch (tmpint) {
 		case 'd':
 			debug = true;
@@ -533,7 +642,17 @@ int main(int argc, char *argv[])
 	}
 
 	ifstream infile;
-	infile.open(file_name);
+	infile.open(file_name, ios::binary);
+
+	char magic[CAPTURE_MAGIC_SIZE];
+	if (infile.read(magic, sizeof(magic)) &&
+	    !memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+		tmpint = decode_capture(infile, proto);
+		infile.close();
+		return tmpint;
+	}
+	infile.clear();
+	infile.seekg(0);
 
 	string s;
 	string payloadbytes("<payloadbytes>");
@@ -94,6 +94,7 @@ LC_CB_STAGE_RESET = 18
 LC_CB_STAGE_SET_TIME = 19
 LC_CB_STAGE_HTTP = 20
 LC_CB_STAGE_LEARN = 21
+LC_CB_STAGE_CALIBRATE = 22
 
 # Public libconcord API: Exception types
 
@@ -665,6 +666,15 @@ update_configuration = _create_func(
     _in('noreset', c_int)
 )
 
+# int update_configuration_delta(lc_callback cb, void *cb_arg, int noreset);
+update_configuration_delta = _create_func(
+    'update_configuration_delta',
+    _ret_lc_concord(),
+    _in('cb', callback_type),
+    _in('cb_arg', py_object),
+    _in('noreset', c_int)
+)
+
 # int read_config_from_remote(uint8_t **out, uint32_t *size,
 #     lc_callback cb, void *cb_arg);
 read_config_from_remote = _create_func(
@@ -1002,3 +1012,87 @@ mh_write_file = _create_func(
     _in('buffer', POINTER(c_ubyte)),
     _in('buflen', c_uint)
 )
+
+# int lc_calibrate_chunk_sizes(lc_callback cb, void *cb_arg);
+lc_calibrate_chunk_sizes = _create_func(
+    'lc_calibrate_chunk_sizes',
+    _ret_lc_concord(),
+    _in('cb', callback_type),
+    _in('cb_arg', py_object)
+)
+
+# void lc_set_resume(int resume);
+lc_set_resume = _create_func(
+    'lc_set_resume',
+    _ret_void(),
+    _in('resume', c_int)
+)
+
+LC_STATS_MAX_COMMANDS = 64
+LC_STATS_LATENCY_BUCKETS = 20
+LC_STATS_LATENCY_BASE_US = 64
+LC_STATS_NAME_LENGTH = 40
+
+#struct lc_command_stats {
+#    uint32_t code;
+#    char name[LC_STATS_NAME_LENGTH];
+#    uint64_t reports_out;
+#    uint64_t reports_in;
+#    uint64_t bytes_out;
+#    uint64_t bytes_in;
+#    uint64_t round_trips;
+#    uint64_t timeouts;
+#    uint64_t retries;
+#    uint64_t latency_total;
+#    uint64_t latency_max;
+#    uint64_t latency[LC_STATS_LATENCY_BUCKETS];
+#};
+class lc_command_stats(Structure):
+    _fields_ = [("code", c_uint32),
+                ("name", c_char * LC_STATS_NAME_LENGTH),
+                ("reports_out", c_uint64),
+                ("reports_in", c_uint64),
+                ("bytes_out", c_uint64),
+                ("bytes_in", c_uint64),
+                ("round_trips", c_uint64),
+                ("timeouts", c_uint64),
+                ("retries", c_uint64),
+                ("latency_total", c_uint64),
+                ("latency_max", c_uint64),
+                ("latency", c_uint64 * LC_STATS_LATENCY_BUCKETS)]
+
+#struct lc_transfer_stats {
+#    struct lc_command_stats total;
+#    int num_commands;
+#    struct lc_command_stats command[LC_STATS_MAX_COMMANDS];
+#};
+class lc_transfer_stats(Structure):
+    _fields_ = [("total", lc_command_stats),
+                ("num_commands", c_int),
+                ("command", lc_command_stats * LC_STATS_MAX_COMMANDS)]
+
+# int lc_get_transfer_stats(struct lc_transfer_stats *stats);
+lc_get_transfer_stats = _create_func(
+    'lc_get_transfer_stats',
+    _ret_lc_concord(),
+    _in('stats', POINTER(lc_transfer_stats))
+)
+
+# void lc_reset_transfer_stats();
+lc_reset_transfer_stats = _create_func(
+    'lc_reset_transfer_stats',
+    _ret_void()
+)
+
+# int lc_start_capture(const char *file_name);
+lc_start_capture = _create_func(
+    'lc_start_capture',
+    _ret_lc_concord(),
+    _in('file_name', c_char_p)
+)
+
+# void lc_stop_capture();
+lc_stop_capture = _create_func(
+    'lc_stop_capture',
+    _ret_void()
+)
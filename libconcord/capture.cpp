@@ -0,0 +1,292 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "lc_internal.h"
+#include "libconcord.h"
+#include "capture.h"
+#include "transfer_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/* A power of two; about a second of the fastest remote's traffic */
+#define CAPTURE_SLOTS 1024
+/* the longest report or usbnet message, with room to spare */
+#define CAPTURE_SNAPLEN 1040
+/* How often the writer looks for something to write (ms) */
+#define CAPTURE_FLUSH_INTERVAL 10
+
+/*
+ * The reports are handed to the writer through a bounded queue that any
+ * number of threads can add to without taking a lock: a thread claims the
+ * next slot by advancing enqueue_pos, fills it in, then publishes it by
+ * setting its seq to one past the position. The writer takes slots in
+ * order once they are published and hands each back, for the position one
+ * lap later, by setting its seq to that. A slot whose seq is still a lap
+ * behind means the queue is full; the report is then dropped and counted.
+ * The writer is woken early when the queue is half full, which is the only
+ * time a report costs more than the copy.
+ */
+struct TCaptureSlot {
+    std::atomic<uint32_t> seq;
+    uint64_t time;
+    uint8_t type;
+    uint8_t proto;
+    uint16_t channel;
+    uint16_t orig_len;
+    uint16_t len;
+    uint8_t data[CAPTURE_SNAPLEN];
+};
+
+static TCaptureSlot *slots = NULL;
+static std::atomic<uint32_t> enqueue_pos(0);
+static std::atomic<uint32_t> dequeue_pos(0);
+static std::atomic<uint32_t> dropped(0);
+
+static std::atomic<bool> capturing(false);
+/* threads inside Capture_Report(), which Capture_Stop() waits out */
+static std::atomic<int> reporters(0);
+static std::atomic<bool> stopping(false);
+static std::atomic<uint16_t> next_channel(0);
+static thread_local int channel = -1;
+
+static std::chrono::steady_clock::time_point start_time;
+static FILE *capture_file = NULL;
+static std::thread writer;
+static std::mutex writer_lock;
+static std::condition_variable writer_wake;
+static std::mutex control_lock;
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    put32(p, v);
+    put32(p + 4, v >> 32);
+}
+
+static uint8_t capture_proto()
+{
+    switch (Stats_Protocol()) {
+    case STATS_CLASSIC:
+        return CAPTURE_PROTO_CLASSIC;
+    case STATS_ZHID:
+        return CAPTURE_PROTO_ZHID;
+    case STATS_USBNET:
+        return CAPTURE_PROTO_USBNET;
+    case STATS_MH:
+        return CAPTURE_PROTO_MH;
+    default:
+        return CAPTURE_PROTO_UNKNOWN;
+    }
+}
+
+static void enqueue(uint8_t type, const uint8_t *data, unsigned int len)
+{
+    const uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+    TCaptureSlot *slot;
+
+    uint32_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (1) {
+        slot = &slots[pos & (CAPTURE_SLOTS - 1)];
+        const int32_t diff = static_cast<int32_t>(
+            slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    if (channel < 0)
+        channel = next_channel++;
+
+    slot->time = now;
+    slot->type = type;
+    slot->proto = capture_proto();
+    slot->channel = channel;
+    slot->orig_len = len > 0xFFFF ? 0xFFFF : len;
+    slot->len = len > CAPTURE_SNAPLEN ? CAPTURE_SNAPLEN : len;
+    if (data && slot->len)
+        memcpy(slot->data, data, slot->len);
+
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    if (pos + 1 - dequeue_pos.load(std::memory_order_relaxed)
+        == CAPTURE_SLOTS / 2)
+        writer_wake.notify_one();
+}
+
+void Capture_Report(uint8_t type, const uint8_t *data, unsigned int len)
+{
+    if (!capturing.load(std::memory_order_relaxed))
+        return;
+
+    reporters.fetch_add(1, std::memory_order_acquire);
+    if (capturing.load(std::memory_order_acquire))
+        enqueue(type, data, len);
+    reporters.fetch_sub(1, std::memory_order_release);
+}
+
+static void write_record(uint8_t type, uint8_t proto, uint16_t chan,
+                         uint64_t time, uint16_t orig_len,
+                         const uint8_t *data, uint16_t len)
+{
+    uint8_t hdr[CAPTURE_RECORD_HEADER_SIZE];
+
+    put64(hdr, time);
+    hdr[8] = type;
+    hdr[9] = proto;
+    put16(hdr + 10, chan);
+    put16(hdr + 12, orig_len);
+    put16(hdr + 14, len);
+    fwrite(hdr, sizeof(hdr), 1, capture_file);
+    if (len)
+        fwrite(data, len, 1, capture_file);
+}
+
+/* Write out everything published so far; returns whether there was any */
+static bool drain()
+{
+    bool wrote = false;
+
+    uint32_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    while (1) {
+        TCaptureSlot *slot = &slots[pos & (CAPTURE_SLOTS - 1)];
+        if (slot->seq.load(std::memory_order_acquire) != pos + 1)
+            break;
+        write_record(slot->type, slot->proto, slot->channel, slot->time,
+                     slot->orig_len, slot->data, slot->len);
+        slot->seq.store(pos + CAPTURE_SLOTS, std::memory_order_release);
+        dequeue_pos.store(++pos, std::memory_order_relaxed);
+        wrote = true;
+    }
+
+    const uint32_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost) {
+        debug("Capture dropped %u reports", lost);
+        uint8_t count[4];
+        put32(count, lost);
+        const uint64_t now =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start_time).count();
+        write_record(CAPTURE_DROPPED, CAPTURE_PROTO_UNKNOWN, 0, now, 0, count,
+                     sizeof(count));
+        wrote = true;
+    }
+
+    return wrote;
+}
+
+static void writer_main()
+{
+    std::unique_lock<std::mutex> lock(writer_lock);
+
+    while (!stopping.load(std::memory_order_acquire)) {
+        if (drain())
+            fflush(capture_file);
+        writer_wake.wait_for(lock,
+            std::chrono::milliseconds(CAPTURE_FLUSH_INTERVAL));
+    }
+    drain();
+}
+
+/* Must hold control_lock */
+static void stop_capture()
+{
+    if (!capturing)
+        return;
+
+    capturing = false;
+    while (reporters.load(std::memory_order_acquire))
+        std::this_thread::yield();
+
+    stopping = true;
+    writer_wake.notify_one();
+    writer.join();
+    stopping = false;
+
+    fclose(capture_file);
+    capture_file = NULL;
+}
+
+int Capture_Start(const char *file_name)
+{
+    std::lock_guard<std::mutex> lock(control_lock);
+
+    stop_capture();
+
+    if (!(capture_file = fopen(file_name, "wb"))) {
+        debug("Can't open capture file %s", file_name);
+        return LC_ERROR_OS_FILE;
+    }
+
+    uint8_t hdr[CAPTURE_MAGIC_SIZE + 2] = CAPTURE_MAGIC;
+    put16(hdr + CAPTURE_MAGIC_SIZE, CAPTURE_VERSION);
+    fwrite(hdr, sizeof(hdr), 1, capture_file);
+
+    /*
+     * The slots are kept once allocated: a thread that saw capturing just
+     * before a stop may still be on its way in.
+     */
+    if (!slots)
+        slots = new TCaptureSlot[CAPTURE_SLOTS];
+    for (uint32_t i = 0; i < CAPTURE_SLOTS; i++)
+        slots[i].seq.store(i, std::memory_order_relaxed);
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    dropped = 0;
+    start_time = std::chrono::steady_clock::now();
+
+    writer = std::thread(writer_main);
+    capturing = true;
+
+    return 0;
+}
+
+void Capture_Stop()
+{
+    std::lock_guard<std::mutex> lock(control_lock);
+
+    stop_capture();
+}
+
+/* Finish the file if the program exits while still capturing */
+static struct TCaptureAtExit {
+    ~TCaptureAtExit() { Capture_Stop(); }
+} capture_at_exit;
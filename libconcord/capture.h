@@ -0,0 +1,69 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*
+ * Traffic capture files, see lc_start_capture(). consnoop reads them too,
+ * so this header must not need anything else from libconcord.
+ *
+ * A capture is the 6 bytes "LCCAP\0", a 16-bit format version and then one
+ * record for each report or message, in the order they were taken. All
+ * numbers are little-endian. Each record is:
+ *
+ *   u64  us since the capture started
+ *   u8   CAPTURE_OUT, CAPTURE_IN, CAPTURE_TIMEOUT or CAPTURE_DROPPED
+ *   u8   CAPTURE_PROTO_*: the kind of remote, to decode the data by
+ *   u16  channel: one per thread, as each session runs in one thread
+ *   u16  length of the report as sent or received
+ *   u16  n, the number of bytes of it that follow (it may be cut short)
+ *   n bytes of data
+ *
+ * A timeout has no data. CAPTURE_DROPPED has a u32 count of the reports
+ * lost because they came faster than they could be written out.
+ */
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "LCCAP"
+#define CAPTURE_MAGIC_SIZE 6
+#define CAPTURE_VERSION 1
+#define CAPTURE_RECORD_HEADER_SIZE 16
+
+#define CAPTURE_OUT 0
+#define CAPTURE_IN 1
+#define CAPTURE_TIMEOUT 2
+#define CAPTURE_DROPPED 3
+
+#define CAPTURE_PROTO_UNKNOWN 0
+#define CAPTURE_PROTO_CLASSIC 1
+#define CAPTURE_PROTO_ZHID 2
+#define CAPTURE_PROTO_USBNET 3
+#define CAPTURE_PROTO_MH 4
+
+int Capture_Start(const char *file_name);
+void Capture_Stop();
+
+/*
+ * For the transport backends. Costs a single load when no capture is
+ * running, and never blocks when one is.
+ */
+void Capture_Report(uint8_t type, const uint8_t *data, unsigned int len);
+
+#endif
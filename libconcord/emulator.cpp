@@ -0,0 +1,1010 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "lc_internal.h"
+#include "libconcord.h"
+#include "emulator.h"
+
+#ifdef WANT_EMULATOR
+#ifndef LC_EMULATOR
+#define LC_EMULATOR
+
+#include "hid.h"
+#include "usblan.h"
+#include "transfer_stats.h"
+#include "capture.h"
+#include "remote.h"
+#include "protocol.h"
+#include "remote_info.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <map>
+#include <thread>
+
+#define LOGITECH_VID 0x046D
+#define EMU_PATH_PREFIX "emu:"
+#define EMU_DEFAULT_SPEC "classic"
+/* what a usbnet read waits for an answer that's already on its way */
+#define EMU_USBNET_TIMEOUT 30000
+
+static std::atomic<uint64_t> emu_writes(0);
+static std::atomic<uint64_t> emu_reads(0);
+static std::atomic<uint64_t> emu_bytes_out(0);
+static std::atomic<uint64_t> emu_bytes_in(0);
+static std::atomic<uint64_t> emu_timeouts(0);
+static std::atomic<uint64_t> emu_mismatches(0);
+
+CEmuDevice::CEmuDevice(const TEmuConfig &config)
+    : cfg(config), wait_for_timeout(true)
+{
+    now = host_free = dev_free = chrono::steady_clock::now();
+    rng = cfg.seed * 2654435761u + 1;
+    if (!rng)
+        rng = 1;
+}
+
+/* xorshift32 - all we need is the same sequence for the same seed */
+uint32_t CEmuDevice::Random()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* How long 'len' bytes keep the link busy, in us */
+uint32_t CEmuDevice::Cost(unsigned int len)
+{
+    uint32_t cost = cfg.interval;
+    if (cfg.rate) {
+        uint32_t t = static_cast<uint64_t>(len) * 1000000 / cfg.rate;
+        if (t > cost)
+            cost = t;
+    }
+    return cost;
+}
+
+/*
+ * The host's write goes out once the link is free and returns when it's
+ * across, which is when the device sees it.
+ */
+void CEmuDevice::Write(const uint8_t *data, unsigned int len)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    TEmuTime start = chrono::steady_clock::now();
+    if (host_free > start)
+        start = host_free;
+    host_free = start + chrono::microseconds(Cost(len));
+    this_thread::sleep_until(host_free);
+    now = host_free;
+
+    emu_writes++;
+    emu_bytes_out += len;
+
+    Receive(data, len);
+}
+
+/*
+ * An answer is ready 'latency' (plus jitter and 'delay') after the request
+ * that caused it reached the device, but not before the answers ahead of it
+ * have been sent, and then takes its own time to cross the link.
+ */
+void CEmuDevice::Send(const uint8_t *data, unsigned int len, uint32_t delay)
+{
+    uint32_t wait = cfg.latency + delay;
+    if (cfg.jitter)
+        wait += Random() % (cfg.jitter + 1);
+
+    TEmuTime ready = now + chrono::microseconds(wait);
+    if (ready < dev_free)
+        ready = dev_free;
+    ready += chrono::microseconds(Cost(len));
+    dev_free = ready;
+
+    TEmuPacket pkt;
+    pkt.ready = ready;
+    pkt.data.assign(data, data + len);
+    queue.push_back(pkt);
+}
+
+int CEmuDevice::Read(uint8_t *data, unsigned int &len, unsigned int timeout)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    TEmuTime deadline = chrono::steady_clock::now() +
+        chrono::milliseconds(timeout);
+    if (queue.empty() || queue.front().ready > deadline) {
+        if (wait_for_timeout || !queue.empty())
+            this_thread::sleep_until(deadline);
+        if (queue.empty())
+            ReadTimedOut();
+        emu_timeouts++;
+        return 1;
+    }
+
+    TEmuPacket &pkt = queue.front();
+    this_thread::sleep_until(pkt.ready);
+    if (len > pkt.data.size())
+        len = pkt.data.size();
+    memcpy(data, &pkt.data[0], len);
+    queue.pop_front();
+
+    emu_reads++;
+    emu_bytes_in += len;
+
+    return 0;
+}
+
+void CEmuDevice::Flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    queue.clear();
+}
+
+bool CEmuDevice::Pending()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return !queue.empty();
+}
+
+void CEmuDevice::CountMismatch()
+{
+    emu_mismatches++;
+}
+
+void CEmuDevice::MakeSerial(uint8_t *ser)
+{
+    uint32_t x = cfg.seed * 0x01000193 + 0x811C9DC5;
+    for (int i = 0; i < SERIAL_SIZE; i++) {
+        x = x * 1103515245 + 12345;
+        ser[i] = x >> 16;
+    }
+}
+
+/*
+ * Up to 30 words to a report: big-endian from byte 2, with the index just
+ * past the last one in byte 63.
+ */
+void CEmuDevice::SendIRCapture(uint8_t seq)
+{
+    vector<uint16_t> words;
+    EmuIRWords(cfg.seed, words);
+
+    for (unsigned int i = 0; i < words.size(); i += 30) {
+        uint8_t rsp[64] = { RESPONSE_IRCAP_DATA | 0x0F, seq };
+        unsigned int n = words.size() - i < 30 ? words.size() - i : 30;
+        for (unsigned int j = 0; j < n; j++) {
+            rsp[2 + j * 2] = words[i + j] >> 8;
+            rsp[3 + j * 2] = words[i + j] & 0xFF;
+        }
+        rsp[63] = 2 + n * 2;
+        Send(rsp, sizeof(rsp));
+        seq += 0x10;
+    }
+
+    uint8_t done[64] = { RESPONSE_DONE };
+    Send(done, sizeof(done));
+}
+
+/*
+ * A 12-bit Sony code at 40kHz: a 2.4ms burst, then the bits LSB first as
+ * bursts of 600us (0) or 1200us (1), each followed by 600us of nothing, with
+ * the last gap stretched to make up a 45ms frame. Thirteen bursts make 28
+ * words, which the USBNET remotes' four-word chunks divide evenly.
+ */
+void EmuIRWords(uint32_t seed, vector<uint16_t> &words)
+{
+    const uint32_t code = seed * 2654435761u >> 20;
+    vector<uint16_t> on, off;
+    uint32_t total = 0;
+
+    on.push_back(2400);
+    off.push_back(600);
+    for (int i = 0; i < 12; i++) {
+        on.push_back(((code >> i) & 1) ? 1200 : 600);
+        off.push_back(600);
+    }
+    for (unsigned int i = 0; i < on.size(); i++)
+        total += on[i] + off[i];
+    off.back() += 45000 - total;
+
+    words.clear();
+    words.push_back(0);
+    words.push_back(on[0]);
+    words.push_back(on[0] * 40 / 1000);
+    words.push_back(on[0] + off[0]);
+    for (unsigned int i = 1; i < on.size(); i++) {
+        words.push_back(on[i]);
+        words.push_back(on[i] + off[i]);
+    }
+}
+
+/*
+ * The classic (CRemote) protocol: 64-byte reports, a command in the high
+ * nibble of the first byte and a length in the low one. See
+ * specs/protocol.txt.
+ */
+class CEmuClassic : public CEmuDevice {
+public:
+    CEmuClassic(const TEmuConfig &config);
+
+protected:
+    void Receive(const uint8_t *data, unsigned int len);
+
+private:
+    uint8_t Peek(uint32_t addr);
+    void Poke(uint32_t addr, uint8_t val);
+    void Program(uint32_t addr, uint8_t val);
+    void ReadFlash(uint32_t addr, uint32_t len);
+    void Erase(uint32_t addr);
+    void WriteMisc(const uint8_t *cmd);
+    void ReadMisc(const uint8_t *cmd);
+
+    const TArchInfo *arch;
+    const TFlash *flash;
+    uint32_t flash_end;
+    /* 64k pages, anything not in here reads as erased */
+    map<uint32_t, vector<uint8_t> > mem;
+    uint8_t eeprom[256];
+    uint8_t ram[256];
+    uint16_t state[16];
+    uint32_t wr_addr;
+};
+
+CEmuClassic::CEmuClassic(const TEmuConfig &config)
+    : CEmuDevice(config), wr_addr(0)
+{
+    static const uint8_t flash_ids[][3] = {
+        /* arch, mfg, id */
+        { 2, 0x01, 0x37 },
+        { 9, 0x15, 0x1C },
+        { 12, 0x1F, 0xC8 },
+        { 14, 0x1F, 0xC8 },
+    };
+    uint8_t mfg = 0x01;
+    uint8_t id = 0x49;
+    for (unsigned int i = 0; i < sizeof(flash_ids) / 3; i++) {
+        if (flash_ids[i][0] == cfg.arch) {
+            mfg = flash_ids[i][1];
+            id = flash_ids[i][2];
+        }
+    }
+    unsigned int u;
+    for (u = 0; u < sizeof(FlashList)/sizeof(TFlash)-1; ++u) {
+        if (FlashList[u].mfg == mfg && FlashList[u].id == id)
+            break;
+    }
+    flash = &FlashList[u];
+    arch = &ArchList[cfg.arch];
+    flash_end = arch->flash_base + (flash->size << 10);
+
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    memset(ram, 0, sizeof(ram));
+    memset(state, 0, sizeof(state));
+    /* noon on 1/1/2020, a Wednesday */
+    state[2] = 12;
+    if (cfg.arch < 8) {
+        state[5] = 20;
+    } else {
+        state[4] = 3;
+        state[6] = 20;
+    }
+
+    uint8_t ser[SERIAL_SIZE];
+    MakeSerial(ser);
+    for (int i = 0; i < SERIAL_SIZE; i++) {
+        if (arch->serial_location == SERIAL_LOCATION_EEPROM)
+            eeprom[(arch->serial_address + i) & 0xFF] = ser[i];
+        else
+            Poke(arch->serial_address + i, ser[i]);
+    }
+
+    /* a config of the right size: cookie, end vector, then anything */
+    const uint32_t base = arch->config_base;
+    const uint32_t size = cfg.config_size;
+    for (uint32_t i = 0; i < size; i++)
+        Poke(base + i, Random() & 0xFF);
+    for (uint32_t i = 0; i < arch->cookie_size; i++)
+        Poke(base + i, (arch->cookie >> (i * 8)) & 0xFF);
+    const uint32_t end = base - arch->flash_base + size - 4;
+    for (uint32_t i = 0; i < 3; i++)
+        Poke(base + arch->end_vector + i, (end >> (i * 8)) & 0xFF);
+}
+
+uint8_t CEmuClassic::Peek(uint32_t addr)
+{
+    map<uint32_t, vector<uint8_t> >::iterator page = mem.find(addr >> 16);
+    if (page == mem.end())
+        return 0xFF;
+    return page->second[addr & 0xFFFF];
+}
+
+void CEmuClassic::Poke(uint32_t addr, uint8_t val)
+{
+    vector<uint8_t> &page = mem[addr >> 16];
+    if (page.empty())
+        page.resize(0x10000, 0xFF);
+    page[addr & 0xFFFF] = val;
+}
+
+/* Programming flash can only clear bits; anything else is plain memory */
+void CEmuClassic::Program(uint32_t addr, uint8_t val)
+{
+    if (addr >= arch->flash_base && addr < flash_end)
+        val &= Peek(addr);
+    Poke(addr, val);
+}
+
+void CEmuClassic::ReadFlash(uint32_t addr, uint32_t len)
+{
+    /* see the length maps in CRemote::ReadFlash() */
+    static const unsigned int dlx[11] =
+        { 0, 0, 1, 2, 3, 4, 5, 6, 14, 30, 62 };
+    uint8_t seq = 1;
+
+    while (len) {
+        unsigned int code;
+        unsigned int n;
+        if (cfg.protocol == 0) {
+            n = len < 14 ? len : 14;
+            code = n + 1;
+        } else {
+            code = 10;
+            while (dlx[code] > len)
+                code--;
+            n = dlx[code];
+        }
+
+        uint8_t rsp[64] = { static_cast<uint8_t>(RESPONSE_READ_FLASH_DATA |
+                                                 code), seq };
+        for (unsigned int i = 0; i < n; i++)
+            rsp[2 + i] = Peek(addr++);
+        Send(rsp, sizeof(rsp));
+        seq += 0x11;
+        len -= n;
+    }
+
+    uint8_t done[64] = { RESPONSE_DONE, COMMAND_READ_FLASH };
+    Send(done, sizeof(done));
+}
+
+/* 'addr' is where a sector starts; clear it up to where the next starts */
+void CEmuClassic::Erase(uint32_t addr)
+{
+    uint32_t end = addr + 0x10000;
+    for (const uint32_t *s = flash->sectors; s && *s; s++) {
+        if (*s + arch->flash_base > addr) {
+            end = *s + arch->flash_base;
+            break;
+        }
+    }
+    for (; addr < end; addr++) {
+        if (Peek(addr) != 0xFF)
+            Poke(addr, 0xFF);
+    }
+}
+
+void CEmuClassic::WriteMisc(const uint8_t *cmd)
+{
+    const unsigned int len = cmd[0] & LENGTH_MASK;
+    const uint8_t kind = cmd[1];
+    uint16_t addr;
+    uint16_t val;
+
+    if (len == 3) {
+        addr = cmd[2];
+        val = cmd[3];
+    } else if (len == 5) {
+        addr = (cmd[2] << 8) | cmd[3];
+        val = (cmd[4] << 8) | cmd[5];
+    } else {
+        /* invalidate flash, clock recalculate and friends */
+        addr = 0;
+        val = 0;
+    }
+
+    if (len > 1) {
+        switch (kind) {
+        case COMMAND_MISC_EEPROM:
+            eeprom[addr & 0xFF] = val;
+            break;
+        case COMMAND_MISC_STATE:
+            state[addr & 0x0F] = val;
+            break;
+        case COMMAND_MISC_RAM:
+            ram[addr & 0xFF] = val;
+            break;
+        }
+    }
+
+    uint8_t rsp[64] = { RESPONSE_DONE, COMMAND_WRITE_MISC };
+    Send(rsp, sizeof(rsp));
+}
+
+void CEmuClassic::ReadMisc(const uint8_t *cmd)
+{
+    const bool word = (cmd[0] & LENGTH_MASK) == 3;
+    const uint8_t kind = cmd[1];
+    const uint16_t addr = word ? (cmd[2] << 8) | cmd[3] : cmd[2];
+    uint16_t val = 0;
+
+    switch (kind) {
+    case COMMAND_MISC_EEPROM:
+        val = eeprom[addr & 0xFF];
+        break;
+    case COMMAND_MISC_STATE:
+        val = state[addr & 0x0F];
+        break;
+    case COMMAND_MISC_RAM:
+        val = ram[addr & 0xFF];
+        break;
+    }
+
+    uint8_t rsp[64] = { RESPONSE_READ_MISC_DATA, kind };
+    if (word) {
+        rsp[0] |= 0x03;
+        rsp[2] = val >> 8;
+        rsp[3] = val & 0xFF;
+    } else {
+        rsp[0] |= 0x02;
+        rsp[2] = val & 0xFF;
+    }
+    Send(rsp, sizeof(rsp));
+}
+
+void CEmuClassic::Receive(const uint8_t *data, unsigned int len)
+{
+    uint8_t rsp[64] = { 0 };
+    const uint32_t addr = (data[1] << 16) | (data[2] << 8) | data[3];
+
+    switch (data[0] & COMMAND_MASK) {
+    case COMMAND_GET_VERSION:
+        rsp[1] = 0x24;
+        rsp[2] = 0x20;
+        rsp[3] = flash->id;
+        rsp[4] = flash->mfg;
+        if (cfg.arch == 2) {
+            rsp[0] = RESPONSE_VERSION_DATA | 5;
+        } else {
+            rsp[0] = RESPONSE_VERSION_DATA | 7;
+            rsp[5] = cfg.arch << 4;
+            rsp[6] = cfg.skin;
+            rsp[7] = cfg.protocol;
+        }
+        Send(rsp, sizeof(rsp));
+        break;
+    case COMMAND_READ_FLASH:
+        ReadFlash(addr, (data[4] << 8) | data[5]);
+        break;
+    case COMMAND_WRITE_FLASH:
+        wr_addr = addr;
+        break;
+    case COMMAND_WRITE_FLASH_DATA: {
+        /* 1-7 bytes as is, then 8, 9 and 10 for 15, 31 and 63 */
+        unsigned int n = data[0] & LENGTH_MASK;
+        if (n > 7)
+            n = (1 << (n - 4)) - 1;
+        for (unsigned int i = 0; i < n && i < 63; i++)
+            Program(wr_addr++, data[1 + i]);
+        break;
+    }
+    case COMMAND_DONE & COMMAND_MASK:
+        if (data[1] == COMMAND_WRITE_FLASH) {
+            rsp[0] = RESPONSE_DONE;
+            rsp[1] = COMMAND_WRITE_FLASH;
+            Send(rsp, sizeof(rsp));
+        }
+        break;
+    case COMMAND_ERASE_FLASH & COMMAND_MASK:
+        Erase(addr);
+        rsp[0] = RESPONSE_DONE;
+        rsp[1] = COMMAND_ERASE_FLASH;
+        Send(rsp, sizeof(rsp), cfg.erase);
+        break;
+    case COMMAND_WRITE_MISC:
+        WriteMisc(data);
+        break;
+    case COMMAND_READ_MISC:
+        ReadMisc(data);
+        break;
+    case COMMAND_START_IRCAP:
+        SendIRCapture(0);
+        break;
+    case COMMAND_STOP_IRCAP:
+        rsp[0] = RESPONSE_DONE;
+        Send(rsp, sizeof(rsp));
+        break;
+    default:
+        /* resets and anything we don't know go unanswered */
+        break;
+    }
+}
+
+CEmuDevice *EmuNewClassic(const TEmuConfig &config)
+{
+    return new CEmuClassic(config);
+}
+
+/*
+ * The glue: which devices there are, and the hid.h and usblan.h calls the
+ * rest of libconcord makes.
+ */
+static std::mutex emu_lock;
+static vector<CEmuDevice*> emu_devices;
+static CEmuDevice *emu_usbnet = NULL;
+static bool emu_configured = false;
+
+/* The device HID_WriteReport()/HID_ReadReport() use on this thread */
+static thread_local THIDINFO *cur_hid = NULL;
+
+static int parse_device(const string &spec, unsigned int index,
+                        TEmuConfig &cfg)
+{
+    const unsigned int unset = ~0u;
+    size_t pos = spec.find(',');
+    const string family = spec.substr(0, pos);
+
+    cfg = TEmuConfig();
+    cfg.config_size = 16384;
+    cfg.seed = index + 1;
+    cfg.protocol = unset;
+    cfg.channel = unset;
+    cfg.strict = 1;
+    if (family == "classic") {
+        cfg.family = EMU_CLASSIC;
+        cfg.arch = 8;
+        cfg.skin = 15;
+        cfg.pid = 0xC111;
+    } else if (family == "zhid") {
+        cfg.family = EMU_ZHID;
+        cfg.arch = 10;
+        cfg.skin = 19;
+        cfg.pid = 0xC112;
+    } else if (family == "usbnet") {
+        cfg.family = EMU_USBNET;
+        cfg.arch = 11;
+        cfg.skin = 63;
+        cfg.pid = 0xC11F;
+    } else if (family == "mh") {
+        cfg.family = EMU_MH;
+        cfg.arch = 16;
+        cfg.skin = 78;
+        cfg.pid = 0xC124;
+    } else {
+        debug("Unknown emulated remote '%s'", family.c_str());
+        return LC_ERROR;
+    }
+
+    while (pos != string::npos) {
+        size_t next = spec.find(',', pos + 1);
+        const string item = spec.substr(pos + 1, next == string::npos
+                                        ? string::npos : next - pos - 1);
+        pos = next;
+
+        size_t eq = item.find('=');
+        if (eq == string::npos) {
+            debug("Bad emulator setting '%s'", item.c_str());
+            return LC_ERROR;
+        }
+        const string key = item.substr(0, eq);
+        if (key == "replay") {
+            cfg.replay = item.substr(eq + 1);
+            continue;
+        }
+        char *end;
+        const unsigned long val = strtoul(item.c_str() + eq + 1, &end, 0);
+        if (*end || end == item.c_str() + eq + 1) {
+            debug("Bad emulator setting '%s'", item.c_str());
+            return LC_ERROR;
+        }
+
+        if (key == "arch")
+            cfg.arch = val;
+        else if (key == "skin")
+            cfg.skin = val;
+        else if (key == "pid")
+            cfg.pid = val;
+        else if (key == "protocol")
+            cfg.protocol = val;
+        else if (key == "config")
+            cfg.config_size = val;
+        else if (key == "latency")
+            cfg.latency = val;
+        else if (key == "jitter")
+            cfg.jitter = val;
+        else if (key == "interval")
+            cfg.interval = val;
+        else if (key == "rate")
+            cfg.rate = val;
+        else if (key == "erase")
+            cfg.erase = val;
+        else if (key == "window")
+            cfg.window = val;
+        else if (key == "seed")
+            cfg.seed = val;
+        else if (key == "channel")
+            cfg.channel = val;
+        else if (key == "strict")
+            cfg.strict = val;
+        else {
+            debug("Unknown emulator setting '%s'", key.c_str());
+            return LC_ERROR;
+        }
+    }
+
+    if (cfg.protocol == unset)
+        cfg.protocol = cfg.family != EMU_CLASSIC ? cfg.arch :
+            cfg.arch == 2 ? 0 : 1;
+
+    if (cfg.family == EMU_CLASSIC) {
+        const unsigned int n = sizeof(ArchList) / sizeof(TArchInfo);
+        if (cfg.arch >= n || cfg.arch > 15 || !ArchList[cfg.arch].cookie_size
+            || cfg.config_size < 8) {
+            debug("Can't emulate a classic remote of arch %d", cfg.arch);
+            return LC_ERROR;
+        }
+    } else if (cfg.config_size < 4) {
+        debug("Emulated config must be at least 4 bytes");
+        return LC_ERROR;
+    }
+
+    return 0;
+}
+
+static void delete_devices(vector<CEmuDevice*> &devices)
+{
+    for (unsigned int i = 0; i < devices.size(); i++)
+        delete devices[i];
+    devices.clear();
+}
+
+int Emu_Configure(const char *spec)
+{
+    vector<TEmuConfig> configs;
+    /* made up front, as reading the capture can fail */
+    vector<CEmuDevice*> replays;
+    const string s(spec ? spec : "");
+    size_t start = 0;
+    bool usbnet = false;
+
+    while (start <= s.size()) {
+        size_t end = s.find(';', start);
+        if (end == string::npos)
+            end = s.size();
+        const string item = s.substr(start, end - start);
+        start = end + 1;
+        if (item.empty())
+            continue;
+
+        TEmuConfig cfg;
+        CEmuDevice *replay = NULL;
+        if (parse_device(item, configs.size(), cfg)
+            || (!cfg.replay.empty() && !(replay = EmuNewReplay(cfg)))) {
+            delete_devices(replays);
+            return LC_ERROR;
+        }
+        replays.push_back(replay);
+        if (cfg.family == EMU_USBNET) {
+            if (usbnet) {
+                debug("Only one usbnet remote can be emulated");
+                delete_devices(replays);
+                return LC_ERROR;
+            }
+            usbnet = true;
+        }
+        configs.push_back(cfg);
+    }
+
+    std::lock_guard<std::mutex> guard(emu_lock);
+    delete_devices(emu_devices);
+    emu_usbnet = NULL;
+
+    for (unsigned int i = 0; i < configs.size(); i++) {
+        CEmuDevice *dev = replays[i];
+        if (!dev) {
+            switch (configs[i].family) {
+            case EMU_CLASSIC:
+                dev = EmuNewClassic(configs[i]);
+                break;
+            case EMU_ZHID:
+                dev = EmuNewZ_HID(configs[i]);
+                break;
+            case EMU_USBNET:
+                dev = EmuNewZ_USBNET(configs[i]);
+                break;
+            case EMU_MH:
+                dev = EmuNewMH(configs[i]);
+                break;
+            }
+        }
+        if (configs[i].family == EMU_USBNET)
+            emu_usbnet = dev;
+        char serial[16];
+        snprintf(serial, sizeof(serial), "EMU%08X", configs[i].seed);
+        dev->serial = serial;
+        emu_devices.push_back(dev);
+    }
+    emu_configured = true;
+
+    return 0;
+}
+
+void Emu_GetStats(TEmuStats &stats)
+{
+    stats.writes = emu_writes;
+    stats.reads = emu_reads;
+    stats.bytes_out = emu_bytes_out;
+    stats.bytes_in = emu_bytes_in;
+    stats.timeouts = emu_timeouts;
+    stats.mismatches = emu_mismatches;
+
+    std::lock_guard<std::mutex> guard(emu_lock);
+    stats.unreplayed = 0;
+    for (unsigned int i = 0; i < emu_devices.size(); i++)
+        stats.unreplayed += emu_devices[i]->Unreplayed();
+}
+
+void Emu_ResetStats()
+{
+    emu_writes = 0;
+    emu_reads = 0;
+    emu_bytes_out = 0;
+    emu_bytes_in = 0;
+    emu_timeouts = 0;
+    emu_mismatches = 0;
+}
+
+int InitUSB()
+{
+    {
+        std::lock_guard<std::mutex> guard(emu_lock);
+        if (emu_configured)
+            return 0;
+    }
+
+    const char *spec = getenv("LIBCONCORD_EMULATOR");
+    if (!spec || !*spec)
+        spec = EMU_DEFAULT_SPEC;
+    if (Emu_Configure(spec)) {
+        debug("Bad LIBCONCORD_EMULATOR: %s", spec);
+        return LC_ERROR;
+    }
+    return 0;
+}
+
+void ShutdownUSB()
+{
+    if (cur_hid) {
+        CloseRemote(*cur_hid);
+    }
+}
+
+int FindRemotes(vector<THIDINFO> &remotes)
+{
+    std::lock_guard<std::mutex> guard(emu_lock);
+
+    for (unsigned int i = 0; i < emu_devices.size(); i++) {
+        if (emu_devices[i] == emu_usbnet)
+            continue;
+        THIDINFO hid_info = THIDINFO();
+        hid_info.vid = LOGITECH_VID;
+        hid_info.pid = emu_devices[i]->cfg.pid;
+        hid_info.path = EMU_PATH_PREFIX + to_string(i);
+        hid_info.serial = emu_devices[i]->serial;
+        remotes.push_back(hid_info);
+    }
+
+    return 0;
+}
+
+int FindRemote(THIDINFO &hid_info)
+{
+    vector<THIDINFO> remotes;
+
+    FindRemotes(remotes);
+    if (remotes.empty()) {
+        debug("Failed to establish communication with remote");
+        return LC_ERROR_CONNECT;
+    }
+
+    hid_info = remotes[0];
+    return OpenRemote(hid_info);
+}
+
+/* Emulated remotes never go away, so they're always back at once */
+int HID_WaitForArrival(unsigned int timeout)
+{
+    return 0;
+}
+
+int OpenRemote(THIDINFO &hid_info)
+{
+    std::lock_guard<std::mutex> guard(emu_lock);
+
+    const size_t prefix_len = strlen(EMU_PATH_PREFIX);
+    unsigned int i;
+    if (hid_info.path.compare(0, prefix_len, EMU_PATH_PREFIX)
+        || (i = atoi(hid_info.path.c_str() + prefix_len)) >= emu_devices.size()
+        || emu_devices[i] == emu_usbnet) {
+        debug("Failed to establish communication with remote");
+        return LC_ERROR_CONNECT;
+    }
+
+    emu_devices[i]->Flush();
+    hid_info.dev = emu_devices[i];
+    hid_info.mfg = "Logitech";
+    hid_info.prod = "Harmony Remote (emulated)";
+    hid_info.irl = 64;
+    hid_info.orl = 64;
+    HID_SelectRemote(&hid_info);
+
+    return 0;
+}
+
+void CloseRemote(THIDINFO &hid_info)
+{
+    hid_info.dev = NULL;
+    if (cur_hid == &hid_info)
+        cur_hid = NULL;
+}
+
+void HID_SelectRemote(THIDINFO *hid_info)
+{
+    cur_hid = hid_info;
+}
+
+int HID_WriteReport(const uint8_t *data)
+{
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+
+    static_cast<CEmuDevice*>(cur_hid->dev)->Write(data, 64);
+    Stats_Sent(data, 64);
+    Capture_Report(CAPTURE_OUT, data, 64);
+    return 0;
+}
+
+int HID_ReadReport(uint8_t *data, unsigned int timeout)
+{
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+
+    unsigned int len = 64;
+    if (static_cast<CEmuDevice*>(cur_hid->dev)->Read(data, len, timeout)) {
+        debug("USB read timed out");
+        Stats_Timeout();
+        Capture_Report(CAPTURE_TIMEOUT, NULL, 0);
+        return 1;
+    }
+    Stats_Received(len);
+    Capture_Report(CAPTURE_IN, data, len);
+    if (len < 64)
+        memset(data + len, 0, 64 - len);
+
+    return 0;
+}
+
+int InitializeUsbLan(void)
+{
+    return 0;
+}
+
+int ShutdownUsbLan(void)
+{
+    if (emu_usbnet)
+        emu_usbnet->Flush();
+    return 0;
+}
+
+int StartUsbLanConnect(void)
+{
+    return emu_usbnet ? 0 : LC_ERROR_OS_NET;
+}
+
+int FinishUsbLanConnect(void)
+{
+    if (!emu_usbnet)
+        return LC_ERROR_OS_NET;
+    emu_usbnet->Flush();
+    return 0;
+}
+
+void CancelUsbLanConnect(void)
+{
+}
+
+int FindUsbLanRemote(void)
+{
+    int err;
+
+    if ((err = StartUsbLanConnect()))
+        return err;
+
+    return FinishUsbLanConnect();
+}
+
+int StartUsbLanProbe(void)
+{
+    return emu_usbnet ? 0 : LC_ERROR_OS_NET;
+}
+
+int FinishUsbLanProbe(void)
+{
+    return emu_usbnet ? 0 : LC_ERROR_OS_NET;
+}
+
+void CancelUsbLanProbe(void)
+{
+}
+
+int UsbLan_Write(unsigned int len, uint8_t *data)
+{
+    if (!emu_usbnet)
+        return LC_ERROR_OS_NET;
+
+    emu_usbnet->Write(data, len);
+    Stats_Sent(data, len);
+    Capture_Report(CAPTURE_OUT, data, len);
+    return 0;
+}
+
+/*
+ * The remote only ever answers requests, so if there's nothing queued
+ * there's nothing coming; a real connection would hang here instead.
+ */
+int UsbLan_ReadMessage(uint8_t *&msg, unsigned int &len)
+{
+    static uint8_t rx_buf[8192];
+
+    if (!emu_usbnet || !emu_usbnet->Pending()) {
+        debug("Nothing coming from the remote");
+        Stats_Timeout();
+        Capture_Report(CAPTURE_TIMEOUT, NULL, 0);
+        return LC_ERROR_READ;
+    }
+
+    len = sizeof(rx_buf);
+    if (emu_usbnet->Read(rx_buf, len, EMU_USBNET_TIMEOUT)) {
+        Stats_Timeout();
+        Capture_Report(CAPTURE_TIMEOUT, NULL, 0);
+        return LC_ERROR_READ;
+    }
+    Stats_Received(len);
+    Capture_Report(CAPTURE_IN, rx_buf, len);
+    msg = rx_buf;
+
+    return 0;
+}
+
+int GetXMLUserRFSetting(char **data)
+{
+    static const char xml[] =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<UserRFSetting><RFChannel>1</RFChannel></UserRFSetting>\n";
+
+    *data = new char[sizeof(xml)];
+    memcpy(*data, xml, sizeof(xml));
+
+    return 0;
+}
+
+#endif
+#endif
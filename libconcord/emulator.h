@@ -0,0 +1,199 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+/*
+ * The emulator is a transport backend like libhidapi.cpp or usblan.cpp, but
+ * instead of a USB device or a socket there is a model of a remote behind
+ * it. Configure with --enable-emulator and libconcord talks to nothing
+ * else. Which remotes are "plugged in" comes from LIBCONCORD_EMULATOR (or
+ * Emu_Configure()), a ';'-separated list of devices, each a family name
+ * followed by ',key=value' settings:
+ *
+ *   classic,arch=8,latency=500;zhid;usbnet,rate=1000000;mh
+ *
+ * Families are classic (CRemote), zhid (CRemoteZ_HID), usbnet
+ * (CRemoteZ_USBNET, at most one) and mh (CRemoteMH). Keys:
+ *
+ *   arch, skin, pid, protocol  what the device reports about itself
+ *   config      size in bytes of the config it starts out with
+ *   latency     us from a request reaching the device to its answer
+ *   jitter      up to this many us added to latency, at random
+ *   interval    us each report or message occupies the link at least
+ *   rate        link speed in bytes/sec (0 is unlimited)
+ *   erase       us the device takes to erase one flash sector
+ *   window      Z-HID only: TCP segments taken before dropping (0 = any)
+ *   seed        seeds the jitter, the serial and the config contents
+ *   replay      a capture file (see capture.h) to answer from instead;
+ *               its name can't have a ',' or ';' in it
+ *   channel     replay only: which channel of the capture (default first)
+ *   strict      replay only: 0 to carry on past requests that differ
+ *
+ * Timings are real: a read waits until the answer is due, so wall time
+ * measured against the emulator means something. With the same seed the
+ * answers, and the delays, are the same every run.
+ *
+ * With replay, the device doesn't model anything: each request must be the
+ * next one the capture has the host sending, and is answered with whatever
+ * the remote sent back after it. A read with nothing to answer times out at
+ * once rather than after its timeout, so a replayed operation takes as
+ * long as libconcord itself needs plus the latency asked for. The first
+ * request that differs is logged and counted; unless strict=0, nothing is
+ * answered from then on, so the operation fails. strict=0 is for requests
+ * that can't be the same twice, such as setting the clock. The family must
+ * be the one the capture was taken from, as it still picks the USB ids.
+ * libconcord's cached identities and upload journals change what it sends,
+ * so replay against the same state the capture was taken in, e.g. with
+ * XDG_CONFIG_HOME pointing at an empty directory both times.
+ */
+
+#include "lc_internal.h"
+#include <vector>
+
+enum TEmuFamily {
+    EMU_CLASSIC,
+    EMU_ZHID,
+    EMU_USBNET,
+    EMU_MH
+};
+
+struct TEmuConfig {
+    TEmuFamily family;
+    unsigned int arch;
+    unsigned int skin;
+    unsigned int pid;
+    unsigned int protocol;
+    uint32_t config_size;
+    uint32_t latency;
+    uint32_t jitter;
+    uint32_t interval;
+    uint32_t rate;
+    uint32_t erase;
+    unsigned int window;
+    uint32_t seed;
+    string replay;
+    unsigned int channel;
+    unsigned int strict;
+};
+
+/* Totals over all emulated devices since the last Emu_ResetStats() */
+struct TEmuStats {
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t timeouts;
+    /* replay: requests that differed from the capture */
+    uint64_t mismatches;
+    /* replay: reports or messages in the captures not yet gone over */
+    uint64_t unreplayed;
+};
+
+/*
+ * Replace the emulated devices with the ones in 'spec' (see above). Only
+ * call this while no remote is open. Returns LC_ERROR if the spec doesn't
+ * parse, in which case nothing changes.
+ */
+int Emu_Configure(const char *spec);
+void Emu_GetStats(TEmuStats &stats);
+void Emu_ResetStats();
+
+#ifdef WANT_EMULATOR
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+typedef std::chrono::steady_clock::time_point TEmuTime;
+
+/*
+ * One emulated remote. The host side calls Write() with each report or
+ * message it sends and Read() to collect the answers; subclasses implement
+ * Receive() and answer through Send(). Every answer gets a time at which it
+ * becomes readable, worked out from the link and device settings, and
+ * Read() doesn't hand it out before then.
+ */
+class CEmuDevice {
+public:
+    CEmuDevice(const TEmuConfig &config);
+    virtual ~CEmuDevice() {};
+
+    void Write(const uint8_t *data, unsigned int len);
+    /* 0, or 1 if nothing came within timeout ms */
+    int Read(uint8_t *data, unsigned int &len, unsigned int timeout);
+    /* Drop anything unread, as a real remote does when it's reopened */
+    void Flush();
+    bool Pending();
+    virtual unsigned int Unreplayed() { return 0; }
+
+    const TEmuConfig cfg;
+    string serial;
+
+protected:
+    virtual void Receive(const uint8_t *data, unsigned int len) = 0;
+    /* A read found nothing queued */
+    virtual void ReadTimedOut() {}
+    void Send(const uint8_t *data, unsigned int len, uint32_t delay = 0);
+    unsigned int Queued() { return queue.size(); }
+    uint32_t Random();
+    /* The 48-byte serial (three GUIDs) this device reports */
+    void MakeSerial(uint8_t *ser);
+    /* IR capture reports and a final RESPONSE_DONE, as classic and MH do */
+    void SendIRCapture(uint8_t seq);
+    /* For TEmuStats.mismatches */
+    void CountMismatch();
+
+    /* whether a read with nothing coming waits out its timeout */
+    bool wait_for_timeout;
+
+private:
+    uint32_t Cost(unsigned int len);
+
+    struct TEmuPacket {
+        TEmuTime ready;
+        std::vector<uint8_t> data;
+    };
+    std::deque<TEmuPacket> queue;
+    std::mutex lock;
+    /* when the request being handled reached the device */
+    TEmuTime now;
+    /* when the link is next free in each direction */
+    TEmuTime host_free;
+    TEmuTime dev_free;
+    uint32_t rng;
+};
+
+/*
+ * A learnt IR signal as the remotes report it: a word we don't use, the
+ * first burst's on time, its carrier cycle count and then for each burst
+ * the on time and on+off time, in us. 'seed' picks the code sent.
+ */
+void EmuIRWords(uint32_t seed, std::vector<uint16_t> &words);
+
+CEmuDevice *EmuNewClassic(const TEmuConfig &config);
+CEmuDevice *EmuNewZ_HID(const TEmuConfig &config);
+CEmuDevice *EmuNewZ_USBNET(const TEmuConfig &config);
+CEmuDevice *EmuNewMH(const TEmuConfig &config);
+/* NULL if the capture can't be read or has nothing for this family */
+CEmuDevice *EmuNewReplay(const TEmuConfig &config);
+
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "lc_internal.h"
+#include "emulator.h"
+
+#ifdef WANT_EMULATOR
+
+#include "remote.h"
+#include <stdio.h>
+#include <string.h>
+#include <map>
+
+#define EMU_MH_DATA_SIZE 62
+/* data packets between the acks in either direction */
+#define EMU_MH_BURST 50
+#define EMU_MH_READ_HANDLE 0x06
+#define EMU_MH_WRITE_HANDLE 0x05
+#define EMU_MH_USERCFG "/cfg/usercfg"
+#define EMU_MH_SYSINFO "/sys/sysinfo"
+#define EMU_MH_IRCAP "/ir/ir_cap"
+
+/*
+ * The MH remotes (CRemoteMH): a small file system. Commands are 0xFF, the
+ * command, a sequence number and a parameter count; we answer with the same
+ * command and the sequence number with its top bit set. File data goes
+ * either way in packets of a sequence number, a length and up to 62 bytes.
+ */
+class CEmuMH : public CEmuDevice {
+public:
+    CEmuMH(const TEmuConfig &config);
+
+protected:
+    void Receive(const uint8_t *data, unsigned int len);
+
+private:
+    void Respond(uint8_t cmd, uint8_t seq, const uint8_t *params = NULL,
+                 unsigned int len = 0);
+    void Open(const uint8_t *pkt);
+    void SendData(uint8_t seq, unsigned int count);
+    void Data(const uint8_t *pkt);
+    void Commit();
+    void SysInfo(vector<uint8_t> &info);
+
+    map<string, vector<uint8_t> > files;
+    string file;
+    bool reading;
+    bool writing;
+    vector<uint8_t> buf;
+    uint32_t expected;
+    uint32_t offset;
+    unsigned int pkts;
+};
+
+CEmuMH::CEmuMH(const TEmuConfig &config)
+    : CEmuDevice(config), reading(false), writing(false), expected(0),
+      offset(0), pkts(0)
+{
+    /* a config as the 300 hands it back: no end marker, and none inside */
+    vector<uint8_t> &cfg_file = files[EMU_MH_USERCFG];
+    uint32_t x = cfg.seed * 2654435761u + 11;
+    cfg_file.resize(cfg.config_size ? cfg.config_size : 1);
+    for (uint32_t i = 0; i < cfg_file.size(); i++) {
+        x = x * 1103515245 + 12345;
+        cfg_file[i] = x >> 16;
+        if (cfg_file[i] == MH_EOF_BYTES[0])
+            cfg_file[i]++;
+    }
+}
+
+void CEmuMH::SysInfo(vector<uint8_t> &info)
+{
+    uint8_t ser[SERIAL_SIZE];
+    char guid[SERIAL_SIZE * 2 + 1];
+    char text[512];
+
+    MakeSerial(ser);
+    for (int i = 0; i < SERIAL_SIZE; i++)
+        sprintf(guid + i * 2, "%02X", ser[i]);
+    int n = snprintf(text, sizeof(text), "serial_number %s\nfw_ver 2.5\n"
+                     "hw_ver 1\narch %x\nfw_type 0\nskin %x\nguid 0x%s\n",
+                     serial.c_str(), cfg.arch, cfg.skin, guid);
+    info.assign(text, text + n + 1);
+}
+
+void CEmuMH::Respond(uint8_t cmd, uint8_t seq, const uint8_t *params,
+                     unsigned int len)
+{
+    uint8_t rsp[64] = { 0xFF, cmd, static_cast<uint8_t>(seq | 0x80) };
+
+    if (params && len)
+        memcpy(rsp + 3, params, len);
+    Send(rsp, sizeof(rsp));
+}
+
+/* 0x80 name 0x00 0x80 'R'|'W' 0x00, and for 'W' 0x04 and the length */
+void CEmuMH::Open(const uint8_t *pkt)
+{
+    const char *name = reinterpret_cast<const char*>(pkt + 5);
+    const size_t name_len = strnlen(name, 64 - 8);
+    const uint8_t *mode = pkt + 5 + name_len + 1;
+
+    file.assign(name, name_len);
+    reading = writing = false;
+    offset = 0;
+    pkts = 0;
+
+    if (mode[1] == 'W' && 5 + name_len + 8 <= 64) {
+        writing = true;
+        expected = mode[4] << 24 | mode[5] << 16 | mode[6] << 8 | mode[7];
+        buf.clear();
+        const uint8_t params[] = { 0x02, 0x01, EMU_MH_WRITE_HANDLE };
+        Respond(pkt[1], pkt[2], params, sizeof(params));
+        return;
+    }
+
+    reading = true;
+    if (file == EMU_MH_SYSINFO)
+        SysInfo(files[file]);
+    uint32_t size = 0;
+    if (file != EMU_MH_IRCAP && files.count(file))
+        size = files[file].size();
+    const uint8_t params[] = { 0x02, 0x01, EMU_MH_READ_HANDLE, 0x04,
+        static_cast<uint8_t>(size >> 24), static_cast<uint8_t>(size >> 16),
+        static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size) };
+    Respond(pkt[1], pkt[2], params, sizeof(params));
+}
+
+/*
+ * Up to 'count' packets of the open file, numbered on from the sequence
+ * number of the request that asked for them.
+ */
+void CEmuMH::SendData(uint8_t seq, unsigned int count)
+{
+    const vector<uint8_t> &data = files[file];
+
+    for (unsigned int i = 1; i <= count && offset < data.size(); i++) {
+        uint8_t pkt[64] = { 0 };
+        uint32_t n = data.size() - offset;
+        if (n > EMU_MH_DATA_SIZE)
+            n = EMU_MH_DATA_SIZE;
+        pkt[0] = 0x80 | ((seq + i) & 0x3F);
+        pkt[1] = n;
+        memcpy(pkt + 2, &data[offset], n);
+        offset += n;
+        Send(pkt, sizeof(pkt));
+    }
+}
+
+void CEmuMH::Commit()
+{
+    files[file] = buf;
+    writing = false;
+}
+
+void CEmuMH::Data(const uint8_t *pkt)
+{
+    if (!writing)
+        return;
+
+    if (pkt[0] == 0x7E) {
+        Commit();
+        Respond(0x7E, 0);
+        return;
+    }
+
+    const unsigned int n = pkt[1] & 0x3F;
+    buf.insert(buf.end(), pkt + 2, pkt + 2 + n);
+
+    if (++pkts % EMU_MH_BURST == 0) {
+        const uint8_t params[] = { 0x02, 0x01, EMU_MH_WRITE_HANDLE, 0x01,
+            0x33 };
+        Respond(0x03, pkt[0], params, sizeof(params));
+    }
+
+    /* the user config ends with an explicit 0x7E, other files just end */
+    if (buf.size() >= expected && file != EMU_MH_USERCFG) {
+        Commit();
+        Respond(0x01, pkt[0]);
+    }
+}
+
+void CEmuMH::Receive(const uint8_t *data, unsigned int len)
+{
+    if (len < 4)
+        return;
+    if (data[0] != 0xFF) {
+        Data(data);
+        return;
+    }
+
+    const uint8_t cmd = data[1];
+    const uint8_t seq = data[2];
+
+    switch (cmd) {
+    case 0x00:
+        /* the "hello"s with a parameter go unanswered */
+        if (!data[3])
+            Respond(cmd, seq);
+        break;
+    case 0x01:
+        Open(data);
+        break;
+    case 0x03:
+        /* acks for our write acks */
+        break;
+    case 0x04: {
+        const uint8_t params[] = { 0x02, 0x01, EMU_MH_READ_HANDLE, 0x01,
+            0x00 };
+        Respond(cmd, seq, params, sizeof(params));
+        if (!reading)
+            break;
+        if (file == EMU_MH_IRCAP) {
+            SendIRCapture(cfg.arch == 17 ? 0x00 : 0x90);
+            reading = false;
+        } else if (data[7] > 1) {
+            SendData(seq, data[7] - 1);
+        }
+        break;
+    }
+    case 0x07:
+        reading = writing = false;
+        Respond(cmd, seq);
+        break;
+    default:
+        /* reset (0xFF), finish (0x05), stop/checksum (0x06) and the rest */
+        Respond(cmd, seq);
+        break;
+    }
+}
+
+CEmuDevice *EmuNewMH(const TEmuConfig &config)
+{
+    return new CEmuMH(config);
+}
+
+#endif
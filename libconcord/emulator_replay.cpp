@@ -0,0 +1,229 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "lc_internal.h"
+#include "emulator.h"
+
+#ifdef WANT_EMULATOR
+
+#include "libconcord.h"
+#include "capture.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+struct TReplayRecord {
+    uint8_t type;
+    vector<uint8_t> data;
+};
+
+/*
+ * A remote that is a capture played back (see emulator.h). 'next' is the
+ * first record not yet gone over: the request we expect next, or a read
+ * the capture has timing out. Whatever the remote sent is queued as soon
+ * as every request the capture has before it has come in.
+ */
+class CEmuReplay : public CEmuDevice {
+public:
+    CEmuReplay(const TEmuConfig &config, vector<TReplayRecord> &recs);
+    unsigned int Unreplayed() { return records.size() - next; }
+
+protected:
+    void Receive(const uint8_t *data, unsigned int len);
+    void ReadTimedOut();
+
+private:
+    unsigned int Significant(const uint8_t *data, unsigned int len);
+    void SendAnswers();
+
+    vector<TReplayRecord> records;
+    std::atomic<size_t> next;
+    /* a request differed and we're strict about it */
+    bool diverged;
+};
+
+CEmuReplay::CEmuReplay(const TEmuConfig &config, vector<TReplayRecord> &recs)
+    : CEmuDevice(config), next(0), diverged(false)
+{
+    records.swap(recs);
+    wait_for_timeout = false;
+}
+
+/*
+ * How much of a request has to match. Z-Wave HID packets don't fill the
+ * report, and the rest of it is whatever was in the host's buffer.
+ */
+unsigned int CEmuReplay::Significant(const uint8_t *data, unsigned int len)
+{
+    if (cfg.family == EMU_ZHID && len && data[0] + 1u < len)
+        return data[0] + 1;
+    return len;
+}
+
+/* Queue everything the remote sent up to the next request or timeout */
+void CEmuReplay::SendAnswers()
+{
+    size_t i = next;
+
+    while (i < records.size() && records[i].type == CAPTURE_IN) {
+        Send(&records[i].data[0], records[i].data.size());
+        i++;
+    }
+    next = i;
+}
+
+void CEmuReplay::Receive(const uint8_t *data, unsigned int len)
+{
+    if (diverged)
+        return;
+
+    size_t i = next;
+    /* reads the host no longer makes, or makes later */
+    while (i < records.size() && records[i].type == CAPTURE_TIMEOUT)
+        i++;
+
+    if (i == records.size()) {
+        debug("Replay: request past the end of the capture");
+        CountMismatch();
+        diverged = cfg.strict != 0;
+        return;
+    }
+    if (len != records[i].data.size()
+        || memcmp(data, &records[i].data[0], Significant(data, len))) {
+        debug("Replay: request differs from record %u of the capture",
+              static_cast<unsigned int>(i));
+        CountMismatch();
+        if (cfg.strict) {
+            diverged = true;
+            return;
+        }
+    }
+
+    next = i + 1;
+    SendAnswers();
+}
+
+void CEmuReplay::ReadTimedOut()
+{
+    if (diverged)
+        return;
+
+    size_t i = next;
+    if (i < records.size() && records[i].type == CAPTURE_TIMEOUT) {
+        next = i + 1;
+        SendAnswers();
+    }
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint8_t capture_proto(TEmuFamily family)
+{
+    switch (family) {
+    case EMU_CLASSIC:
+        return CAPTURE_PROTO_CLASSIC;
+    case EMU_ZHID:
+        return CAPTURE_PROTO_ZHID;
+    case EMU_USBNET:
+        return CAPTURE_PROTO_USBNET;
+    case EMU_MH:
+        return CAPTURE_PROTO_MH;
+    }
+    return CAPTURE_PROTO_UNKNOWN;
+}
+
+/*
+ * Read the records of the channel we're to replay: the one asked for, or
+ * the first with traffic for our family. The requests are compared whole
+ * and the answers sent whole, so nothing may be cut short or dropped.
+ */
+static int load_capture(const TEmuConfig &config,
+                        vector<TReplayRecord> &records)
+{
+    const char *file_name = config.replay.c_str();
+    const uint8_t proto = capture_proto(config.family);
+    unsigned int channel = config.channel;
+    uint8_t hdr[CAPTURE_RECORD_HEADER_SIZE];
+    int err = LC_ERROR_READ;
+
+    FILE *f = fopen(file_name, "rb");
+    if (!f) {
+        debug("Can't open capture %s", file_name);
+        return LC_ERROR_OS_FILE;
+    }
+
+    if (fread(hdr, CAPTURE_MAGIC_SIZE + 2, 1, f) != 1
+        || memcmp(hdr, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)
+        || get16(hdr + CAPTURE_MAGIC_SIZE) != CAPTURE_VERSION) {
+        debug("%s is not a capture we can read", file_name);
+        goto out;
+    }
+
+    while (fread(hdr, sizeof(hdr), 1, f) == 1) {
+        TReplayRecord rec;
+        rec.type = hdr[8];
+        rec.data.resize(get16(hdr + 14));
+        if (!rec.data.empty()
+            && fread(&rec.data[0], rec.data.size(), 1, f) != 1) {
+            debug("Capture %s is cut short", file_name);
+            goto out;
+        }
+
+        if (rec.type == CAPTURE_DROPPED) {
+            debug("Capture %s lost reports, can't replay it", file_name);
+            goto out;
+        }
+        if (hdr[9] != proto)
+            continue;
+        if (channel == ~0u)
+            channel = get16(hdr + 10);
+        if (get16(hdr + 10) != channel)
+            continue;
+        if (rec.data.size() < get16(hdr + 12)) {
+            debug("Capture %s has reports cut short", file_name);
+            goto out;
+        }
+        records.push_back(rec);
+    }
+
+    if (records.empty()) {
+        debug("Nothing in capture %s for this kind of remote", file_name);
+        goto out;
+    }
+    debug("Replaying %u records from %s",
+          static_cast<unsigned int>(records.size()), file_name);
+    err = 0;
+
+out:
+    fclose(f);
+    return err;
+}
+
+CEmuDevice *EmuNewReplay(const TEmuConfig &config)
+{
+    vector<TReplayRecord> records;
+
+    if (load_capture(config, records))
+        return NULL;
+    return new CEmuReplay(config, records);
+}
+
+#endif
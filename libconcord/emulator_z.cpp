@@ -0,0 +1,615 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "lc_internal.h"
+#include "emulator.h"
+
+#ifdef WANT_EMULATOR
+
+#include "remote.h"
+#include "protocol_z.h"
+#include <string.h>
+
+#define EMU_Z_VID 0x046D
+#define EMU_Z_FW_MAJOR 2
+#define EMU_Z_FW_MINOR 5
+#define EMU_Z_HW_VER 0x0110
+
+/* the end-of-config marker the HID remotes' region reads stop at */
+static const uint8_t emu_z_eof[] = { 0x44, 0x4B, 0x44, 0x4B };
+
+/*
+ * A user config for the Z remotes: 'size' bytes ending in the end-of-config
+ * marker, with no 0x44 anywhere before it so the marker can't turn up early.
+ */
+static void emu_z_config(uint32_t size, uint32_t seed, vector<uint8_t> &rgn)
+{
+    uint32_t x = seed * 2654435761u + 7;
+
+    if (size < sizeof(emu_z_eof))
+        size = sizeof(emu_z_eof);
+    rgn.resize(size);
+    for (uint32_t i = 0; i < size - sizeof(emu_z_eof); i++) {
+        x = x * 1103515245 + 12345;
+        rgn[i] = x >> 16;
+        if (rgn[i] == emu_z_eof[0])
+            rgn[i]++;
+    }
+    memcpy(&rgn[size - sizeof(emu_z_eof)], emu_z_eof, sizeof(emu_z_eof));
+}
+
+static uint32_t emu_z_word32(const uint8_t *x)
+{
+    return x[0] << 24 | x[1] << 16 | x[2] << 8 | x[3];
+}
+
+/*
+ * The HID-based Z-Wave remotes (CRemoteZ_HID). Every report starts with the
+ * index of its last byte. In "UDP" mode that's followed by 0x01, the type
+ * and the command; INITIATE_UPDATE_TCP_CHANNEL switches to "TCP" mode, where
+ * it's the flags, our sequence number and ack, and then the type and
+ * command. See specs/protocol_z.txt.
+ */
+class CEmuZ_HID : public CEmuDevice {
+public:
+    CEmuZ_HID(const TEmuConfig &config);
+
+protected:
+    void Receive(const uint8_t *data, unsigned int len);
+
+private:
+    void Udp(const uint8_t *pkt);
+    void Tcp(const uint8_t *pkt);
+    void Command(uint8_t cmd, const uint8_t *params, unsigned int len);
+    void UdpRespond(uint8_t cmd, const uint8_t *params = NULL,
+                    unsigned int len = 0, uint8_t status = STATUS_OK);
+    void TcpSend(uint8_t flags, const uint8_t *payload = NULL,
+                 unsigned int len = 0);
+    void TcpRespond(uint8_t cmd, uint8_t status = STATUS_OK);
+
+    vector<uint8_t> region;
+    vector<uint8_t> upload;
+    uint32_t read_off;
+    /* the 16 bytes GET_CURRENT_TIME hands back and UPDATE_TIME replaces */
+    uint8_t time[16];
+    bool tcp;
+    /* the FINISH_UPDATE response waits for the host's next ack */
+    bool finish_pending;
+    /* we've acked the host's FIN and only its last ack is to come */
+    bool closing;
+    uint8_t seq;
+    uint8_t ack;
+};
+
+CEmuZ_HID::CEmuZ_HID(const TEmuConfig &config)
+    : CEmuDevice(config), read_off(0), tcp(false), finish_pending(false),
+      closing(false), seq(0), ack(0)
+{
+    emu_z_config(cfg.config_size, cfg.seed, region);
+
+    /* noon, Wednesday 1 January 2020, UTC */
+    const uint8_t t[16] = { 0xE4, 0x07, 1, 1, 12, 0, 0, 3 };
+    memcpy(time, t, sizeof(time));
+}
+
+void CEmuZ_HID::UdpRespond(uint8_t cmd, const uint8_t *params,
+                           unsigned int len, uint8_t status)
+{
+    uint8_t pkt[64] = { 0 };
+
+    pkt[0] = 4 + len;
+    pkt[1] = 0x01;
+    pkt[2] = TYPE_RESPONSE;
+    pkt[3] = cmd;
+    pkt[4] = status;
+    if (params && len)
+        memcpy(pkt + 5, params, len);
+    Send(pkt, sizeof(pkt));
+}
+
+void CEmuZ_HID::TcpSend(uint8_t flags, const uint8_t *payload,
+                        unsigned int len)
+{
+    uint8_t pkt[64] = { 0 };
+
+    pkt[0] = 3 + len;
+    pkt[1] = flags;
+    pkt[2] = seq;
+    pkt[3] = ack;
+    if (payload && len)
+        memcpy(pkt + 4, payload, len);
+    seq += len;
+    Send(pkt, sizeof(pkt));
+}
+
+void CEmuZ_HID::TcpRespond(uint8_t cmd, uint8_t status)
+{
+    const uint8_t payload[3] = { TYPE_RESPONSE, cmd, status };
+    TcpSend(TYPE_TCP_ACK, payload, sizeof(payload));
+}
+
+void CEmuZ_HID::Udp(const uint8_t *pkt)
+{
+    const uint8_t cmd = pkt[3];
+    const unsigned int len = pkt[0] > 3 ? pkt[0] - 3 : 0;
+
+    switch (cmd) {
+    case COMMAND_GET_SYSTEM_INFO: {
+        const uint16_t w[] = { EMU_Z_VID, static_cast<uint16_t>(cfg.pid),
+            static_cast<uint16_t>(cfg.arch), EMU_Z_FW_MAJOR, EMU_Z_FW_MINOR };
+        uint8_t info[15];
+        for (unsigned int i = 0; i < 5; i++) {
+            info[i * 2] = w[i] & 0xFF;
+            info[i * 2 + 1] = w[i] >> 8;
+        }
+        info[10] = 0; /* fw_type */
+        info[11] = cfg.skin & 0xFF;
+        info[12] = cfg.skin >> 8;
+        info[13] = EMU_Z_HW_VER & 0xFF;
+        info[14] = EMU_Z_HW_VER >> 8;
+        UdpRespond(cmd, info, sizeof(info));
+        break;
+    }
+    case COMMAND_GET_GUID: {
+        uint8_t ser[SERIAL_SIZE];
+        MakeSerial(ser);
+        UdpRespond(cmd, ser, sizeof(ser));
+        break;
+    }
+    case COMMAND_GET_CURRENT_TIME:
+        UdpRespond(cmd, time, sizeof(time));
+        break;
+    case COMMAND_UPDATE_TIME:
+        memcpy(time, pkt + 4, len < sizeof(time) ? len : sizeof(time));
+        UdpRespond(cmd);
+        break;
+    case COMMAND_INITIATE_UPDATE_TCP_CHANNEL: {
+        UdpRespond(cmd);
+        tcp = true;
+        finish_pending = false;
+        closing = false;
+        seq = 0xF0;
+        const uint8_t syn[64] = { 3, TYPE_TCP_SYN, seq, 0xFF };
+        Send(syn, sizeof(syn));
+        seq++;
+        break;
+    }
+    case COMMAND_Z_RESET:
+        UdpRespond(cmd);
+        break;
+    default:
+        UdpRespond(cmd, NULL, 0, STATUS_UNKNOWN_ACTION);
+        break;
+    }
+}
+
+/*
+ * Segments are taken strictly in order. One that isn't the next we want is
+ * answered with an ack for what we do have; one arriving while 'window'
+ * answers are still unread is dropped as if our buffer were full.
+ */
+void CEmuZ_HID::Tcp(const uint8_t *pkt)
+{
+    const uint8_t flags = pkt[1];
+    const uint8_t hseq = pkt[2];
+    const unsigned int bytes = pkt[0] > 3 ? pkt[0] - 3 : 0;
+
+    if (closing) {
+        tcp = false;
+        closing = false;
+        return;
+    }
+
+    if (flags & TYPE_TCP_SYN)
+        ack = hseq;
+
+    if (bytes) {
+        if (cfg.window && Queued() >= cfg.window)
+            return;
+        if (hseq != ack) {
+            TcpSend(TYPE_TCP_ACK);
+            return;
+        }
+        ack = hseq + bytes;
+        Command(pkt[5], pkt + 6, bytes - 2);
+        return;
+    }
+
+    if (flags & TYPE_TCP_FIN) {
+        TcpSend(TYPE_TCP_ACK | TYPE_TCP_FIN);
+        closing = true;
+        return;
+    }
+
+    TcpSend(TYPE_TCP_ACK);
+    if (finish_pending) {
+        finish_pending = false;
+        TcpRespond(COMMAND_FINISH_UPDATE);
+    }
+}
+
+void CEmuZ_HID::Command(uint8_t cmd, const uint8_t *params, unsigned int len)
+{
+    switch (cmd) {
+    case COMMAND_START_UPDATE:
+        upload.clear();
+        TcpRespond(cmd);
+        break;
+    case COMMAND_WRITE_UPDATE_HEADER:
+        if (len >= 4)
+            upload.reserve(params[0] | params[1] << 8 | params[2] << 16 |
+                           params[3] << 24);
+        TcpRespond(cmd);
+        break;
+    case COMMAND_WRITE_UPDATE_DATA:
+        upload.insert(upload.end(), params, params + len);
+        TcpSend(TYPE_TCP_ACK);
+        break;
+    case COMMAND_WRITE_UPDATE_DATA_DONE:
+    case COMMAND_GET_UPDATE_CHECKSUM:
+        TcpRespond(cmd);
+        break;
+    case COMMAND_FINISH_UPDATE:
+        region = upload;
+        TcpSend(TYPE_TCP_ACK);
+        finish_pending = true;
+        break;
+    case COMMAND_READ_REGION:
+        read_off = 0;
+        TcpRespond(cmd);
+        break;
+    case COMMAND_READ_REGION_DATA:
+        if (read_off < region.size()) {
+            uint8_t payload[56] = { TYPE_RESPONSE, cmd };
+            uint32_t n = region.size() - read_off;
+            if (n > 54)
+                n = 54;
+            memcpy(payload + 2, &region[read_off], n);
+            read_off += n;
+            TcpSend(TYPE_TCP_ACK, payload, sizeof(payload));
+        } else {
+            TcpRespond(COMMAND_READ_REGION_DONE);
+        }
+        break;
+    default:
+        TcpRespond(cmd, STATUS_INVALID_TCP_COMMAND);
+        break;
+    }
+}
+
+void CEmuZ_HID::Receive(const uint8_t *data, unsigned int len)
+{
+    if (len < 4)
+        return;
+    if (tcp && data[1] != 0x01)
+        Tcp(data);
+    else
+        Udp(data);
+}
+
+/*
+ * The USB networking Z-Wave remotes (CRemoteZ_USBNET): whole messages, a
+ * three byte header of service and command then a parameter count, and each
+ * parameter preceded by a length byte. Requests have 0x80 in the third byte,
+ * our answers the status there.
+ */
+class CEmuZ_USBNET : public CEmuDevice {
+public:
+    CEmuZ_USBNET(const TEmuConfig &config);
+
+protected:
+    void Receive(const uint8_t *data, unsigned int len);
+
+private:
+    typedef vector<pair<const uint8_t*, unsigned int> > TParams;
+
+    static void Parse(const uint8_t *data, unsigned int len, TParams &p);
+    static void AddParam(vector<uint8_t> &msg, const uint8_t *data,
+                         unsigned int len, uint8_t flag = 0);
+    static void AddWord(vector<uint8_t> &msg, uint16_t w);
+    void Respond(uint8_t cmd, vector<uint8_t> &msg);
+    uint16_t IRWord(uint32_t i);
+
+    vector<uint8_t> region;
+    vector<uint8_t> upload;
+    uint32_t read_off;
+    /* year, month, day, hour, minute, second, day of week */
+    uint16_t time[7];
+    /* the learnt signal, and how far into it we've sent */
+    vector<uint16_t> ir;
+    uint32_t ir_pos;
+};
+
+CEmuZ_USBNET::CEmuZ_USBNET(const TEmuConfig &config)
+    : CEmuDevice(config), read_off(0), ir_pos(0)
+{
+    emu_z_config(cfg.config_size, cfg.seed, region);
+
+    const uint16_t t[7] = { 2020, 1, 1, 12, 0, 0, 3 };
+    memcpy(time, t, sizeof(time));
+}
+
+void CEmuZ_USBNET::Parse(const uint8_t *data, unsigned int len, TParams &p)
+{
+    unsigned int i = 4;
+
+    p.clear();
+    while (i < len) {
+        unsigned int plen = data[i];
+        switch (plen & 0xC0) {
+        case 0x00:
+        case 0x80:
+            plen &= 0x3F;
+            break;
+        case 0x40:
+            plen = (plen & 0x3F) * 4;
+            break;
+        case 0xC0:
+            plen = (plen & 0x3F) * 512;
+            break;
+        }
+        i++;
+        if (i + plen > len)
+            plen = len - i;
+        p.push_back(make_pair(data + i, plen));
+        i += plen;
+    }
+}
+
+/*
+ * Lengths under 64 go straight into the length byte (with 'flag' on top);
+ * larger ones must be a multiple of 4 or 512 that fits in six bits.
+ */
+void CEmuZ_USBNET::AddParam(vector<uint8_t> &msg, const uint8_t *data,
+                            unsigned int len, uint8_t flag)
+{
+    if (len < 0x40)
+        msg.push_back(flag | len);
+    else if (len % 512 == 0)
+        msg.push_back(0xC0 | len / 512);
+    else
+        msg.push_back(0x40 | len / 4);
+    msg.insert(msg.end(), data, data + len);
+}
+
+void CEmuZ_USBNET::AddWord(vector<uint8_t> &msg, uint16_t w)
+{
+    const uint8_t b[2] = { static_cast<uint8_t>(w >> 8),
+                           static_cast<uint8_t>(w) };
+    AddParam(msg, b, sizeof(b));
+}
+
+/* 'msg' holds the parameter count and the parameters */
+void CEmuZ_USBNET::Respond(uint8_t cmd, vector<uint8_t> &msg)
+{
+    const uint8_t hdr[3] = { SERVICE_FAMILY_CLIENT << 4, cmd, STATUS_OK };
+
+    if (msg.empty())
+        msg.push_back(0);
+    msg.insert(msg.begin(), hdr, hdr + sizeof(hdr));
+    Send(&msg[0], msg.size());
+}
+
+/*
+ * Word 'i' of a signal that repeats for as long as anyone listens: the
+ * signal's own words, then its bursts over and over.
+ */
+uint16_t CEmuZ_USBNET::IRWord(uint32_t i)
+{
+    if (i < ir.size())
+        return ir[i];
+    /* the bursts, first one included, are from word 1 as on/segment pairs */
+    const uint32_t n = ir.size() - 2;
+    i = (i - ir.size()) % n;
+    if (i == 0)
+        return ir[1];
+    if (i == 1)
+        return ir[3];
+    return ir[i + 2];
+}
+
+void CEmuZ_USBNET::Receive(const uint8_t *data, unsigned int len)
+{
+    if (len < 4)
+        return;
+
+    const uint8_t cmd = data[1];
+    TParams p;
+    vector<uint8_t> msg;
+    Parse(data, len, p);
+
+    switch (cmd) {
+    case COMMAND_GET_SYSTEM_INFO: {
+        const uint8_t fw_type = 0;
+        msg.push_back(8);
+        AddWord(msg, EMU_Z_VID);
+        AddWord(msg, cfg.pid);
+        AddWord(msg, cfg.arch);
+        AddWord(msg, EMU_Z_FW_MAJOR);
+        AddWord(msg, EMU_Z_FW_MINOR);
+        AddParam(msg, &fw_type, 1);
+        AddWord(msg, cfg.skin);
+        AddWord(msg, EMU_Z_HW_VER);
+        break;
+    }
+    case COMMAND_GET_GUID: {
+        uint8_t ser[SERIAL_SIZE];
+        MakeSerial(ser);
+        msg.push_back(1);
+        AddParam(msg, ser, sizeof(ser), 0x80);
+        break;
+    }
+    case COMMAND_GET_REGION_IDS: {
+        const uint8_t ids[] = { 0x01, 0x02, 0x03, 0x05, 0x07,
+            0x0B, 0x0C, 0x0D, 0x0E, 0x0F };
+        msg.push_back(1);
+        AddParam(msg, ids, sizeof(ids), 0x80);
+        break;
+    }
+    case COMMAND_GET_REGION_VERSION: {
+        /* minor, then major */
+        const uint8_t ver[2] = { 0, 1 };
+        msg.push_back(1);
+        AddParam(msg, ver, sizeof(ver));
+        break;
+    }
+    case COMMAND_GET_HOME_ID: {
+        const uint8_t id[4] = { static_cast<uint8_t>(cfg.seed >> 24),
+            static_cast<uint8_t>(cfg.seed >> 16),
+            static_cast<uint8_t>(cfg.seed >> 8),
+            static_cast<uint8_t>(cfg.seed) };
+        msg.push_back(1);
+        AddParam(msg, id, sizeof(id));
+        break;
+    }
+    case COMMAND_GET_NODE_ID: {
+        const uint8_t id = 1;
+        msg.push_back(1);
+        AddParam(msg, &id, 1);
+        break;
+    }
+    case COMMAND_GET_INTERFACE_LIST: {
+        const uint8_t count = 1;
+        uint8_t list[12] = { 0x00, 0x01 };
+        for (unsigned int i = 2; i < sizeof(list); i++)
+            list[i] = (cfg.seed * 31 + i) & 0xFF;
+        msg.push_back(2);
+        AddParam(msg, &count, 1);
+        AddParam(msg, list, sizeof(list), 0x80);
+        break;
+    }
+    case COMMAND_GET_CURRENT_TIME: {
+        const uint8_t zero[2] = { 0, 0 };
+        const uint8_t tz[4] = { 'U', 'T', 'C', 0 };
+        msg.push_back(12);
+        AddWord(msg, time[0]);
+        for (unsigned int i = 1; i < 7; i++) {
+            const uint8_t b = time[i];
+            AddParam(msg, &b, 1);
+        }
+        for (unsigned int i = 0; i < 4; i++)
+            AddParam(msg, zero, sizeof(zero));
+        AddParam(msg, tz, sizeof(tz), 0x80);
+        break;
+    }
+    case COMMAND_UPDATE_TIME:
+        if (p.size() >= 7 && p[0].second == 2) {
+            time[0] = p[0].first[0] << 8 | p[0].first[1];
+            for (unsigned int i = 1; i < 7; i++)
+                time[i] = p[i].second ? p[i].first[0] : 0;
+        }
+        break;
+    case COMMAND_START_UPDATE:
+        upload.clear();
+        break;
+    case COMMAND_WRITE_UPDATE_HEADER:
+        if (p.size() >= 1 && p[0].second == 4)
+            upload.reserve(emu_z_word32(p[0].first));
+        break;
+    case COMMAND_WRITE_UPDATE_DATA:
+        if (p.size() >= 3 && p[2].second == 4) {
+            uint32_t n = emu_z_word32(p[2].first);
+            if (n > p[1].second)
+                n = p[1].second;
+            upload.insert(upload.end(), p[1].first, p[1].first + n);
+        }
+        break;
+    case COMMAND_FINISH_UPDATE:
+        region = upload;
+        break;
+    case COMMAND_READ_REGION: {
+        const uint8_t size[4] = {
+            static_cast<uint8_t>(region.size() >> 24),
+            static_cast<uint8_t>(region.size() >> 16),
+            static_cast<uint8_t>(region.size() >> 8),
+            static_cast<uint8_t>(region.size()) };
+        read_off = 0;
+        msg.push_back(1);
+        AddParam(msg, size, sizeof(size));
+        break;
+    }
+    case COMMAND_READ_REGION_DATA: {
+        /* always a full 1024-byte slot, the actual length after it */
+        uint8_t chunk[1024] = { 0 };
+        uint32_t n = 0;
+        if (read_off < region.size()) {
+            n = region.size() - read_off;
+            if (n > sizeof(chunk))
+                n = sizeof(chunk);
+            memcpy(chunk, &region[read_off], n);
+            read_off += n;
+        }
+        const uint8_t rgn = REGION_USER_CONFIG;
+        const uint8_t clen[4] = { static_cast<uint8_t>(n >> 24),
+            static_cast<uint8_t>(n >> 16), static_cast<uint8_t>(n >> 8),
+            static_cast<uint8_t>(n) };
+        msg.push_back(3);
+        AddParam(msg, &rgn, 1);
+        AddParam(msg, chunk, sizeof(chunk));
+        AddParam(msg, clen, sizeof(clen));
+        break;
+    }
+    case COMMAND_LEARNIR_START:
+        EmuIRWords(cfg.seed, ir);
+        ir_pos = 0;
+        break;
+    case COMMAND_LEARNIR_SINGLE: {
+        /* a "more" flag, then four words, the last chunk zero padded */
+        const uint8_t more = ir_pos + 4 < ir.size();
+        msg.push_back(5);
+        AddParam(msg, &more, 1);
+        for (unsigned int i = 0; i < 4; i++, ir_pos++)
+            AddWord(msg, ir_pos < ir.size() ? ir[ir_pos] : 0);
+        break;
+    }
+    case COMMAND_LEARNIR_STREAM: {
+        /* 96 words and a terminator, until the host has heard enough */
+        uint8_t words[192];
+        const uint8_t term = 0x30;
+        for (unsigned int i = 0; i < 96; i++, ir_pos++) {
+            const uint16_t w = IRWord(ir_pos);
+            words[i * 2] = w >> 8;
+            words[i * 2 + 1] = w & 0xFF;
+        }
+        msg.push_back(2);
+        AddParam(msg, words, sizeof(words));
+        AddParam(msg, &term, 1);
+        break;
+    }
+    default:
+        /*
+         * READ_REGION_DONE, WRITE_UPDATE_DATA_DONE, GET_UPDATE_CHECKSUM,
+         * Z_RESET, LEARNIR_DONE and the rest just get a bare response.
+         */
+        break;
+    }
+
+    Respond(cmd, msg);
+}
+
+CEmuDevice *EmuNewZ_HID(const TEmuConfig &config)
+{
+    return new CEmuZ_HID(config);
+}
+
+CEmuDevice *EmuNewZ_USBNET(const TEmuConfig &config)
+{
+    return new CEmuZ_USBNET(config);
+}
+
+#endif
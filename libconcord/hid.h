@@ -21,6 +21,8 @@
 #ifndef HID_H
 #define HID_H
 
+#include <vector>
+
 struct THIDINFO {
     string mfg;
     string prod;
@@ -30,12 +32,37 @@ struct THIDINFO {
     unsigned int irl;
     unsigned int orl;
     unsigned int frl;
+    /* Backend-specific location of the device, accepted by OpenRemote() */
+    string path;
+    string serial;
+    /* Backend handle while the device is open, NULL otherwise */
+    void *dev;
 };
 
 int InitUSB();
 void ShutdownUSB();
 
+/*
+ * FindRemote() opens the first Harmony found. FindRemotes() lists all of
+ * them without opening any; pick one and hand it to OpenRemote().
+ */
 int FindRemote(THIDINFO &hid_info);
+int FindRemotes(vector<THIDINFO> &remotes);
+int OpenRemote(THIDINFO &hid_info);
+void CloseRemote(THIDINFO &hid_info);
+
+/*
+ * Wait up to 'timeout' ms for a Harmony to be plugged in. Returns 0 as soon
+ * as one arrives, or -ETIMEDOUT; backends that don't get hotplug events
+ * always sleep the whole time.
+ */
+int HID_WaitForArrival(unsigned int timeout);
+
+/*
+ * HID_WriteReport() and HID_ReadReport() talk to the device last selected
+ * by the calling thread. Opening a remote selects it.
+ */
+void HID_SelectRemote(THIDINFO *hid_info);
 
 int HID_WriteReport(const uint8_t *data);
 int HID_ReadReport(uint8_t *data, unsigned int timeout = 1000);
@@ -33,6 +33,8 @@
 #include <list>
 #include <unistd.h>
 #include <vector>
+#include <mutex>
+#include <chrono>
 #include "libconcord.h"
 #include "lc_internal.h"
 #include "remote.h"
@@ -43,6 +45,9 @@
 #include "protocol.h"
 #include "time.h"
 #include "operationfile.h"
+#include "profile.h"
+#include "transfer_stats.h"
+#include "capture.h"
 
 #define ZWAVE_HID_PID_MIN 0xC112
 #define ZWAVE_HID_PID_MAX 0xC115
@@ -50,177 +55,270 @@
 // Certain remotes (e.g., 900) take longer to reboot, so extend wait time.
 #define MAX_WAIT_FOR_BOOT 10
 #define WAIT_FOR_BOOT_SLEEP 5
+/*
+ * The first reconnect attempt after a reset comes this long after it (ms),
+ * so the remote has dropped off the bus by then
+ */
+#define BOOT_POLL_FIRST 1000
+/* Later reconnect attempts start this far apart (ms) and double */
+#define BOOT_POLL_MIN 100
+#define BOOT_POLL_MAX 2000
+
+/*
+ * Everything we know about one remote. The legacy (non-_s) API operates on
+ * default_session, so old callers see exactly the behavior they always have.
+ */
+struct lc_session {
+    class CRemoteBase *rmt;
+    class OperationFile *of;
+    struct TRemoteInfo ri;
+    struct THIDINFO hid_info;
+    struct THarmonyTime rtime;
+    /*
+     * What init_concord_path_s() was asked to open, empty to take the
+     * first remote found.
+     */
+    string path;
+    string serial;
+    /* of belongs to another session, see lc_session_share_file() */
+    bool of_shared;
+    /* pick up interrupted uploads, see lc_set_resume() */
+    bool resume;
+    TTransferStats stats;
+};
+
+static struct lc_session default_session;
+
+/*
+ * Point the transport at this session's remote for the calling thread.
+ * Every entry point that talks to the remote must do this first.
+ */
+static void _bind(lc_session *s)
+{
+    HID_SelectRemote(&s->hid_info);
+    Stats_Select(&s->stats);
+}
+
+/*
+ * SESSIONS
+ */
+lc_session *lc_session_new()
+{
+    return new lc_session();
+}
+
+void lc_session_free(lc_session *s)
+{
+    if (!s || s == &default_session)
+        return;
+
+    if (s->rmt)
+        deinit_concord_s(s);
+    delete_opfile_obj_s(s);
+    Stats_Forget(&s->stats);
+    delete s;
+}
+
+lc_session *lc_default_session()
+{
+    return &default_session;
+}
+
+int lc_session_share_file(lc_session *s, lc_session *from)
+{
+    if (!s || !from || !from->of || s == from)
+        return LC_ERROR;
+
+    delete_opfile_obj_s(s);
+    s->of = from->of;
+    s->of_shared = true;
+
+    return 0;
+}
+
+void lc_set_resume_s(lc_session *s, int resume)
+{
+    s->resume = resume != 0;
+}
+
+int lc_get_transfer_stats_s(lc_session *s, struct lc_transfer_stats *stats)
+{
+    if (!stats)
+        return LC_ERROR;
+
+    Stats_Get(s->stats, *stats);
+    return 0;
+}
 
-static class CRemoteBase *rmt;
-static class OperationFile *of;
-static struct TRemoteInfo ri;
-static struct THIDINFO hid_info;
-static struct THarmonyTime rtime;
+void lc_reset_transfer_stats_s(lc_session *s)
+{
+    Stats_Reset(s->stats);
+}
 
 /*
  * BEGIN ACCESSORS
  */
-const char *get_mfg()
+const char *get_mfg_s(lc_session *s)
 {
-    return ri.model->mfg;
+    return s->ri.model->mfg;
 }
 
-const char *get_model()
+const char *get_model_s(lc_session *s)
 {
-    return ri.model->model;
+    return s->ri.model->model;
 }
 
-const char *get_codename()
+const char *get_codename_s(lc_session *s)
 {
-    return (ri.model->code_name) ? ri.model->code_name : (char *)"";
+    return (s->ri.model->code_name) ? s->ri.model->code_name : (char *)"";
 }
 
-int get_skin()
+int get_skin_s(lc_session *s)
 {
-    return ri.skin;
+    return s->ri.skin;
 }
 
-int get_fw_ver_maj()
+int get_fw_ver_maj_s(lc_session *s)
 {
-    return ri.fw_ver_major;
+    return s->ri.fw_ver_major;
 }
 
-int get_fw_ver_min()
+int get_fw_ver_min_s(lc_session *s)
 {
-    return ri.fw_ver_minor;
+    return s->ri.fw_ver_minor;
 }
 
-int get_fw_type()
+int get_fw_type_s(lc_session *s)
 {
-    return ri.fw_type;
+    return s->ri.fw_type;
 }
 
-int get_hw_ver_maj()
+int get_hw_ver_maj_s(lc_session *s)
 {
-    return ri.hw_ver_major;
+    return s->ri.hw_ver_major;
 }
 
-int get_hw_ver_min()
+int get_hw_ver_min_s(lc_session *s)
 {
-    return ri.hw_ver_minor;
+    return s->ri.hw_ver_minor;
 }
 
-int get_hw_ver_mic()
+int get_hw_ver_mic_s(lc_session *s)
 {
-    return ri.hw_ver_micro;
+    return s->ri.hw_ver_micro;
 }
 
-int get_flash_size()
+int get_flash_size_s(lc_session *s)
 {
-    return ri.flash->size;
+    return s->ri.flash->size;
 }
 
-int get_flash_mfg()
+int get_flash_mfg_s(lc_session *s)
 {
-    return ri.flash_mfg;
+    return s->ri.flash_mfg;
 }
 
-int get_flash_id()
+int get_flash_id_s(lc_session *s)
 {
-    return ri.flash_id;
+    return s->ri.flash_id;
 }
 
-const char *get_flash_part_num()
+const char *get_flash_part_num_s(lc_session *s)
 {
-    return ri.flash->part;
+    return s->ri.flash->part;
 }
 
-int get_arch()
+int get_arch_s(lc_session *s)
 {
-    return ri.architecture;
+    return s->ri.architecture;
 }
 
-int get_proto()
+int get_proto_s(lc_session *s)
 {
-    return ri.protocol;
+    return s->ri.protocol;
 }
 
-const char *get_hid_mfg_str()
+const char *get_hid_mfg_str_s(lc_session *s)
 {
-    return hid_info.mfg.c_str();
+    return s->hid_info.mfg.c_str();
 }
 
-const char *get_hid_prod_str()
+const char *get_hid_prod_str_s(lc_session *s)
 {
-    return hid_info.prod.c_str();
+    return s->hid_info.prod.c_str();
 }
 
-int get_hid_irl()
+int get_hid_irl_s(lc_session *s)
 {
-    return hid_info.irl;
+    return s->hid_info.irl;
 }
 
-int get_hid_orl()
+int get_hid_orl_s(lc_session *s)
 {
-    return hid_info.orl;
+    return s->hid_info.orl;
 }
 
-int get_hid_frl()
+int get_hid_frl_s(lc_session *s)
 {
-    return hid_info.frl;
+    return s->hid_info.frl;
 }
 
-int get_usb_vid()
+int get_usb_vid_s(lc_session *s)
 {
-    return hid_info.vid;
+    return s->hid_info.vid;
 }
 
-int get_usb_pid()
+int get_usb_pid_s(lc_session *s)
 {
-    return hid_info.pid;
+    return s->hid_info.pid;
 }
 
-int get_usb_bcd()
+int get_usb_bcd_s(lc_session *s)
 {
-    return hid_info.ver;
+    return s->hid_info.ver;
 }
 
-char *get_serial(int p)
+char *get_serial_s(lc_session *s, int p)
 {
     switch (p) {
         case 1:
-            return ri.serial1;
+            return s->ri.serial1;
             break;
         case 2:
-            return ri.serial2;
+            return s->ri.serial2;
             break;
         case 3:
-            return ri.serial3;
+            return s->ri.serial3;
             break;
     }
 
     return (char *)"";
 }
 
-int get_config_bytes_used()
+int get_config_bytes_used_s(lc_session *s)
 {
-    return ri.config_bytes_used;
+    return s->ri.config_bytes_used;
 }
 
-int get_config_bytes_total()
+int get_config_bytes_total_s(lc_session *s)
 {
-    return ri.max_config_size;
+    return s->ri.max_config_size;
 }
 
-int is_z_remote()
+int is_z_remote_s(lc_session *s)
 {
     /* should this be in the remoteinfo struct? */
-    return rmt->IsZRemote() ? 1 : 0;
+    return s->rmt->IsZRemote() ? 1 : 0;
 }
 
-int is_usbnet_remote()
+int is_usbnet_remote_s(lc_session *s)
 {
-    return rmt->IsUSBNet() ? 1 : 0;
+    return s->rmt->IsUSBNet() ? 1 : 0;
 }
 
-int is_mh_remote()
+int is_mh_remote_s(lc_session *s)
 {
-    return rmt->IsMHRemote() ? 1 : 0;
+    return s->rmt->IsMHRemote() ? 1 : 0;
 }
 
 int is_mh_pid(unsigned int pid)
@@ -237,49 +335,49 @@ int is_mh_pid(unsigned int pid)
     }
 }
 
-int get_time_second()
+int get_time_second_s(lc_session *s)
 {
-    return rtime.second;
+    return s->rtime.second;
 }
 
-int get_time_minute()
+int get_time_minute_s(lc_session *s)
 {
-    return rtime.minute;
+    return s->rtime.minute;
 }
 
-int get_time_hour()
+int get_time_hour_s(lc_session *s)
 {
-    return rtime.hour;
+    return s->rtime.hour;
 }
 
-int get_time_day()
+int get_time_day_s(lc_session *s)
 {
-    return rtime.day;
+    return s->rtime.day;
 }
 
-int get_time_dow()
+int get_time_dow_s(lc_session *s)
 {
-    return rtime.dow;
+    return s->rtime.dow;
 }
 
-int get_time_month()
+int get_time_month_s(lc_session *s)
 {
-    return rtime.month;
+    return s->rtime.month;
 }
 
-int get_time_year()
+int get_time_year_s(lc_session *s)
 {
-    return rtime.year;
+    return s->rtime.year;
 }
 
-int get_time_utc_offset()
+int get_time_utc_offset_s(lc_session *s)
 {
-    return rtime.utc_offset;
+    return s->rtime.utc_offset;
 }
 
-const char *get_time_timezone()
+const char *get_time_timezone_s(lc_session *s)
 {
-    return rtime.timezone.c_str();
+    return s->rtime.timezone.c_str();
 }
 
 
@@ -435,6 +533,10 @@ const char *lc_cb_stage_str(int stage)
         case LC_CB_STAGE_LEARN:
             return "Learning IR code";
             break;
+
+        case LC_CB_STAGE_CALIBRATE:
+            return "Calibrating";
+            break;
     }
 
     return "(Unknown)";
@@ -443,23 +545,28 @@ const char *lc_cb_stage_str(int stage)
 /*
  * Wrapper around the OperationFile class.
  */
-int read_and_parse_file(char *filename, int *type)
+int read_and_parse_file_s(lc_session *s, char *filename, int *type)
 {
-    of = new OperationFile;
-    return of->ReadAndParseOpFile(filename, type);
+    delete_opfile_obj_s(s);
+    s->of = new OperationFile;
+    return s->of->ReadAndParseOpFile(filename, type);
 }
 
-void delete_opfile_obj()
+void delete_opfile_obj_s(lc_session *s)
 {
-    if (of)
-        delete of;
+    if (s->of) {
+        if (!s->of_shared)
+            delete s->of;
+        s->of = NULL;
+        s->of_shared = false;
+    }
 }
 
 /*
  * PRIVATE HELPER FUNCTIONS
  */
 
-int _is_fw_update_supported(int direct)
+int _is_fw_update_supported(lc_session *s, int direct)
 {
     /*
      * If we don't have a fw_base, then we don't support fw updates
@@ -472,33 +579,35 @@ int _is_fw_update_supported(int direct)
      * Also, only allow architectures where we've figured out the
      * structure of the initial magic bytes.
      */
-    if (is_z_remote()) {
+    if (is_z_remote_s(s)) {
         return 0;
     }
 
-    if (ri.arch->firmware_base == 0
-        || (!direct && ri.arch->firmware_update_base == 0)
-        || (ri.arch->firmware_4847_offset == 0)) {
+    if (s->ri.arch->firmware_base == 0
+        || (!direct && s->ri.arch->firmware_update_base == 0)
+        || (s->ri.arch->firmware_4847_offset == 0)) {
         return 0;
     }
 
     return 1;
 }
 
-int _write_fw_to_remote(uint8_t *in, uint32_t size, uint32_t addr,
-                        lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _write_fw_to_remote(lc_session *s, uint8_t *in, uint32_t size,
+                        uint32_t addr, lc_callback cb, void *cb_arg,
+                        uint32_t cb_stage)
 {
     int err = 0;
 
-    if ((err = rmt->WriteFlash(addr, size, in, ri.protocol, cb, cb_arg,
-                               cb_stage))) {
+    if ((err = s->rmt->WriteFlash(addr, size, in, s->ri.protocol, cb, cb_arg,
+                                  cb_stage))) {
         return LC_ERROR_WRITE;
     }
     return 0;
 }
 
-int _read_fw_from_remote(uint8_t *&out, uint32_t size, uint32_t addr,
-                         lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _read_fw_from_remote(lc_session *s, uint8_t *&out, uint32_t size,
+                         uint32_t addr, lc_callback cb, void *cb_arg,
+                         uint32_t cb_stage)
 {
     out = new uint8_t[size];
     int err = 0;
@@ -507,8 +616,8 @@ int _read_fw_from_remote(uint8_t *&out, uint32_t size, uint32_t addr,
         cb_arg = (void *)true;
     }
 
-    if ((err = rmt->ReadFlash(addr, size, out, ri.protocol, false, cb, cb_arg,
-                              cb_stage))) {
+    if ((err = s->rmt->ReadFlash(addr, size, out, s->ri.protocol, false, cb,
+                                 cb_arg, cb_stage))) {
         return LC_ERROR_READ;
     }
 
@@ -531,10 +640,13 @@ int _read_fw_from_remote(uint8_t *&out, uint32_t size, uint32_t addr,
  * For most users, that will be all the time.
  *
  *   - Phil Dibowitz    Tue Mar 11 23:17:53 PDT 2008
+ *
+ * The checksum runs to FIRMWARE_MAX_SIZE whatever size is, so in must hold
+ * that much, padded with 0xFF past the image.
  */
-int _fix_magic_bytes(uint8_t *in, uint32_t size)
+int _fix_magic_bytes(lc_session *s, uint8_t *in, uint32_t size)
 {
-    if (size < (ri.arch->firmware_4847_offset + 2)) {
+    if (size < (s->ri.arch->firmware_4847_offset + 2)) {
         return LC_ERROR;
     }
 
@@ -550,8 +662,8 @@ int _fix_magic_bytes(uint8_t *in, uint32_t size)
          * Note: Arch 2 may be an exception to rule, and needs
          * more investigation.
          */
-        in[ri.arch->firmware_4847_offset] = 0x48;
-        in[ri.arch->firmware_4847_offset + 1] = 0x47;
+        in[s->ri.arch->firmware_4847_offset] = 0x48;
+        in[s->ri.arch->firmware_4847_offset + 1] = 0x47;
 
         /*
          * The first 2 bytes are a simple 16-bit checksum, computed
@@ -561,7 +673,7 @@ int _fix_magic_bytes(uint8_t *in, uint32_t size)
         uint8_t suma = 0x21;
         uint8_t sumb = 0x43;
         for (
-            uint32_t index = ri.arch->firmware_4847_offset;
+            uint32_t index = s->ri.arch->firmware_4847_offset;
             index < FIRMWARE_MAX_SIZE;
             index += 2
         ) {
@@ -590,17 +702,17 @@ int is_config_update_supported()
     return 0;
 }
 
-int is_fw_dump_supported()
+int is_fw_dump_supported_s(lc_session *s)
 {
-    return is_z_remote() ? LC_ERROR_UNSUPP: 0;
+    return is_z_remote_s(s) ? LC_ERROR_UNSUPP: 0;
 }
 
-int is_fw_update_supported(int direct)
+int is_fw_update_supported_s(lc_session *s, int direct)
 {
     /*
      * Currently firmware upgrades are only available certain remotes.
      */
-    if (_is_fw_update_supported(direct)) {
+    if (_is_fw_update_supported(s, direct)) {
         return 0;
     } else {
         return LC_ERROR_UNSUPP;
@@ -622,6 +734,16 @@ static const uint32_t update_configuration_hid_stages[]={
 };
 static const int update_configuration_hid_num_stages = 5;
 
+static const uint32_t update_configuration_hid_delta_stages[]={
+    LC_CB_STAGE_INITIALIZE_UPDATE,
+    LC_CB_STAGE_READ_CONFIG,
+    LC_CB_STAGE_INVALIDATE_FLASH,
+    LC_CB_STAGE_ERASE_FLASH,
+    LC_CB_STAGE_WRITE_CONFIG,
+    LC_CB_STAGE_VERIFY_CONFIG,
+};
+static const int update_configuration_hid_delta_num_stages = 6;
+
 static const uint32_t update_configuration_zwave_mh_stages[]={
     LC_CB_STAGE_INITIALIZE_UPDATE,
     LC_CB_STAGE_WRITE_CONFIG,
@@ -645,15 +767,19 @@ static const uint32_t update_firmware_hid_direct_stages[]={
 };
 static const int update_firmware_hid_direct_num_stages = 3;
 
-std::vector<uint32_t> _get_update_config_stages(int noreset)
+std::vector<uint32_t> _get_update_config_stages(lc_session *s, int noreset,
+                                                bool delta)
 {
     std::vector<uint32_t> stages;
     uint32_t *base_stages;
     int num_base_stages;
 
-    if (is_z_remote() || is_mh_remote()) {
+    if (is_z_remote_s(s) || is_mh_remote_s(s)) {
         base_stages = (uint32_t*)update_configuration_zwave_mh_stages;
         num_base_stages = update_configuration_zwave_mh_num_stages;
+    } else if (delta) {
+        base_stages = (uint32_t*)update_configuration_hid_delta_stages;
+        num_base_stages = update_configuration_hid_delta_num_stages;
     } else {
         base_stages = (uint32_t*)update_configuration_hid_stages;
         num_base_stages = update_configuration_hid_num_stages;
@@ -662,7 +788,7 @@ std::vector<uint32_t> _get_update_config_stages(int noreset)
     for (int i = 0; i < num_base_stages; i++)
         stages.push_back(base_stages[i]);
 
-    if (!noreset && !(is_z_remote() && !is_usbnet_remote()))
+    if (!noreset && !(is_z_remote_s(s) && !is_usbnet_remote_s(s)))
         stages.push_back(LC_CB_STAGE_RESET);
 
     stages.push_back(LC_CB_STAGE_SET_TIME);
@@ -670,7 +796,8 @@ std::vector<uint32_t> _get_update_config_stages(int noreset)
     return stages;
 }
 
-std::vector<uint32_t> _get_update_firmware_stages(int noreset, int direct)
+std::vector<uint32_t> _get_update_firmware_stages(lc_session *s, int noreset,
+                                                  int direct)
 {
     std::vector<uint32_t> stages;
     uint32_t *base_stages;
@@ -687,7 +814,7 @@ std::vector<uint32_t> _get_update_firmware_stages(int noreset, int direct)
     for (int i = 0; i < num_base_stages; i++)
         stages.push_back(base_stages[i]);
 
-    if (!noreset && !(is_z_remote() && !is_usbnet_remote()))
+    if (!noreset && !(is_z_remote_s(s) && !is_usbnet_remote_s(s)))
         stages.push_back(LC_CB_STAGE_RESET);
 
     stages.push_back(LC_CB_STAGE_SET_TIME);
@@ -698,11 +825,18 @@ std::vector<uint32_t> _get_update_firmware_stages(int noreset, int direct)
 /*
  * GENERAL REMOTE STUFF
  */
-int init_concord()
-{
-    int err;
-    rmt = NULL;
+/*
+ * The USB libraries keep one global list of devices, which finding or
+ * opening a remote rebuilds, so sessions in different threads take turns
+ * doing either. Talking to an open remote needs no lock.
+ */
+static std::mutex discovery_mutex;
 
+/*
+ * Get the OS-level pieces (WinSock, the USB library) ready.
+ */
+int _init_os()
+{
 #ifdef _WIN32
     // Initialize WinSock
     WSADATA wsainfo;
@@ -718,14 +852,97 @@ int init_concord()
         return LC_ERROR_OS;
     }
 
-    if ((err = FindRemote(hid_info))) {
-        hid_info.pid = 0;
+    return 0;
+}
+
+/*
+ * Find the remote a session was opened on by path. A reset re-enumerates
+ * the remote, which may change its path, so once we know the unit's serial
+ * we go by that instead. A remote without a serial that isn't at its old
+ * path any more is taken to be the only one of its VID/PID, if there is
+ * just one.
+ */
+int _find_session_remote(lc_session *s)
+{
+    vector<THIDINFO> remotes;
+    int same_model = -1;
+    int same_model_count = 0;
+
+    FindRemotes(remotes);
+    for (unsigned int i = 0; i < remotes.size(); i++) {
+        if ((!s->serial.empty() && remotes[i].serial == s->serial)
+            || (s->serial.empty() && remotes[i].path == s->path)) {
+            s->hid_info = remotes[i];
+            return OpenRemote(s->hid_info);
+        }
+        if (s->hid_info.vid && remotes[i].vid == s->hid_info.vid
+            && remotes[i].pid == s->hid_info.pid) {
+            same_model = i;
+            same_model_count++;
+        }
+    }
+
+    if (s->serial.empty() && same_model_count == 1) {
+        debug("Remote moved from %s to %s", s->path.c_str(),
+              remotes[same_model].path.c_str());
+        s->hid_info = remotes[same_model];
+        s->path = s->hid_info.path;
+        return OpenRemote(s->hid_info);
+    }
+
+    debug("No remote at %s", s->path.c_str());
+    return LC_ERROR_CONNECT;
+}
+
+int init_concord_s(lc_session *s)
+{
+    std::lock_guard<std::mutex> lock(discovery_mutex);
+    static bool capture_env_checked = false;
+    int err;
+    s->rmt = NULL;
+    _bind(s);
+
+    if (!capture_env_checked) {
+        const char *capture_file = getenv("LIBCONCORD_CAPTURE");
+        if (capture_file && *capture_file)
+            Capture_Start(capture_file);
+        capture_env_checked = true;
+    }
 
+    if ((err = _init_os()))
+        return err;
+
+    if (s->path == LC_USBNET_PATH) {
+        s->hid_info = THIDINFO();
         if ((err = FindUsbLanRemote())) {
             return LC_ERROR_CONNECT;
         }
 
-        rmt = new CRemoteZ_USBNET;
+        s->rmt = new CRemoteZ_USBNET;
+        s->stats.protocol = STATS_USBNET;
+    } else if (!s->path.empty()) {
+        if ((err = _find_session_remote(s))) {
+            return LC_ERROR_CONNECT;
+        }
+    } else {
+        /*
+         * Get the usbnet connect going before looking over USB, so when
+         * there's no HID remote we don't then wait on the network from
+         * scratch, and when there is one the connect costs us nothing.
+         */
+        bool usbnet_pending = (StartUsbLanConnect() == 0);
+        if ((err = FindRemote(s->hid_info))) {
+            s->hid_info.pid = 0;
+
+            if (!usbnet_pending || (err = FinishUsbLanConnect())) {
+                return LC_ERROR_CONNECT;
+            }
+
+            s->rmt = new CRemoteZ_USBNET;
+            s->stats.protocol = STATS_USBNET;
+        } else if (usbnet_pending) {
+            CancelUsbLanConnect();
+        }
     }
 
     /*
@@ -733,19 +950,22 @@ int init_concord()
      * via HID that's a 1000... that REALLY shouldn't even be possible
      * but this'll catch that.
      */
-    if (hid_info.pid == 0xC11F) {
+    if (s->hid_info.pid == 0xC11F) {
         return LC_ERROR_INVALID_DATA_FROM_REMOTE;
     }
 
-    if (!rmt) {
-        if (hid_info.pid >= ZWAVE_HID_PID_MIN &&
-            hid_info.pid <= ZWAVE_HID_PID_MAX) {
+    if (!s->rmt) {
+        if (s->hid_info.pid >= ZWAVE_HID_PID_MIN &&
+            s->hid_info.pid <= ZWAVE_HID_PID_MAX) {
             // 890, Monstor, etc.
-            rmt = new CRemoteZ_HID;
-        } else if (is_mh_pid(hid_info.pid)) {
-            rmt = new CRemoteMH;
+            s->rmt = new CRemoteZ_HID;
+            s->stats.protocol = STATS_ZHID;
+        } else if (is_mh_pid(s->hid_info.pid)) {
+            s->rmt = new CRemoteMH;
+            s->stats.protocol = STATS_MH;
         } else {
-            rmt = new CRemote;
+            s->rmt = new CRemote;
+            s->stats.protocol = STATS_CLASSIC;
             /*
              * Send a "reset USB" command before sending any other
              * commands.  Seems to be required for the Harmony One;
@@ -753,72 +973,200 @@ int init_concord()
              * The official software seems to do this for most
              * remotes.
              */
-            rmt->Reset(COMMAND_RESET_USB);
+            s->rmt->Reset(COMMAND_RESET_USB);
         }
     }
 
     return 0;
 }
 
-int deinit_concord()
+int init_concord_path_s(lc_session *s, const char *path)
+{
+    int err;
+
+    if (!path)
+        return LC_ERROR;
+
+    s->path = path;
+    s->serial = "";
+    /* nothing to fall back on until we've found it at this path */
+    s->hid_info.vid = 0;
+    if ((err = init_concord_s(s)))
+        return err;
+    s->serial = s->hid_info.serial;
+
+    return 0;
+}
+
+int deinit_concord_s(lc_session *s)
 {
-    ShutdownUSB();
-    if (rmt) {
-        delete rmt;
-        rmt = NULL;
+    _bind(s);
+    if (s->rmt && s->rmt->IsUSBNet())
+        ShutdownUsbLan();
+    std::lock_guard<std::mutex> lock(discovery_mutex);
+    CloseRemote(s->hid_info);
+    if (s->rmt) {
+        delete s->rmt;
+        s->rmt = NULL;
     }
     return 0;
 }
 
-int _get_identity(lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int lc_enumerate_remotes(struct lc_device_info **devices, int *count,
+                         int probe_usbnet)
+{
+    int err;
+    vector<THIDINFO> remotes;
+    vector<lc_device_info> found;
+    bool usbnet = false;
+
+    if (!devices || !count)
+        return LC_ERROR;
+
+    std::lock_guard<std::mutex> lock(discovery_mutex);
+    if ((err = _init_os()))
+        return err;
+
+    /* let the usbnet probe's connect run while we enumerate USB */
+    bool probing = probe_usbnet && StartUsbLanProbe() == 0;
+
+    FindRemotes(remotes);
+    for (unsigned int i = 0; i < remotes.size(); i++) {
+        /* Some USB backends can see the 1000, but we talk to it over IP */
+        if (remotes[i].pid == 0xC11F) {
+            usbnet = true;
+            continue;
+        }
+        lc_device_info dev = lc_device_info();
+        dev.transport = LC_TRANSPORT_HID;
+        dev.vid = remotes[i].vid;
+        dev.pid = remotes[i].pid;
+        strncpy(dev.path, remotes[i].path.c_str(),
+                LC_DEVICE_STRING_LENGTH - 1);
+        strncpy(dev.serial, remotes[i].serial.c_str(),
+                LC_DEVICE_STRING_LENGTH - 1);
+        found.push_back(dev);
+    }
+
+    if (probing) {
+        if (usbnet)
+            CancelUsbLanProbe();
+        else if (FinishUsbLanProbe() == 0)
+            usbnet = true;
+    }
+
+    if (usbnet) {
+        lc_device_info dev = lc_device_info();
+        dev.transport = LC_TRANSPORT_USBNET;
+        dev.vid = 0x046D;
+        dev.pid = 0xC11F;
+        strncpy(dev.path, LC_USBNET_PATH, LC_DEVICE_STRING_LENGTH - 1);
+        found.push_back(dev);
+    }
+
+    *count = found.size();
+    *devices = new lc_device_info[found.size() + 1];
+    for (unsigned int i = 0; i < found.size(); i++)
+        (*devices)[i] = found[i];
+
+    return 0;
+}
+
+void lc_delete_device_list(struct lc_device_info *devices)
+{
+    delete[] devices;
+}
+
+/*
+ * Use the chunk sizes calibrated for this kind of remote, if any.
+ */
+void _apply_chunk_profile(lc_session *s)
+{
+    TChunkProfile profile = TChunkProfile();
+
+    if (is_z_remote_s(s) || is_mh_remote_s(s))
+        return;
+    LoadChunkProfile(s->ri.architecture, s->ri.flash_mfg, s->ri.flash_id,
+                     profile);
+    s->rmt->SetChunkSizes(profile.read_chunk_len, profile.write_chunk_len);
+}
+
+int _get_identity(lc_session *s, lc_callback cb, void *cb_arg,
+                  uint32_t cb_stage)
 {
-    if ((rmt->GetIdentity(ri, hid_info, cb, cb_arg, cb_stage))) {
+    if ((s->rmt->GetIdentity(s->ri, s->hid_info, cb, cb_arg, cb_stage))) {
         return LC_ERROR;
     }
 
+    _apply_chunk_profile(s);
+
     /* Do some sanity checking */
-    if (ri.flash->size == 0) {
+    if (s->ri.flash->size == 0) {
         return LC_ERROR_INVALID_CONFIG;
     }
 
-    if (ri.arch == NULL || ri.arch->cookie == 0) {
+    if (s->ri.arch == NULL || s->ri.arch->cookie == 0) {
         return LC_ERROR_INVALID_CONFIG;
     }
 
-    if (!ri.valid_config) {
+    if (!s->ri.valid_config) {
         return LC_ERROR_INVALID_CONFIG;
     }
 
     return 0;
 }
 
-int get_identity(lc_callback cb, void *cb_arg)
+int get_identity_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     _report_stages(cb, cb_arg, 1, NULL);
-    return _get_identity(cb, cb_arg, LC_CB_STAGE_GET_IDENTITY);
+    return _get_identity(s, cb, cb_arg, LC_CB_STAGE_GET_IDENTITY);
 }
 
-int reset_remote(lc_callback cb, void *cb_arg)
+/*
+ * Most remotes are back within a couple of seconds of a reset, but some take
+ * much longer, so we try to reconnect soon and then back off. Where the USB
+ * backend reports hotplug events, a remote arriving ends the wait early.
+ *
+ * The remote doesn't leave the bus the moment it's told to reset, and
+ * reconnecting before it has would find it as it was, so the first attempt
+ * waits BOOT_POLL_FIRST, or until a hotplug event says a remote is back.
+ */
+int reset_remote_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     int err;
-    int secs = 0;
+    int cb_count = 0;
+    unsigned int delay = BOOT_POLL_MIN;
+    bool first = true;
     const int max_secs = MAX_WAIT_FOR_BOOT * WAIT_FOR_BOOT_SLEEP;
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(max_secs);
 
-    if ((err = rmt->Reset(COMMAND_RESET_DEVICE)))
+    if ((err = s->rmt->Reset(COMMAND_RESET_DEVICE)))
         return err;
 
-    deinit_concord();
-    for (int i = 0; i < MAX_WAIT_FOR_BOOT; i++) {
-        for (int j = 0; j < WAIT_FOR_BOOT_SLEEP; j++) {
-            if (cb)
-                cb(LC_CB_STAGE_RESET, secs, secs, max_secs,
-                    LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
-            sleep(1);
-            secs++;
+    deinit_concord_s(s);
+    err = LC_ERROR_CONNECT;
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (cb) {
+            const int secs = max_secs -
+                std::chrono::duration_cast<std::chrono::seconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            cb(LC_CB_STAGE_RESET, cb_count++, secs, max_secs,
+                LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
+        }
+        if (first) {
+            HID_WaitForArrival(BOOT_POLL_FIRST);
+            first = false;
+        } else {
+            HID_WaitForArrival(delay);
+            delay = delay * 2 > BOOT_POLL_MAX ? BOOT_POLL_MAX : delay * 2;
         }
-        err = init_concord();
+
+        err = init_concord_s(s);
         if (err == 0) {
-            err = _get_identity(NULL, NULL, 0);
+            err = _get_identity(s, NULL, NULL, 0);
             /*
              * On remotes where firmware upgrades are not "direct",
              * the config gets erased as part of the firmware
@@ -830,7 +1178,7 @@ int reset_remote(lc_callback cb, void *cb_arg)
                 err = 0;
                 break;
             }
-            deinit_concord();
+            deinit_concord_s(s);
         }
     }
 
@@ -838,35 +1186,38 @@ int reset_remote(lc_callback cb, void *cb_arg)
         return err;
 
     if (cb)
-        cb(LC_CB_STAGE_RESET, max_secs, max_secs, max_secs,
+        cb(LC_CB_STAGE_RESET, cb_count, max_secs, max_secs,
             LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
 
     return 0;
 }
 
 /* FIXME: This should almost certainly be rolled into prep_config() */
-int _invalidate_flash(lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _invalidate_flash(lc_session *s, lc_callback cb, void *cb_arg,
+                      uint32_t cb_stage)
 {
     int err = 0;
 
-    if ((err = rmt->InvalidateFlash(cb, cb_arg, cb_stage)))
+    if ((err = s->rmt->InvalidateFlash(cb, cb_arg, cb_stage)))
         return LC_ERROR_INVALIDATE;
 
     return 0;
 }
 
-int invalidate_flash(lc_callback cb, void *cb_arg)
+int invalidate_flash_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
-    return _invalidate_flash(cb, cb_arg, LC_CB_STAGE_INVALIDATE_FLASH);
+    _bind(s);
+    return _invalidate_flash(s, cb, cb_arg, LC_CB_STAGE_INVALIDATE_FLASH);
 }
 
-int post_preconfig(lc_callback cb, void *cb_arg)
+int post_preconfig_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
     int err;
     if (cb)
         cb(LC_CB_STAGE_HTTP, 0, 0, 1, LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
 
-    if ((err = Post(of->GetXml(), of->GetXmlSize(), "POSTOPTIONS", ri, true)))
+    if ((err = Post(s->of->GetXmlIndex(), "POSTOPTIONS",
+                    s->ri, true)))
         return err;
 
     if (cb)
@@ -875,15 +1226,15 @@ int post_preconfig(lc_callback cb, void *cb_arg)
     return 0;
 }
 
-int post_postfirmware(lc_callback cb, void *cb_arg)
+int post_postfirmware_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
     int err;
     if (cb)
         cb(LC_CB_STAGE_HTTP, 0, 0, 1, LC_CB_COUNTER_TYPE_STEPS, cb_arg,
             NULL);
 
-    if ((err = Post(of->GetXml(), of->GetXmlSize(), "COMPLETEPOSTOPTIONS", ri,
-            false)))
+    if ((err = Post(s->of->GetXmlIndex(),
+            "COMPLETEPOSTOPTIONS", s->ri, false)))
         return err;
 
     if (cb)
@@ -892,14 +1243,15 @@ int post_postfirmware(lc_callback cb, void *cb_arg)
     return 0;
 }
 
-int post_postconfig(lc_callback cb, void *cb_arg)
+int post_postconfig_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
     int err;
     if (cb)
         cb(LC_CB_STAGE_HTTP, 0, 0, 1, LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
 
-    if ((err = Post(of->GetXml(), of->GetXmlSize(), "COMPLETEPOSTOPTIONS", ri,
-                    true, false, is_z_remote() ? true : false, NULL, NULL)))
+    if ((err = Post(s->of->GetXmlIndex(),
+                    "COMPLETEPOSTOPTIONS", s->ri, true, false,
+                    is_z_remote_s(s) ? true : false, NULL, NULL)))
         return err;
 
     if (cb)
@@ -908,7 +1260,7 @@ int post_postconfig(lc_callback cb, void *cb_arg)
     return 0;
 }
 
-int post_connect_test_success(lc_callback cb, void *cb_arg)
+int post_connect_test_success_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
     /*
      * If we arrived, we can talk to the remote - so if it's
@@ -922,15 +1274,15 @@ int post_connect_test_success(lc_callback cb, void *cb_arg)
      */
     int err;
     bool add_cookiekeyval = false;
-    if (ri.architecture == 9) {
+    if (s->ri.architecture == 9) {
         add_cookiekeyval = true;
     }
 
     if (cb)
         cb(LC_CB_STAGE_HTTP, 0, 0, 1, LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
 
-    if ((err = Post(of->GetXml(), of->GetXmlSize(), "POSTOPTIONS", ri, true,
-                    add_cookiekeyval)))
+    if ((err = Post(s->of->GetXmlIndex(), "POSTOPTIONS",
+                    s->ri, true, add_cookiekeyval)))
         return err;
 
     if (cb)
@@ -939,16 +1291,17 @@ int post_connect_test_success(lc_callback cb, void *cb_arg)
     return 0;
 }
 
-int get_time()
+int get_time_s(lc_session *s)
 {
+    _bind(s);
     int err;
-    if ((err = rmt->GetTime(ri, rtime)))
+    if ((err = s->rmt->GetTime(s->ri, s->rtime)))
         return LC_ERROR_GET_TIME;
 
     return 0;
 }
 
-int _set_time(lc_callback cb, void *cb_arg)
+int _set_time(lc_session *s, lc_callback cb, void *cb_arg)
 {
     const time_t t = time(NULL);
     struct tm *lt = localtime(&t);
@@ -957,17 +1310,17 @@ int _set_time(lc_callback cb, void *cb_arg)
         cb(LC_CB_STAGE_SET_TIME, 0, 1, 2, LC_CB_COUNTER_TYPE_STEPS, cb_arg,
            NULL);
 
-    rtime.second = lt->tm_sec;
-    rtime.minute = lt->tm_min;
-    rtime.hour = lt->tm_hour;
-    rtime.day = lt->tm_mday;
-    rtime.dow = lt->tm_wday;
-    rtime.month = lt->tm_mon + 1;
-    rtime.year = lt->tm_year + 1900;
-    rtime.utc_offset = 0;
-    rtime.timezone = "";
-
-    int err = rmt->SetTime(ri, rtime);
+    s->rtime.second = lt->tm_sec;
+    s->rtime.minute = lt->tm_min;
+    s->rtime.hour = lt->tm_hour;
+    s->rtime.day = lt->tm_mday;
+    s->rtime.dow = lt->tm_wday;
+    s->rtime.month = lt->tm_mon + 1;
+    s->rtime.year = lt->tm_year + 1900;
+    s->rtime.utc_offset = 0;
+    s->rtime.timezone = "";
+
+    int err = s->rmt->SetTime(s->ri, s->rtime);
     if (err != 0) {
         return err;
     }
@@ -978,10 +1331,11 @@ int _set_time(lc_callback cb, void *cb_arg)
     return 0;
 }
 
-int set_time(lc_callback cb, void *cb_arg)
+int set_time_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     _report_stages(cb, cb_arg, 1, NULL);
-    return _set_time(cb, cb_arg);
+    return _set_time(s, cb, cb_arg);
 }
 
 
@@ -989,12 +1343,13 @@ int set_time(lc_callback cb, void *cb_arg)
  * CONFIG-RELATED
  */
 
-int read_config_from_remote(uint8_t **out, uint32_t *size, lc_callback cb,
-                            void *cb_arg)
+int read_config_from_remote_s(lc_session *s, uint8_t **out, uint32_t *size,
+                              lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     int err = 0;
 
-    if (!ri.valid_config) {
+    if (!s->ri.valid_config) {
         return LC_ERROR_INVALID_CONFIG;
     }
 
@@ -1004,26 +1359,28 @@ int read_config_from_remote(uint8_t **out, uint32_t *size, lc_callback cb,
 
     // For zwave-hid remotes, need to read the config once to get the size
     // For usbnet we do this in GetIdentity, but for hid it takes too long
-    if (is_z_remote() && !is_usbnet_remote()) {
-        if ((err = ((CRemoteZ_HID*)rmt)->ReadRegion(
-                      REGION_USER_CONFIG, ri.config_bytes_used, NULL, cb,
+    if (is_z_remote_s(s) && !is_usbnet_remote_s(s)) {
+        if ((err = ((CRemoteZ_HID*)s->rmt)->ReadRegion(
+                      REGION_USER_CONFIG, s->ri.config_bytes_used, NULL, cb,
                       cb_arg, LC_CB_STAGE_READ_CONFIG))) {
             return err;
         }
     }
 
-    *size = ri.config_bytes_used;
+    *size = s->ri.config_bytes_used;
     *out = new uint8_t[*size];
 
-    if ((err = rmt->ReadFlash(ri.arch->config_base, *size, *out, ri.protocol,
-                              false, cb, cb_arg, LC_CB_STAGE_READ_CONFIG))) {
+    if ((err = s->rmt->ReadFlash(s->ri.arch->config_base, *size, *out,
+                                 s->ri.protocol, false, cb, cb_arg,
+                                 LC_CB_STAGE_READ_CONFIG))) {
         return LC_ERROR_READ;
     }
 
     return 0;
 }
 
-int _write_config_to_remote(lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _write_config_to_remote(lc_session *s, lc_callback cb, void *cb_arg,
+                            uint32_t cb_stage)
 {
     int err = 0;
 
@@ -1031,15 +1388,16 @@ int _write_config_to_remote(lc_callback cb, void *cb_arg, uint32_t cb_stage)
         cb_arg = (void *)true;
     }
 
-    if (is_z_remote() || is_mh_remote()) {
-        if ((err = rmt->UpdateConfig(of->GetDataSize(), of->GetData(), cb,
-                                     cb_arg, cb_stage, of->GetXmlSize(),
-                                     of->GetXml())))
+    if (is_z_remote_s(s) || is_mh_remote_s(s)) {
+        if ((err = s->rmt->UpdateConfig(s->of->GetDataSize(),
+                                        s->of->GetData(), cb, cb_arg,
+                                        cb_stage, s->of->GetXmlSize(),
+                                        s->of->GetXml())))
             return LC_ERROR_WRITE;
     } else {
-        if ((err = rmt->WriteFlash(ri.arch->config_base, of->GetDataSize(),
-                                   of->GetData(), ri.protocol, cb, cb_arg,
-                                   cb_stage)))
+        if ((err = s->rmt->WriteFlash(s->ri.arch->config_base,
+                                      s->of->GetDataSize(), s->of->GetData(),
+                                      s->ri.protocol, cb, cb_arg, cb_stage)))
             return LC_ERROR_WRITE;
     }
 
@@ -1065,7 +1423,8 @@ uint32_t _mh_get_config_len(uint8_t *in, uint32_t size)
     return 0;
 }
 
-int _mh_write_config_to_file(uint8_t *in, uint32_t size, char *file_name)
+int _mh_write_config_to_file(lc_session *s, uint8_t *in, uint32_t size,
+                             char *file_name)
 {
     int zip_err;
     struct zip *zip = zip_open(file_name, ZIP_CREATE | ZIP_EXCL, &zip_err);
@@ -1088,7 +1447,7 @@ int _mh_write_config_to_file(uint8_t *in, uint32_t size, char *file_name)
     char xml_buffer[xml_buffer_len];
     uint16_t checksum = mh_get_checksum(in, size);
     int xml_len = snprintf(xml_buffer, xml_buffer_len, mh_config_header,
-        size, size - 6, checksum, ri.skin);
+        size, size - 6, checksum, s->ri.skin);
     if (xml_len >= xml_buffer_len) {
         debug("Error, XML buffer length exceeded");
         return LC_ERROR;
@@ -1126,23 +1485,24 @@ int _mh_write_config_to_file(uint8_t *in, uint32_t size, char *file_name)
     return 0;
 }
 
-int write_config_to_remote(lc_callback cb, void *cb_arg)
+int write_config_to_remote_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
-    return _write_config_to_remote(cb, cb_arg, LC_CB_STAGE_WRITE_CONFIG);
+    _bind(s);
+    return _write_config_to_remote(s, cb, cb_arg, LC_CB_STAGE_WRITE_CONFIG);
 }
 
-int write_config_to_file(uint8_t *in, uint32_t size, char *file_name,
-    int binary)
+int write_config_to_file_s(lc_session *s, uint8_t *in, uint32_t size,
+    char *file_name, int binary)
 {
     // If this is an MH remote, need to find the real end of the binary
-    if (is_mh_remote()) {
+    if (is_mh_remote_s(s)) {
         size = _mh_get_config_len(in, size);
     }
-    ri.config_bytes_used = size;
+    s->ri.config_bytes_used = size;
 
     // If this is an MH remote, need to write out zip file with XML/binary
-    if (!binary && is_mh_remote()) {
-        return _mh_write_config_to_file(in, size, file_name);
+    if (!binary && is_mh_remote_s(s)) {
+        return _mh_write_config_to_file(s, in, size, file_name);
     }
 
     binaryoutfile of;
@@ -1166,15 +1526,16 @@ int write_config_to_file(uint8_t *in, uint32_t size, char *file_name,
         extern const char *config_header;
         char *ch = new char[strlen(config_header) + 200];
         const int chlen = sprintf(
-            ch, config_header, ri.protocol, ri.skin, ri.flash_mfg, ri.flash_id,
-            ri.hw_ver_major, ri.hw_ver_minor, ri.fw_type, ri.protocol, ri.skin,
-            ri.flash_mfg, ri.flash_id, ri.hw_ver_major, ri.hw_ver_minor,
-            ri.fw_type, ri.config_bytes_used, chk);
+            ch, config_header, s->ri.protocol, s->ri.skin, s->ri.flash_mfg,
+            s->ri.flash_id, s->ri.hw_ver_major, s->ri.hw_ver_minor,
+            s->ri.fw_type, s->ri.protocol, s->ri.skin, s->ri.flash_mfg,
+            s->ri.flash_id, s->ri.hw_ver_major, s->ri.hw_ver_minor,
+            s->ri.fw_type, s->ri.config_bytes_used, chk);
         of.write(reinterpret_cast<uint8_t*>(ch), chlen);
         delete[] ch;
     }
 
-    of.write(in, ri.config_bytes_used);
+    of.write(in, s->ri.config_bytes_used);
 
     if (of.close() != 0) {
         debug("Failed to close %s", file_name);
@@ -1184,186 +1545,510 @@ int write_config_to_file(uint8_t *in, uint32_t size, char *file_name,
     return 0;
 }
 
-int _verify_remote_config(lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _verify_remote_config(lc_session *s, lc_callback cb, void *cb_arg,
+                          uint32_t cb_stage)
 {
     int err = 0;
 
-    if ((err = rmt->ReadFlash(ri.arch->config_base, of->GetDataSize(),
-                              of->GetData(), ri.protocol, true, cb, cb_arg,
-                              cb_stage))) {
+    if ((err = s->rmt->ReadFlash(s->ri.arch->config_base, s->of->GetDataSize(),
+                                 s->of->GetData(), s->ri.protocol, true, cb,
+                                 cb_arg, cb_stage))) {
         return LC_ERROR_VERIFY;
     }
 
     return 0;
 }
 
-int verify_remote_config(lc_callback cb, void *cb_arg)
+int verify_remote_config_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
-    return _verify_remote_config(cb, cb_arg, LC_CB_STAGE_VERIFY_CONFIG);
+    _bind(s);
+    return _verify_remote_config(s, cb, cb_arg, LC_CB_STAGE_VERIFY_CONFIG);
 }
 
-int _prep_config(lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _prep_config(lc_session *s, lc_callback cb, void *cb_arg, uint32_t cb_stage)
 {
     int err = 0;
 
-    if ((err = rmt->PrepConfig(ri, cb, cb_arg, cb_stage))) {
+    if ((err = s->rmt->PrepConfig(s->ri, cb, cb_arg, cb_stage))) {
         return LC_ERROR;
     }
 
     return 0;
 }
 
-int prep_config(lc_callback cb, void *cb_arg)
+int prep_config_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
-    return _prep_config(cb, cb_arg, LC_CB_STAGE_INITIALIZE_UPDATE);
+    _bind(s);
+    return _prep_config(s, cb, cb_arg, LC_CB_STAGE_INITIALIZE_UPDATE);
 }
 
-int _finish_config(lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _finish_config(lc_session *s, lc_callback cb, void *cb_arg,
+                   uint32_t cb_stage)
 {
     int err = 0;
 
-    if ((err = rmt->FinishConfig(ri))) {
+    if ((err = s->rmt->FinishConfig(s->ri))) {
         return LC_ERROR;
     }
 
     return 0;
 }
 
-int finish_config(lc_callback cb, void *cb_arg)
+int finish_config_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
-    return _finish_config(cb, cb_arg, LC_CB_STAGE_FINALIZE_UPDATE);
+    _bind(s);
+    return _finish_config(s, cb, cb_arg, LC_CB_STAGE_FINALIZE_UPDATE);
 }
 
-int _erase_config(lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _erase_config(lc_session *s, lc_callback cb, void *cb_arg,
+                  uint32_t cb_stage)
 {
     int err = 0;
 
-    if ((err = rmt->EraseFlash(ri.arch->config_base, of->GetDataSize(),
-            ri, cb, cb_arg, cb_stage))) {
+    if ((err = s->rmt->EraseFlash(s->ri.arch->config_base, s->of->GetDataSize(),
+            s->ri, cb, cb_arg, cb_stage))) {
         return LC_ERROR_ERASE;
     }
 
     return 0;
 }
 
-int erase_config(lc_callback cb, void *cb_arg)
+int erase_config_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
-    return _erase_config(cb, cb_arg, LC_CB_STAGE_ERASE_FLASH);
+    _bind(s);
+    return _erase_config(s, cb, cb_arg, LC_CB_STAGE_ERASE_FLASH);
 }
 
-int _update_configuration_zwave(lc_callback cb, void *cb_arg)
+int _update_configuration_zwave(lc_session *s, lc_callback cb, void *cb_arg)
 {
     int err;
 
-    if ((err = _write_config_to_remote(cb, cb_arg, 0))) {
+    if ((err = _write_config_to_remote(s, cb, cb_arg, 0))) {
         return err;
     }
 
     return 0;
 }
 
-int _update_configuration_mh(lc_callback cb, void *cb_arg)
+int _update_configuration_mh(lc_session *s, lc_callback cb, void *cb_arg)
 {
     int err;
 
-    if ((err = _write_config_to_remote(cb, cb_arg, 0))) {
+    if ((err = _write_config_to_remote(s, cb, cb_arg, 0))) {
         return err;
     }
 
     return 0;
 }
 
-int _update_configuration_hid(lc_callback cb, void *cb_arg) {
-    int err;
+/*
+ * Progress for a stage that is done in several pieces, reported as one run
+ * over the whole stage.
+ */
+struct delta_progress {
+    lc_callback cb;
+    void *cb_arg;
+    uint32_t count;
+    uint32_t done;
+    uint32_t total;
+};
 
-    if ((err = prep_config(cb, cb_arg))) {
-        return err;
+static void _delta_cb(uint32_t stage, uint32_t count, uint32_t curr,
+                      uint32_t total, uint32_t type, void *arg,
+                      const uint32_t *stages)
+{
+    delta_progress *p = (delta_progress *)arg;
+
+    p->cb(stage, p->count++, p->done + curr, p->total, type, p->cb_arg,
+          stages);
+}
+
+/* FNV-1a, to tell whether a journal is for the image being uploaded */
+static uint64_t _image_hash(const uint8_t *data, uint32_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
     }
+    return hash;
+}
 
-    /*
-     * We must invalidate flash before we erase and write so that
-     * nothing will attempt to reference it while we're working.
-     */
-    if ((err = invalidate_flash(cb, cb_arg))) {
-        return err;
+/*
+ * Erase, write and verify the flash sectors [begins[i], ends[i]), holding
+ * the data for addr up to addr + size; only the part of a sector within
+ * that is written. Each stage is done for every sector before the next
+ * stage starts, adjacent sectors together, and pass_done (if set) is called
+ * with 'E', 'W' and 'V' as each finishes.
+ *
+ * Verify progress is only reported if verify_stage is non-zero.
+ */
+static int _write_sectors(lc_session *s, const vector<uint32_t> &begins,
+                          const vector<uint32_t> &ends, uint32_t addr,
+                          const uint8_t *data, uint32_t size,
+                          lc_callback cb, void *cb_arg, uint32_t write_stage,
+                          uint32_t verify_stage,
+                          void (*pass_done)(char state, void *arg),
+                          void *pass_arg)
+{
+    int err;
+    const uint32_t end = addr + size;
+
+    vector<uint32_t> run_begin;
+    vector<uint32_t> run_end;
+    uint32_t erase_total = 0;
+    uint32_t write_total = 0;
+    for (unsigned int i = 0; i < begins.size(); i++) {
+        if (!run_end.empty() && run_end.back() == begins[i]) {
+            run_end.back() = ends[i];
+        } else {
+            run_begin.push_back(begins[i]);
+            run_end.push_back(ends[i]);
+        }
+        erase_total++;
+        write_total += (ends[i] < end ? ends[i] : end) -
+            (begins[i] > addr ? begins[i] : addr);
     }
 
+    delta_progress erase = { cb, cb_arg, 0, 0, erase_total };
+    delta_progress write = { cb, cb_arg ? cb_arg : (void *)true, 0, 0,
+                             write_total };
+    delta_progress verify = { cb, cb_arg, 0, 0, write_total };
+    lc_callback pcb = cb ? _delta_cb : NULL;
+
     /*
      * Flash can be changed to 0, but not back to 1, so you must
      * erase the flash (to 1) in order to write the flash.
      */
-    if ((err = erase_config(cb, cb_arg))) {
-        return err;
+    for (unsigned int i = 0; i < run_begin.size(); i++) {
+        if ((err = s->rmt->EraseFlash(run_begin[i], run_end[i] - run_begin[i],
+                                      s->ri, pcb, &erase,
+                                      LC_CB_STAGE_ERASE_FLASH))) {
+            return LC_ERROR_ERASE;
+        }
+        erase.done = erase.count;
     }
+    if (pass_done)
+        pass_done('E', pass_arg);
 
-    if ((err = write_config_to_remote(cb, cb_arg))) {
-        return err;
+    for (unsigned int i = 0; i < run_begin.size(); i++) {
+        const uint32_t begin = run_begin[i] > addr ? run_begin[i] : addr;
+        const uint32_t len = (run_end[i] < end ? run_end[i] : end) - begin;
+        if ((err = s->rmt->WriteFlash(begin, len, data + (begin - addr),
+                                      s->ri.protocol, pcb, &write,
+                                      write_stage))) {
+            return LC_ERROR_WRITE;
+        }
+        write.done += len;
+    }
+    if (pass_done)
+        pass_done('W', pass_arg);
+
+    for (unsigned int i = 0; i < run_begin.size(); i++) {
+        const uint32_t begin = run_begin[i] > addr ? run_begin[i] : addr;
+        const uint32_t len = (run_end[i] < end ? run_end[i] : end) - begin;
+        if ((err = s->rmt->ReadFlash(begin, len,
+                                     const_cast<uint8_t *>(data +
+                                                           (begin - addr)),
+                                     s->ri.protocol, true,
+                                     verify_stage ? pcb : NULL, &verify,
+                                     verify_stage))) {
+            return LC_ERROR_VERIFY;
+        }
+        verify.done += len;
     }
+    if (pass_done)
+        pass_done('V', pass_arg);
 
-    if ((err = verify_remote_config(cb, cb_arg))) {
-        return err;
-    }
+    return 0;
+}
 
-    if ((err = finish_config(cb, cb_arg))) {
-        return err;
-    }
+/* The sectors of an upload still to do, and where to record their state */
+struct journal_pass {
+    string key;
+    TUploadJournal *journal;
+    vector<unsigned int> pending;
+};
 
-    return 0;
+static void _journal_pass_done(char state, void *arg)
+{
+    journal_pass *p = (journal_pass *)arg;
+
+    for (unsigned int i = 0; i < p->pending.size(); i++)
+        p->journal->sectors[p->pending[i]] = state;
+    SaveJournal(p->key, *p->journal);
 }
 
-int update_configuration(lc_callback cb, void *cb_arg, int noreset)
+/*
+ * Erase, write and verify size bytes of data at addr, recording in the
+ * upload journal how far we got after each stage. If the session is
+ * resuming and the journal is for this same image on this remote, the
+ * sectors it says were verified are skipped. The first sector is always
+ * rewritten, since invalidating flash may have touched it. The journal is
+ * removed once everything is verified.
+ *
+ * Verify progress is only reported if verify_stage is non-zero.
+ */
+static int _journaled_write(lc_session *s, const char *kind, uint32_t addr,
+                            const uint8_t *data, uint32_t size,
+                            lc_callback cb, void *cb_arg,
+                            uint32_t write_stage, uint32_t verify_stage)
 {
     int err;
+    const uint32_t *sectors = s->ri.flash->sectors;
+    const uint32_t flash_base = s->ri.arch->flash_base;
+    const uint32_t end = addr + size;
 
-    std::vector<uint32_t> stages = _get_update_config_stages(noreset);
-    _report_stages(cb, cb_arg, stages.size(), &stages[0]);
-
-    if (is_z_remote()) {
-        err = _update_configuration_zwave(cb, cb_arg);
-    } else if (is_mh_remote()) {
-        err = _update_configuration_mh(cb, cb_arg);
-    } else {
-        err = _update_configuration_hid(cb, cb_arg);
+    /*
+     * The sector table lists sector boundaries relative to flash_base,
+     * ending with 0.
+     */
+    vector<uint32_t> sector_begin;
+    vector<uint32_t> sector_end;
+    unsigned int n = 0;
+    while (sectors[n] && sectors[n + 1] && sectors[n + 1] + flash_base <= addr)
+        n++;
+    for (; sectors[n] && sectors[n] + flash_base < end; n++) {
+        sector_begin.push_back(sectors[n] + flash_base);
+        sector_end.push_back(sectors[n + 1] ? sectors[n + 1] + flash_base
+                                            : end);
+    }
+    if (sector_begin.empty() || sector_begin[0] > addr) {
+        debug("No sectors for %06X - %06X", addr, end);
+        return LC_ERROR;
     }
 
-    if (err != 0)
+    journal_pass pass;
+    pass.key = string(kind) + " " + (s->ri.serial1 ? s->ri.serial1 : "") +
+        (s->ri.serial2 ? s->ri.serial2 : "") +
+        (s->ri.serial3 ? s->ri.serial3 : "");
+    TUploadJournal journal;
+    pass.journal = &journal;
+    const uint64_t hash = _image_hash(data, size);
+    if (!s->resume || LoadJournal(pass.key, journal) ||
+        journal.addr != addr || journal.size != size ||
+        journal.hash != hash ||
+        journal.sectors.size() != sector_begin.size()) {
+        if (s->resume)
+            debug("No journal for this %s upload, starting over", kind);
+        journal.addr = addr;
+        journal.size = size;
+        journal.hash = hash;
+        journal.sectors.assign(sector_begin.size(), '.');
+    }
+    journal.sectors[0] = '.';
+
+    vector<uint32_t> begins;
+    vector<uint32_t> ends;
+    for (unsigned int i = 0; i < sector_begin.size(); i++) {
+        if (journal.sectors[i] == 'V')
+            continue;
+        pass.pending.push_back(i);
+        begins.push_back(sector_begin[i]);
+        ends.push_back(sector_end[i]);
+    }
+    debug("%d of %d sectors of the %s to upload", (int)begins.size(),
+          (int)sector_begin.size(), kind);
+    SaveJournal(pass.key, journal);
+
+    if ((err = _write_sectors(s, begins, ends, addr, data, size, cb, cb_arg,
+                              write_stage, verify_stage, _journal_pass_done,
+                              &pass))) {
         return err;
+    }
 
-    // If reset is enabled (!noreset), we do reset, except that
-    // zwave-hid (is_z_remote() && !is_usbnet_remote()) doesn't need it.
-    // thus...
-    if (!noreset && !(is_z_remote() && !is_usbnet_remote()))
-        if ((err = reset_remote(cb, cb_arg)))
-            return err;
-
-    if ((err = _set_time(cb, cb_arg)))
-        return err;
+    ClearJournal(pass.key);
 
     return 0;
 }
 
+int _update_configuration_hid(lc_session *s, lc_callback cb, void *cb_arg) {
+    int err;
 
-/*
- * SAFEMODE FIRMWARE RELATED
- */
+    if ((err = prep_config_s(s, cb, cb_arg))) {
+        return err;
+    }
 
-int erase_safemode(lc_callback cb, void *cb_arg)
-{
-    int err = 0;
+    /*
+     * We must invalidate flash before we erase and write so that
+     * nothing will attempt to reference it while we're working.
+     */
+    if ((err = invalidate_flash_s(s, cb, cb_arg))) {
+        return err;
+    }
+
+    if ((err = _journaled_write(s, "config", s->ri.arch->config_base,
+                                s->of->GetData(), s->of->GetDataSize(), cb,
+                                cb_arg, LC_CB_STAGE_WRITE_CONFIG,
+                                LC_CB_STAGE_VERIFY_CONFIG))) {
+        return err;
+    }
+
+    if ((err = finish_config_s(s, cb, cb_arg))) {
+        return err;
+    }
+
+    return 0;
+}
+
+/*
+ * Like _update_configuration_hid(), but only erases, writes and verifies
+ * the flash sectors whose contents actually change. The current config is
+ * read back first and compared with the new one sector by sector. The
+ * sector holding the config's cookie is always rewritten, since
+ * invalidating flash may have touched it.
+ */
+int _update_configuration_hid_delta(lc_session *s, lc_callback cb,
+                                    void *cb_arg)
+{
+    int err;
+    const uint32_t *sectors = s->ri.flash->sectors;
+    const uint32_t flash_base = s->ri.arch->flash_base;
+    const uint32_t cfg_base = s->ri.arch->config_base;
+    const uint32_t size = s->of->GetDataSize();
+    const uint32_t cfg_end = cfg_base + size;
+    const uint8_t *data = s->of->GetData();
+
+    if ((err = prep_config_s(s, cb, cb_arg))) {
+        return err;
+    }
+
+    uint8_t *cur = new uint8_t[size];
+    if ((err = s->rmt->ReadFlash(cfg_base, size, cur, s->ri.protocol, false,
+                                 cb, cb_arg ? cb_arg : (void *)true,
+                                 LC_CB_STAGE_READ_CONFIG))) {
+        delete[] cur;
+        return LC_ERROR_READ;
+    }
+
+    /*
+     * The sector table lists sector boundaries relative to flash_base,
+     * ending with 0. Collect the sectors that differ.
+     */
+    unsigned int n = 0;
+    while (sectors[n] && sectors[n] + flash_base < cfg_base) {
+        n++;
+    }
+    vector<uint32_t> begins;
+    vector<uint32_t> ends;
+    for (; sectors[n] && sectors[n + 1] && sectors[n] + flash_base < cfg_end;
+         n++) {
+        const uint32_t begin = sectors[n] + flash_base;
+        const uint32_t end = sectors[n + 1] + flash_base;
+        const uint32_t cmp_end = end < cfg_end ? end : cfg_end;
+        if (begin != cfg_base &&
+            !memcmp(cur + (begin - cfg_base), data + (begin - cfg_base),
+                    cmp_end - begin)) {
+            continue;
+        }
+        debug("sector %06X - %06X changed", begin, end);
+        begins.push_back(begin);
+        ends.push_back(end);
+    }
+    delete[] cur;
+    debug("%d sectors of the config changed", (int)begins.size());
 
-    if ((err = rmt->EraseFlash(ri.arch->flash_base, FIRMWARE_MAX_SIZE, ri,
-            cb, cb_arg))) {
+    /*
+     * We must invalidate flash before we erase and write so that
+     * nothing will attempt to reference it while we're working.
+     */
+    if ((err = invalidate_flash_s(s, cb, cb_arg))) {
+        return err;
+    }
+
+    if ((err = _write_sectors(s, begins, ends, cfg_base, data, size, cb,
+                              cb_arg, LC_CB_STAGE_WRITE_CONFIG,
+                              LC_CB_STAGE_VERIFY_CONFIG, NULL, NULL))) {
+        return err;
+    }
+
+    if ((err = finish_config_s(s, cb, cb_arg))) {
+        return err;
+    }
+
+    return 0;
+}
+
+int _update_configuration(lc_session *s, lc_callback cb, void *cb_arg,
+                          int noreset, bool delta)
+{
+    int err;
+
+    /* there's nothing to compare against without a valid config */
+    if (delta && (is_z_remote_s(s) || is_mh_remote_s(s) ||
+                  !s->ri.valid_config)) {
+        delta = false;
+    }
+
+    std::vector<uint32_t> stages = _get_update_config_stages(s, noreset,
+                                                             delta);
+    _report_stages(cb, cb_arg, stages.size(), &stages[0]);
+
+    if (is_z_remote_s(s)) {
+        err = _update_configuration_zwave(s, cb, cb_arg);
+    } else if (is_mh_remote_s(s)) {
+        err = _update_configuration_mh(s, cb, cb_arg);
+    } else if (delta) {
+        err = _update_configuration_hid_delta(s, cb, cb_arg);
+    } else {
+        err = _update_configuration_hid(s, cb, cb_arg);
+    }
+
+    if (err != 0)
+        return err;
+
+    // If reset is enabled (!noreset), we do reset, except that
+    // zwave-hid (is_z_remote() && !is_usbnet_remote()) doesn't need it.
+    // thus...
+    if (!noreset && !(is_z_remote_s(s) && !is_usbnet_remote_s(s)))
+        if ((err = reset_remote_s(s, cb, cb_arg)))
+            return err;
+
+    if ((err = _set_time(s, cb, cb_arg)))
+        return err;
+
+    return 0;
+}
+
+int update_configuration_s(lc_session *s, lc_callback cb, void *cb_arg,
+                           int noreset)
+{
+    _bind(s);
+    return _update_configuration(s, cb, cb_arg, noreset, false);
+}
+
+int update_configuration_delta_s(lc_session *s, lc_callback cb, void *cb_arg,
+                                 int noreset)
+{
+    _bind(s);
+    return _update_configuration(s, cb, cb_arg, noreset, true);
+}
+
+
+/*
+ * SAFEMODE FIRMWARE RELATED
+ */
+
+int erase_safemode_s(lc_session *s, lc_callback cb, void *cb_arg)
+{
+    _bind(s);
+    int err = 0;
+
+    if ((err = s->rmt->EraseFlash(s->ri.arch->flash_base, FIRMWARE_MAX_SIZE,
+            s->ri, cb, cb_arg))) {
         return LC_ERROR_ERASE;
     }
 
     return 0;
 }
 
-int read_safemode_from_remote(uint8_t **out, uint32_t *size, lc_callback cb,
-    void *cb_arg)
+int read_safemode_from_remote_s(lc_session *s, uint8_t **out, uint32_t *size,
+    lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     *size = FIRMWARE_MAX_SIZE;
-    return _read_fw_from_remote(*out, *size, ri.arch->flash_base, cb,
+    return _read_fw_from_remote(s, *out, *size, s->ri.arch->flash_base, cb,
         cb_arg, LC_CB_STAGE_READ_SAFEMODE);
 }
 
@@ -1389,25 +2074,26 @@ int write_safemode_to_file(uint8_t *in, uint32_t size, char *file_name)
  * FIRMWARE RELATED
  */
 
-int is_config_safe_after_fw()
+int is_config_safe_after_fw_s(lc_session *s)
 {
     /*
      * For some remotes, firmware updates wipes out the config. The
      * user code needs to be able to determine this so they can tell
      * the user and/or update the config.
      */
-    if (ri.arch->firmware_update_base == ri.arch->config_base) {
+    if (s->ri.arch->firmware_update_base == s->ri.arch->config_base) {
         return LC_ERROR;
     } else {
         return 0;
     }
 }
 
-int prep_firmware(lc_callback cb, void *cb_arg)
+int prep_firmware_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     int err = 0;
 
-    if ((err = rmt->PrepFirmware(ri, cb, cb_arg,
+    if ((err = s->rmt->PrepFirmware(s->ri, cb, cb_arg,
                                  LC_CB_STAGE_INITIALIZE_UPDATE))) {
         return LC_ERROR;
     }
@@ -1415,11 +2101,12 @@ int prep_firmware(lc_callback cb, void *cb_arg)
     return 0;
 }
 
-int finish_firmware(lc_callback cb, void *cb_arg)
+int finish_firmware_s(lc_session *s, lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     int err = 0;
 
-    if ((err = rmt->FinishFirmware(ri, cb, cb_arg,
+    if ((err = s->rmt->FinishFirmware(s->ri, cb, cb_arg,
                                    LC_CB_STAGE_FINALIZE_UPDATE))) {
         return LC_ERROR;
     }
@@ -1427,63 +2114,94 @@ int finish_firmware(lc_callback cb, void *cb_arg)
     return 0;
 }
 
-int _erase_firmware(int direct, lc_callback cb, void *cb_arg, uint32_t cb_stage)
+int _erase_firmware(lc_session *s, int direct, lc_callback cb, void *cb_arg,
+                    uint32_t cb_stage)
 {
     int err = 0;
 
-    uint32_t addr = ri.arch->firmware_update_base;
+    uint32_t addr = s->ri.arch->firmware_update_base;
     if (direct) {
         debug("Writing direct");
-        addr = ri.arch->firmware_base;
+        addr = s->ri.arch->firmware_base;
     }
 
-    if ((err = rmt->EraseFlash(addr, FIRMWARE_MAX_SIZE, ri, cb, cb_arg,
-                               cb_stage))) {
+    if ((err = s->rmt->EraseFlash(addr, FIRMWARE_MAX_SIZE, s->ri, cb, cb_arg,
+                                  cb_stage))) {
         return LC_ERROR_ERASE;
     }
 
     return 0;
 }
 
-int erase_firmware(int direct, lc_callback cb, void *cb_arg)
+int erase_firmware_s(lc_session *s, int direct, lc_callback cb, void *cb_arg)
 {
-    return _erase_firmware(direct, cb, cb_arg, LC_CB_STAGE_ERASE_FLASH);
+    _bind(s);
+    return _erase_firmware(s, direct, cb, cb_arg, LC_CB_STAGE_ERASE_FLASH);
 }
 
-int read_firmware_from_remote(uint8_t **out, uint32_t *size, lc_callback cb,
-                              void *cb_arg)
+int read_firmware_from_remote_s(lc_session *s, uint8_t **out, uint32_t *size,
+                                lc_callback cb, void *cb_arg)
 {
+    _bind(s);
     *size = FIRMWARE_MAX_SIZE;
-    return _read_fw_from_remote(*out, *size, ri.arch->firmware_base, cb,
+    return _read_fw_from_remote(s, *out, *size, s->ri.arch->firmware_base, cb,
         cb_arg, LC_CB_STAGE_READ_FIRMWARE);
 }
 
-int _write_firmware_to_remote(int direct, lc_callback cb, void *cb_arg,
-                              uint32_t cb_stage)
+/*
+ * Point fw at the firmware to write, padded with 0xFF to FIRMWARE_MAX_SIZE;
+ * delete[] it when done. The magic bytes depend on the remote's arch and the
+ * file may be shared with other sessions, so this patches a copy rather than
+ * the file.
+ */
+static int _firmware_image(lc_session *s, uint8_t *&fw)
 {
-    uint32_t addr = ri.arch->firmware_update_base;
-    int err = 0;
+    const uint32_t size = s->of->GetDataSize();
 
-    if (of->GetDataSize() > FIRMWARE_MAX_SIZE) {
+    if (size > FIRMWARE_MAX_SIZE) {
         return LC_ERROR;
     }
 
+    fw = new uint8_t[FIRMWARE_MAX_SIZE];
+    memcpy(fw, s->of->GetData(), size);
+    memset(fw + size, 0xFF, FIRMWARE_MAX_SIZE - size);
+
+    if (_fix_magic_bytes(s, fw, size)) {
+        delete[] fw;
+        return LC_ERROR_READ;
+    }
+
+    return 0;
+}
+
+int _write_firmware_to_remote(lc_session *s, int direct, lc_callback cb,
+                              void *cb_arg, uint32_t cb_stage)
+{
+    uint32_t addr = s->ri.arch->firmware_update_base;
+    int err = 0;
+
     if (direct) {
         debug("Writing direct");
-        addr = ri.arch->firmware_base;
+        addr = s->ri.arch->firmware_base;
     }
 
-    if ((err = _fix_magic_bytes(of->GetData(), of->GetDataSize()))) {
-        return LC_ERROR_READ;
+    uint8_t *fw;
+    if ((err = _firmware_image(s, fw))) {
+        return err;
     }
 
-    return _write_fw_to_remote(of->GetData(), of->GetDataSize(), addr, cb,
-                               cb_arg, cb_stage);
+    err = _write_fw_to_remote(s, fw, s->of->GetDataSize(), addr, cb, cb_arg,
+                              cb_stage);
+    delete[] fw;
+
+    return err;
 }
 
-int write_firmware_to_remote(int direct, lc_callback cb, void *cb_arg)
+int write_firmware_to_remote_s(lc_session *s, int direct, lc_callback cb,
+                               void *cb_arg)
 {
-    return _write_firmware_to_remote(direct, cb, cb_arg,
+    _bind(s);
+    return _write_firmware_to_remote(s, direct, cb, cb_arg,
         LC_CB_STAGE_WRITE_FIRMWARE);
 }
 
@@ -1546,41 +2264,52 @@ int write_firmware_to_file(uint8_t *in, uint32_t size, char *file_name,
     return 0;
 }
 
-int update_firmware(lc_callback cb, void *cb_arg, int noreset, int direct)
+int update_firmware_s(lc_session *s, lc_callback cb, void *cb_arg, int noreset,
+                      int direct)
 {
+    _bind(s);
     int err;
 
-    if (!_is_fw_update_supported(direct)) {
+    if (!_is_fw_update_supported(s, direct)) {
         return LC_ERROR_UNSUPP;
     }
 
-    vector<uint32_t> stages = _get_update_firmware_stages(noreset, direct);
+    vector<uint32_t> stages = _get_update_firmware_stages(s, noreset, direct);
     _report_stages(cb, cb_arg, stages.size(), &stages[0]);
 
     if (!direct) {
-        if ((err = prep_firmware(cb, cb_arg)))
+        if ((err = prep_firmware_s(s, cb, cb_arg)))
             return err;
     }
 
-    if ((err = invalidate_flash(cb, cb_arg)))
+    if ((err = invalidate_flash_s(s, cb, cb_arg)))
         return err;
 
-    if ((err = erase_firmware(direct, cb, cb_arg)))
+    /*
+     * Erase and write the whole firmware area, as erase_firmware() would,
+     * but a sector at a time so that an interrupted upload can be resumed.
+     */
+    uint8_t *fw;
+    if ((err = _firmware_image(s, fw)))
         return err;
-
-    if ((err = write_firmware_to_remote(direct, cb, cb_arg)))
+    err = _journaled_write(s, "firmware", direct ? s->ri.arch->firmware_base
+                           : s->ri.arch->firmware_update_base, fw,
+                           FIRMWARE_MAX_SIZE, cb, cb_arg,
+                           LC_CB_STAGE_WRITE_FIRMWARE, 0);
+    delete[] fw;
+    if (err)
         return err;
 
     if (!direct) {
-        if ((err = finish_firmware(cb, cb_arg)))
+        if ((err = finish_firmware_s(s, cb, cb_arg)))
             return err;
     }
 
     if (!noreset)
-        if ((err = reset_remote(cb, cb_arg)))
+        if ((err = reset_remote_s(s, cb, cb_arg)))
             return err;
 
-    if ((err = _set_time(cb, cb_arg)))
+    if ((err = _set_time(s, cb, cb_arg)))
         return err;
 
     return 0;
@@ -1602,22 +2331,24 @@ int update_firmware(lc_callback cb, void *cb_arg, int noreset, int direct)
 /*
  * locate the INPUTPARMS section in *data:
  */
-int _init_key_scan(uint8_t *data, uint32_t size, uint8_t **inputparams_start,
+int _init_key_scan(const XmlIndex &xml, uint8_t **inputparams_start,
                    uint8_t **inputparams_end)
 {
     int err;
 
     /* locating start tag "<INPUTPARMS>" */
-    err = GetTag("INPUTPARMS", data, size, *inputparams_start);
+    err = xml.GetTag("INPUTPARMS", *inputparams_start);
     if (err == 0) {
         /* locating end tag "</INPUTPARMS>" */
-        err = GetTag("/INPUTPARMS", *inputparams_start,
-            size - (*inputparams_start - data), *inputparams_end);
+        err = xml.GetTag("/INPUTPARMS", *inputparams_start,
+            xml.GetXmlSize() - (*inputparams_start - xml.GetXml()),
+            *inputparams_end);
     }
     return err;
 }
 
-int _next_key_name(uint8_t **start, uint8_t *inputparams_end, string *keyname)
+int _next_key_name(const XmlIndex &xml, uint8_t **start,
+                   uint8_t *inputparams_end, string *keyname)
 {
     int err;
     /*
@@ -1626,14 +2357,14 @@ int _next_key_name(uint8_t **start, uint8_t *inputparams_end, string *keyname)
      * should be safe to assume that Logitech always sends sane files:
      */
     do {
-        err = GetTag("KEY", *start, (inputparams_end - *start), *start,
-                     keyname);
+        err = xml.GetTag("KEY", *start, (inputparams_end - *start), *start,
+                         keyname);
         if (err != 0) {
             return err;
         }
     } while (*keyname != "KeyName");
 
-    err = GetTag("VALUE", *start, (inputparams_end - *start),
+    err = xml.GetTag("VALUE", *start, (inputparams_end - *start),
             *start, keyname);
 
     if (err == 0) {
@@ -1644,10 +2375,11 @@ int _next_key_name(uint8_t **start, uint8_t *inputparams_end, string *keyname)
 }
 
 
-int get_key_names(char ***key_names, uint32_t *key_names_length)
+int get_key_names_s(lc_session *s, char ***key_names,
+                    uint32_t *key_names_length)
 {
     using namespace std;
-    uint8_t *cursor = of->GetXml();
+    uint8_t *cursor = s->of->GetXml();
     uint8_t *inputparams_end;
     uint32_t key_index = 0;
     list<string> key_list;
@@ -1657,13 +2389,14 @@ int get_key_names(char ***key_names, uint32_t *key_names_length)
         return LC_ERROR;
     }
     /* setup data scanning, locating start and end of keynames section: */
-    if (_init_key_scan(of->GetXml(), of->GetXmlSize(), &cursor,
+    if (_init_key_scan(s->of->GetXmlIndex(), &cursor,
         &inputparams_end) != 0) {
         return LC_ERROR;
     }
 
     /* scan for key names and append found names to list: */
-    while (_next_key_name(&cursor, inputparams_end, &key_name) == 0) {
+    while (_next_key_name(s->of->GetXmlIndex(), &cursor, inputparams_end,
+                          &key_name) == 0) {
         key_list.push_back(key_name);
     }
 
@@ -1704,13 +2437,14 @@ void delete_key_names(char **key_names, uint32_t key_names_length)
 /*
  * set USBNET learn mode / time
  */
-int set_learning_mode(int mode, uint32_t timeout_ms)
+int set_learning_mode_s(lc_session *s, int mode, uint32_t timeout_ms)
 {
-  if (rmt == NULL){
+  _bind(s);
+  if (s->rmt == NULL){
       return LC_ERROR_CONNECT;
   }
 
-  auto *p = dynamic_cast<CRemoteZ_USBNET*>(rmt);
+  auto *p = dynamic_cast<CRemoteZ_USBNET*>(s->rmt);
   if (p == nullptr) {
       return LC_ERROR;
   }
@@ -1722,10 +2456,12 @@ int set_learning_mode(int mode, uint32_t timeout_ms)
  * via Harmony IR receiver.
  * Returns 0 for success, error code for failure.
  */
-int learn_from_remote(uint32_t *carrier_clock, uint32_t **ir_signal,
-                      uint32_t *ir_signal_length, lc_callback cb, void *cb_arg)
+int learn_from_remote_s(lc_session *s, uint32_t *carrier_clock,
+                        uint32_t **ir_signal, uint32_t *ir_signal_length,
+                        lc_callback cb, void *cb_arg)
 {
-    if (rmt == NULL){
+    _bind(s);
+    if (s->rmt == NULL){
         return LC_ERROR_CONNECT;
     }
     if ((carrier_clock == NULL) || (ir_signal == NULL)
@@ -1735,8 +2471,8 @@ int learn_from_remote(uint32_t *carrier_clock, uint32_t **ir_signal,
     }
 
     /* try to learn code via Harmony from original remote: */
-    return rmt->LearnIR(carrier_clock, ir_signal, ir_signal_length, cb, cb_arg,
-                        LC_CB_STAGE_LEARN);
+    return s->rmt->LearnIR(carrier_clock, ir_signal, ir_signal_length, cb,
+                           cb_arg, LC_CB_STAGE_LEARN);
 }
 
 /*
@@ -1782,8 +2518,8 @@ void delete_encoded_signal(char *encoded_signal)
  * information from XML data[size] to Logitech.
  * Returns 0 for success, error code for failure.
  */
-int post_new_code(char *key_name, char *encoded_signal, lc_callback cb,
-    void *cb_arg)
+int post_new_code_s(lc_session *s, char *key_name, char *encoded_signal,
+    lc_callback cb, void *cb_arg)
 {
     int err;
     string learn_key, learn_seq;
@@ -1801,8 +2537,8 @@ int post_new_code(char *key_name, char *encoded_signal, lc_callback cb,
     if (cb)
         cb(LC_CB_STAGE_HTTP, 1, 1, 2, LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
 
-    if ((err = Post(of->GetXml(), of->GetXmlSize(), "POSTOPTIONS", ri, true,
-                    false, false, &learn_seq, &learn_key)))
+    if ((err = Post(s->of->GetXmlIndex(), "POSTOPTIONS",
+                    s->ri, true, false, false, &learn_seq, &learn_key)))
         return err;
 
     if (cb)
@@ -1845,16 +2581,17 @@ void mh_get_value(char *buffer, const char *key, char *dest)
         strncpy(dest, start, len);
 }
 
-int mh_get_cfg_properties(struct mh_cfg_properties *properties)
+int mh_get_cfg_properties_s(lc_session *s, struct mh_cfg_properties *properties)
 {
-    if (!is_mh_remote())
+    _bind(s);
+    if (!is_mh_remote_s(s))
         return LC_ERROR;
 
     int err;
     int buflen = 5000;
     char buffer[buflen];
     uint32_t data_read;
-    if ((err = rmt->ReadFile("/cfg/properties", (uint8_t*)buffer, buflen,
+    if ((err = s->rmt->ReadFile("/cfg/properties", (uint8_t*)buffer, buflen,
                              &data_read, 0x00, NULL, NULL, 0)))
         return err;
 
@@ -1865,9 +2602,11 @@ int mh_get_cfg_properties(struct mh_cfg_properties *properties)
     return 0;
 }
 
-int mh_set_cfg_properties(const struct mh_cfg_properties *properties)
+int mh_set_cfg_properties_s(lc_session *s,
+                            const struct mh_cfg_properties *properties)
 {
-    if (!is_mh_remote())
+    _bind(s);
+    if (!is_mh_remote_s(s))
         return LC_ERROR;
 
     int err;
@@ -1882,21 +2621,22 @@ int mh_set_cfg_properties(const struct mh_cfg_properties *properties)
     str_buffer += properties->service_link;
     str_buffer += "\n";
 
-    err = rmt->WriteFile("/cfg/properties", (uint8_t*)str_buffer.c_str(),
+    err = s->rmt->WriteFile("/cfg/properties", (uint8_t*)str_buffer.c_str(),
                          strlen(str_buffer.c_str()));
     return err;
 }
 
-int mh_get_wifi_networks(struct mh_wifi_networks *networks)
+int mh_get_wifi_networks_s(lc_session *s, struct mh_wifi_networks *networks)
 {
-    if (!is_mh_remote())
+    _bind(s);
+    if (!is_mh_remote_s(s))
         return LC_ERROR;
 
     int err;
     int buflen = 5000;
     char buffer[buflen];
     uint32_t data_read;
-    if ((err = rmt->ReadFile("/sys/wifi/networks", (uint8_t*)buffer, buflen,
+    if ((err = s->rmt->ReadFile("/sys/wifi/networks", (uint8_t*)buffer, buflen,
                              &data_read, 0x00, NULL, NULL, 0)))
         return err;
 
@@ -1917,16 +2657,17 @@ int mh_get_wifi_networks(struct mh_wifi_networks *networks)
     return 0;
 }
 
-int mh_get_wifi_config(struct mh_wifi_config *config)
+int mh_get_wifi_config_s(lc_session *s, struct mh_wifi_config *config)
 {
-    if (!is_mh_remote())
+    _bind(s);
+    if (!is_mh_remote_s(s))
         return LC_ERROR;
 
     int err;
     int buflen = 5000;
     char buffer[buflen];
     uint32_t data_read;
-    if ((err = rmt->ReadFile("/sys/wifi/connect", (uint8_t*)buffer, buflen,
+    if ((err = s->rmt->ReadFile("/sys/wifi/connect", (uint8_t*)buffer, buflen,
                              &data_read, 0x00, NULL, NULL, 0)))
         return err;
 
@@ -1939,9 +2680,10 @@ int mh_get_wifi_config(struct mh_wifi_config *config)
     return 0;
 }
 
-int mh_set_wifi_config(const struct mh_wifi_config *config)
+int mh_set_wifi_config_s(lc_session *s, const struct mh_wifi_config *config)
 {
-    if (!is_mh_remote())
+    _bind(s);
+    if (!is_mh_remote_s(s))
         return LC_ERROR;
 
     int err;
@@ -1957,30 +2699,583 @@ int mh_set_wifi_config(const struct mh_wifi_config *config)
     str_buffer += config->password;
     str_buffer += "\n";
 
-    err = rmt->WriteFile("/sys/wifi/connect", (uint8_t*)str_buffer.c_str(),
+    err = s->rmt->WriteFile("/sys/wifi/connect", (uint8_t*)str_buffer.c_str(),
                          strlen(str_buffer.c_str()));
     return err;
 }
 
+const char *mh_get_serial_s(lc_session *s)
+{
+    return s->ri.mh_serial.c_str();
+}
+
+int mh_read_file_s(lc_session *s, const char *filename, uint8_t *buffer,
+                   const uint32_t buflen, uint32_t *data_read)
+{
+    _bind(s);
+    if (!is_mh_remote_s(s))
+        return LC_ERROR;
+    return s->rmt->ReadFile(filename, buffer, buflen, data_read, 0x00, NULL,
+                            NULL, 0);
+}
+
+int mh_write_file_s(lc_session *s, const char *filename, uint8_t *buffer,
+                    const uint32_t buflen)
+{
+    _bind(s);
+    if (!is_mh_remote_s(s))
+        return LC_ERROR;
+    return s->rmt->WriteFile(filename, buffer, buflen);
+}
+
+/*
+ * CHUNK SIZE CALIBRATION
+ */
+/*
+ * How much of the config we read to time each read chunk size.
+ */
+#define CALIBRATION_READ_SIZE 16*1024
+#define CALIBRATION_MAX_CHUNK 0xFFFF
+
+int lc_calibrate_chunk_sizes_s(lc_session *s, lc_callback cb, void *cb_arg)
+{
+    _bind(s);
+    int err;
+
+    if (!s->rmt || is_z_remote_s(s) || is_mh_remote_s(s))
+        return LC_ERROR_UNSUPP;
+    if (!s->ri.arch || !s->ri.flash)
+        return LC_ERROR;
+
+    const uint32_t addr = s->ri.arch->config_base;
+    const uint32_t size = CALIBRATION_READ_SIZE;
+    const unsigned int def = s->ri.protocol == 0 ? 700 : 1022;
+    uint8_t *ref = new uint8_t[size];
+    uint8_t *buf = new uint8_t[size];
+    TChunkProfile profile = TChunkProfile();
+    LoadChunkProfile(s->ri.architecture, s->ri.flash_mfg, s->ri.flash_id,
+                     profile);
+
+    vector<unsigned int> sizes;
+    for (unsigned int len = def; len <= CALIBRATION_MAX_CHUNK; len *= 2)
+        sizes.push_back(len);
+
+    if (cb) {
+        cb(LC_CB_STAGE_CALIBRATE, 0, 0, sizes.size(),
+           LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
+    }
+
+    /* What the default size reads is what every other size must read */
+    s->rmt->SetChunkSizes(0, profile.write_chunk_len);
+    if ((err = s->rmt->ReadFlash(addr, size, ref, s->ri.protocol))) {
+        delete[] ref;
+        delete[] buf;
+        _apply_chunk_profile(s);
+        return LC_ERROR_READ;
+    }
+
+    /*
+     * Read the same region with ever larger chunks until the remote stops
+     * getting it right (or stops answering), keeping the fastest.
+     */
+    unsigned int best = def;
+    double best_time = 0;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        s->rmt->SetChunkSizes(sizes[i], profile.write_chunk_len);
+        auto start = chrono::steady_clock::now();
+        err = s->rmt->ReadFlash(addr, size, buf, s->ri.protocol);
+        double t = chrono::duration<double>(chrono::steady_clock::now() -
+                                            start).count();
+        if (err || memcmp(ref, buf, size)) {
+            debug("Reads of %u bytes failed", sizes[i]);
+            /* Eat whatever the remote still has to say */
+            uint8_t rsp[68];
+            while (HID_ReadReport(rsp, 100) == 0)
+                ;
+            break;
+        }
+        debug("Reads of %u bytes: %u bytes/sec", sizes[i],
+              (unsigned int)(size / t));
+        if (i == 0 || t < best_time) {
+            best = sizes[i];
+            best_time = t;
+        }
+        if (cb) {
+            cb(LC_CB_STAGE_CALIBRATE, i + 1, i + 1, sizes.size(),
+               LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
+        }
+    }
+    delete[] ref;
+    delete[] buf;
+
+    if (cb) {
+        cb(LC_CB_STAGE_CALIBRATE, sizes.size(), sizes.size(), sizes.size(),
+           LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
+    }
+
+    profile.read_chunk_len = best == def ? 0 : best;
+    err = SaveChunkProfile(s->ri.architecture, s->ri.flash_mfg,
+                           s->ri.flash_id, profile);
+    _apply_chunk_profile(s);
+
+    return err;
+}
+
+/*
+ * LEGACY API
+ * Everything that existed before sessions did, operating on the default
+ * session.
+ */
+
+const char *get_mfg()
+{
+    return get_mfg_s(&default_session);
+}
+
+const char *get_model()
+{
+    return get_model_s(&default_session);
+}
+
+const char *get_codename()
+{
+    return get_codename_s(&default_session);
+}
+
+int get_skin()
+{
+    return get_skin_s(&default_session);
+}
+
+int get_fw_ver_maj()
+{
+    return get_fw_ver_maj_s(&default_session);
+}
+
+int get_fw_ver_min()
+{
+    return get_fw_ver_min_s(&default_session);
+}
+
+int get_fw_type()
+{
+    return get_fw_type_s(&default_session);
+}
+
+int get_hw_ver_maj()
+{
+    return get_hw_ver_maj_s(&default_session);
+}
+
+int get_hw_ver_min()
+{
+    return get_hw_ver_min_s(&default_session);
+}
+
+int get_hw_ver_mic()
+{
+    return get_hw_ver_mic_s(&default_session);
+}
+
+int get_flash_size()
+{
+    return get_flash_size_s(&default_session);
+}
+
+int get_flash_mfg()
+{
+    return get_flash_mfg_s(&default_session);
+}
+
+int get_flash_id()
+{
+    return get_flash_id_s(&default_session);
+}
+
+const char *get_flash_part_num()
+{
+    return get_flash_part_num_s(&default_session);
+}
+
+int get_arch()
+{
+    return get_arch_s(&default_session);
+}
+
+int get_proto()
+{
+    return get_proto_s(&default_session);
+}
+
+const char *get_hid_mfg_str()
+{
+    return get_hid_mfg_str_s(&default_session);
+}
+
+const char *get_hid_prod_str()
+{
+    return get_hid_prod_str_s(&default_session);
+}
+
+int get_hid_irl()
+{
+    return get_hid_irl_s(&default_session);
+}
+
+int get_hid_orl()
+{
+    return get_hid_orl_s(&default_session);
+}
+
+int get_hid_frl()
+{
+    return get_hid_frl_s(&default_session);
+}
+
+int get_usb_vid()
+{
+    return get_usb_vid_s(&default_session);
+}
+
+int get_usb_pid()
+{
+    return get_usb_pid_s(&default_session);
+}
+
+int get_usb_bcd()
+{
+    return get_usb_bcd_s(&default_session);
+}
+
+char *get_serial(int p)
+{
+    return get_serial_s(&default_session, p);
+}
+
+int get_config_bytes_used()
+{
+    return get_config_bytes_used_s(&default_session);
+}
+
+int get_config_bytes_total()
+{
+    return get_config_bytes_total_s(&default_session);
+}
+
+int is_fw_dump_supported()
+{
+    return is_fw_dump_supported_s(&default_session);
+}
+
+int is_fw_update_supported(int direct)
+{
+    return is_fw_update_supported_s(&default_session, direct);
+}
+
+int get_time_second()
+{
+    return get_time_second_s(&default_session);
+}
+
+int get_time_minute()
+{
+    return get_time_minute_s(&default_session);
+}
+
+int get_time_hour()
+{
+    return get_time_hour_s(&default_session);
+}
+
+int get_time_day()
+{
+    return get_time_day_s(&default_session);
+}
+
+int get_time_dow()
+{
+    return get_time_dow_s(&default_session);
+}
+
+int get_time_month()
+{
+    return get_time_month_s(&default_session);
+}
+
+int get_time_year()
+{
+    return get_time_year_s(&default_session);
+}
+
+int get_time_utc_offset()
+{
+    return get_time_utc_offset_s(&default_session);
+}
+
+const char *get_time_timezone()
+{
+    return get_time_timezone_s(&default_session);
+}
+
+int read_and_parse_file(char *filename, int *type)
+{
+    return read_and_parse_file_s(&default_session, filename, type);
+}
+
+void delete_opfile_obj()
+{
+    delete_opfile_obj_s(&default_session);
+}
+
+int init_concord()
+{
+    return init_concord_s(&default_session);
+}
+
+int deinit_concord()
+{
+    return deinit_concord_s(&default_session);
+}
+
+int get_identity(lc_callback cb, void *cb_arg)
+{
+    return get_identity_s(&default_session, cb, cb_arg);
+}
+
+int reset_remote(lc_callback cb, void *cb_arg)
+{
+    return reset_remote_s(&default_session, cb, cb_arg);
+}
+
+int get_time()
+{
+    return get_time_s(&default_session);
+}
+
+int set_time(lc_callback cb, void *cb_arg)
+{
+    return set_time_s(&default_session, cb, cb_arg);
+}
+
+int post_connect_test_success(lc_callback cb, void *cb_arg)
+{
+    return post_connect_test_success_s(&default_session, cb, cb_arg);
+}
+
+int post_preconfig(lc_callback cb, void *cb_arg)
+{
+    return post_preconfig_s(&default_session, cb, cb_arg);
+}
+
+int post_postconfig(lc_callback cb, void *cb_arg)
+{
+    return post_postconfig_s(&default_session, cb, cb_arg);
+}
+
+int post_postfirmware(lc_callback cb, void *cb_arg)
+{
+    return post_postfirmware_s(&default_session, cb, cb_arg);
+}
+
+int invalidate_flash(lc_callback cb, void *cb_arg)
+{
+    return invalidate_flash_s(&default_session, cb, cb_arg);
+}
+
+int update_configuration(lc_callback cb, void *cb_arg, int noreset)
+{
+    return update_configuration_s(&default_session, cb, cb_arg, noreset);
+}
+
+int update_configuration_delta(lc_callback cb, void *cb_arg, int noreset)
+{
+    return update_configuration_delta_s(&default_session, cb, cb_arg, noreset);
+}
+
+int read_config_from_remote(uint8_t **out, uint32_t *size, lc_callback cb,
+                            void *cb_arg)
+{
+    return read_config_from_remote_s(&default_session, out, size, cb, cb_arg);
+}
+
+int write_config_to_remote(lc_callback cb, void *cb_arg)
+{
+    return write_config_to_remote_s(&default_session, cb, cb_arg);
+}
+
+int write_config_to_file(uint8_t *in, uint32_t size, char *file_name,
+                         int binary)
+{
+    return write_config_to_file_s(&default_session, in, size, file_name,
+                                  binary);
+}
+
+int verify_remote_config(lc_callback cb, void *cb_arg)
+{
+    return verify_remote_config_s(&default_session, cb, cb_arg);
+}
+
+int prep_config(lc_callback cb, void *cb_arg)
+{
+    return prep_config_s(&default_session, cb, cb_arg);
+}
+
+int finish_config(lc_callback cb, void *cb_arg)
+{
+    return finish_config_s(&default_session, cb, cb_arg);
+}
+
+int erase_config(lc_callback cb, void *cb_arg)
+{
+    return erase_config_s(&default_session, cb, cb_arg);
+}
+
+int erase_safemode(lc_callback cb, void *cb_arg)
+{
+    return erase_safemode_s(&default_session, cb, cb_arg);
+}
+
+int read_safemode_from_remote(uint8_t **out, uint32_t *size, lc_callback cb,
+                              void *cb_arg)
+{
+    return read_safemode_from_remote_s(&default_session, out, size, cb,
+                                       cb_arg);
+}
+
+int update_firmware(lc_callback cb, void *cb_arg, int noreset, int direct)
+{
+    return update_firmware_s(&default_session, cb, cb_arg, noreset, direct);
+}
+
+int is_config_safe_after_fw()
+{
+    return is_config_safe_after_fw_s(&default_session);
+}
+
+int prep_firmware(lc_callback cb, void *cb_arg)
+{
+    return prep_firmware_s(&default_session, cb, cb_arg);
+}
+
+int finish_firmware(lc_callback cb, void *cb_arg)
+{
+    return finish_firmware_s(&default_session, cb, cb_arg);
+}
+
+int erase_firmware(int direct, lc_callback cb, void *cb_arg)
+{
+    return erase_firmware_s(&default_session, direct, cb, cb_arg);
+}
+
+int read_firmware_from_remote(uint8_t **out, uint32_t *size, lc_callback cb,
+                              void *cb_arg)
+{
+    return read_firmware_from_remote_s(&default_session, out, size, cb,
+                                       cb_arg);
+}
+
+int write_firmware_to_remote(int direct, lc_callback cb, void *cb_arg)
+{
+    return write_firmware_to_remote_s(&default_session, direct, cb, cb_arg);
+}
+
+int get_key_names(char ***key_names, uint32_t *key_names_length)
+{
+    return get_key_names_s(&default_session, key_names, key_names_length);
+}
+
+int set_learning_mode(int mode, uint32_t timeout_ms)
+{
+    return set_learning_mode_s(&default_session, mode, timeout_ms);
+}
+
+int learn_from_remote(uint32_t *carrier_clock, uint32_t **ir_signal,
+                      uint32_t *ir_signal_length, lc_callback cb, void *cb_arg)
+{
+    return learn_from_remote_s(&default_session, carrier_clock, ir_signal,
+                               ir_signal_length, cb, cb_arg);
+}
+
+int post_new_code(char *key_name, char *encoded_signal, lc_callback cb,
+                  void *cb_arg)
+{
+    return post_new_code_s(&default_session, key_name, encoded_signal, cb,
+                           cb_arg);
+}
+
+int mh_get_cfg_properties(struct mh_cfg_properties *properties)
+{
+    return mh_get_cfg_properties_s(&default_session, properties);
+}
+
+int mh_set_cfg_properties(const struct mh_cfg_properties *properties)
+{
+    return mh_set_cfg_properties_s(&default_session, properties);
+}
+
+int mh_get_wifi_networks(struct mh_wifi_networks *networks)
+{
+    return mh_get_wifi_networks_s(&default_session, networks);
+}
+
+int mh_get_wifi_config(struct mh_wifi_config *config)
+{
+    return mh_get_wifi_config_s(&default_session, config);
+}
+
+int mh_set_wifi_config(const struct mh_wifi_config *config)
+{
+    return mh_set_wifi_config_s(&default_session, config);
+}
+
 const char *mh_get_serial()
 {
-    return ri.mh_serial.c_str();
+    return mh_get_serial_s(&default_session);
 }
 
 int mh_read_file(const char *filename, uint8_t *buffer, const uint32_t buflen,
                  uint32_t *data_read)
 {
-    if (!is_mh_remote())
-        return LC_ERROR;
-    return rmt->ReadFile(filename, buffer, buflen, data_read, 0x00, NULL, NULL,
-                         0);
+    return mh_read_file_s(&default_session, filename, buffer, buflen,
+                          data_read);
 }
 
 int mh_write_file(const char *filename, uint8_t *buffer, const uint32_t buflen)
 {
-    if (!is_mh_remote())
+    return mh_write_file_s(&default_session, filename, buffer, buflen);
+}
+
+int lc_calibrate_chunk_sizes(lc_callback cb, void *cb_arg)
+{
+    return lc_calibrate_chunk_sizes_s(&default_session, cb, cb_arg);
+}
+
+void lc_set_resume(int resume)
+{
+    lc_set_resume_s(&default_session, resume);
+}
+
+int lc_get_transfer_stats(struct lc_transfer_stats *stats)
+{
+    return lc_get_transfer_stats_s(&default_session, stats);
+}
+
+void lc_reset_transfer_stats()
+{
+    lc_reset_transfer_stats_s(&default_session);
+}
+
+int lc_start_capture(const char *file_name)
+{
+    if (!file_name)
         return LC_ERROR;
-    return rmt->WriteFile(filename, buffer, buflen);
+
+    return Capture_Start(file_name);
+}
+
+void lc_stop_capture()
+{
+    Capture_Stop();
 }
 
 /*
@@ -83,6 +83,7 @@
 #define LC_CB_STAGE_SET_TIME 19
 #define LC_CB_STAGE_HTTP 20
 #define LC_CB_STAGE_LEARN 21
+#define LC_CB_STAGE_CALIBRATE 22
 
 
 /*
@@ -289,6 +290,14 @@ int invalidate_flash(lc_callback cb, void *cb_arg);
  */
 int update_configuration(lc_callback cb, void *cb_arg, int noreset);
 
+/*
+ * Like update_configuration(), but for the non-Z-Wave HID remotes it reads
+ * the current config first and only erases, writes and verifies the flash
+ * sectors that change, which is much quicker for small edits. Other remotes,
+ * and remotes without a valid config, get a normal update.
+ */
+int update_configuration_delta(lc_callback cb, void *cb_arg, int noreset);
+
 /*
  * Read the config from the remote and store it into the unit8_t array
  * *out. The callback is for status information. See above for CB info.
@@ -550,6 +559,256 @@ int mh_read_file(const char *filename, uint8_t *buffer, const uint32_t buflen,
 int mh_write_file(const char *filename, uint8_t *buffer,
                   const uint32_t buflen);
 
+/*
+ * Find the fastest flash read size the remote handles correctly, by
+ * reading the start of the config with ever larger chunks, and save it in
+ * the chunk size profile for its architecture and flash part. Later
+ * sessions with that kind of remote use the saved size for every config
+ * and firmware dump or upload.
+ *
+ * Write sizes are not probed, as there is no scratch region we could
+ * safely write to, but a write size put in the profile by hand is used.
+ * Only the non-Z-Wave HID remotes support this. get_identity() must have
+ * been called first.
+ */
+int lc_calibrate_chunk_sizes(lc_callback cb, void *cb_arg);
+
+/*
+ * update_configuration() and update_firmware() keep a journal of which
+ * flash sectors they have erased, written and verified, so that an upload
+ * cut short (say the remote was unplugged) can be picked up where it
+ * stopped. With resume set, they skip the sectors the journal says were
+ * verified, if it is for the same file and remote; otherwise they start
+ * over as usual. Only the non-Z-Wave HID remotes keep a journal.
+ */
+void lc_set_resume(int resume);
+
+/*
+ * TRANSFER STATISTICS
+ *
+ * Each session counts the HID reports or usbnet messages going to and from
+ * its remote, in total and for each protocol command they carry (say
+ * READ_FLASH, WRITE_UPDATE_DATA or an MH file operation). Whatever comes
+ * back is put down to the command last sent. A round trip is a command and
+ * the first report back after it, and its latency the time in between:
+ * latency[0] counts those under LC_STATS_LATENCY_BASE_US, each bucket after
+ * it those up to twice as long as the one before, and the last bucket the
+ * rest. Timeouts are reads that got nothing, including the ones expected
+ * while draining the remote; retries are commands sent again after the
+ * remote didn't take them. Codes above 0xFFF are our own: DATA is MH file
+ * data, TCP_ACK a Z-Wave HID acknowledgement carrying no command.
+ *
+ * lc_get_transfer_stats() gives the counts since the session was created or
+ * lc_reset_transfer_stats() last called. If more than LC_STATS_MAX_COMMANDS
+ * commands were seen, only the first ones are listed, but the total has
+ * them all.
+ */
+#define LC_STATS_MAX_COMMANDS 64
+#define LC_STATS_LATENCY_BUCKETS 20
+#define LC_STATS_LATENCY_BASE_US 64
+#define LC_STATS_NAME_LENGTH 40
+struct lc_command_stats {
+    uint32_t code;
+    char name[LC_STATS_NAME_LENGTH];
+    uint64_t reports_out;
+    uint64_t reports_in;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t round_trips;
+    uint64_t timeouts;
+    uint64_t retries;
+    /* in us */
+    uint64_t latency_total;
+    uint64_t latency_max;
+    uint64_t latency[LC_STATS_LATENCY_BUCKETS];
+};
+struct lc_transfer_stats {
+    /* code 0 and no name */
+    struct lc_command_stats total;
+    int num_commands;
+    struct lc_command_stats command[LC_STATS_MAX_COMMANDS];
+};
+int lc_get_transfer_stats(struct lc_transfer_stats *stats);
+void lc_reset_transfer_stats();
+
+/*
+ * TRAFFIC CAPTURE
+ *
+ * lc_start_capture() writes every HID report and usbnet message that goes to
+ * or from any remote, with the time it went, to a binary file that consnoop
+ * can decode. Each session's traffic is kept apart as its own channel. The
+ * reports are queued as they go and written out in the background, so this
+ * costs little enough to leave on; if the disk can't keep up, reports are
+ * dropped rather than the transfer slowed down, and the file says how many.
+ * Starting a capture while one is running ends the first. Setting
+ * LIBCONCORD_CAPTURE to a file name has the first init_concord() start one.
+ * lc_stop_capture() writes out the rest and closes the file; it is also done
+ * on exit.
+ */
+int lc_start_capture(const char *file_name);
+void lc_stop_capture();
+
+/*
+ * SESSIONS
+ *
+ * Everything above operates on a single, implicit remote. To drive several
+ * remotes from one process, create one session per remote and use the _s
+ * variants below; each behaves exactly like the function of the same name
+ * without the suffix, but only touches the state of the session passed in.
+ * The implicit remote is itself just a session, returned by
+ * lc_default_session(), so the two styles can be mixed.
+ *
+ * A session must only be used by one thread at a time.
+ */
+typedef struct lc_session lc_session;
+lc_session *lc_session_new();
+/*
+ * Deinitializes the remote (if needed) and frees the session. Freeing the
+ * default session is a no-op.
+ */
+void lc_session_free(lc_session *s);
+lc_session *lc_default_session();
+/*
+ * Make session s use the file already read into session from with
+ * read_and_parse_file_s() instead of reading it again. Nothing writes to a
+ * parsed file, so any number of sessions may share one, from any number of
+ * threads, as long as from outlives them. delete_opfile_obj_s() on s only
+ * drops its reference.
+ */
+int lc_session_share_file(lc_session *s, lc_session *from);
+
+/*
+ * DEVICE DISCOVERY
+ *
+ * lc_enumerate_remotes() lists every attached remote without opening any of
+ * them. Checking for a usbnet remote (Harmony 1000) means trying to connect
+ * to it, which can take a second when there is none, so it is only done if
+ * probe_usbnet is set (some USB backends see it regardless). Free the list
+ * with lc_delete_device_list().
+ *
+ * Pass the path of an entry to init_concord_path_s() to open that
+ * particular remote instead of the first one found; LC_USBNET_PATH opens
+ * the usbnet remote.
+ */
+#define LC_TRANSPORT_HID 1
+#define LC_TRANSPORT_USBNET 2
+#define LC_USBNET_PATH "usbnet"
+#define LC_DEVICE_STRING_LENGTH 256
+struct lc_device_info {
+    int transport;
+    unsigned int vid;
+    unsigned int pid;
+    char path[LC_DEVICE_STRING_LENGTH];
+    /* USB serial number string, empty if the remote has none */
+    char serial[LC_DEVICE_STRING_LENGTH];
+};
+int lc_enumerate_remotes(struct lc_device_info **devices, int *count,
+                         int probe_usbnet);
+void lc_delete_device_list(struct lc_device_info *devices);
+int init_concord_path_s(lc_session *s, const char *path);
+
+const char *get_mfg_s(lc_session *s);
+const char *get_model_s(lc_session *s);
+const char *get_codename_s(lc_session *s);
+int get_skin_s(lc_session *s);
+int get_fw_ver_maj_s(lc_session *s);
+int get_fw_ver_min_s(lc_session *s);
+int get_fw_type_s(lc_session *s);
+int get_hw_ver_maj_s(lc_session *s);
+int get_hw_ver_min_s(lc_session *s);
+int get_hw_ver_mic_s(lc_session *s);
+int get_flash_size_s(lc_session *s);
+int get_flash_mfg_s(lc_session *s);
+int get_flash_id_s(lc_session *s);
+const char *get_flash_part_num_s(lc_session *s);
+int get_arch_s(lc_session *s);
+int get_proto_s(lc_session *s);
+const char *get_hid_mfg_str_s(lc_session *s);
+const char *get_hid_prod_str_s(lc_session *s);
+int get_hid_irl_s(lc_session *s);
+int get_hid_orl_s(lc_session *s);
+int get_hid_frl_s(lc_session *s);
+int get_usb_vid_s(lc_session *s);
+int get_usb_pid_s(lc_session *s);
+int get_usb_bcd_s(lc_session *s);
+char *get_serial_s(lc_session *s, int p);
+int get_config_bytes_used_s(lc_session *s);
+int get_config_bytes_total_s(lc_session *s);
+int is_fw_dump_supported_s(lc_session *s);
+int is_fw_update_supported_s(lc_session *s, int direct);
+int get_time_second_s(lc_session *s);
+int get_time_minute_s(lc_session *s);
+int get_time_hour_s(lc_session *s);
+int get_time_day_s(lc_session *s);
+int get_time_dow_s(lc_session *s);
+int get_time_month_s(lc_session *s);
+int get_time_year_s(lc_session *s);
+int get_time_utc_offset_s(lc_session *s);
+const char *get_time_timezone_s(lc_session *s);
+int read_and_parse_file_s(lc_session *s, char *filename, int *type);
+void delete_opfile_obj_s(lc_session *s);
+int init_concord_s(lc_session *s);
+int deinit_concord_s(lc_session *s);
+int get_identity_s(lc_session *s, lc_callback cb, void *cb_arg);
+int reset_remote_s(lc_session *s, lc_callback cb, void *cb_arg);
+int get_time_s(lc_session *s);
+int set_time_s(lc_session *s, lc_callback cb, void *cb_arg);
+int post_connect_test_success_s(lc_session *s, lc_callback cb, void *cb_arg);
+int post_preconfig_s(lc_session *s, lc_callback cb, void *cb_arg);
+int post_postconfig_s(lc_session *s, lc_callback cb, void *cb_arg);
+int post_postfirmware_s(lc_session *s, lc_callback cb, void *cb_arg);
+int invalidate_flash_s(lc_session *s, lc_callback cb, void *cb_arg);
+int update_configuration_s(lc_session *s, lc_callback cb, void *cb_arg,
+                           int noreset);
+int update_configuration_delta_s(lc_session *s, lc_callback cb, void *cb_arg,
+                                 int noreset);
+int read_config_from_remote_s(lc_session *s, uint8_t **out, uint32_t *size,
+                              lc_callback cb, void *cb_arg);
+int write_config_to_remote_s(lc_session *s, lc_callback cb, void *cb_arg);
+int write_config_to_file_s(lc_session *s, uint8_t *in, uint32_t size,
+                           char *file_name, int binary);
+int verify_remote_config_s(lc_session *s, lc_callback cb, void *cb_arg);
+int prep_config_s(lc_session *s, lc_callback cb, void *cb_arg);
+int finish_config_s(lc_session *s, lc_callback cb, void *cb_arg);
+int erase_config_s(lc_session *s, lc_callback cb, void *cb_arg);
+int erase_safemode_s(lc_session *s, lc_callback cb, void *cb_arg);
+int read_safemode_from_remote_s(lc_session *s, uint8_t **out, uint32_t *size,
+                                lc_callback cb, void *cb_arg);
+int update_firmware_s(lc_session *s, lc_callback cb, void *cb_arg, int noreset,
+                      int direct);
+int is_config_safe_after_fw_s(lc_session *s);
+int prep_firmware_s(lc_session *s, lc_callback cb, void *cb_arg);
+int finish_firmware_s(lc_session *s, lc_callback cb, void *cb_arg);
+int erase_firmware_s(lc_session *s, int direct, lc_callback cb, void *cb_arg);
+int read_firmware_from_remote_s(lc_session *s, uint8_t **out, uint32_t *size,
+                                lc_callback cb, void *cb_arg);
+int write_firmware_to_remote_s(lc_session *s, int direct, lc_callback cb,
+                               void *cb_arg);
+int get_key_names_s(lc_session *s, char ***key_names,
+                    uint32_t *key_names_length);
+int set_learning_mode_s(lc_session *s, int mode, uint32_t timeout_ms);
+int learn_from_remote_s(lc_session *s, uint32_t *carrier_clock,
+                        uint32_t **ir_signal, uint32_t *ir_signal_length,
+                        lc_callback cb, void *cb_arg);
+int post_new_code_s(lc_session *s, char *key_name, char *encoded_signal,
+                    lc_callback cb, void *cb_arg);
+int mh_get_cfg_properties_s(lc_session *s,
+                            struct mh_cfg_properties *properties);
+int mh_set_cfg_properties_s(lc_session *s,
+                            const struct mh_cfg_properties *properties);
+int mh_get_wifi_networks_s(lc_session *s, struct mh_wifi_networks *networks);
+int mh_get_wifi_config_s(lc_session *s, struct mh_wifi_config *config);
+int mh_set_wifi_config_s(lc_session *s, const struct mh_wifi_config *config);
+const char *mh_get_serial_s(lc_session *s);
+int mh_read_file_s(lc_session *s, const char *filename, uint8_t *buffer,
+                   const uint32_t buflen, uint32_t *data_read);
+int mh_write_file_s(lc_session *s, const char *filename, uint8_t *buffer,
+                    const uint32_t buflen);
+int lc_calibrate_chunk_sizes_s(lc_session *s, lc_callback cb, void *cb_arg);
+void lc_set_resume_s(lc_session *s, int resume);
+int lc_get_transfer_stats_s(lc_session *s, struct lc_transfer_stats *stats);
+void lc_reset_transfer_stats_s(lc_session *s);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,10 +27,14 @@
 #define LC_LIBHIDAPI
 
 #include "hid.h"
+#include "transfer_stats.h"
+#include "capture.h"
 #include <hidapi/hidapi.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <thread>
+#include <chrono>
 
 /*
  * Harmonies either fall under logitech's VendorID (0x046d), and logitech's
@@ -46,10 +50,15 @@
 
 #define USB_PACKET_LENGTH 64
 
-hid_device *h_dev;
+/* The device HID_WriteReport()/HID_ReadReport() use on this thread */
+static thread_local THIDINFO *cur_hid = NULL;
 
 int InitUSB()
 {
+    static bool initialized = false;
+
+    if (initialized)
+        return 0;
     hid_init();
     /*
      * Note we do NOT call hid_exit() in ShutdownUSB, because you can
@@ -57,13 +66,14 @@ int InitUSB()
      * to come back and do more stuff. So we set it up as an atexit()
      */
     atexit((void(*)())hid_exit);
+    initialized = true;
     return 0;
 }
 
 void ShutdownUSB()
 {
-    if (h_dev) {
-        hid_close(h_dev);
+    if (cur_hid) {
+        CloseRemote(*cur_hid);
     }
 }
 
@@ -83,49 +93,113 @@ bool is_harmony(struct hid_device_info *dev)
 }
 
 /*
- * Find a HID device that is a Harmony
+ * List every HID device that is a Harmony
  */
-int FindRemote(THIDINFO &hid_info)
+int FindRemotes(vector<THIDINFO> &remotes)
 {
     struct hid_device_info *devs, *cur_dev;
-    bool found = false;
     devs = hid_enumerate(0x0, 0x0);
     cur_dev = devs;
     while (cur_dev) {
         debug("Testing: %04X, %04X", cur_dev->vendor_id, cur_dev->product_id);
         if (is_harmony(cur_dev)) {
-            debug("Found a Harmony!");
+            debug("Found a Harmony at %s", cur_dev->path);
+            THIDINFO hid_info = THIDINFO();
             hid_info.vid = cur_dev->vendor_id;
             hid_info.pid = cur_dev->product_id;
             hid_info.ver = cur_dev->release_number;
-            h_dev = hid_open(cur_dev->vendor_id, cur_dev->product_id, NULL);
-            found = true;
-            break;
+            hid_info.path = cur_dev->path;
+            if (cur_dev->serial_number) {
+                char s[128];
+                if (wcstombs(s, cur_dev->serial_number, sizeof(s))
+                        != (size_t)-1) {
+                    s[sizeof(s) - 1] = '\0';
+                    hid_info.serial = s;
+                }
+            }
+            remotes.push_back(hid_info);
         }
         cur_dev = cur_dev->next;
     }
     hid_free_enumeration(devs);
-    if (!found || !h_dev) {
+
+    return 0;
+}
+
+/*
+ * Find a HID device that is a Harmony
+ */
+int FindRemote(THIDINFO &hid_info)
+{
+    vector<THIDINFO> remotes;
+
+    FindRemotes(remotes);
+    if (remotes.empty()) {
+        debug("Failed to establish communication with remote");
+        return LC_ERROR_CONNECT;
+    }
+
+    hid_info = remotes[0];
+    return OpenRemote(hid_info);
+}
+
+/*
+ * hidapi can't tell us when devices appear, so just wait it out.
+ */
+int HID_WaitForArrival(unsigned int timeout)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+    return -ETIMEDOUT;
+}
+
+/*
+ * Open the Harmony at hid_info.path
+ */
+int OpenRemote(THIDINFO &hid_info)
+{
+    hid_device *dev = hid_open_path(hid_info.path.c_str());
+    if (!dev) {
         debug("Failed to establish communication with remote");
         return LC_ERROR_CONNECT;
     }
+    hid_info.dev = dev;
+    HID_SelectRemote(&hid_info);
 
     // Fill in hid_info
     const size_t buf_len = 128;
     wchar_t wide_s[buf_len];
     char s[buf_len];
-    hid_get_manufacturer_string(h_dev, wide_s, buf_len);
+    hid_get_manufacturer_string(dev, wide_s, buf_len);
     wcstombs(s, wide_s, buf_len);
     hid_info.mfg = s;
-    hid_get_product_string(h_dev, wide_s, buf_len);
+    hid_get_product_string(dev, wide_s, buf_len);
     wcstombs(s, wide_s, buf_len);
     hid_info.prod = s;
 
     return 0;
 }
 
+void CloseRemote(THIDINFO &hid_info)
+{
+    if (hid_info.dev) {
+        hid_close(static_cast<hid_device*>(hid_info.dev));
+        hid_info.dev = NULL;
+    }
+    if (cur_hid == &hid_info)
+        cur_hid = NULL;
+}
+
+void HID_SelectRemote(THIDINFO *hid_info)
+{
+    cur_hid = hid_info;
+}
+
 int HID_WriteReport(const uint8_t *data)
 {
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+    hid_device *h_dev = static_cast<hid_device*>(cur_hid->dev);
+
     uint8_t newdata[USB_PACKET_LENGTH+1];
     newdata[0] = 0x00;
     memcpy(&newdata[1], data, USB_PACKET_LENGTH);
@@ -134,20 +208,30 @@ int HID_WriteReport(const uint8_t *data)
         debug("Failed to write to device: %d (%ls)", err, hid_error(h_dev));
         return err;
     }
+    Stats_Sent(data, USB_PACKET_LENGTH);
+    Capture_Report(CAPTURE_OUT, data, USB_PACKET_LENGTH);
 
     return 0;
 }
 
 int HID_ReadReport(uint8_t *data, unsigned int timeout)
 {
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+    hid_device *h_dev = static_cast<hid_device*>(cur_hid->dev);
+
     int err = hid_read_timeout(h_dev, data, USB_PACKET_LENGTH, timeout);
     if (err < 0) {
         debug("Failed to read from device: %d (%ls)", err, hid_error(h_dev));
         return err;
     } else if (err == 0) {
         debug("USB read timed out");
+        Stats_Timeout();
+        Capture_Report(CAPTURE_TIMEOUT, NULL, 0);
         return 1;
     }
+    Stats_Received(err);
+    Capture_Report(CAPTURE_IN, data, err);
 
     return 0;
 }
@@ -0,0 +1,676 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright Kevin Timmerman 2007
+ * (C) Copyright Phil Dibowitz 2007
+ */
+
+#include "lc_internal.h"
+#include "libconcord.h"
+
+#ifdef WANT_LIBUSB1
+
+#ifndef LC_LIBUSB1
+#define LC_LIBUSB1
+
+#include "hid.h"
+#include "transfer_stats.h"
+#include "capture.h"
+#include <libusb-1.0/libusb.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+/*
+ * This backend talks to the remote with libusb-1.0's asynchronous
+ * transfers. HID_WriteReport() only queues the report and returns, so
+ * code that streams reports without waiting for an answer (e.g.
+ * CRemote::WriteFlash) keeps the endpoint busy instead of paying a full
+ * round trip per report. Errors from queued writes are reported by the
+ * next HID_WriteReport() or HID_ReadReport() call.
+ */
+
+/*
+ * Harmonies either fall under logitech's VendorID (0x046d), and logitech's
+ * productID range for Harmonies (0xc110 - 0xc14f)...
+ *
+ * OR, they fall under 0x400/0xc359 (older 7-series, all 6-series).
+ */
+#define LOGITECH_VID 0x046D
+#define LOGITECH_MIN_PID 0xc110
+#define LOGITECH_MAX_PID 0xc14f
+#define NATIONAL_VID 0x0400
+#define NATIONAL_PID 0xc359
+
+/*
+ * How many output reports may be queued on one remote before
+ * HID_WriteReport() waits for the oldest one to go out.
+ */
+#define WRITE_POOL_SIZE 16
+#define WRITE_TIMEOUT 500
+
+struct usb1_remote;
+
+struct usb1_transfer {
+    struct libusb_transfer *xfer;
+    struct usb1_remote *ur;
+    int index;
+};
+
+/* What we need to talk to one open remote; lives in THIDINFO::dev */
+struct usb1_remote {
+    libusb_device_handle *h_hid;
+    int ep_read;
+    int ep_write;
+
+    /*
+     * Completion callbacks run in whichever thread is handling libusb
+     * events, which need not be the one using this remote, so everything
+     * below is protected by lock.
+     */
+    std::mutex lock;
+    struct usb1_transfer pool[WRITE_POOL_SIZE];
+    /* indexes into pool of the transfers not in flight */
+    int idle[WRITE_POOL_SIZE];
+    int num_idle;
+    /* set when a write completes, for wait_for() */
+    int write_done;
+    /* first error from a queued write, not yet reported */
+    int write_err;
+
+    struct libusb_transfer *read_xfer;
+    int read_done;
+};
+
+static libusb_context *ctx = NULL;
+
+/* The device HID_WriteReport()/HID_ReadReport() use on this thread */
+static thread_local THIDINFO *cur_hid = NULL;
+
+int InitUSB()
+{
+    int err;
+
+    if (ctx)
+        return 0;
+    if ((err = libusb_init(&ctx))) {
+        debug("Failed to initialize libusb: %s", libusb_error_name(err));
+        ctx = NULL;
+        return err;
+    }
+    return 0;
+}
+
+void ShutdownUSB()
+{
+    if (cur_hid) {
+        CloseRemote(*cur_hid);
+    }
+}
+
+/*
+ * Callers expect the negative errno values libusb-0.1 returned.
+ */
+static int transfer_error(enum libusb_transfer_status status)
+{
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return -ETIMEDOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return -EPIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return -ENODEV;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return -EOVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return -ECANCELED;
+        default:
+            return -EIO;
+    }
+}
+
+static int usb1_error(int err)
+{
+    switch (err) {
+        case LIBUSB_ERROR_TIMEOUT:
+            return -ETIMEDOUT;
+        case LIBUSB_ERROR_PIPE:
+            return -EPIPE;
+        case LIBUSB_ERROR_NO_DEVICE:
+            return -ENODEV;
+        case LIBUSB_ERROR_BUSY:
+            return -EBUSY;
+        case LIBUSB_ERROR_NO_MEM:
+            return -ENOMEM;
+        default:
+            return -EIO;
+    }
+}
+
+/*
+ * Handle libusb events until *done is set. Every transfer we submit has a
+ * timeout, so this always ends. Several threads may wait at once, libusb
+ * picks one of them to handle the events.
+ */
+static int wait_for(int *done)
+{
+    while (!*done) {
+        struct timeval tv = { 1, 0 };
+        int err = libusb_handle_events_timeout_completed(ctx, &tv, done);
+        if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            debug("Failed to handle events: %s", libusb_error_name(err));
+            return usb1_error(err);
+        }
+    }
+    return 0;
+}
+
+static void LIBUSB_CALL write_cb(struct libusb_transfer *xfer)
+{
+    usb1_transfer *t = static_cast<usb1_transfer*>(xfer->user_data);
+    usb1_remote *ur = t->ur;
+    int err = transfer_error(xfer->status);
+
+    if (!err && xfer->actual_length != xfer->length)
+        err = -EIO;
+
+    std::lock_guard<std::mutex> guard(ur->lock);
+    if (err && !ur->write_err) {
+        debug("Failed to write to device: %d (%s)", err, strerror(-err));
+        ur->write_err = err;
+    }
+    ur->idle[ur->num_idle++] = t->index;
+    ur->write_done = 1;
+}
+
+static void LIBUSB_CALL read_cb(struct libusb_transfer *xfer)
+{
+    usb1_remote *ur = static_cast<usb1_remote*>(xfer->user_data);
+
+    std::lock_guard<std::mutex> guard(ur->lock);
+    ur->read_done = 1;
+}
+
+/*
+ * Hand back (and clear) the error of a queued write, if there was one.
+ */
+static int take_write_error(usb1_remote *ur)
+{
+    std::lock_guard<std::mutex> guard(ur->lock);
+    int err = ur->write_err;
+    ur->write_err = 0;
+    return err;
+}
+
+/*
+ * Wait for every queued write to complete.
+ */
+static void drain_writes(usb1_remote *ur)
+{
+    while (1) {
+        {
+            std::lock_guard<std::mutex> guard(ur->lock);
+            if (ur->num_idle == WRITE_POOL_SIZE)
+                return;
+            ur->write_done = 0;
+        }
+        if (wait_for(&ur->write_done))
+            return;
+    }
+}
+
+static void free_remote(usb1_remote *ur)
+{
+    for (int i = 0; i < WRITE_POOL_SIZE; i++) {
+        if (ur->pool[i].xfer)
+            libusb_free_transfer(ur->pool[i].xfer);
+    }
+    if (ur->read_xfer)
+        libusb_free_transfer(ur->read_xfer);
+    delete ur;
+}
+
+void check_ep(const libusb_endpoint_descriptor &ued, usb1_remote &ur,
+              THIDINFO &hid_info)
+{
+    debug("address %02X attrib %02X max_length %i",
+        ued.bEndpointAddress, ued.bmAttributes,
+        ued.wMaxPacketSize);
+
+    if ((ued.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+        LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+        if (ued.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) {
+            if (ur.ep_read == -1) {
+                ur.ep_read = ued.bEndpointAddress;
+                // hack! todo: get from HID report descriptor
+                hid_info.irl = ued.wMaxPacketSize;
+            }
+        } else {
+            if (ur.ep_write == -1) {
+                ur.ep_write = ued.bEndpointAddress;
+                // hack! todo: get from HID report descriptor
+                hid_info.orl = ued.wMaxPacketSize;
+            }
+        }
+    }
+}
+
+bool is_harmony(const libusb_device_descriptor &desc)
+{
+    /* IF vendor == logitech AND product is in range of harmony
+     *   OR vendor == National Semiconductor and product is harmony
+     */
+    if ((desc.idVendor == LOGITECH_VID
+          && (desc.idProduct >= LOGITECH_MIN_PID
+              && desc.idProduct <= LOGITECH_MAX_PID))
+        || (desc.idVendor == NATIONAL_VID
+              && desc.idProduct == NATIONAL_PID)) {
+        return true;
+    }
+    return false;
+}
+
+/*
+ * The bus number and the chain of hub ports leading to the device, e.g.
+ * "1-2.4". Unlike the device address this survives a reset.
+ */
+static string usb_path(libusb_device *h_dev)
+{
+    uint8_t ports[8];
+    char s[8];
+    string path;
+
+    snprintf(s, sizeof(s), "%d", libusb_get_bus_number(h_dev));
+    path = s;
+    int n = libusb_get_port_numbers(h_dev, ports, sizeof(ports));
+    for (int i = 0; i < n; i++) {
+        snprintf(s, sizeof(s), "%c%d", i ? '.' : '-', ports[i]);
+        path += s;
+    }
+    return path;
+}
+
+/*
+ * List every USB device with VendorID == 0x046D ||
+ *    (VendorID == 0x0400 && ProductID == 0xC359)
+ */
+int FindRemotes(vector<THIDINFO> &remotes)
+{
+    libusb_device **list;
+    ssize_t num = libusb_get_device_list(ctx, &list);
+
+    if (num < 0) {
+        debug("Failed to list devices: %s", libusb_error_name(num));
+        return LC_ERROR_CONNECT;
+    }
+
+    for (ssize_t i = 0; i < num; i++) {
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) || !is_harmony(desc))
+            continue;
+
+        THIDINFO hid_info = THIDINFO();
+        hid_info.vid = desc.idVendor;
+        hid_info.pid = desc.idProduct;
+        hid_info.ver = desc.bcdDevice;
+        hid_info.path = usb_path(list[i]);
+        debug("Found a Harmony at %s", hid_info.path.c_str());
+
+        /* Reading the serial requires opening, but not claiming */
+        libusb_device_handle *h_hid;
+        if (desc.iSerialNumber && !libusb_open(list[i], &h_hid)) {
+            unsigned char s[128];
+            if (libusb_get_string_descriptor_ascii(h_hid, desc.iSerialNumber,
+                    s, sizeof(s)) > 0)
+                hid_info.serial = reinterpret_cast<char *>(s);
+            libusb_close(h_hid);
+        }
+        remotes.push_back(hid_info);
+    }
+
+    libusb_free_device_list(list, 1);
+    return 0;
+}
+
+/*
+ * Find a HID device with VendorID == 0x046D ||
+ *    (VendorID == 0x0400 && ProductID == 0xC359)
+ */
+int FindRemote(THIDINFO &hid_info)
+{
+    vector<THIDINFO> remotes;
+
+    FindRemotes(remotes);
+    if (remotes.empty()) {
+        debug("Failed to establish communication with remote");
+        return LC_ERROR_CONNECT;
+    }
+
+    hid_info = remotes[0];
+    return OpenRemote(hid_info);
+}
+
+static int LIBUSB_CALL arrived_cb(libusb_context *c, libusb_device *dev,
+                                  libusb_hotplug_event event, void *user_data)
+{
+    libusb_device_descriptor desc;
+
+    if (!libusb_get_device_descriptor(dev, &desc) && is_harmony(desc)) {
+        debug("A Harmony arrived");
+        *static_cast<int*>(user_data) = 1;
+    }
+    return 0;
+}
+
+/*
+ * Wait for a Harmony to be plugged in, using libusb's hotplug events where
+ * the platform has them.
+ */
+int HID_WaitForArrival(unsigned int timeout)
+{
+    int arrived = 0;
+    libusb_hotplug_callback_handle handle;
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ||
+        libusb_hotplug_register_callback(ctx,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+            LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, arrived_cb, &arrived, &handle)) {
+        std::this_thread::sleep_until(deadline);
+        return -ETIMEDOUT;
+    }
+
+    while (!arrived) {
+        std::chrono::microseconds left =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0)
+            break;
+        struct timeval tv = { (long)(left.count() / 1000000),
+                              (long)(left.count() % 1000000) };
+        int err = libusb_handle_events_timeout_completed(ctx, &tv, &arrived);
+        if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            debug("Failed to handle events: %s", libusb_error_name(err));
+            break;
+        }
+    }
+    libusb_hotplug_deregister_callback(ctx, handle);
+
+    return arrived ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * Open the remote at hid_info.path
+ */
+int OpenRemote(THIDINFO &hid_info)
+{
+    libusb_device **list;
+    libusb_device *h_dev = NULL;
+    libusb_device_descriptor desc;
+    ssize_t num = libusb_get_device_list(ctx, &list);
+
+    for (ssize_t i = 0; i < num; i++) {
+        if (!libusb_get_device_descriptor(list[i], &desc) &&
+            is_harmony(desc) && usb_path(list[i]) == hid_info.path) {
+            h_dev = list[i];
+            break;
+        }
+    }
+
+    libusb_device_handle *h_hid = NULL;
+    int err = LIBUSB_ERROR_NOT_FOUND;
+    if (h_dev) {
+        err = libusb_open(h_dev, &h_hid);
+    }
+    if (err) {
+        debug("Failed to establish communication with remote: %s",
+              libusb_error_name(err));
+        if (num >= 0)
+            libusb_free_device_list(list, 1);
+        return LC_ERROR_CONNECT;
+    }
+
+    /*
+     * Before we attempt to claim the interface, lets go ahead and get
+     * the kernel off of it, in case it claimed it already. We don't check
+     * for an error because it will error if no kernel driver is attached
+     * to it, or on platforms that have no such thing.
+     *
+     * Don't attempt to do this if this is a usbnet remote as it will
+     * unload the zaurus driver, which is not desired.
+     */
+    if (desc.idProduct != 0xC11F) {
+        libusb_detach_kernel_driver(h_hid, 0);
+    }
+
+    if ((err = libusb_claim_interface(h_hid, 0))) {
+        debug("Failed to claim interface: %d (%s)", err,
+              libusb_error_name(err));
+        libusb_close(h_hid);
+        libusb_free_device_list(list, 1);
+        return usb1_error(err);
+    }
+
+    usb1_remote *ur = new usb1_remote;
+    ur->h_hid = h_hid;
+    ur->ep_read = -1;
+    ur->ep_write = -1;
+    ur->num_idle = 0;
+    ur->write_done = 0;
+    ur->write_err = 0;
+    ur->read_done = 0;
+    ur->read_xfer = NULL;
+    for (int i = 0; i < WRITE_POOL_SIZE; i++) {
+        ur->pool[i].xfer = NULL;
+        ur->pool[i].ur = ur;
+        ur->pool[i].index = i;
+    }
+
+    for (uint8_t j = 0; j < desc.bNumConfigurations; ++j) {
+        libusb_config_descriptor *uc;
+        if (libusb_get_config_descriptor(h_dev, j, &uc))
+            continue;
+        for (uint8_t k = 0; k < uc->bNumInterfaces; ++k) {
+            const libusb_interface &ui = uc->interface[k];
+            for (int l = 0; l < ui.num_altsetting; ++l) {
+                const libusb_interface_descriptor &uid = ui.altsetting[l];
+                debug("bNumEndpoints %i", uid.bNumEndpoints);
+                for (uint8_t n = 0; n < uid.bNumEndpoints; ++n) {
+                    check_ep(uid.endpoint[n], *ur, hid_info);
+                }
+            }
+        }
+        libusb_free_config_descriptor(uc);
+    }
+    libusb_free_device_list(list, 1);
+
+    if (ur->ep_read == -1 || ur->ep_write == -1) {
+        libusb_release_interface(h_hid, 0);
+        libusb_close(h_hid);
+        free_remote(ur);
+        return 1;
+    }
+
+    /*
+     * Everything a transfer needs is allocated up front, so queueing a
+     * report is just a copy and a submit.
+     */
+    for (int i = 0; i < WRITE_POOL_SIZE; i++) {
+        libusb_transfer *xfer = libusb_alloc_transfer(0);
+        if (!xfer)
+            break;
+        /* LIBUSB_TRANSFER_FREE_BUFFER hands this to free() */
+        uint8_t *buf = static_cast<uint8_t*>(malloc(hid_info.orl));
+        libusb_fill_interrupt_transfer(xfer, h_hid, ur->ep_write, buf,
+            hid_info.orl, write_cb, &ur->pool[i], WRITE_TIMEOUT);
+        xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        ur->pool[i].xfer = xfer;
+        ur->idle[ur->num_idle++] = i;
+    }
+    ur->read_xfer = libusb_alloc_transfer(0);
+    if (ur->num_idle != WRITE_POOL_SIZE || !ur->read_xfer) {
+        libusb_release_interface(h_hid, 0);
+        libusb_close(h_hid);
+        free_remote(ur);
+        return -ENOMEM;
+    }
+    libusb_fill_interrupt_transfer(ur->read_xfer, h_hid, ur->ep_read,
+        static_cast<uint8_t*>(malloc(hid_info.irl)), hid_info.irl, read_cb,
+        ur, 0);
+    ur->read_xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    hid_info.dev = ur;
+    HID_SelectRemote(&hid_info);
+
+    // Fill in hid_info
+
+    unsigned char s[128];
+    s[0] = '\0';
+    libusb_get_string_descriptor_ascii(h_hid, desc.iManufacturer, s,
+                                       sizeof(s));
+    hid_info.mfg = reinterpret_cast<char *>(s);
+    s[0] = '\0';
+    libusb_get_string_descriptor_ascii(h_hid, desc.iProduct, s, sizeof(s));
+    hid_info.prod = reinterpret_cast<char *>(s);
+
+    hid_info.vid = desc.idVendor;
+    hid_info.pid = desc.idProduct;
+    hid_info.ver = desc.bcdDevice;
+
+    hid_info.frl = 0;/// ???
+
+    return 0;
+}
+
+void CloseRemote(THIDINFO &hid_info)
+{
+    usb1_remote *ur = static_cast<usb1_remote*>(hid_info.dev);
+    if (ur) {
+        /* The last thing written is often a reset, let it get there */
+        drain_writes(ur);
+        libusb_release_interface(ur->h_hid, 0);
+        libusb_close(ur->h_hid);
+        free_remote(ur);
+        hid_info.dev = NULL;
+    }
+    if (cur_hid == &hid_info)
+        cur_hid = NULL;
+}
+
+void HID_SelectRemote(THIDINFO *hid_info)
+{
+    cur_hid = hid_info;
+}
+
+int HID_WriteReport(const uint8_t *data)
+{
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+    usb1_remote *ur = static_cast<usb1_remote*>(cur_hid->dev);
+    int err;
+
+    if ((err = take_write_error(ur)))
+        return err;
+
+    /* Get an idle transfer, waiting for one to complete if need be */
+    usb1_transfer *t = NULL;
+    while (!t) {
+        {
+            std::lock_guard<std::mutex> guard(ur->lock);
+            if (ur->num_idle) {
+                t = &ur->pool[ur->idle[--ur->num_idle]];
+                break;
+            }
+            ur->write_done = 0;
+        }
+        if ((err = wait_for(&ur->write_done)))
+            return err;
+    }
+
+    /*
+     * In Windows you send an preceeding 0x00 byte with
+     * every command, and the codebase used to do that, and we'd
+     * skip the first byte here. Now, we do not assume this, we send
+     * wholesale here, and add the 0 in the windows code.
+     */
+    memcpy(t->xfer->buffer, data, cur_hid->orl);
+    if ((err = libusb_submit_transfer(t->xfer))) {
+        debug("Failed to write to device: %s", libusb_error_name(err));
+        std::lock_guard<std::mutex> guard(ur->lock);
+        ur->idle[ur->num_idle++] = t->index;
+        return usb1_error(err);
+    }
+    Stats_Sent(data, cur_hid->orl);
+    Capture_Report(CAPTURE_OUT, data, cur_hid->orl);
+
+    return 0;
+}
+
+int HID_ReadReport(uint8_t *data, unsigned int timeout)
+{
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+    usb1_remote *ur = static_cast<usb1_remote*>(cur_hid->dev);
+    libusb_transfer *xfer = ur->read_xfer;
+    int err;
+
+    /* A failed write means there is nothing coming back */
+    if ((err = take_write_error(ur)))
+        return err;
+
+    ur->read_done = 0;
+    xfer->timeout = timeout;
+    if ((err = libusb_submit_transfer(xfer))) {
+        debug("Failed to read from device: %s", libusb_error_name(err));
+        return usb1_error(err);
+    }
+    if ((err = wait_for(&ur->read_done))) {
+        libusb_cancel_transfer(xfer);
+        wait_for(&ur->read_done);
+        return err;
+    }
+
+    err = transfer_error(xfer->status);
+    if (err == -ETIMEDOUT) {
+        debug("Timeout on interrupt read from device");
+        Stats_Timeout();
+        Capture_Report(CAPTURE_TIMEOUT, NULL, 0);
+        return err;
+    }
+
+    if (err < 0) {
+        debug("Failed to read from device: %d (%s)", err, strerror(-err));
+        return err;
+    }
+
+    memcpy(data, xfer->buffer, xfer->actual_length);
+    Stats_Received(xfer->actual_length);
+    Capture_Report(CAPTURE_IN, data, xfer->actual_length);
+
+    return 0;
+}
+
+#endif
+#endif
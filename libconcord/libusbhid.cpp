@@ -28,9 +28,13 @@
 #define LC_LIBUSB
 
 #include "hid.h"
+#include "transfer_stats.h"
+#include "capture.h"
 #include <usb.h>
 #include <errno.h>
 #include <string.h>
+#include <thread>
+#include <chrono>
 
 /*
  * Harmonies either fall under logitech's VendorID (0x046d), and logitech's
@@ -44,11 +48,15 @@
 #define NATIONAL_VID 0x0400
 #define NATIONAL_PID 0xc359
 
-static usb_dev_handle *h_hid = NULL;
-static unsigned int irl;
-static unsigned int orl;
-static int ep_read = -1;
-static int ep_write = -1;
+/* What we need to talk to one open remote; lives in THIDINFO::dev */
+struct usb_remote {
+    usb_dev_handle *h_hid;
+    int ep_read;
+    int ep_write;
+};
+
+/* The device HID_WriteReport()/HID_ReadReport() use on this thread */
+static thread_local THIDINFO *cur_hid = NULL;
 
 int InitUSB()
 {
@@ -58,12 +66,13 @@ int InitUSB()
 
 void ShutdownUSB()
 {
-    if (h_hid) {
-        usb_release_interface(h_hid,0);
+    if (cur_hid) {
+        CloseRemote(*cur_hid);
     }
 }
 
-void check_ep(usb_endpoint_descriptor &ued)
+void check_ep(usb_endpoint_descriptor &ued, usb_remote &ur,
+              THIDINFO &hid_info)
 {
     debug("address %02X attrib %02X max_length %i",
         ued.bEndpointAddress, ued.bmAttributes,
@@ -72,16 +81,16 @@ void check_ep(usb_endpoint_descriptor &ued)
     if ((ued.bmAttributes & USB_ENDPOINT_TYPE_MASK) ==
         USB_ENDPOINT_TYPE_INTERRUPT) {
         if (ued.bEndpointAddress & USB_ENDPOINT_DIR_MASK) {
-            if (ep_read == -1) {
-                ep_read = ued.bEndpointAddress;
+            if (ur.ep_read == -1) {
+                ur.ep_read = ued.bEndpointAddress;
                 // hack! todo: get from HID report descriptor
-                irl = ued.wMaxPacketSize;
+                hid_info.irl = ued.wMaxPacketSize;
             }
         } else {
-            if (ep_write == -1) {
-                ep_write = ued.bEndpointAddress;
+            if (ur.ep_write == -1) {
+                ur.ep_write = ued.bEndpointAddress;
                 // hack! todo: get from HID report descriptor
-                orl = ued.wMaxPacketSize;
+                hid_info.orl = ued.wMaxPacketSize;
             }
         }
     }
@@ -102,27 +111,94 @@ bool is_harmony(struct usb_device *h_dev)
     return false;
 }
 
+/*
+ * libusb-0.1 has no notion of a device path, so we make one up from the
+ * bus and device names, e.g. "001:005".
+ */
+static string usb_path(struct usb_bus *bus, struct usb_device *h_dev)
+{
+    return string(bus->dirname) + ":" + h_dev->filename;
+}
+
+/*
+ * List every USB device with VendorID == 0x046D ||
+ *    (VendorID == 0x0400 && ProductID == 0xC359)
+ */
+int FindRemotes(vector<THIDINFO> &remotes)
+{
+    usb_find_busses();
+    usb_find_devices();
+
+    for (usb_bus *bus = usb_busses; bus; bus = bus->next) {
+        for (usb_device *h_dev = bus->devices; h_dev; h_dev = h_dev->next) {
+            if (!is_harmony(h_dev))
+                continue;
+
+            THIDINFO hid_info = THIDINFO();
+            hid_info.vid = h_dev->descriptor.idVendor;
+            hid_info.pid = h_dev->descriptor.idProduct;
+            hid_info.ver = h_dev->descriptor.bcdDevice;
+            hid_info.path = usb_path(bus, h_dev);
+            debug("Found a Harmony at %s", hid_info.path.c_str());
+
+            /* Reading the serial requires opening, but not claiming */
+            usb_dev_handle *h_hid;
+            if (h_dev->descriptor.iSerialNumber && (h_hid = usb_open(h_dev))) {
+                char s[128];
+                if (usb_get_string_simple(h_hid,
+                        h_dev->descriptor.iSerialNumber, s, sizeof(s)) > 0)
+                    hid_info.serial = s;
+                usb_close(h_hid);
+            }
+            remotes.push_back(hid_info);
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Find a HID device with VendorID == 0x046D ||
  *    (VendorID == 0x0400 && ProductID == 0xC359)
  */
 int FindRemote(THIDINFO &hid_info)
 {
+    vector<THIDINFO> remotes;
 
-    usb_find_busses();
-    usb_find_devices();
+    FindRemotes(remotes);
+    if (remotes.empty()) {
+        debug("Failed to establish communication with remote: %s",
+              usb_strerror());
+        return LC_ERROR_CONNECT;
+    }
+
+    hid_info = remotes[0];
+    return OpenRemote(hid_info);
+}
+
+/*
+ * libusb-0.1 can't tell us when devices appear, so just wait it out.
+ */
+int HID_WaitForArrival(unsigned int timeout)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+    return -ETIMEDOUT;
+}
 
+/*
+ * Open the remote at hid_info.path
+ */
+int OpenRemote(THIDINFO &hid_info)
+{
     struct usb_device *h_dev = NULL;
-    bool found = false;
-    for (usb_bus *bus = usb_busses; bus && !found; bus = bus->next) {
+    for (usb_bus *bus = usb_busses; bus && !h_dev; bus = bus->next) {
         for (h_dev = bus->devices; h_dev; h_dev = h_dev->next) {
-            if (is_harmony(h_dev)) {
-                found = true;
+            if (is_harmony(h_dev) && usb_path(bus, h_dev) == hid_info.path)
                 break;
-            }
         }
     }
 
+    usb_dev_handle *h_hid = NULL;
     if (h_dev) {
         h_hid = usb_open(h_dev);
     }
@@ -143,7 +219,7 @@ int FindRemote(THIDINFO &hid_info)
      * Don't attempt to do this if this is a usbnet remote as it will
      * unload the zaurus driver, which is not desired.
      */
-    if (!(h_dev && (h_dev->descriptor.idProduct == 0xC11F))) {
+    if (h_dev->descriptor.idProduct != 0xC11F) {
         usb_detach_kernel_driver_np(h_hid, 0);
     }
 #endif
@@ -153,9 +229,15 @@ int FindRemote(THIDINFO &hid_info)
     if ((err=usb_claim_interface(h_hid, 0))) {
         debug("Failed to claim interface: %d (%s)", err,
               usb_strerror());
+        usb_close(h_hid);
         return err;
     }
 
+    usb_remote *ur = new usb_remote;
+    ur->h_hid = h_hid;
+    ur->ep_read = -1;
+    ur->ep_write = -1;
+
     unsigned char maxconf = h_dev->descriptor.bNumConfigurations;
     for (unsigned char j = 0; j < maxconf; ++j) {
         usb_config_descriptor &uc = h_dev->config[j];
@@ -171,13 +253,18 @@ int FindRemote(THIDINFO &hid_info)
                         uid.bNumEndpoints);
                 unsigned char maxep = uid.bNumEndpoints;
                 for (unsigned char n = 0; n < maxep; ++n) {
-                    check_ep(uid.endpoint[n]);
+                    check_ep(uid.endpoint[n], *ur, hid_info);
                 }
             }
         }
     }
 
-    if (ep_read == -1 || ep_write == -1) return 1;
+    hid_info.dev = ur;
+    if (ur->ep_read == -1 || ur->ep_write == -1) {
+        CloseRemote(hid_info);
+        return 1;
+    }
+    HID_SelectRemote(&hid_info);
 
     // Fill in hid_info
 
@@ -191,42 +278,70 @@ int FindRemote(THIDINFO &hid_info)
     hid_info.pid = h_dev->descriptor.idProduct;
     hid_info.ver = h_dev->descriptor.bcdDevice;
 
-    hid_info.irl = irl;
-    hid_info.orl = orl;
     hid_info.frl = 0;/// ???
 
     return 0;
 }
 
+void CloseRemote(THIDINFO &hid_info)
+{
+    usb_remote *ur = static_cast<usb_remote*>(hid_info.dev);
+    if (ur) {
+        usb_release_interface(ur->h_hid, 0);
+        usb_close(ur->h_hid);
+        delete ur;
+        hid_info.dev = NULL;
+    }
+    if (cur_hid == &hid_info)
+        cur_hid = NULL;
+}
+
+void HID_SelectRemote(THIDINFO *hid_info)
+{
+    cur_hid = hid_info;
+}
+
 int HID_WriteReport(const uint8_t *data)
 {
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+    usb_remote *ur = static_cast<usb_remote*>(cur_hid->dev);
+
     /*
      * In Windows you send an preceeding 0x00 byte with
      * every command, and the codebase used to do that, and we'd
      * skip the first byte here. Now, we do not assume this, we send
      * wholesale here, and add the 0 in the windows code.
      */
-    const int err=usb_interrupt_write(h_hid, ep_write,
+    const int err=usb_interrupt_write(ur->h_hid, ur->ep_write,
         reinterpret_cast<char *>(const_cast<uint8_t*>(data)),
-        orl, 500);
+        cur_hid->orl, 500);
 
     if (err < 0) {
         debug("Failed to write to device: %d (%s)", err,
               strerror(-err));
         return err;
     }
+    Stats_Sent(data, cur_hid->orl);
+    Capture_Report(CAPTURE_OUT, data, cur_hid->orl);
 
     return 0;
 }
 
 int HID_ReadReport(uint8_t *data, unsigned int timeout)
 {
+    if (!cur_hid || !cur_hid->dev)
+        return -EBADF;
+    usb_remote *ur = static_cast<usb_remote*>(cur_hid->dev);
+
     /* Note default timeout is set to 500 in hid.h */
-    const int err = usb_interrupt_read(h_hid, ep_read,
-        reinterpret_cast<char *>(data), irl, timeout);
+    const int err = usb_interrupt_read(ur->h_hid, ur->ep_read,
+        reinterpret_cast<char *>(data), cur_hid->irl, timeout);
 
     if (err == -ETIMEDOUT) {
         debug("Timeout on interrupt read from device");
+        Stats_Timeout();
+        Capture_Report(CAPTURE_TIMEOUT, NULL, 0);
         return err;
     }
 
@@ -235,6 +350,8 @@ int HID_ReadReport(uint8_t *data, unsigned int timeout)
               usb_strerror());
         return err;
     }
+    Stats_Received(err);
+    Capture_Report(CAPTURE_IN, data, err);
 
     return 0;
 }
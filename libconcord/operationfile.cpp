@@ -22,6 +22,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <zip.h>
 #include <string>
 
@@ -34,24 +35,42 @@
 static const char *FW_URL =
     "EasyZapper/New/ProcUpgradeFirmware/Upgrade_Receive_Complete.asp";
 
+/*
+ * Split a plain config file into its XML and the binary after it, and index
+ * the XML part (all of it if there is no binary).
+ */
 int find_config_binary(uint8_t *config, uint32_t config_size,
-    uint8_t **binary_ptr, uint32_t *binary_size)
+    uint8_t **binary_ptr, uint32_t *binary_size, XmlIndex &index)
 {
     int err;
 
     err = GetTag("/INFORMATION", config, config_size, *binary_ptr);
-    if (err == -1)
+    if (err == -1) {
+        index.Build(config, config_size);
         return LC_ERROR;
+    }
+
+    /*
+     * The binary starts after the CR LF following the tag. A file that
+     * ends before them (say one with no binary) is all XML.
+     */
+    if (*binary_ptr + 2 > config + config_size) {
+        *binary_ptr = NULL;
+        *binary_size = 0;
+        index.Build(config, config_size);
+        return LC_ERROR;
+    }
 
     *binary_ptr += 2;
     *binary_size = config_size - (*binary_ptr - config);
 
     // Limit tag searches to XML portion
     config_size -= *binary_size;
+    index.Build(config, config_size);
 
     string binary_tag_size_s;
     uint8_t *n = 0;
-    err = GetTag("BINARYDATASIZE", config, config_size, n, &binary_tag_size_s);
+    err = index.GetTag("BINARYDATASIZE", n, &binary_tag_size_s);
     if (err == -1)
         return LC_ERROR;
     uint32_t binary_tag_size = (uint32_t)atoi(binary_tag_size_s.c_str());
@@ -65,7 +84,7 @@ int find_config_binary(uint8_t *config, uint32_t config_size,
     }
 
     string s;
-    err = GetTag("CHECKSUM", config, config_size, n, &s);
+    err = index.GetTag("CHECKSUM", n, &s);
     if (err != 0)
         return err;
     const uint8_t checksum = atoi(s.c_str());
@@ -118,6 +137,8 @@ int OperationFile::ReadZipFile(char *file_name)
         zip_fclose(file);
     }
     zip_close(zip);
+    if (xml)
+        xml_index.Build(xml, xml_size);
     return 0;
 }
 
@@ -143,7 +164,7 @@ int OperationFile::ReadPlainFile(char *file_name)
 
     debug("finding binary bit...");
     /* Find the config part */
-    find_config_binary(out, size, &data, &data_size);
+    find_config_binary(out, size, &data, &data_size, xml_index);
 
     xml = out;
     xml_size = size - data_size;
@@ -154,7 +175,7 @@ int OperationFile::ReadPlainFile(char *file_name)
 OperationFile::OperationFile()
 {
     data_size = xml_size = 0;
-    data = xml = NULL;
+    data = xml = phase_data = NULL;
     data_alloc = false;
 }
 
@@ -168,62 +189,109 @@ OperationFile::~OperationFile()
      */
     if (data && data_alloc)
         delete data;
+    if (phase_data)
+        delete[] phase_data;
     if (xml)
         delete xml;
 }
 
-int _convert_to_binary(string hex, uint8_t *&ptr)
+static inline int hex_nibble(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * Decode len hex digits straight into out, which has room for out_size
+ * bytes, skipping whitespace. Sets written to the number of bytes decoded.
+ */
+static int decode_hex(const uint8_t *hex, uint32_t len, uint8_t *out,
+                      uint32_t out_size, uint32_t &written)
 {
-    size_t size = hex.length();
-    for (size_t i = 0; i < size; i += 2) {
-        char tmp[6];
-        sprintf(tmp, "0x%s ", hex.substr(i, 2).c_str());
-        ptr[0] = (uint8_t)strtoul(tmp, NULL, 16);
-        ptr++;
+    const uint8_t *end = hex + len;
+    written = 0;
+
+    while (hex < end) {
+        if (isspace(*hex)) {
+            hex++;
+            continue;
+        }
+        if (end - hex < 2 || written == out_size)
+            return LC_ERROR;
+        const int hi = hex_nibble(hex[0]);
+        const int lo = hex_nibble(hex[1]);
+        if (hi < 0 || lo < 0)
+            return LC_ERROR;
+        out[written++] = (hi << 4) | lo;
+        hex += 2;
     }
+
     return 0;
 }
 
 int OperationFile::_ExtractFirmwareBinary()
 {
     debug("extracting firmware binary");
-    uint32_t o_size = FIRMWARE_MAX_SIZE;
-    data = new uint8_t[o_size];
-    data_alloc = true;
-    uint8_t *o = data;
-
-    uint8_t *x = xml;
-    uint8_t *x_new;
-    uint32_t x_size = xml_size;
+    uint8_t *const xml_end = xml + xml_size;
 
     /*
      * Some remotes (e.g., Arch 7) contain multiple phases in their
-     * firmware update files.  In that case, extract only the first phase.
+     * firmware update files, each with its own TYPE and DATA. Files
+     * without PHASE tags are a single phase.
      */
-    if (GetTag("PHASE", x, x_size, x_new) == 0) {
-        debug("multi-phase firmware found, extracting 1st phase");
-        x_size = x_size - (x_new - x);
-        x = x_new;
-        uint8_t *phase_end;
-        GetTag("/PHASE", x, x_size, phase_end);
-        x_size = phase_end - x;
+    vector<uint8_t*> phase_begin;
+    vector<uint8_t*> phase_end;
+    uint8_t *x = xml;
+    uint8_t *x_new;
+    while (xml_index.GetTag("PHASE", x, xml_end - x, x_new) == 0) {
+        phase_begin.push_back(x_new);
+        if (xml_index.GetTag("/PHASE", x_new, xml_end - x_new, x))
+            x = xml_end;
+        phase_end.push_back(x);
     }
-
-    string hex;
-    while (GetTag("DATA", x, x_size, x_new, &hex) == 0) {
-        uint32_t hex_size = hex.length() / 2;
-        if (hex_size > o_size) {
-            return LC_ERROR;
+    if (phase_begin.empty()) {
+        phase_begin.push_back(xml);
+        phase_end.push_back(xml_end);
+    }
+    debug("%u firmware phase(s)", (unsigned int)phase_begin.size());
+
+    phase_data = new uint8_t[phase_begin.size() * FIRMWARE_MAX_SIZE];
+    for (unsigned int i = 0; i < phase_begin.size(); i++) {
+        TFirmwarePhase phase;
+        phase.data = phase_data + i * FIRMWARE_MAX_SIZE;
+        phase.size = 0;
+
+        uint8_t *tag;
+        xml_index.GetTag("TYPE", phase_begin[i], phase_end[i] - phase_begin[i],
+                         tag, &phase.type);
+
+        uint8_t *hex;
+        uint32_t hex_len;
+        x = phase_begin[i];
+        while (xml_index.GetTagContent("DATA", x, phase_end[i] - x, hex,
+                                       hex_len) == 0) {
+            uint32_t n;
+            if (decode_hex(hex, hex_len, phase.data + phase.size,
+                           FIRMWARE_MAX_SIZE - phase.size, n)) {
+                debug("bad DATA in firmware phase %u", i);
+                return LC_ERROR;
+            }
+            phase.size += n;
+            x = hex + hex_len;
         }
-
-        _convert_to_binary(hex, o);
-
-        x_size = x_size - (x_new - x);
-        x = x_new;
-        o_size -= hex_size;
+        debug("phase %u: type %s, %u bytes", i, phase.type.c_str(),
+              phase.size);
+        phases.push_back(phase);
     }
 
-    data_size = o - data;
+    /* the first phase is what we write, as it always has been */
+    data = phases[0].data;
+    data_size = phases[0].size;
+    data_alloc = false;
     debug("acquired firmware binary");
 
     return 0;
@@ -266,13 +334,13 @@ int OperationFile::ReadAndParseOpFile(char *file_name, int *type)
         start_info_ptr = xml;
         end_info_ptr = xml + xml_size;
     } else {
-        err = GetTag("INFORMATION", xml, xml_size, start_info_ptr);
+        err = xml_index.GetTag("INFORMATION", start_info_ptr);
         debug("err is %d", err);
         if (err == -1) {
             debug("Unable to find INFORMATION tag");
             return LC_ERROR;
         }
-        err = GetTag("/INFORMATION", xml, xml_size, end_info_ptr);
+        err = xml_index.GetTag("/INFORMATION", end_info_ptr);
         if (err == -1) {
             debug("Unable to find /INFORMATION tag");
             return LC_ERROR;
@@ -289,7 +357,7 @@ int OperationFile::ReadAndParseOpFile(char *file_name, int *type)
     while (1) {
         uint8_t *tag_ptr;
         string tag_s;
-        err = GetTag("KEY", tmp_data, tmp_size, tag_ptr, &tag_s);
+        err = xml_index.GetTag("KEY", tmp_data, tmp_size, tag_ptr, &tag_s);
         if (err == -1) {
             debug("not a connectivity test file");
             break;
@@ -318,9 +386,10 @@ int OperationFile::ReadAndParseOpFile(char *file_name, int *type)
          * Unless we created them, which is what the DATA check
          * is for.
          */
-        err = GetTag("TYPE", tmp_data, tmp_size, tag_ptr, &tag_s);
+        err = xml_index.GetTag("TYPE", tmp_data, tmp_size, tag_ptr, &tag_s);
         if (err == -1) {
-            err = GetTag("PATH", tmp_data, tmp_size, tag_ptr, &tag_s);
+            err = xml_index.GetTag("PATH", tmp_data, tmp_size, tag_ptr,
+                                   &tag_s);
             if (err == -1) {
                 debug("not a firmware file");
                 break;
@@ -339,14 +408,14 @@ int OperationFile::ReadAndParseOpFile(char *file_name, int *type)
         tmp_size = end_info_ptr - tmp_data;
     }
 
-    if (found_firmware)
-        _ExtractFirmwareBinary();
+    if (found_firmware && _ExtractFirmwareBinary())
+        return LC_ERROR;
 
     /*
      * Search for tag only in "IR learning files.
      */
     uint8_t *tag_ptr;
-    err = GetTag("CHECKKEYS", xml, xml_size, tag_ptr);
+    err = xml_index.GetTag("CHECKKEYS", tag_ptr);
     bool found_learn_ir = (err != -1);
 
     debug("zaps: %d, binary: %d, firmware: %d, ir: %d",
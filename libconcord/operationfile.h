@@ -22,6 +22,14 @@
 #define OPERATIONFILE_H
 
 #include "lc_internal.h"
+#include "web.h"
+
+/* One PHASE of a firmware file, decoded */
+struct TFirmwarePhase {
+    string type;
+    uint8_t *data;
+    uint32_t size;
+};
 
 class OperationFile {
 private:
@@ -30,6 +38,10 @@ private:
     bool data_alloc;
     uint8_t *xml;
     uint32_t xml_size;
+    XmlIndex xml_index;
+    /* the decoded firmware phases, data points at the one we write */
+    uint8_t *phase_data;
+    vector<TFirmwarePhase> phases;
     int ReadPlainFile(char *file_name);
     int ReadZipFile(char *file_name);
     int _ExtractFirmwareBinary();
@@ -41,6 +53,7 @@ public:
     uint32_t GetXmlSize() {return xml_size;}
     uint8_t* GetData() {return data;}
     uint8_t* GetXml() {return xml;}
+    const XmlIndex &GetXmlIndex() {return xml_index;}
     int ReadAndParseOpFile(char *file_name, int *type);
 };
 
@@ -0,0 +1,461 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright Phil Dibowitz 2007
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <vector>
+#include "libconcord.h"
+#include "lc_internal.h"
+#include "remote.h"
+#include "profile.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+#endif
+
+#define CHUNK_PROFILE_FILE "chunk_sizes"
+#define IDENTITY_CACHE_FILE "identities"
+#define UPLOAD_JOURNAL_FILE "journal"
+
+/* Several sessions may save at once */
+static std::mutex profile_mutex;
+
+static int make_dir(const string &path)
+{
+#ifdef _WIN32
+    int err = _mkdir(path.c_str());
+#else
+    int err = mkdir(path.c_str(), 0755);
+#endif
+    if (err && errno != EEXIST)
+        return LC_ERROR_OS_FILE;
+    return 0;
+}
+
+string StateFilePath(const char *name)
+{
+    string dir;
+    const char *env;
+
+#ifdef _WIN32
+    if (!(env = getenv("APPDATA")))
+        return "";
+    dir = env;
+#else
+    if ((env = getenv("XDG_CONFIG_HOME")) && *env) {
+        dir = env;
+    } else if ((env = getenv("HOME"))) {
+        dir = string(env) + PATH_SEP + ".config";
+        make_dir(dir);
+    } else {
+        return "";
+    }
+#endif
+    dir += PATH_SEP "libconcord";
+    if (make_dir(dir)) {
+        debug("Can't create %s", dir.c_str());
+        return "";
+    }
+
+    return dir + PATH_SEP + name;
+}
+
+/*
+ * Write a new file and move it into place, so readers never see half of it.
+ */
+static int write_state_file(const string &path, const string &contents)
+{
+    string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return LC_ERROR_OS_FILE;
+    if (fwrite(contents.data(), 1, contents.size(), f) != contents.size()) {
+        fclose(f);
+        remove(tmp.c_str());
+        return LC_ERROR_OS_FILE;
+    }
+    if (fclose(f)) {
+        remove(tmp.c_str());
+        return LC_ERROR_OS_FILE;
+    }
+#ifdef _WIN32
+    /* rename() won't replace an existing file on Windows */
+    remove(path.c_str());
+#endif
+    if (rename(tmp.c_str(), path.c_str())) {
+        remove(tmp.c_str());
+        return LC_ERROR_OS_FILE;
+    }
+
+    return 0;
+}
+
+/*
+ * The profile is a text file with one line per kind of remote:
+ *
+ *   <arch> <flash mfg> <flash id> <read chunk len> <write chunk len>
+ *
+ * Lines starting with # are ignored, so it can be annotated or edited by
+ * hand - e.g. to try a larger write size, which we don't calibrate.
+ */
+struct TChunkProfileLine {
+    unsigned int arch;
+    unsigned int flash_mfg;
+    unsigned int flash_id;
+    TChunkProfile profile;
+};
+
+static void read_profile(const string &path, vector<TChunkProfileLine> &lines)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    char buf[256];
+
+    if (!f)
+        return;
+    while (fgets(buf, sizeof(buf), f)) {
+        TChunkProfileLine l;
+        if (buf[0] == '#')
+            continue;
+        if (sscanf(buf, "%u %x %x %u %u", &l.arch, &l.flash_mfg,
+                   &l.flash_id, &l.profile.read_chunk_len,
+                   &l.profile.write_chunk_len) == 5)
+            lines.push_back(l);
+    }
+    fclose(f);
+}
+
+int LoadChunkProfile(uint16_t arch, uint8_t flash_mfg, uint8_t flash_id,
+                     TChunkProfile &profile)
+{
+    vector<TChunkProfileLine> lines;
+    string path = StateFilePath(CHUNK_PROFILE_FILE);
+
+    if (path.empty())
+        return LC_ERROR_OS_FILE;
+
+    read_profile(path, lines);
+    for (unsigned int i = 0; i < lines.size(); i++) {
+        if (lines[i].arch == arch && lines[i].flash_mfg == flash_mfg &&
+            lines[i].flash_id == flash_id) {
+            profile = lines[i].profile;
+            return 0;
+        }
+    }
+
+    return LC_ERROR;
+}
+
+int SaveChunkProfile(uint16_t arch, uint8_t flash_mfg, uint8_t flash_id,
+                     const TChunkProfile &profile)
+{
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    vector<TChunkProfileLine> lines;
+    string path = StateFilePath(CHUNK_PROFILE_FILE);
+    bool found = false;
+
+    if (path.empty())
+        return LC_ERROR_OS_FILE;
+
+    read_profile(path, lines);
+    for (unsigned int i = 0; i < lines.size(); i++) {
+        if (lines[i].arch == arch && lines[i].flash_mfg == flash_mfg &&
+            lines[i].flash_id == flash_id) {
+            lines[i].profile = profile;
+            found = true;
+        }
+    }
+    if (!found) {
+        TChunkProfileLine l = { arch, flash_mfg, flash_id, profile };
+        lines.push_back(l);
+    }
+
+    string contents =
+        "# libconcord flash chunk sizes, see lc_calibrate_chunk_sizes()\n"
+        "# arch flash_mfg flash_id read_chunk_len write_chunk_len\n";
+    for (unsigned int i = 0; i < lines.size(); i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%u %02X %02X %u %u\n", lines[i].arch,
+                 lines[i].flash_mfg, lines[i].flash_id,
+                 lines[i].profile.read_chunk_len,
+                 lines[i].profile.write_chunk_len);
+        contents += buf;
+    }
+
+    return write_state_file(path, contents);
+}
+
+/*
+ * The identity cache is a text file with one line per unit:
+ *
+ *   <key> <fw major> <fw minor> <hw major> <hw minor> <hw micro> <fw type>
+ *   <flash mfg> <flash id> <arch> <skin> <protocol> <config bytes used>
+ *   <serial1> <serial2> <serial3> <home id> <node id> <tid>
+ *   <region count> <region id>:<region version>... <xml user rf setting>
+ *
+ * all on one line. The key, tid and XML are hex-encoded so they can't
+ * contain spaces; a missing string is written as "-".
+ */
+static string hex_encode(const char *str)
+{
+    string hex;
+    char buf[3];
+
+    if (!str)
+        return "-";
+    for (; *str; str++) {
+        snprintf(buf, sizeof(buf), "%02X", (unsigned char)*str);
+        hex += buf;
+    }
+    return hex.empty() ? "-" : hex;
+}
+
+static char *hex_decode(const string &hex)
+{
+    if (hex == "-")
+        return NULL;
+
+    char *str = new char[hex.size() / 2 + 1];
+    unsigned int i;
+    for (i = 0; i + 1 < hex.size(); i += 2) {
+        unsigned int c;
+        sscanf(hex.c_str() + i, "%2x", &c);
+        str[i / 2] = c;
+    }
+    str[i / 2] = '\0';
+    return str;
+}
+
+static void split_words(const string &line, vector<string> &words)
+{
+    string::size_type start = 0;
+
+    while (start < line.size()) {
+        string::size_type end = line.find(' ', start);
+        if (end == string::npos)
+            end = line.size();
+        if (end > start)
+            words.push_back(line.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+/* lines of unlimited length, without their newlines */
+static void read_lines(const string &path, vector<string> &lines)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    char buf[1024];
+    string line;
+
+    if (!f)
+        return;
+    while (fgets(buf, sizeof(buf), f)) {
+        line += buf;
+        if (line[line.size() - 1] != '\n')
+            continue;
+        line.erase(line.size() - 1);
+        lines.push_back(line);
+        line.clear();
+    }
+    if (!line.empty())
+        lines.push_back(line);
+    fclose(f);
+}
+
+static string identity_line(const string &key, const TRemoteInfo &ri)
+{
+    char buf[512];
+    string line = hex_encode(key.c_str());
+
+    snprintf(buf, sizeof(buf), " %u %u %u %u %u %u %u %u %u %u %u %u"
+             " %s %s %s %u %u %s %u", ri.fw_ver_major, ri.fw_ver_minor,
+             ri.hw_ver_major, ri.hw_ver_minor, ri.hw_ver_micro, ri.fw_type,
+             ri.flash_mfg, ri.flash_id, ri.architecture, ri.skin,
+             ri.protocol, ri.config_bytes_used,
+             ri.serial1 ? ri.serial1 : "-", ri.serial2 ? ri.serial2 : "-",
+             ri.serial3 ? ri.serial3 : "-", ri.home_id, ri.node_id,
+             hex_encode(ri.tid).c_str(), ri.region_ids ? ri.num_regions : 0);
+    line += buf;
+    for (unsigned int i = 0; ri.region_ids && i < ri.num_regions; i++) {
+        snprintf(buf, sizeof(buf), " %u:%s", ri.region_ids[i],
+                 ri.region_versions[i]);
+        line += buf;
+    }
+    line += " " + hex_encode(ri.xml_user_rf_setting);
+
+    return line;
+}
+
+int LoadIdentity(const string &key, TRemoteInfo &ri)
+{
+    vector<string> lines;
+    string path = StateFilePath(IDENTITY_CACHE_FILE);
+    string hkey = hex_encode(key.c_str());
+
+    if (path.empty())
+        return LC_ERROR_OS_FILE;
+
+    read_lines(path, lines);
+    for (unsigned int i = 0; i < lines.size(); i++) {
+        vector<string> w;
+        split_words(lines[i], w);
+        if (w.size() < 21 || w[0] != hkey)
+            continue;
+
+        const unsigned int num_regions = atoi(w[19].c_str());
+        if (w.size() != 21 + num_regions)
+            continue;
+
+        /* only good while the remote says what it said last time */
+        const unsigned int ids[12] = { ri.fw_ver_major, ri.fw_ver_minor,
+            ri.hw_ver_major, ri.hw_ver_minor, ri.hw_ver_micro, ri.fw_type,
+            ri.flash_mfg, ri.flash_id, ri.architecture, ri.skin,
+            ri.protocol, ri.config_bytes_used };
+        unsigned int n;
+        for (n = 0; n < 12; n++) {
+            if (strtoul(w[n + 1].c_str(), NULL, 10) != ids[n])
+                break;
+        }
+        if (n < 12) {
+            debug("Cached identity for %s is stale", key.c_str());
+            return LC_ERROR;
+        }
+
+        ri.serial1 = strdup(w[13].c_str());
+        ri.serial2 = strdup(w[14].c_str());
+        ri.serial3 = strdup(w[15].c_str());
+        ri.home_id = strtoul(w[16].c_str(), NULL, 10);
+        ri.node_id = atoi(w[17].c_str());
+        ri.tid = hex_decode(w[18]);
+        ri.num_regions = num_regions;
+        ri.region_ids = NULL;
+        ri.region_versions = NULL;
+        if (num_regions) {
+            ri.region_ids = new uint8_t[num_regions];
+            ri.region_versions = new char*[num_regions];
+        }
+        for (n = 0; n < num_regions; n++) {
+            const string &r = w[20 + n];
+            string::size_type colon = r.find(':');
+            ri.region_ids[n] = atoi(r.c_str());
+            ri.region_versions[n] = new char[8];
+            snprintf(ri.region_versions[n], 8, "%s",
+                     colon == string::npos ? "" : r.c_str() + colon + 1);
+        }
+        ri.xml_user_rf_setting = hex_decode(w[20 + num_regions]);
+
+        return 0;
+    }
+
+    return LC_ERROR;
+}
+
+/*
+ * Rewrite a file of lines keyed by their first (hex-encoded) word, dropping
+ * comments and any line for key, and adding line unless it's empty.
+ */
+static int replace_keyed_line(const char *file, const char *header,
+                              const string &key, const string &line)
+{
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    vector<string> lines;
+    string path = StateFilePath(file);
+    string hkey = hex_encode(key.c_str()) + " ";
+
+    if (path.empty())
+        return LC_ERROR_OS_FILE;
+
+    read_lines(path, lines);
+    string contents = header;
+    for (unsigned int i = 0; i < lines.size(); i++) {
+        if (lines[i].empty() || lines[i][0] == '#' ||
+            !lines[i].compare(0, hkey.size(), hkey))
+            continue;
+        contents += lines[i] + "\n";
+    }
+    if (!line.empty())
+        contents += line + "\n";
+
+    return write_state_file(path, contents);
+}
+
+int SaveIdentity(const string &key, const TRemoteInfo &ri)
+{
+    return replace_keyed_line(IDENTITY_CACHE_FILE,
+                              "# libconcord identity cache, safe to delete\n",
+                              key, identity_line(key, ri));
+}
+
+/*
+ * The upload journal has one line per interrupted upload:
+ *
+ *   <key> <addr> <size> <image hash> <sector states>
+ *
+ * with one character per sector in the sector states, see TUploadJournal.
+ */
+#define JOURNAL_HEADER "# libconcord upload journal, safe to delete\n"
+
+int LoadJournal(const string &key, TUploadJournal &journal)
+{
+    vector<string> lines;
+    string path = StateFilePath(UPLOAD_JOURNAL_FILE);
+    string hkey = hex_encode(key.c_str());
+
+    if (path.empty())
+        return LC_ERROR_OS_FILE;
+
+    read_lines(path, lines);
+    for (unsigned int i = 0; i < lines.size(); i++) {
+        vector<string> w;
+        split_words(lines[i], w);
+        if (w.size() != 5 || w[0] != hkey)
+            continue;
+
+        journal.addr = strtoul(w[1].c_str(), NULL, 16);
+        journal.size = strtoul(w[2].c_str(), NULL, 10);
+        journal.hash = strtoull(w[3].c_str(), NULL, 16);
+        journal.sectors = w[4];
+        return 0;
+    }
+
+    return LC_ERROR;
+}
+
+int SaveJournal(const string &key, const TUploadJournal &journal)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), " %06X %u %016llX ", journal.addr,
+             journal.size, (unsigned long long)journal.hash);
+    return replace_keyed_line(UPLOAD_JOURNAL_FILE, JOURNAL_HEADER, key,
+                              hex_encode(key.c_str()) + buf +
+                              journal.sectors);
+}
+
+int ClearJournal(const string &key)
+{
+    return replace_keyed_line(UPLOAD_JOURNAL_FILE, JOURNAL_HEADER, key, "");
+}
@@ -0,0 +1,77 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright Phil Dibowitz 2007
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "lc_internal.h"
+
+/*
+ * Where libconcord keeps what it learns about remotes between runs:
+ * $XDG_CONFIG_HOME/libconcord (~/.config/libconcord) or, on Windows,
+ * %APPDATA%\libconcord. Returns the full path of the file name in there,
+ * creating the directory if need be, or an empty string if there is no
+ * such place.
+ */
+string StateFilePath(const char *name);
+
+/*
+ * The flash transfer sizes that work best for one kind of remote, as found
+ * by lc_calibrate_chunk_sizes(). 0 means use the protocol's default.
+ */
+struct TChunkProfile {
+    unsigned int read_chunk_len;
+    unsigned int write_chunk_len;
+};
+
+int LoadChunkProfile(uint16_t arch, uint8_t flash_mfg, uint8_t flash_id,
+                     TChunkProfile &profile);
+int SaveChunkProfile(uint16_t arch, uint8_t flash_mfg, uint8_t flash_id,
+                     const TChunkProfile &profile);
+
+/*
+ * What GetIdentity() learnt about one unit, so it needn't ask again. 'key'
+ * must name the unit uniquely (e.g. its USB path and serial, or its GUID).
+ * LoadIdentity() only uses the entry if the version, flash and config size
+ * fields already in 'ri' - the cheap part of the identity - match what was
+ * saved; it then fills in the serials and the usbnet-only fields.
+ */
+struct TRemoteInfo;
+int LoadIdentity(const string &key, TRemoteInfo &ri);
+int SaveIdentity(const string &key, const TRemoteInfo &ri);
+
+/*
+ * How far an upload of an image to flash got, so an interrupted one can be
+ * picked up again. 'sectors' has one character per flash sector the image
+ * covers: '.' untouched, 'E' erased, 'W' written, 'V' verified. The entry
+ * is only good for an image of the same address, size and hash.
+ */
+struct TUploadJournal {
+    uint32_t addr;
+    uint32_t size;
+    uint64_t hash;
+    string sectors;
+};
+
+int LoadJournal(const string &key, TUploadJournal &journal);
+int SaveJournal(const string &key, const TUploadJournal &journal);
+int ClearJournal(const string &key);
+
+#endif
@@ -23,12 +23,16 @@
 
 #include <string.h>
 #include <errno.h>
+#include <chrono>
+#include <vector>
 
 #include "libconcord.h"
 #include "lc_internal.h"
 #include "hid.h"
 #include "protocol.h"
 #include "remote_info.h"
+#include "profile.h"
+#include "transfer_stats.h"
 
 #define GUID_STR \
   "{%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X}"
@@ -50,29 +54,27 @@ void setup_ri_pointers(TRemoteInfo &ri)
             ? &ModelList[ri.skin] : &ModelList[max_model];
 }
 
-void make_guid(const uint8_t * const in, char*&out)
+void make_guid(const uint8_t * const in, char*&out, bool swap)
 {
     char x[48];
-    // Non-HID remotes (ZWave-HID, ZWave-USBNet, MH) as well as Arch 14 seem
-    // to use a more normal byte ordering for serial #'s.
-    if (is_z_remote() || is_mh_remote() || (get_arch() == 14)) {
-        sprintf(x, GUID_STR, in[0], in[1], in[2], in[3], in[4], in[5], in[6],
-                in[7], in[8], in[9], in[10], in[11], in[12], in[13], in[14],
+    if (swap) {
+        sprintf(x, GUID_STR, in[3], in[2], in[1], in[0], in[5], in[4], in[7],
+                in[6], in[8], in[9], in[10], in[11], in[12], in[13], in[14],
                 in[15]);
     }
     else {
-        sprintf(x, GUID_STR, in[3], in[2], in[1], in[0], in[5], in[4], in[7],
-                in[6], in[8], in[9], in[10], in[11], in[12], in[13], in[14],
+        sprintf(x, GUID_STR, in[0], in[1], in[2], in[3], in[4], in[5], in[6],
+                in[7], in[8], in[9], in[10], in[11], in[12], in[13], in[14],
                 in[15]);
     }
     out = strdup(x);
 }
 
-void make_serial(uint8_t *ser, TRemoteInfo &ri)
+void make_serial(uint8_t *ser, TRemoteInfo &ri, bool swap)
 {
-    make_guid(ser, ri.serial1);
-    make_guid(ser+16, ri.serial2);
-    make_guid(ser+32, ri.serial3);
+    make_guid(ser, ri.serial1, swap);
+    make_guid(ser+16, ri.serial2, swap);
+    make_guid(ser+32, ri.serial3, swap);
 }
 
 int CRemote::Reset(uint8_t kind)
@@ -147,9 +149,14 @@ int CRemote::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
 
     setup_ri_pointers(ri);
 
-    uint8_t rd[1024];
-    if ((err=ReadFlash(ri.arch->config_base, 1024, rd, ri.protocol, false))) {
-        debug("Error reading first k of config data");
+    /* all we need from the config is its cookie and end vector */
+    uint8_t rd[8];
+    uint32_t hdr_len = ri.arch->end_vector + 3;
+    if (hdr_len < 4)
+        hdr_len = 4;
+    if ((err=ReadFlash(ri.arch->config_base, hdr_len, rd, ri.protocol,
+                       false))) {
+        debug("Error reading config header");
         return LC_ERROR_READ;
     }
     if (cb) {
@@ -180,6 +187,24 @@ int CRemote::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         ri.max_config_size = 1;
     }
 
+    /*
+     * Units that report a USB serial can be told apart without reading
+     * ours, so if we've seen this one before with the same firmware and
+     * config header we can take the serial from the cache. Without a USB
+     * serial two identically-configured units could pass for each other.
+     */
+    string cache_key;
+    if (!hid.serial.empty())
+        cache_key = "hid " + hid.path + " " + hid.serial;
+    if (!cache_key.empty() && !LoadIdentity(cache_key, ri)) {
+        debug("Using cached identity");
+        if (cb) {
+            cb(cb_stage, cb_count++, 2, 2, LC_CB_COUNTER_TYPE_STEPS, cb_arg,
+               NULL);
+        }
+        return 0;
+    }
+
     // read serial (see specs/protocol.txt for details)
     switch (ri.arch->serial_location) {
     case SERIAL_LOCATION_EEPROM:
@@ -202,17 +227,35 @@ int CRemote::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         cb(cb_stage, cb_count++, 2, 2, LC_CB_COUNTER_TYPE_STEPS, cb_arg, NULL);
     }
 
-    make_serial(rsp, ri);
+    /*
+     * Non-HID remotes (ZWave-HID, ZWave-USBNet, MH) as well as Arch 14 seem
+     * to use a more normal byte ordering for serial #'s.
+     */
+    make_serial(rsp, ri, ri.architecture != 14);
+
+    if (!cache_key.empty())
+        SaveIdentity(cache_key, ri);
 
     return 0;
 }
 
+/*
+ * The setup commands carry the length in 16 bits.
+ */
+void CRemote::SetChunkSizes(unsigned int read_len, unsigned int write_len)
+{
+    read_chunk_len = read_len > 0xFFFF ? 0xFFFF : read_len;
+    write_chunk_len = write_len > 0xFFFF ? 0xFFFF : write_len;
+}
+
 int CRemote::ReadFlash(uint32_t addr, const uint32_t len, uint8_t *rd,
                        unsigned int protocol, bool verify, lc_callback cb,
                        void *cb_arg, uint32_t cb_stage)
 {
     uint32_t cb_count = 0;
-    const unsigned int max_chunk_len = protocol == 0 ? 700 : 1022;
+    unsigned int max_chunk_len = protocol == 0 ? 700 : 1022;
+    if (read_chunk_len)
+        max_chunk_len = read_chunk_len;
 
     /*
      * This is a mapping of the lower-half of the first command byte to
@@ -234,7 +277,7 @@ int CRemote::ReadFlash(uint32_t addr, const uint32_t len, uint8_t *rd,
     int err = 0;
 
     do {
-        static uint8_t cmd[64] = {0};
+        uint8_t cmd[64] = {0};
         cmd[0] = COMMAND_READ_FLASH | 0x05;
         cmd[1] = (addr >> 16) & 0xFF;
         cmd[2] = (addr >> 8) & 0xFF;
@@ -265,8 +308,10 @@ int CRemote::ReadFlash(uint32_t addr, const uint32_t len, uint8_t *rd,
                     break;
                 }
                 seq += 0x11;
-                const unsigned int rxlen =
-                    rxlenmap[rsp[0] & LENGTH_MASK];
+                /* a report can carry more than is left to read */
+                unsigned int rxlen = rxlenmap[rsp[0] & LENGTH_MASK];
+                if (rxlen > end - addr)
+                    rxlen = end - addr;
                 if (rxlen) {
                     if (verify) {
                         if (memcmp(pr, rsp+2, rxlen)) {
@@ -359,7 +404,7 @@ int CRemote::EraseFlash(uint32_t addr, uint32_t len,  const TRemoteInfo &ri,
     uint32_t sector_end = sectors[n] + flash_base;
 
     for (uint32_t i = 0; i < num_sectors; i++) {
-        static uint8_t erase_cmd[64] = {0};
+        uint8_t erase_cmd[64] = {0};
         erase_cmd[0] = COMMAND_ERASE_FLASH;
         erase_cmd[1] = (sector_begin >> 16) & 0xFF;
         erase_cmd[2] = (sector_begin >> 8) & 0xFF;
@@ -547,89 +592,247 @@ int CRemote::ReadRam(uint32_t addr, const uint32_t len, uint8_t *rd)
     return ReadMiscByte(addr, len, COMMAND_MISC_RAM, rd);
 }
 
-int CRemote::WriteFlash(uint32_t addr, const uint32_t len, const uint8_t *wr,
-    unsigned int protocol, lc_callback cb, void *cb_arg, uint32_t cb_stage)
+/*
+ * Encode one WriteFlash chunk - the setup report, the data reports and the
+ * end report - into reports, 64 bytes each. Returns the number of bytes of
+ * wr the chunk covers.
+ */
+static uint32_t encode_flash_chunk(uint32_t addr, uint32_t chunk_len,
+                                   const uint8_t *pw, unsigned int protocol,
+                                   vector<uint8_t> &reports)
 {
-    uint32_t cb_count = 0;
-    const unsigned int max_chunk_len = protocol == 0 ? 749 : 3150;
-
     /* mapping of lenghts - see specs/protocol.txt */
     static const unsigned int txlenmap0[] = { 0x07, 7, 6, 5, 4, 3, 2, 1 };
     static const unsigned int txlenmapx[] =
         { 0x0A, 63, 31, 15, 7, 6, 5, 4, 3, 2, 1 };
     const unsigned int *txlenmap = protocol ? txlenmapx : txlenmap0;
+    const uint32_t total = chunk_len;
+
+    reports.clear();
+    reports.resize(64);
+    uint8_t *write_setup_cmd = &reports[0];
+    write_setup_cmd[0] = COMMAND_WRITE_FLASH | 0x05;
+    write_setup_cmd[1] = (addr >> 16) & 0xFF;
+    write_setup_cmd[2] = (addr >> 8) & 0xFF;
+    write_setup_cmd[3] = addr & 0xFF;
+    write_setup_cmd[4] = (chunk_len >> 8) & 0xFF;
+    write_setup_cmd[5] = chunk_len & 0xFF;
+
+    while (chunk_len) {
+        unsigned int n = txlenmap[0];
+        unsigned int i = 1;
+        while (chunk_len < txlenmap[i]) {
+            ++i;
+            --n;
+        }
+        unsigned int block_len = txlenmap[i];
+        reports.resize(reports.size() + 64);
+        uint8_t *wd = &reports[reports.size() - 64];
+        wd[0] = COMMAND_WRITE_FLASH_DATA | n;
+        memcpy(wd+1, pw, block_len);
+        pw += block_len;
+        chunk_len -= block_len;
+    }
+
+    reports.resize(reports.size() + 64);
+    uint8_t *end_cmd = &reports[reports.size() - 64];
+    end_cmd[0] = COMMAND_DONE;
+    end_cmd[1] = COMMAND_WRITE_FLASH;
+
+    return total;
+}
+
+/* Number of erased (0xFF) bytes at the start of p */
+static uint32_t blank_len(const uint8_t *p, uint32_t len)
+{
+    uint32_t n = 0;
+    while (n < len && p[n] == 0xFF)
+        n++;
+    return n;
+}
+
+/*
+ * Find the next chunk of wr to write, starting at off. Leading runs of
+ * 0xFF at least FLASH_BLANK_SKIP_MIN long (or running to the end) are
+ * skipped, moving off past them, and the chunk stops short of the next
+ * such run. chunk_len is 0 once there's nothing left to write.
+ */
+static void next_flash_chunk(const uint8_t *wr, uint32_t len,
+                             uint32_t max_chunk_len, uint32_t &off,
+                             uint32_t &chunk_len)
+{
+    uint32_t run = blank_len(wr + off, len - off);
+    if (run >= FLASH_BLANK_SKIP_MIN || off + run == len)
+        off += run;
+
+    uint32_t limit = len - off > max_chunk_len ? off + max_chunk_len : len;
+    uint32_t i = off;
+    while (i < limit) {
+        if (wr[i] != 0xFF) {
+            i++;
+            continue;
+        }
+        run = blank_len(wr + i, len - i);
+        if (run >= FLASH_BLANK_SKIP_MIN || i + run == len)
+            break;
+        i += run;
+    }
+    if (i > limit)
+        i = limit;
+    chunk_len = i - off;
+}
+
+/*
+ * Each chunk is acked by the remote before it takes the next one. The
+ * reports for the next chunk are built while we wait for that ack, so all
+ * that's left to do once it arrives is to send them.
+ *
+ * Programming flash can only clear bits, so writing 0xFF never changes
+ * anything. Long runs of it - erased space in the config and the blank
+ * tail of firmware images - are skipped and writing resumes with a new
+ * setup at the next non-blank address.
+ */
+int CRemote::WriteFlash(uint32_t addr, const uint32_t len, const uint8_t *wr,
+    unsigned int protocol, lc_callback cb, void *cb_arg, uint32_t cb_stage)
+{
+    uint32_t cb_count = 0;
+    unsigned int max_chunk_len = protocol == 0 ? 749 : 3150;
+    if (write_chunk_len)
+        max_chunk_len = write_chunk_len;
 
-    const uint8_t *pw = wr;
-    const uint32_t end = addr+len;
     unsigned int bytes_written = 0;
     int err = 0;
+    vector<uint8_t> reports, next_reports;
+    uint32_t off = 0, next_off, chunk_len, next_chunk_len;
 
-    do {
-        static uint8_t write_setup_cmd[64] = {0};
-        write_setup_cmd[0] = COMMAND_WRITE_FLASH | 0x05;
-        write_setup_cmd[1] = (addr >> 16) & 0xFF;
-        write_setup_cmd[2] = (addr >> 8) & 0xFF;
-        write_setup_cmd[3] = addr & 0xFF;
-        uint32_t chunk_len = end - addr;
-        if (chunk_len > max_chunk_len)
-            chunk_len = max_chunk_len;
-        write_setup_cmd[4] = (chunk_len >> 8) & 0xFF;
-        write_setup_cmd[5] = chunk_len & 0xFF;
+#ifdef _DEBUG
+    auto t_start = chrono::steady_clock::now();
+#endif
 
-        if ((err = HID_WriteReport(write_setup_cmd)))
+    next_flash_chunk(wr, len, max_chunk_len, off, chunk_len);
+    if (chunk_len)
+        encode_flash_chunk(addr + off, chunk_len, wr + off, protocol,
+                           reports);
+
+    while (chunk_len) {
+        if ((err = HID_WriteReport(&reports[0])))
             break;
+        for (size_t i = 64; i < reports.size(); i += 64)
+            HID_WriteReport(&reports[i]);
 
-        while (chunk_len) {
-            unsigned int n = txlenmap[0];
-            unsigned int i = 1;
-            while (chunk_len < txlenmap[i]) {
-                ++i;
-                --n;
-            }
-            unsigned int block_len = txlenmap[i];
-            uint8_t wd[64] = {0};
-            wd[0] = COMMAND_WRITE_FLASH_DATA | n;
-            memcpy(wd+1, pw, block_len);
-            HID_WriteReport(wd);
-            pw += block_len;
-            addr += block_len;
-            bytes_written += block_len;
-            chunk_len -= block_len;
-        }
+        bytes_written += chunk_len;
 
-        uint8_t end_cmd[64] = { COMMAND_DONE, COMMAND_WRITE_FLASH };
-        HID_WriteReport(end_cmd);
+        next_off = off + chunk_len;
+        next_flash_chunk(wr, len, max_chunk_len, next_off, next_chunk_len);
+        if (next_chunk_len)
+            encode_flash_chunk(addr + next_off, next_chunk_len, wr + next_off,
+                               protocol, next_reports);
 
         uint8_t rsp[68];
         if ((err = HID_ReadReport(rsp, 5000)))
             break;
 
         if (cb) {
-            cb(cb_stage, cb_count++, bytes_written, len,
+            cb(cb_stage, cb_count++, next_chunk_len ? next_off : len, len,
                LC_CB_COUNTER_TYPE_BYTES, cb_arg, NULL);
         }
-    } while (addr < end);
+
+        reports.swap(next_reports);
+        off = next_off;
+        chunk_len = next_chunk_len;
+    }
+
+    /* everything was blank, still let the caller know we're done */
+    if (!err && !cb_count && cb)
+        cb(cb_stage, cb_count++, len, len, LC_CB_COUNTER_TYPE_BYTES, cb_arg,
+           NULL);
+
+#ifdef _DEBUG
+    long long elapsed = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now() - t_start).count();
+    debug("Wrote %u bytes (%u blank skipped) in %lld ms (%lld bytes/sec)",
+          bytes_written, len - bytes_written, elapsed,
+          elapsed ? bytes_written * 1000LL / elapsed : 0LL);
+#endif
 
     return err;
 }
 
-int CRemote::ReadMiscByte(uint8_t addr, uint32_t len, uint8_t kind, uint8_t *rd)
+/*
+ * Misc register accesses are tiny request/response pairs, and doing them one
+ * round trip at a time makes reading the clock or the serial number slow.
+ * So we send up to misc_batch_len requests back-to-back and only then
+ * collect the responses, which come back in the order of the requests.
+ *
+ * cmds holds count 64-byte requests, rsps gets count 68-byte responses,
+ * each of which must be an expect_cmd response whose second byte is
+ * expect_arg. Reading or writing a register twice is harmless, so if a
+ * batch goes wrong we retry it, and everything after it, one at a time.
+ */
+int CRemote::MiscTransfer(const uint8_t *cmds, uint32_t count, uint8_t *rsps,
+                          uint8_t expect_cmd, uint8_t expect_arg)
 {
-    uint8_t rmb[64] = { COMMAND_READ_MISC | 0x02, kind, 0 };
+    uint32_t done = 0;
 
-    while (len--) {
-        rmb[2] = addr++;
+    while (done < count) {
+        uint32_t n = count - done;
+        if (n > misc_batch_len)
+            n = misc_batch_len;
 
-        int err;
-        if ((err = HID_WriteReport(rmb)))
-            return err;
+        int err = 0;
+        uint32_t sent;
+        for (sent = 0; sent < n; sent++) {
+            if ((err = HID_WriteReport(cmds + (done + sent) * 64)))
+                break;
+        }
+        for (uint32_t i = 0; i < sent && !err; i++) {
+            uint8_t *rsp = rsps + (done + i) * 68;
+            if ((err = HID_ReadReport(rsp)))
+                break;
+            if ((rsp[0] & COMMAND_MASK) != expect_cmd || rsp[1] != expect_arg)
+                err = 1;
+        }
 
-        uint8_t rsp[68];
-        if ((err = HID_ReadReport(rsp)))
+        if (err && misc_batch_len > 1) {
+            debug("Batched misc access failed, going one at a time");
+            uint8_t rsp[68];
+            while (HID_ReadReport(rsp, 100) == 0)
+                ;
+            misc_batch_len = 1;
+            Stats_Retry();
+            continue;
+        }
+        if (err)
             return err;
 
-        if (rsp[0] != (RESPONSE_READ_MISC_DATA | 0x02) ||
-            rsp[1] != kind)
+        done += n;
+    }
+
+    return 0;
+}
+
+int CRemote::ReadMiscByte(uint8_t addr, uint32_t len, uint8_t kind, uint8_t *rd)
+{
+    if (!len)
+        return 0;
+
+    vector<uint8_t> cmds(len * 64), rsps(len * 68);
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t *rmb = &cmds[i * 64];
+        rmb[0] = COMMAND_READ_MISC | 0x02;
+        rmb[1] = kind;
+        rmb[2] = addr++;
+    }
+
+    int err;
+    if ((err = MiscTransfer(&cmds[0], len, &rsps[0], RESPONSE_READ_MISC_DATA,
+                            kind)))
+        return err;
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t *rsp = &rsps[i * 68];
+        if (rsp[0] != (RESPONSE_READ_MISC_DATA | 0x02))
             return 1;
 
         *rd++ = rsp[2];
@@ -640,27 +843,28 @@ int CRemote::ReadMiscByte(uint8_t addr, uint32_t len, uint8_t kind, uint8_t *rd)
 int CRemote::ReadMiscWord(uint16_t addr, uint32_t len, uint8_t kind,
                           uint16_t *rd)
 {
-    uint8_t rmw[64] = { COMMAND_READ_MISC | 0x03, kind, 0, 0 };
+    if (!len)
+        return 0;
+
+    vector<uint8_t> cmds(len * 64), rsps(len * 68);
 
-    while (len--) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t *rmw = &cmds[i * 64];
+        rmw[0] = COMMAND_READ_MISC | 0x03;
+        rmw[1] = kind;
         rmw[2] = addr >> 8;
         rmw[3] = addr & 0xFF;
         ++addr;
+    }
 
-        int err;
-        if ((err = HID_WriteReport(rmw)))
-            return err;
-
-        uint8_t rsp[68];
-        if ((err = HID_ReadReport(rsp)))
-            return err;
-
-        // WARNING: The 880 responds with C2 rather than C3
-        if ((rsp[0] & COMMAND_MASK) != RESPONSE_READ_MISC_DATA ||
-            rsp[1] != kind) {
-            return 1;
-        }
+    // WARNING: The 880 responds with C2 rather than C3
+    int err;
+    if ((err = MiscTransfer(&cmds[0], len, &rsps[0], RESPONSE_READ_MISC_DATA,
+                            kind)))
+        return err;
 
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t *rsp = &rsps[i * 68];
         *rd++ = (rsp[2] << 8) | rsp[3];
     }
     return 0;
@@ -669,57 +873,45 @@ int CRemote::ReadMiscWord(uint16_t addr, uint32_t len, uint8_t kind,
 int CRemote::WriteMiscByte(uint8_t addr, uint32_t len, uint8_t kind,
                            uint8_t *wr)
 {
-    uint8_t wmb[64] = {0};
-    wmb[0] = COMMAND_WRITE_MISC | 0x03;
-    wmb[1] = kind;
+    if (!len)
+        return 0;
+
+    vector<uint8_t> cmds(len * 64), rsps(len * 68);
 
-    while (len--) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t *wmb = &cmds[i * 64];
+        wmb[0] = COMMAND_WRITE_MISC | 0x03;
+        wmb[1] = kind;
         wmb[2] = addr++;
         wmb[3] = *wr++;
-
-        int err;
-        if ((err = HID_WriteReport(wmb)))
-            return err;
-
-        uint8_t rsp[68];
-        if ((err = HID_ReadReport(rsp)))
-            return err;
-        if ((rsp[0] & COMMAND_MASK) != RESPONSE_DONE ||
-            rsp[1] != COMMAND_WRITE_MISC) {
-            return 1;
-        }
     }
-    return 0;
+
+    return MiscTransfer(&cmds[0], len, &rsps[0], RESPONSE_DONE,
+                        COMMAND_WRITE_MISC);
 }
 
 int CRemote::WriteMiscWord(uint16_t addr, uint32_t len, uint8_t kind,
                            uint16_t *wr)
 {
-    uint8_t wmw[64] = {0};
-    wmw[0] = COMMAND_WRITE_MISC | 0x05;
-    wmw[1] = kind;
+    if (!len)
+        return 0;
 
-    while (len--) {
+    vector<uint8_t> cmds(len * 64), rsps(len * 68);
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t *wmw = &cmds[i * 64];
+        wmw[0] = COMMAND_WRITE_MISC | 0x05;
+        wmw[1] = kind;
         wmw[2] = addr >> 8;
         wmw[3] = addr & 0xFF;
         ++addr;
         wmw[4] = *wr >> 8;
         wmw[5] = *wr & 0xFF;
         ++wr;
-
-        int err;
-        if ((err = HID_WriteReport(wmw)))
-            return err;
-
-        uint8_t rsp[68];
-        if ((err = HID_ReadReport(rsp)))
-            return err;
-        if ((rsp[0] & COMMAND_MASK) != RESPONSE_DONE ||
-            rsp[1] != COMMAND_WRITE_MISC) {
-            return 1;
-        }
     }
-    return 0;
+
+    return MiscTransfer(&cmds[0], len, &rsps[0], RESPONSE_DONE,
+                        COMMAND_WRITE_MISC);
 }
 
 
@@ -26,15 +26,40 @@
 #include "libconcord.h"
 
 #define SERIAL_SIZE 48
+/* misc register requests CRemote sends before reading the responses */
+#define MISC_BATCH_LEN 8
 #define FIRMWARE_MAX_SIZE 64*1024
+/*
+ * Shortest run of erased (0xFF) bytes WriteFlash skips rather than sends.
+ * Skipping costs a new write setup and ack, so short runs are cheaper to
+ * just write.
+ */
+#define FLASH_BLANK_SKIP_MIN 256
 /* Largest packet size for HID-UDP is 4 bytes (header) + 64 bytes (data) */
 #define HID_UDP_MAX_PACKET_SIZE 68
 #define HID_UDP_HDR_SIZE 2
 #define HID_TCP_HDR_SIZE 4
+/*
+ * Update-data segments the HID zwave remotes may have unacked at once.  The
+ * sequence numbers are a single byte, so everything in flight must stay well
+ * under 256 bytes for cumulative acks to be unambiguous.
+ */
+#define ZHID_TCP_WINDOW 4
+#define ZHID_TCP_MAX_WINDOW 4
+/*
+ * retransmit timeout for windowed update data, and how long we keep
+ * retransmitting without an ack before giving up (ms)
+ */
+#define ZHID_TCP_RTO 1000
+#define ZHID_TCP_ACK_TIMEOUT 30000
 /* Largest packet size for usbnet is the COMMAND_WRITE_UPDATE_DATA
    which is 1 (num params) + 3 (3 parameter size bytes) + 1 (param 1)
    + 1024 (param 2) + 4 (param 3) = 1033. */
 #define USBNET_MAX_PACKET_SIZE 1033
+/* COMMAND_WRITE_UPDATE_DATA packets a usbnet remote may have unanswered */
+#define USBNET_UPDATE_WINDOW 4
+/* COMMAND_READ_REGION_DATA requests kept outstanding by ReadRegion */
+#define USBNET_READ_WINDOW 4
 const uint8_t MH_EOF_BYTES[] = { 0x50, 0x54, 0x59, 0x59 };
 
 /*
@@ -151,7 +176,7 @@ struct THarmonyTime {
 
 
 void setup_ri_pointers(TRemoteInfo &ri);
-void make_serial(uint8_t *ser, TRemoteInfo &ri);
+void make_serial(uint8_t *ser, TRemoteInfo &ri, bool swap);
 int LearnIRInnerLoop(uint32_t *freq, uint32_t **ir_signal,
     uint32_t *ir_signal_length, uint8_t seq);
 uint16_t mh_get_checksum(uint8_t* rd, const uint32_t len);
@@ -202,6 +227,13 @@ public:
     virtual int IsUSBNet()=0;
     virtual int IsMHRemote()=0;
 
+    /*
+     * Override how many bytes ReadFlash()/WriteFlash() move per command,
+     * 0 for the protocol's default. Only meaningful for CRemote.
+     */
+    virtual void SetChunkSizes(unsigned int read_len,
+        unsigned int write_len) {};
+
     virtual int ReadFile(const char *filename, uint8_t *rd,
         const uint32_t rdlen, uint32_t *data_read, uint8_t start_seq,
         lc_callback cb, void *cb_arg, uint32_t cb_stage)=0;
@@ -212,6 +244,12 @@ public:
 class CRemote : public CRemoteBase    // All non-Z-Wave remotes
 {
 private:
+    unsigned int read_chunk_len;
+    unsigned int write_chunk_len;
+    /* how many misc requests MiscTransfer() sends before reading */
+    unsigned int misc_batch_len;
+    int MiscTransfer(const uint8_t *cmds, uint32_t count, uint8_t *rsps,
+        uint8_t expect_cmd, uint8_t expect_arg);
     int ReadMiscByte(uint8_t addr, uint32_t len, uint8_t kind,
         uint8_t *rd);
     int ReadMiscWord(uint16_t addr, uint32_t len, uint8_t kind,
@@ -222,8 +260,10 @@ private:
         uint16_t *wr);
 
 public:
-    CRemote() {};
+    CRemote() : read_chunk_len(0), write_chunk_len(0),
+        misc_batch_len(MISC_BATCH_LEN) {};
     virtual ~CRemote() {};
+    void SetChunkSizes(unsigned int read_len, unsigned int write_len);
     int Reset(uint8_t kind);
     int GetIdentity(struct TRemoteInfo &ri, struct THIDINFO &hid,
         lc_callback cb=NULL, void *cb_arg=NULL, uint32_t cb_stage=0);
@@ -280,7 +320,9 @@ protected:
     };
     virtual int Write(uint8_t typ, uint8_t cmd, uint32_t len=0,
         uint8_t *data=NULL)=0;
-    virtual int Read(uint8_t &status, uint32_t &len, uint8_t *data)=0;
+    /* Read one message into data, which has room for size bytes */
+    virtual int Read(uint8_t &status, uint32_t &len, uint8_t *data,
+        uint32_t size)=0;
     virtual int ParseParams(uint32_t len, uint8_t *data,
         TParamList &pl)=0;
     virtual uint16_t GetWord(uint8_t *x)=0;
@@ -328,32 +370,62 @@ public:
     int WriteFile(const char *filename, uint8_t *wr, const uint32_t wrlen);
 };
 
+/*
+ * State of the pseudo-TCP connection spoken by the HID-based zwave remotes.
+ * Each CRemoteZ_HID owns one of these, so transfers to several remotes can
+ * run in parallel without sharing sequence numbers.
+ */
+struct TZHIDConnection {
+    /* Have we acked the syn packet yet? */
+    bool syn_acked;
+    unsigned int last_seq;
+    unsigned int last_ack;
+    unsigned int last_payload_bytes;
+
+    TZHIDConnection() { Reset(); }
+    void Reset() {
+        syn_acked = false;
+        last_seq = 0;
+        last_ack = 0;
+        last_payload_bytes = 0;
+    }
+};
+
 // 890, 890Pro, AVL-300, RF Extender
 class CRemoteZ_HID : public CRemoteZ_Base
 {
 private:
-    uint8_t m_tx_seq;
-    uint8_t m_rx_seq;
+    TZHIDConnection m_tcp;
+    /* drops to 1 (stop-and-wait) if the remote doesn't cope with more */
+    unsigned int m_tx_window;
     int UDP_Write(uint8_t typ, uint8_t cmd, uint32_t len=0,
         uint8_t *data=NULL);
     int UDP_Read(uint8_t &status, uint32_t &len, uint8_t *data);
+    int TCP_Send(uint8_t flags, uint8_t seq, uint8_t ack, uint8_t typ,
+        uint8_t cmd, uint32_t len=0, const uint8_t *data=NULL);
     int TCP_Write(uint8_t typ, uint8_t cmd, uint32_t len=0,
         uint8_t *data=NULL);
-    int TCP_Read(uint8_t &status, uint32_t &len, uint8_t *data);
+    int TCP_Read(uint8_t &status, uint32_t &len, uint8_t *data,
+        unsigned int timeout=30000);
+    int TCP_Ack(bool increment_ack=false, bool fin=false);
+    int TCPSendWindowed(uint8_t cmd, uint32_t len, const uint8_t *data,
+        lc_callback cb, void *cb_arg, uint32_t cb_stage);
 
 protected:
     int TCPSendAndCheck(uint8_t cmd, uint32_t len=0, uint8_t *data=NULL,
         bool ackonly=false);
     virtual int Write(uint8_t typ, uint8_t cmd, uint32_t len=0,
         uint8_t *data=NULL);
-    virtual int Read(uint8_t &status, uint32_t &len, uint8_t *data);
+    virtual int Read(uint8_t &status, uint32_t &len, uint8_t *data,
+        uint32_t size);
     virtual int ParseParams(uint32_t len, uint8_t *data,
         TParamList &pl);
     virtual uint16_t GetWord(uint8_t *x) { return x[1]<<8 | x[0]; };
 
 public:
-    CRemoteZ_HID() {};
+    CRemoteZ_HID() : m_tx_window(ZHID_TCP_WINDOW) {};
     virtual ~CRemoteZ_HID() {};
+    void SetTCPWindow(unsigned int segments);
     int UpdateConfig(const uint32_t len, const uint8_t *wr,
         lc_callback cb, void *cb_arg, uint32_t cb_stage,
         uint32_t xml_size=0, uint8_t *xml=NULL);
@@ -373,9 +445,12 @@ protected:
     uint32_t ir_stream_timeout_ms = 1000;
 
     int TCPSendAndCheck(uint8_t cmd, uint32_t len=0, uint8_t *data=NULL);
+    int SendUpdateData(uint32_t len, const uint8_t *wr, lc_callback cb,
+        void *cb_arg, uint32_t cb_stage);
     virtual int Write(uint8_t typ, uint8_t cmd, uint32_t len=0,
         uint8_t *data=NULL);
-    virtual int Read(uint8_t &status, uint32_t &len, uint8_t *data);
+    virtual int Read(uint8_t &status, uint32_t &len, uint8_t *data,
+        uint32_t size);
     virtual int ParseParams(uint32_t len, uint8_t *data,
         TParamList &pl);
     virtual uint16_t GetWord(uint8_t *x) { return x[0]<<8 | x[1]; };
@@ -419,9 +494,11 @@ private:
         uint8_t *wr);
     int WriteMiscWord(uint16_t addr, uint32_t len, uint8_t kind,
         uint16_t *wr);
+    /* Learned in GetIdentity, LearnIR needs it to pick a sequence number */
+    uint16_t architecture;
 
 public:
-    CRemoteMH() {};
+    CRemoteMH() : architecture(0) {};
     virtual ~CRemoteMH() {};
     int Reset(uint8_t kind);
     int GetIdentity(struct TRemoteInfo &ri, struct THIDINFO &hid,
@@ -523,6 +523,7 @@ int CRemoteMH::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
     ri.flash_id = 0x12; // TODO: FIXME
     ri.flash_mfg = 0xFF; // TODO: FIXME
     ri.architecture = strtol(find_value(identity, "arch").c_str(), NULL, 16);
+    architecture = ri.architecture;
     ri.fw_type = strtol(find_value(identity, "fw_type").c_str(), NULL, 16);
     ri.skin = strtol(find_value(identity, "skin").c_str(), NULL, 16);
     ri.protocol = 9; // TODO: FIXME
@@ -541,7 +542,7 @@ int CRemoteMH::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
             guid[i] = strtol(guid_char, NULL, 16);
             guid_cstr = guid_cstr + 2;
         }
-        make_serial(guid, ri);
+        make_serial(guid, ri, false);
     }
     ri.mh_serial = find_value(identity, "serial_number");
 
@@ -755,7 +756,7 @@ int CRemoteMH::LearnIR(uint32_t *freq, uint32_t **ir_signal,
 
     uint8_t start_seq = 0x90;
     /* Arch 17 uses a different starting sequence number for IR learning */
-    if (get_arch() == 17) {
+    if (architecture == 17) {
         start_seq = 0x00;
     }
 
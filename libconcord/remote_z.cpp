@@ -20,25 +20,23 @@
  */
 
 #include <string.h>
+#include <chrono>
 #include "libconcord.h"
 #include "lc_internal.h"
 #include "hid.h"
 #include "remote.h"
 #include "usblan.h"
 #include "protocol_z.h"
+#include "profile.h"
+#include "transfer_stats.h"
 #include "remote_z_learn/single.h"
 #include "remote_z_learn/start.h"
 #include "remote_z_learn/stop.h"
 #include "remote_z_learn/stream.h"
 #include "remote_z_learn/data.h"
 
-/* Have we acked the syn packet yet? */
-static bool SYN_ACKED = false;
-static unsigned int last_seq;
-static unsigned int last_ack;
-static unsigned int last_payload_bytes;
-
-int TCP_Ack(bool increment_ack = false, bool fin = false) {
+int CRemoteZ_HID::TCP_Ack(bool increment_ack, bool fin)
+{
     uint8_t pkt[HID_UDP_MAX_PACKET_SIZE];
 
     /*
@@ -50,8 +48,8 @@ int TCP_Ack(bool increment_ack = false, bool fin = false) {
     uint8_t ack;
     uint8_t flags;
 
-    seq = last_ack;
-    ack = last_seq + last_payload_bytes;
+    seq = m_tcp.last_ack;
+    ack = m_tcp.last_seq + m_tcp.last_payload_bytes;
     if (increment_ack)
         ack++;
     flags = TYPE_TCP_ACK;
@@ -139,31 +137,12 @@ int CRemoteZ_HID::UDP_Read(uint8_t &status, uint32_t &len, uint8_t *data)
     return 0;
 }
 
-int CRemoteZ_HID::TCP_Write(uint8_t typ, uint8_t cmd, uint32_t len,
-                            uint8_t *data)
+int CRemoteZ_HID::TCP_Send(uint8_t flags, uint8_t seq, uint8_t ack,
+                           uint8_t typ, uint8_t cmd, uint32_t len,
+                           const uint8_t *data)
 {
     uint8_t pkt[HID_UDP_MAX_PACKET_SIZE];
 
-    /*
-     * Note: It's the caller's responsibility to ensure we've already
-     * seen the SYN packet.
-     */
-
-    uint8_t seq;
-    uint8_t ack;
-    uint8_t flags;
-
-    if (!SYN_ACKED) {
-        seq = 0x28;
-        ack = last_seq + 1;
-        flags = TYPE_TCP_ACK | TYPE_TCP_SYN;
-        SYN_ACKED = true;
-    } else {
-        seq = last_ack;
-        ack = last_seq + last_payload_bytes;
-        flags = TYPE_TCP_ACK;
-    }
-
     if (len > 60)
         return LC_ERROR;
     pkt[0] = 5+len;
@@ -186,17 +165,44 @@ int CRemoteZ_HID::TCP_Write(uint8_t typ, uint8_t cmd, uint32_t len,
     return HID_WriteReport(pkt);
 }
 
+int CRemoteZ_HID::TCP_Write(uint8_t typ, uint8_t cmd, uint32_t len,
+                            uint8_t *data)
+{
+    /*
+     * Note: It's the caller's responsibility to ensure we've already
+     * seen the SYN packet.
+     */
+
+    uint8_t seq;
+    uint8_t ack;
+    uint8_t flags;
+
+    if (!m_tcp.syn_acked) {
+        seq = 0x28;
+        ack = m_tcp.last_seq + 1;
+        flags = TYPE_TCP_ACK | TYPE_TCP_SYN;
+        m_tcp.syn_acked = true;
+    } else {
+        seq = m_tcp.last_ack;
+        ack = m_tcp.last_seq + m_tcp.last_payload_bytes;
+        flags = TYPE_TCP_ACK;
+    }
+
+    return TCP_Send(flags, seq, ack, typ, cmd, len, data);
+}
+
 
-int CRemoteZ_HID::TCP_Read(uint8_t &status, uint32_t &len, uint8_t *data)
+int CRemoteZ_HID::TCP_Read(uint8_t &status, uint32_t &len, uint8_t *data,
+                           unsigned int timeout)
 {
     uint8_t pkt[HID_UDP_MAX_PACKET_SIZE];
     int err;
     /*
      * Many TCP operations can take a while, like computing checksums,
-     * and it will be a while before we get a response. So we set the
-     * timeout to 30 seconds.
+     * and it will be a while before we get a response. So the timeout
+     * defaults to 30 seconds.
      */
-    if ((err = HID_ReadReport(pkt, 30000))) {
+    if ((err = HID_ReadReport(pkt, timeout))) {
         return LC_ERROR_READ;
     }
 
@@ -218,9 +224,9 @@ int CRemoteZ_HID::TCP_Read(uint8_t &status, uint32_t &len, uint8_t *data)
      * UDP headers from pkt[0] and then add one.
      */
     len = pkt[0] - HID_TCP_HDR_SIZE - HID_UDP_HDR_SIZE + 1;
-    last_seq = pkt[2];
-    last_ack = pkt[3];
-    last_payload_bytes = len + HID_UDP_HDR_SIZE; // tcp payload size
+    m_tcp.last_seq = pkt[2];
+    m_tcp.last_ack = pkt[3];
+    m_tcp.last_payload_bytes = len + HID_UDP_HDR_SIZE; // tcp payload size
     //if(!len) return 0;
     //memcpy(data, pkt + 6, len);
     // include headers, minus the size
@@ -233,7 +239,9 @@ int CRemoteZ_HID::Write(uint8_t typ, uint8_t cmd, uint32_t len, uint8_t *data)
     return UDP_Write(typ, cmd, len, data);
 }
 
-int CRemoteZ_HID::Read(uint8_t &status, uint32_t &len, uint8_t *data)
+/* HID reports are smaller than any buffer we read them into */
+int CRemoteZ_HID::Read(uint8_t &status, uint32_t &len, uint8_t *data,
+                       uint32_t size)
 {
     return UDP_Read(status, len, data);
 }
@@ -305,17 +313,24 @@ int CRemoteZ_USBNET::Write(uint8_t typ, uint8_t cmd, uint32_t len,
     return UsbLan_Write(len, pkt);
 }
 
-int CRemoteZ_USBNET::Read(uint8_t &status, uint32_t &len, uint8_t *data)
+int CRemoteZ_USBNET::Read(uint8_t &status, uint32_t &len, uint8_t *data,
+                          uint32_t size)
 {
-    uint8_t buf[1600];
-    len = sizeof(buf);
     int err;
-    if ((err = UsbLan_Read(len, buf)))
+    uint8_t *msg;
+    unsigned int msg_len;
+
+    if ((err = UsbLan_ReadMessage(msg, msg_len)))
         return err;
 
-    memcpy(data, buf, len);
+    if (msg_len > size) {
+        debug("%u byte message doesn't fit in %u bytes", msg_len, size);
+        return LC_ERROR_INVALID_DATA_FROM_REMOTE;
+    }
+    memcpy(data, msg, msg_len);
+    len = msg_len;
 
-    return err;
+    return 0;
 }
 
 int CRemoteZ_USBNET::ParseParams(uint32_t len, uint8_t *data, TParamList &pl)
@@ -356,16 +371,15 @@ int CRemoteZ_USBNET::ParseParams(uint32_t len, uint8_t *data, TParamList &pl)
 int CRemoteZ_USBNET::TCPSendAndCheck(uint8_t cmd, uint32_t len, uint8_t *data)
 {
     int err = 0;
-    uint8_t status;
     unsigned int rlen;
-    uint8_t rsp[60];
+    uint8_t *rsp;
 
     if ((err = Write(TYPE_REQUEST, cmd, len, data))) {
         debug("Failed to send request %02X", cmd);
         return LC_ERROR_WRITE;
     }
 
-    if ((err = Read(status, rlen, rsp))) {
+    if ((err = UsbLan_ReadMessage(rsp, rlen))) {
         debug("Failed to read from remote");
         return LC_ERROR_READ;
     }
@@ -383,6 +397,84 @@ int CRemoteZ_USBNET::TCPSendAndCheck(uint8_t cmd, uint32_t len, uint8_t *data)
     return 0;
 }
 
+/*
+ * Send the config as 1024-byte COMMAND_WRITE_UPDATE_DATA packets, keeping up
+ * to USBNET_UPDATE_WINDOW of them unanswered. The remote answers in order on
+ * the one TCP stream, so each response belongs to the oldest packet still
+ * outstanding.
+ */
+int CRemoteZ_USBNET::SendUpdateData(uint32_t len, const uint8_t *wr,
+                                    lc_callback cb, void *cb_arg,
+                                    uint32_t cb_stage)
+{
+    int err;
+    int cb_count = 0;
+    uint32_t sent = 0;
+    uint32_t done = 0;
+    /* end offsets of the packets we're waiting to hear about */
+    uint32_t pending[USBNET_UPDATE_WINDOW];
+    unsigned int head = 0;
+    unsigned int inflight = 0;
+    unsigned int rlen;
+    uint8_t *rsp;
+    uint8_t tmp_pkt[1033];
+    tmp_pkt[0] = 0x03; // 3 parameters
+    tmp_pkt[1] = 0x01; // 1st parameter, 1 byte (region id)
+    tmp_pkt[2] = REGION_USER_CONFIG;
+    tmp_pkt[3] = 0xC2; // 2nd parameter, 1024 bytes (data)
+    tmp_pkt[1028] = 0x04; // 3rd parameter, 4 bytes (length)
+
+    while (done < len) {
+        while (sent < len && inflight < USBNET_UPDATE_WINDOW) {
+            uint32_t pkt_len = 1024; // max packet length seems to be 1024
+            if (len - sent < pkt_len) {
+                pkt_len = len - sent;
+            }
+
+            memcpy(&tmp_pkt[4], wr + sent, pkt_len);
+            tmp_pkt[1029] = (pkt_len & 0xFF000000) >> 24;
+            tmp_pkt[1030] = (pkt_len & 0x00FF0000) >> 16;
+            tmp_pkt[1031] = (pkt_len & 0x0000FF00) >> 8;
+            tmp_pkt[1032] = (pkt_len & 0x000000FF);
+
+            debug("DATA sending %d bytes, %d bytes left, %d in flight",
+                  pkt_len, len - sent - pkt_len, inflight);
+
+            if ((err = Write(TYPE_REQUEST, COMMAND_WRITE_UPDATE_DATA, 1033,
+                             tmp_pkt))) {
+                debug("Failed to send update data");
+                return LC_ERROR_WRITE;
+            }
+            sent += pkt_len;
+            pending[(head + inflight) % USBNET_UPDATE_WINDOW] = sent;
+            inflight++;
+        }
+
+        if ((err = UsbLan_ReadMessage(rsp, rlen))) {
+            debug("Failed to read from remote");
+            return LC_ERROR_READ;
+        }
+        if (rsp[2] != TYPE_RESPONSE) {
+            debug("Packet didn't have response bit!");
+            return LC_ERROR;
+        }
+        if (rsp[1] != COMMAND_WRITE_UPDATE_DATA) {
+            debug("The cmd bit didn't match our request packet");
+            return LC_ERROR;
+        }
+        done = pending[head];
+        head = (head + 1) % USBNET_UPDATE_WINDOW;
+        inflight--;
+
+        if (cb) {
+            cb(cb_stage, cb_count++, done, len, LC_CB_COUNTER_TYPE_BYTES,
+               cb_arg, NULL);
+        }
+    }
+
+    return 0;
+}
+
 int CRemoteZ_USBNET::UpdateConfig(const uint32_t len, const uint8_t *wr,
                                   lc_callback cb, void *cb_arg,
                                   uint32_t cb_stage, uint32_t xml_size,
@@ -426,40 +518,8 @@ int CRemoteZ_USBNET::UpdateConfig(const uint32_t len, const uint8_t *wr,
 
     /* write data */
     debug("UPDATE_DATA");
-    uint32_t pkt_len;
-    uint32_t tlen = len;
-    uint8_t *wr_ptr = const_cast<uint8_t*>(wr);
-    uint8_t tmp_pkt[1033];
-    tmp_pkt[0] = 0x03; // 3 parameters
-    tmp_pkt[1] = 0x01; // 1st parameter, 1 byte (region id)
-    tmp_pkt[2] = REGION_USER_CONFIG;
-    tmp_pkt[3] = 0xC2; // 2nd parameter, 1024 bytes (data)
-    tmp_pkt[1028] = 0x04; // 3rd parameter, 4 bytes (length)
-    while (tlen) {
-        pkt_len = 1024; // max packet length seems to be 1024
-        if (tlen < pkt_len) {
-            pkt_len = tlen;
-        }
-        tlen -= pkt_len;
-
-        memcpy(&tmp_pkt[4], wr_ptr, pkt_len);
-        tmp_pkt[1029] = (pkt_len & 0xFF000000) >> 24;
-        tmp_pkt[1030] = (pkt_len & 0x00FF0000) >> 16;
-        tmp_pkt[1031] = (pkt_len & 0x0000FF00) >> 8;
-        tmp_pkt[1032] = (pkt_len & 0x000000FF);
-
-        debug("DATA %d, sending %d bytes, %d bytes left", cb_count,
-            pkt_len, tlen);
-
-        if ((err = TCPSendAndCheck(COMMAND_WRITE_UPDATE_DATA, 1033, tmp_pkt))) {
-            return err;
-        }
-        wr_ptr += pkt_len;
-
-        if (cb) {
-            cb(LC_CB_STAGE_WRITE_CONFIG, cb_count++, (int)(wr_ptr - wr), len,
-               LC_CB_COUNTER_TYPE_BYTES, cb_arg, NULL);
-        }
+    if ((err = SendUpdateData(len, wr, cb, cb_arg, LC_CB_STAGE_WRITE_CONFIG))) {
+        return err;
     }
 
     /* write update-done */
@@ -520,7 +580,7 @@ int CRemoteZ_USBNET::GetTime(const TRemoteInfo &ri, THarmonyTime &ht)
     uint8_t time[60];
     unsigned int len;
     uint8_t status;
-    if ((err = Read(status, len, time))) {
+    if ((err = Read(status, len, time, sizeof(time)))) {
         debug("Failed to read to remote");
         return LC_ERROR_READ;
     }
@@ -648,7 +708,7 @@ int CRemoteZ_USBNET::SendLearnStart()
     }
     unsigned int len;
     uint8_t status;
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read to remote");
         return LC_ERROR_READ;
     }
@@ -677,7 +737,7 @@ int CRemoteZ_USBNET::SendLearnStop()
     }
     unsigned int len;
     uint8_t status;
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read to remote");
         return LC_ERROR_READ;
     }
@@ -722,7 +782,7 @@ int CRemoteZ_USBNET::ReadIrData(uint32_t *freq, uint32_t **ir_signal,
         }
         unsigned int len;
         uint8_t status;
-        if ((err = Read(status, len, rsp))) {
+        if ((err = Read(status, len, rsp, sizeof(rsp)))) {
             debug("Failed to read to remote");
             err = LC_ERROR_READ;
             break;
@@ -818,7 +878,7 @@ int CRemoteZ_USBNET::ReadIrStream(uint32_t *freq, uint32_t **ir_signal,
         }
         unsigned int len;
         uint8_t status;
-        if ((err = Read(status, len, rsp))) {
+        if ((err = Read(status, len, rsp, sizeof(rsp)))) {
             debug("Failed to read to remote");
             err = LC_ERROR_READ;
             break;
@@ -900,7 +960,7 @@ int CRemoteZ_USBNET::ReadRegion(uint8_t region, uint32_t &rgn_len, uint8_t *rd,
         debug("Failed to write to remote");
         return LC_ERROR_WRITE;
     }
-    if ((err = Read(status, rlen, rsp))) {
+    if ((err = Read(status, rlen, rsp, sizeof(rsp)))) {
         debug("Failed to read to remote");
         return LC_ERROR_READ;
     }
@@ -912,24 +972,45 @@ int CRemoteZ_USBNET::ReadRegion(uint8_t region, uint32_t &rgn_len, uint8_t *rd,
     ParseParams(rlen, rsp, pl);
     rgn_len = GetWord32(pl.p[0]);
 
+    /*
+     * Every COMMAND_READ_REGION_DATA request is the same and the remote just
+     * hands out the next piece, so we keep several of them outstanding and
+     * copy each payload straight from the receive buffer into place as it
+     * arrives. We don't know how big the
+     * pieces are until the first one comes back, so that one goes alone;
+     * after that we only ask for as many as the remaining bytes need.
+     */
     debug("READ_REGION_DATA");
     uint32_t pkt_len;
+    uint32_t chunk_len = 0;
     unsigned int data_to_read = rgn_len;
+    unsigned int data_requested = 0;
+    unsigned int inflight = 0;
     uint8_t *rd_ptr = rd;
-    uint8_t tmp_pkt[USBNET_MAX_PACKET_SIZE+3]; /* add standard 3-byte header */
+    uint8_t *tmp_pkt;
     cmd[0] = 0x01; // 1 parameter
     cmd[1] = 0x01; // 1st parameter, 1 byte (region id)
     cmd[2] = region;
 
-    while (data_to_read) {
-        if ((err = Write(TYPE_REQUEST, COMMAND_READ_REGION_DATA, 3, cmd))) {
-            debug("Failed to write to remote");
-            return LC_ERROR_WRITE;
+    while (data_to_read || inflight) {
+        while (data_requested < rgn_len && inflight < USBNET_READ_WINDOW &&
+               (chunk_len || !inflight)) {
+            if ((err = Write(TYPE_REQUEST, COMMAND_READ_REGION_DATA, 3,
+                             cmd))) {
+                debug("Failed to write to remote");
+                return LC_ERROR_WRITE;
+            }
+            inflight++;
+            if (!chunk_len)
+                break;
+            data_requested += chunk_len;
         }
-        if ((err = Read(status, rlen, tmp_pkt))) {
+
+        if ((err = UsbLan_ReadMessage(tmp_pkt, rlen))) {
             debug("Failed to read to remote");
             return LC_ERROR_READ;
         }
+        inflight--;
         if (tmp_pkt[2] != TYPE_RESPONSE ||
             tmp_pkt[1] != COMMAND_READ_REGION_DATA) {
             debug("Incorrect response type from remote");
@@ -937,6 +1018,32 @@ int CRemoteZ_USBNET::ReadRegion(uint8_t region, uint32_t &rgn_len, uint8_t *rd,
         }
         ParseParams(rlen, tmp_pkt, pl);
         pkt_len = GetWord32(pl.p[2]);
+
+        if (!chunk_len) {
+            if (!pkt_len) {
+                debug("Remote sent an empty region chunk");
+                return LC_ERROR_INVALID_DATA_FROM_REMOTE;
+            }
+            chunk_len = pkt_len;
+            data_requested = pkt_len;
+        } else if (pkt_len < chunk_len && data_to_read > pkt_len) {
+            /* a short piece mid-region, ask for what it left out */
+            data_requested -= chunk_len - pkt_len;
+        }
+
+        /*
+         * If the pieces grew after the first one we may have asked for
+         * more than the region holds; those answers are just drained.
+         */
+        if (!data_to_read) {
+            debug("Draining surplus region data response");
+            continue;
+        }
+        if (pkt_len > data_to_read) {
+            debug("Remote sent %d bytes with only %d left", pkt_len,
+                  data_to_read);
+            return LC_ERROR_INVALID_DATA_FROM_REMOTE;
+        }
         data_to_read -= pkt_len;
 
         if (rd) {
@@ -983,7 +1090,7 @@ int CRemoteZ_Base::Reset(uint8_t kind)
     uint8_t rsp[60];
     unsigned int len;
     uint8_t status;
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read to remote");
         return LC_ERROR_READ;
     }
@@ -1014,7 +1121,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
     uint8_t rsp[60];
     unsigned int len;
     uint8_t status;
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read from remote");
         return LC_ERROR_READ;
     }
@@ -1058,7 +1165,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         debug("Failed to write to remote");
         return LC_ERROR_WRITE;
     }
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read from remote");
         return LC_ERROR_READ;
     }
@@ -1070,7 +1177,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
 
     ParseParams(len, rsp, pl);
 
-    make_serial(pl.p[0], ri);
+    make_serial(pl.p[0], ri, false);
 
     if (IsUSBNet()) {
         // Get the User Config Region to find the config bytes used.
@@ -1087,7 +1194,19 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
     if (!IsUSBNet()) {
         return 0;
     }
-    
+
+    /*
+     * Everything below is fixed for a given unit and firmware, and takes a
+     * dozen round trips plus an HTTP request to learn, so it's cached by
+     * GUID.
+     */
+    string cache_key = string(LC_USBNET_PATH " ") + ri.serial1 + ri.serial2 +
+        ri.serial3;
+    if (!LoadIdentity(cache_key, ri)) {
+        debug("Using cached identity");
+        return 0;
+    }
+
     // Get region info - everything below is extra stuff that only the
     // usbnet remotes seem to use.
     uint8_t rr[] = { 1, 1, 1 }; // AddByteParam(1);
@@ -1096,7 +1215,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         return LC_ERROR;
     }
     uint8_t rgn[64];
-    if ((err = Read(status, len, rgn))) {
+    if ((err = Read(status, len, rgn, sizeof(rgn)))) {
         debug("Failed to read from remote");
         return LC_ERROR;
     }
@@ -1115,7 +1234,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
             return LC_ERROR;
         }
         uint8_t rgz[64];
-        if ((err = Read(status, len, rgz))) {
+        if ((err = Read(status, len, rgz, sizeof(rgz)))) {
             debug("Failed to read from remote");
             return LC_ERROR;
         }
@@ -1135,7 +1254,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
                 return LC_ERROR;
             }
             uint8_t rgv[64];
-            if ((err = Read(status, len, rgv))) {
+            if ((err = Read(status, len, rgv, sizeof(rgv)))) {
                 debug("Failed to read from remote");
                 return LC_ERROR;
             }
@@ -1153,7 +1272,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         debug("Failed to write to remote");
         return LC_ERROR;
     }
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read from remote");
         return LC_ERROR;
     }
@@ -1164,7 +1283,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         debug("Failed to write to remote");
         return LC_ERROR;
     }
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read from remote");
         return LC_ERROR;
     }
@@ -1176,7 +1295,7 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         debug("Failed to write to remote");
         return LC_ERROR;
     }
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("Failed to read from remote");
         return LC_ERROR;
     }
@@ -1195,7 +1314,9 @@ int CRemoteZ_Base::GetIdentity(TRemoteInfo &ri, THIDINFO &hid, lc_callback cb,
         debug("Failed to read XML User RF Settings");
         return LC_ERROR;
     }
-    
+
+    SaveIdentity(cache_key, ri);
+
     return 0;
 }
 
@@ -1248,7 +1369,7 @@ int CRemoteZ_HID::ReadRegion(uint8_t region, uint32_t &rgn_len, uint8_t *rd,
     }
 
     /* Make sure the remote is ready to start the TCP transfer */
-    if ((err = Read(status, rlen, rsp))) {
+    if ((err = Read(status, rlen, rsp, sizeof(rsp)))) {
         debug("Failed to read from remote");
         return LC_ERROR_READ;
     }
@@ -1363,7 +1484,7 @@ int CRemoteZ_HID::ReadRegion(uint8_t region, uint32_t &rgn_len, uint8_t *rd,
     }
 
     /* Return TCP state to initial conditions */
-    SYN_ACKED = false;
+    m_tcp.Reset();
 
     if (cb) {
         cb(cb_stage, cb_count++, data_read, data_read, LC_CB_COUNTER_TYPE_BYTES,
@@ -1437,7 +1558,7 @@ int CRemoteZ_Base::GetTime(const TRemoteInfo &ri, THarmonyTime &ht)
     uint8_t time[60];
     unsigned int len;
     uint8_t status;
-    if ((err = Read(status, len, time))) {
+    if ((err = Read(status, len, time, sizeof(time)))) {
         debug("Failed to read to remote");
         return LC_ERROR_READ;
     }
@@ -1496,7 +1617,7 @@ int CRemoteZ_Base::SetTime(const TRemoteInfo &ri, const THarmonyTime &ht,
     uint8_t rsp[60];
     unsigned int len;
     uint8_t status;
-    if ((err = Read(status, len, rsp))) {
+    if ((err = Read(status, len, rsp, sizeof(rsp)))) {
         debug("failed to read from remote");
         return LC_ERROR_READ;
     }
@@ -1545,6 +1666,142 @@ int CRemoteZ_HID::TCPSendAndCheck(uint8_t cmd, uint32_t len, uint8_t *data,
     return 0;
 }
 
+void CRemoteZ_HID::SetTCPWindow(unsigned int segments)
+{
+    if (segments < 1)
+        segments = 1;
+    if (segments > ZHID_TCP_MAX_WINDOW)
+        segments = ZHID_TCP_MAX_WINDOW;
+    m_tx_window = segments;
+}
+
+/*
+ * Send 'len' bytes as a stream of 'cmd' segments of up to 58 bytes each,
+ * keeping up to m_tx_window of them unacked.
+ *
+ * Each segment advances our sequence number by its TCP payload (the data
+ * plus the type and command bytes), and the remote acks cumulatively, so an
+ * ack equal to the end of some in-flight segment retires it and everything
+ * before it. If no ack comes within ZHID_TCP_RTO we go back and resend from
+ * the oldest unacked segment, for up to ZHID_TCP_ACK_TIMEOUT without one. A
+ * slow ack is only the remote being busy, so that keeps the window.
+ *
+ * An ack that doesn't line up with an in-flight segment while more than one
+ * is in flight is taken to mean the remote doesn't do windows. We then drop
+ * to stop-and-wait for good, take in whatever acks are still on their way
+ * and resend from the oldest segment still unacked.
+ */
+int CRemoteZ_HID::TCPSendWindowed(uint8_t cmd, uint32_t len,
+                                  const uint8_t *data, lc_callback cb,
+                                  void *cb_arg, uint32_t cb_stage)
+{
+    struct {
+        uint32_t off;
+        uint32_t len;
+        uint8_t end;
+    } segs[ZHID_TCP_MAX_WINDOW];
+    unsigned int head = 0;
+    unsigned int inflight = 0;
+    uint32_t sent = 0;
+    uint32_t acked = 0;
+    /* the sequence number at 'acked', and at 'sent' */
+    uint8_t acked_seq = m_tcp.last_ack;
+    uint8_t nxt = acked_seq;
+    std::chrono::steady_clock::time_point last_ack =
+        std::chrono::steady_clock::now();
+    int cb_count = 0;
+    int err;
+    uint8_t rsp[60];
+    uint8_t status;
+    unsigned int rlen;
+
+    /* retire the segments an ack covers; false if it isn't for any */
+    auto take_ack = [&](uint8_t ack) {
+        unsigned int n;
+        for (n = 0; n < inflight; n++) {
+            if (segs[(head + n) % ZHID_TCP_MAX_WINDOW].end == ack)
+                break;
+        }
+        if (n == inflight)
+            return false;
+        unsigned int i = (head + n) % ZHID_TCP_MAX_WINDOW;
+        acked = segs[i].off + segs[i].len;
+        acked_seq = segs[i].end;
+        head = (i + 1) % ZHID_TCP_MAX_WINDOW;
+        inflight -= n + 1;
+        last_ack = std::chrono::steady_clock::now();
+        if (cb) {
+            cb(cb_stage, cb_count++, acked, len, LC_CB_COUNTER_TYPE_BYTES,
+               cb_arg, NULL);
+        }
+        return true;
+    };
+
+    if (m_tx_window > ZHID_TCP_MAX_WINDOW)
+        m_tx_window = ZHID_TCP_MAX_WINDOW;
+
+    while (acked < len) {
+        while (sent < len && inflight < m_tx_window) {
+            unsigned int i = (head + inflight) % ZHID_TCP_MAX_WINDOW;
+            segs[i].off = sent;
+            segs[i].len = len - sent < 58 ? len - sent : 58;
+            debug("DATA seq %02X, sending %d bytes, %d bytes left", nxt,
+                  segs[i].len, len - sent - segs[i].len);
+            if ((err = TCP_Send(TYPE_TCP_ACK, nxt,
+                                m_tcp.last_seq + m_tcp.last_payload_bytes,
+                                TYPE_REQUEST, cmd, segs[i].len,
+                                data + sent))) {
+                debug("Failed to send request %02X", cmd);
+                return LC_ERROR_WRITE;
+            }
+            nxt += segs[i].len + HID_UDP_HDR_SIZE;
+            segs[i].end = nxt;
+            sent += segs[i].len;
+            inflight++;
+        }
+
+        bool resync = false;
+        if ((err = TCP_Read(status, rlen, rsp, ZHID_TCP_RTO))) {
+            debug("No ack for seq %02X after %dms", segs[head].end,
+                  ZHID_TCP_RTO);
+            resync = true;
+        } else if (rsp[0] != TYPE_TCP_ACK) {
+            debug("Packet wasn't an ACK!");
+            resync = true;
+        } else if (!take_ack(rsp[2])) {
+            debug("Ack %02X doesn't match any segment", rsp[2]);
+            resync = true;
+            if (m_tx_window > 1) {
+                debug("Remote rejected a window of %d, using stop-and-wait",
+                      m_tx_window);
+                m_tx_window = 1;
+                /* take in the acks still on their way from the remote */
+                while (!TCP_Read(status, rlen, rsp, 100)) {
+                    if (rsp[0] == TYPE_TCP_ACK)
+                        take_ack(rsp[2]);
+                }
+            }
+        }
+
+        if (!resync || acked >= len)
+            continue;
+
+        if (std::chrono::steady_clock::now() - last_ack >=
+            std::chrono::milliseconds(ZHID_TCP_ACK_TIMEOUT)) {
+            debug("Giving up after %dms without an ack",
+                  ZHID_TCP_ACK_TIMEOUT);
+            return LC_ERROR_READ;
+        }
+        /* go back to the oldest unacked segment */
+        Stats_Retry();
+        sent = acked;
+        nxt = acked_seq;
+        inflight = 0;
+    }
+
+    return 0;
+}
+
 int CRemoteZ_HID::UpdateConfig(const uint32_t len, const uint8_t *wr,
                                lc_callback cb, void *cb_arg, uint32_t cb_stage,
                                uint32_t xml_size, uint8_t *xml)
@@ -1565,7 +1822,7 @@ int CRemoteZ_HID::UpdateConfig(const uint32_t len, const uint8_t *wr,
     uint8_t status;
 
     /* Make sure the remote is ready to start the TCP transfer */
-    if ((err = Read(status, rlen, rsp))) {
+    if ((err = Read(status, rlen, rsp, sizeof(rsp)))) {
         debug("Failed to read from remote");
         return LC_ERROR_READ;
     }
@@ -1630,29 +1887,9 @@ int CRemoteZ_HID::UpdateConfig(const uint32_t len, const uint8_t *wr,
 
     /* write data */
     debug("UPDATE_DATA");
-    int pkt_len;
-    int tlen = len;
-    uint8_t *wr_ptr = const_cast<uint8_t*>(wr);
-    while (tlen) {
-        pkt_len = 58;
-        if (tlen < pkt_len) {
-            pkt_len = tlen;
-        }
-        tlen -= pkt_len;
-
-        debug("DATA %d, sending %d bytes, %d bytes left", cb_count,
-              pkt_len, tlen);
-
-        if ((err = TCPSendAndCheck(COMMAND_WRITE_UPDATE_DATA, pkt_len,
-            wr_ptr, true))) {
-            return err;
-        }
-        wr_ptr += pkt_len;
-
-        if (cb) {
-            cb(LC_CB_STAGE_WRITE_CONFIG, cb_count++, (int)(wr_ptr - wr), len,
-               LC_CB_COUNTER_TYPE_BYTES, cb_arg, NULL);
-        }
+    if ((err = TCPSendWindowed(COMMAND_WRITE_UPDATE_DATA, len, wr, cb, cb_arg,
+                               LC_CB_STAGE_WRITE_CONFIG))) {
+        return err;
     }
 
     /* write update-done */
@@ -1781,7 +2018,7 @@ int CRemoteZ_HID::UpdateConfig(const uint32_t len, const uint8_t *wr,
      */
 
     /* Return TCP state to initial conditions */
-    SYN_ACKED = false;
+    m_tcp.Reset();
 
     return 0;
 }
@@ -0,0 +1,345 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "transfer_stats.h"
+#include "protocol.h"
+#include "protocol_z.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Our own codes, for reports that carry no command */
+#define STATS_CMD_DATA 0x1000
+#define STATS_CMD_TCP_ACK 0x1001
+
+struct TStatsName {
+    uint32_t code;
+    const char *name;
+};
+
+#define STATS_NAME(cmd) { COMMAND_##cmd, #cmd }
+
+/* The low nibble of a classic command is its length, so it's masked off */
+static const TStatsName classic_names[] = {
+    STATS_NAME(INVALID),
+    STATS_NAME(GET_VERSION),
+    STATS_NAME(WRITE_FLASH),
+    STATS_NAME(WRITE_FLASH_DATA),
+    STATS_NAME(READ_FLASH),
+    STATS_NAME(START_IRCAP),
+    STATS_NAME(STOP_IRCAP),
+    STATS_NAME(WRITE_MISC),
+    STATS_NAME(READ_MISC),
+    { COMMAND_ERASE_FLASH & COMMAND_MASK, "ERASE_FLASH" },
+    { COMMAND_RESET & COMMAND_MASK, "RESET" },
+    { COMMAND_DONE & COMMAND_MASK, "DONE" },
+    { 0, NULL }
+};
+
+static const TStatsName z_names[] = {
+    STATS_NAME(INVALID),
+    STATS_NAME(EXECUTE_ACTION),
+    STATS_NAME(EXECUTE_REPEATED_ACTION),
+    STATS_NAME(CONTINUE_REPEATED_ACTION),
+    STATS_NAME(FINISH_REPEATED_ACTION),
+    STATS_NAME(INITIATE_DIAGNOSTIC_TCP_CHANNEL),
+    STATS_NAME(UDP_ECHO),
+    STATS_NAME(UDP_PING),
+    STATS_NAME(TCP_ECHO),
+    STATS_NAME(TCP_PING),
+    STATS_NAME(READ_MEMORY_HEADER),
+    STATS_NAME(READ_MEMORY_DATA),
+    STATS_NAME(READ_MEMORY_DONE),
+    STATS_NAME(WRITE_MEMORY_HEADER),
+    STATS_NAME(WRITE_MEMORY_DATA),
+    STATS_NAME(WRITE_MEMORY_DONE),
+    STATS_NAME(Z_RESET),
+    STATS_NAME(CALCULATE_CHECKSUM),
+    STATS_NAME(INITIATE_UPDATE_TCP_CHANNEL),
+    STATS_NAME(START_UPDATE),
+    STATS_NAME(WRITE_UPDATE_HEADER),
+    STATS_NAME(WRITE_UPDATE_DATA),
+    STATS_NAME(WRITE_UPDATE_DATA_DONE),
+    STATS_NAME(GET_UPDATE_CHECKSUM),
+    STATS_NAME(FINISH_UPDATE),
+    STATS_NAME(READ_REGION),
+    STATS_NAME(READ_REGION_DATA),
+    STATS_NAME(READ_REGION_DONE),
+    STATS_NAME(START_RAW_IR_TCP_CHANNEL),
+    STATS_NAME(CACHE_RAW_IR_HEADER),
+    STATS_NAME(CACHE_RAW_IR_DATA),
+    STATS_NAME(CACHE_RAW_IR_DONE),
+    STATS_NAME(EXECUTE_RAW_IR),
+    STATS_NAME(START_RAW_IR),
+    STATS_NAME(CONTINUE_RAW_IR),
+    STATS_NAME(FINISH_RAW_IR),
+    STATS_NAME(INITIATE_SYSTEM_TCP_CHANNEL),
+    STATS_NAME(GET_SYSTEM_INFO),
+    STATS_NAME(GET_INTERFACE_LIST),
+    STATS_NAME(IS_INTERFACE_SUPPORTED),
+    STATS_NAME(GET_GUID),
+    STATS_NAME(SET_GUID),
+    STATS_NAME(GET_NAME),
+    STATS_NAME(SET_NAME),
+    STATS_NAME(GET_LOCATION),
+    STATS_NAME(SET_LOCATION),
+    STATS_NAME(GET_REGION_IDS),
+    STATS_NAME(GET_REGION_VERSION),
+    STATS_NAME(GET_CURRENT_TIME),
+    STATS_NAME(UPDATE_TIME),
+    STATS_NAME(INITIATE_ZWAVE_TCP_CHANNEL),
+    STATS_NAME(SEND_LONG_ZWAVE_REQUEST_HEADER),
+    STATS_NAME(SEND_LONG_ZWAVE_REQUEST_DATA),
+    STATS_NAME(SEND_LONG_ZWAVE_REQUEST_DATA_DONE),
+    STATS_NAME(SEND_SHORT_ZWAVE_REQUEST),
+    STATS_NAME(SEND_SHORT_ZWAVE_RESPONSE),
+    STATS_NAME(SET_NODE_ID),
+    STATS_NAME(GET_NODE_ID),
+    STATS_NAME(SET_HOME_ID),
+    STATS_NAME(GET_HOME_ID),
+    STATS_NAME(SEND_LONG_ZWAVE_RESPONSE_HEADER),
+    STATS_NAME(SEND_LONG_ZWAVE_RESPONSE_DATA),
+    STATS_NAME(SEND_LONG_ZWAVE_RESPONSE_DATA_DONE),
+    STATS_NAME(INITIATE_LEARNIR_TCP_CHANNEL),
+    STATS_NAME(LEARNIR_START),
+    STATS_NAME(LEARNIR_SINGLE),
+    STATS_NAME(LEARNIR_STREAM),
+    STATS_NAME(LEARNIR_DONE),
+    STATS_NAME(LEARNIR_STOP),
+    STATS_NAME(RESET_TEST_FLAG),
+    { 0, NULL }
+};
+
+/* remote_mh.cpp has no names for these, so they're named for their use */
+static const TStatsName mh_names[] = {
+    { 0x00, "HELLO" },
+    { 0x01, "OPEN_FILE" },
+    { 0x03, "WRITE_ACK" },
+    { 0x04, "READ_ACK" },
+    { 0x05, "FINISH" },
+    { 0x06, "STOP" },
+    { 0x07, "RESET_SEQUENCE" },
+    { 0xFF, "RESET" },
+    { 0, NULL }
+};
+
+static const TStatsName own_names[] = {
+    { STATS_CMD_DATA, "DATA" },
+    { STATS_CMD_TCP_ACK, "TCP_ACK" },
+    { 0, NULL }
+};
+
+static thread_local TTransferStats *cur_stats = NULL;
+
+TTransferStats::TTransferStats()
+    : protocol(STATS_UNKNOWN), last_cmd(0), awaiting(false), awaiting_cmd(0),
+      retry(false)
+{
+}
+
+static uint32_t command_of(TStatsProtocol protocol, const uint8_t *data,
+                           unsigned int len)
+{
+    if (len < 2)
+        return len ? data[0] : 0;
+
+    switch (protocol) {
+    case STATS_CLASSIC:
+        return data[0] & COMMAND_MASK;
+    case STATS_ZHID:
+        /*
+         * "UDP" is length, 1, type, command; "TCP" is length, flags,
+         * seq, ack, type, command, or just the first four for an ack.
+         */
+        if (data[1] == 1)
+            return data[3];
+        return data[0] >= 5 ? data[5] : STATS_CMD_TCP_ACK;
+    case STATS_USBNET:
+        return (data[0] & 0x0F) << 8 | data[1];
+    case STATS_MH:
+        return data[0] == 0xFF ? data[1] : STATS_CMD_DATA;
+    default:
+        return data[0];
+    }
+}
+
+static void command_name(TStatsProtocol protocol, uint32_t code, char *name)
+{
+    const TStatsName *names = own_names;
+
+    if (code < STATS_CMD_DATA) {
+        switch (protocol) {
+        case STATS_CLASSIC:
+            names = classic_names;
+            break;
+        case STATS_ZHID:
+        case STATS_USBNET:
+            names = z_names;
+            break;
+        case STATS_MH:
+            names = mh_names;
+            break;
+        default:
+            names = NULL;
+            break;
+        }
+    }
+
+    for (; names && names->name; names++) {
+        if (names->code == code) {
+            snprintf(name, LC_STATS_NAME_LENGTH, "%s", names->name);
+            return;
+        }
+    }
+    snprintf(name, LC_STATS_NAME_LENGTH, "0x%02X", code);
+}
+
+static unsigned int latency_bucket(uint64_t us)
+{
+    unsigned int i = 0;
+    uint64_t limit = LC_STATS_LATENCY_BASE_US;
+
+    while (us >= limit && i < LC_STATS_LATENCY_BUCKETS - 1) {
+        limit <<= 1;
+        i++;
+    }
+    return i;
+}
+
+static void add_stats(lc_command_stats &to, const lc_command_stats &from)
+{
+    to.reports_out += from.reports_out;
+    to.reports_in += from.reports_in;
+    to.bytes_out += from.bytes_out;
+    to.bytes_in += from.bytes_in;
+    to.round_trips += from.round_trips;
+    to.timeouts += from.timeouts;
+    to.retries += from.retries;
+    to.latency_total += from.latency_total;
+    if (from.latency_max > to.latency_max)
+        to.latency_max = from.latency_max;
+    for (int i = 0; i < LC_STATS_LATENCY_BUCKETS; i++)
+        to.latency[i] += from.latency[i];
+}
+
+void Stats_Reset(TTransferStats &stats)
+{
+    stats.cmds.clear();
+    stats.awaiting = false;
+    stats.retry = false;
+}
+
+void Stats_Get(const TTransferStats &stats, lc_transfer_stats &out)
+{
+    memset(&out, 0, sizeof(out));
+
+    map<uint32_t, lc_command_stats>::const_iterator it;
+    for (it = stats.cmds.begin(); it != stats.cmds.end(); it++) {
+        add_stats(out.total, it->second);
+        if (out.num_commands == LC_STATS_MAX_COMMANDS)
+            continue;
+        lc_command_stats &cs = out.command[out.num_commands++];
+        cs = it->second;
+        cs.code = it->first;
+        command_name(stats.protocol, it->first, cs.name);
+    }
+}
+
+void Stats_Select(TTransferStats *stats)
+{
+    cur_stats = stats;
+}
+
+void Stats_Forget(TTransferStats *stats)
+{
+    if (cur_stats == stats)
+        cur_stats = NULL;
+}
+
+TStatsProtocol Stats_Protocol()
+{
+    return cur_stats ? cur_stats->protocol : STATS_UNKNOWN;
+}
+
+/*
+ * Reports sent back-to-back before anything comes back (a batch of misc
+ * reads, a window of TCP segments) make one round trip, timed from the
+ * first of them and put down to its command.
+ */
+void Stats_Sent(const uint8_t *data, unsigned int len)
+{
+    TTransferStats *st = cur_stats;
+    if (!st)
+        return;
+
+    const uint32_t cmd = command_of(st->protocol, data, len);
+    lc_command_stats &cs = st->cmds[cmd];
+    cs.reports_out++;
+    cs.bytes_out += len;
+    if (st->retry) {
+        cs.retries++;
+        st->retry = false;
+    }
+
+    st->last_cmd = cmd;
+    if (!st->awaiting) {
+        st->awaiting = true;
+        st->awaiting_cmd = cmd;
+        st->sent_at = chrono::steady_clock::now();
+    }
+}
+
+void Stats_Received(unsigned int len)
+{
+    TTransferStats *st = cur_stats;
+    if (!st)
+        return;
+
+    lc_command_stats &cs = st->cmds[st->last_cmd];
+    cs.reports_in++;
+    cs.bytes_in += len;
+
+    if (!st->awaiting)
+        return;
+    st->awaiting = false;
+
+    const uint64_t us = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - st->sent_at).count();
+    lc_command_stats &rt = st->cmds[st->awaiting_cmd];
+    rt.round_trips++;
+    rt.latency_total += us;
+    if (us > rt.latency_max)
+        rt.latency_max = us;
+    rt.latency[latency_bucket(us)]++;
+}
+
+void Stats_Timeout()
+{
+    TTransferStats *st = cur_stats;
+    if (!st)
+        return;
+
+    st->cmds[st->last_cmd].timeouts++;
+    /* whatever turns up later isn't an answer we can time */
+    st->awaiting = false;
+}
+
+void Stats_Retry()
+{
+    if (cur_stats)
+        cur_stats->retry = true;
+}
@@ -0,0 +1,72 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TRANSFER_STATS_H
+#define TRANSFER_STATS_H
+
+#include "lc_internal.h"
+#include "libconcord.h"
+#include <chrono>
+#include <map>
+
+/* How to tell which command a report sent carries */
+enum TStatsProtocol {
+    STATS_UNKNOWN,
+    STATS_CLASSIC,
+    STATS_ZHID,
+    STATS_USBNET,
+    STATS_MH
+};
+
+/*
+ * What a session has sent and received, see lc_get_transfer_stats(). The
+ * counting is done by the transport backends, against whichever session
+ * the calling thread last selected with Stats_Select().
+ */
+struct TTransferStats {
+    TTransferStats();
+
+    TStatsProtocol protocol;
+    map<uint32_t, lc_command_stats> cmds;
+    /* what came back is put down to the command last sent */
+    uint32_t last_cmd;
+    /* a command has gone out and nothing has come back since */
+    bool awaiting;
+    uint32_t awaiting_cmd;
+    chrono::steady_clock::time_point sent_at;
+    /* the next report sent repeats one that failed */
+    bool retry;
+};
+
+void Stats_Reset(TTransferStats &stats);
+void Stats_Get(const TTransferStats &stats, lc_transfer_stats &out);
+
+void Stats_Select(TTransferStats *stats);
+/* Stop counting against 'stats' in this thread, if we were */
+void Stats_Forget(TTransferStats *stats);
+/* The kind of remote this thread is talking to, as far as we know */
+TStatsProtocol Stats_Protocol();
+
+/* For the transport backends */
+void Stats_Sent(const uint8_t *data, unsigned int len);
+void Stats_Received(unsigned int len);
+void Stats_Timeout();
+/* For the protocol code, when it's about to send something again */
+void Stats_Retry();
+
+#endif
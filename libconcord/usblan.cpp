@@ -27,8 +27,12 @@
 
 #ifdef _WIN32
 #include <winsock.h>
+typedef int socklen_t;
 #else
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #define closesocket close
@@ -43,8 +47,32 @@
 
 #include "libconcord.h"
 #include "lc_internal.h"
+#include "transfer_stats.h"
+#include "capture.h"
+
+/* emulator.cpp provides all of this when we're built against the emulator */
+#ifndef WANT_EMULATOR
 
 static SOCKET sock = INVALID_SOCKET;
+/*
+ * StartUsbLanConnect()'s connection until FinishUsbLanConnect() makes it
+ * 'sock', so a connect that loses to a HID remote leaves 'sock' alone
+ */
+static SOCKET pending_sock = INVALID_SOCKET;
+/* ProbeUsbLanRemote()'s own connection, so it never disturbs 'sock' */
+static SOCKET probe_sock = INVALID_SOCKET;
+
+/*
+ * Receive buffer for the remote's message stream. Bytes between rx_head and
+ * rx_tail have been received but not yet handed out. The buffer is reused
+ * for the whole connection; unread bytes are only slid back to the start
+ * when a message would otherwise run off the end, so every message handed
+ * out is contiguous and can be parsed in place.
+ */
+#define USBLAN_RX_BUF_SIZE 8192
+static uint8_t rx_buf[USBLAN_RX_BUF_SIZE];
+static unsigned int rx_head = 0;
+static unsigned int rx_tail = 0;
 
 const char * const remote_ip_address = "169.254.1.2";
 const uint16_t remote_port = 3074;
@@ -65,9 +93,13 @@ int ShutdownUsbLan(void)
 {
     int err=0;
 
+    rx_head = rx_tail = 0;
+
     // Close the socket
     if (sock != INVALID_SOCKET) {
-        if ((err = closesocket(sock))) {
+        err = closesocket(sock);
+        sock = INVALID_SOCKET;
+        if (err) {
             report_net_error("closesocket()");
             return LC_ERROR_OS_NET;
         }
@@ -76,33 +108,30 @@ int ShutdownUsbLan(void)
     return 0;
 }
 
-int FindUsbLanRemote(void)
+/*
+ * Start a non-blocking connect to the remote, so callers can get on with
+ * something else (like looking for HID remotes) while it completes. The
+ * remote's address is fixed and numeric, so there is no resolver call.
+ */
+static int StartConnect(SOCKET &sock)
 {
     int err;
 
-    hostent* addr = gethostbyname(remote_ip_address);
-
-    if (!addr) {
-        report_net_error("gethostbyname()");
-        return LC_ERROR_OS_NET;
-    }
-
     sockaddr_in sa;
-    memcpy(&(sa.sin_addr), addr->h_addr, addr->h_length);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_addr.s_addr = inet_addr(remote_ip_address);
     sa.sin_family = AF_INET;        // TCP/IP
     sa.sin_port = htons(remote_port);    // Port 3074
 
     sock = socket(sa.sin_family, SOCK_STREAM, 0);    // TCP
     //sock = socket(sa.sin_family, SOCK_DGRAM, 0);    // UDP
+    if (sock == INVALID_SOCKET) {
+        report_net_error("socket()");
+        return LC_ERROR_OS_NET;
+    }
 
     // Make the socket non-blocking so it doesn't hang on systems that 
     // don't have a usbnet remote.
-    fd_set wset;
-    FD_ZERO(&wset);
-    FD_SET(sock, &wset);
-    struct timeval tv;
-    tv.tv_sec = connect_timeout;
-    tv.tv_usec = 0;
 #ifdef _WIN32
     u_long non_blocking = 1;
     if(ioctlsocket(sock, FIONBIO, &non_blocking) != 0) {
@@ -132,20 +161,48 @@ int FindUsbLanRemote(void)
         }
     }
 
+    return 0;
+}
+
+/*
+ * Wait up to connect_timeout for a connect started by StartConnect() and
+ * put the socket back into blocking mode.
+ */
+static int FinishConnect(SOCKET &sock)
+{
+    int err;
+
+    fd_set wset;
+    FD_ZERO(&wset);
+    FD_SET(sock, &wset);
+    struct timeval tv;
+    tv.tv_sec = connect_timeout;
+    tv.tv_usec = 0;
+
     if ((err = select(sock+1, NULL, &wset, NULL, &tv)) <= 0) {
         report_net_error("select()");
         return LC_ERROR_OS_NET;
     }
 
+    /* writable just means the connect is over, not that it worked */
+    int so_error = 0;
+    socklen_t so_len = sizeof(so_error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR,
+                   reinterpret_cast<char*>(&so_error), &so_len) || so_error) {
+        debug("connect() failed: %i", so_error);
+        return LC_ERROR_OS_NET;
+    }
+
     // Change the socket back to blocking which should be fine now that we
     // connected.
 #ifdef _WIN32
-    non_blocking = 0;
+    u_long non_blocking = 0;
     if(ioctlsocket(sock, FIONBIO, &non_blocking) != 0) {
         report_net_error("ioctlsocket()");
         return LC_ERROR_OS_NET;
     }
 #else
+    int flags = 0;
     if((flags = fcntl(sock, F_GETFL, 0)) < 0) {
         report_net_error("fcntl()");
         return LC_ERROR_OS_NET;
@@ -161,6 +218,102 @@ int FindUsbLanRemote(void)
     return 0;
 }
 
+static void CloseConnect(SOCKET &sock)
+{
+    if (sock != INVALID_SOCKET) {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+}
+
+int StartUsbLanConnect(void)
+{
+    int err;
+
+    CloseConnect(pending_sock);
+    if ((err = StartConnect(pending_sock)))
+        CloseConnect(pending_sock);
+
+    return err;
+}
+
+int FinishUsbLanConnect(void)
+{
+    int err;
+
+    if (pending_sock == INVALID_SOCKET)
+        return LC_ERROR_OS_NET;
+    if ((err = FinishConnect(pending_sock))) {
+        CloseConnect(pending_sock);
+        return err;
+    }
+
+    /*
+     * Config updates keep several small requests in flight; don't let Nagle
+     * hold them back waiting for the remote's acks.
+     */
+    int nodelay = 1;
+    if (setsockopt(pending_sock, IPPROTO_TCP, TCP_NODELAY,
+                   reinterpret_cast<char*>(&nodelay), sizeof(nodelay))) {
+        report_net_error("setsockopt()");
+        CloseConnect(pending_sock);
+        return LC_ERROR_OS_NET;
+    }
+
+    CloseConnect(sock);
+    rx_head = rx_tail = 0;
+    sock = pending_sock;
+    pending_sock = INVALID_SOCKET;
+
+    return 0;
+}
+
+void CancelUsbLanConnect(void)
+{
+    CloseConnect(pending_sock);
+}
+
+int FindUsbLanRemote(void)
+{
+    int err;
+
+    if ((err = StartUsbLanConnect()))
+        return err;
+
+    return FinishUsbLanConnect();
+}
+
+/*
+ * The probe calls check whether a usbnet remote answers on a connection of
+ * their own, without disturbing the one FindUsbLanRemote() may have open.
+ */
+int StartUsbLanProbe(void)
+{
+    int err;
+
+    CloseConnect(probe_sock);
+    if ((err = StartConnect(probe_sock)))
+        CloseConnect(probe_sock);
+
+    return err;
+}
+
+int FinishUsbLanProbe(void)
+{
+    int err = LC_ERROR_OS_NET;
+
+    if (probe_sock != INVALID_SOCKET)
+        err = FinishConnect(probe_sock);
+    CloseConnect(probe_sock);
+
+    return err;
+}
+
+void CancelUsbLanProbe(void)
+{
+    CloseConnect(probe_sock);
+}
+
 int UsbLan_Write(unsigned int len, uint8_t *data)
 {
     int err = send(sock, reinterpret_cast<char*>(data), len, 0);
@@ -171,23 +324,89 @@ int UsbLan_Write(unsigned int len, uint8_t *data)
     }
 
     debug("%i bytes sent", err);
+    Stats_Sent(data, len);
+    Capture_Report(CAPTURE_OUT, data, len);
 
     return 0;
 }
 
 
-int UsbLan_Read(unsigned int &len, uint8_t *data)
+/*
+ * Work out how long the message at the start of 'buf' is: the 3-byte header,
+ * the parameter count and then each parameter's length byte and data.
+ * Returns 0 if 'len' bytes aren't enough to tell yet.
+ */
+static unsigned int message_len(const uint8_t *buf, unsigned int len)
 {
-    int err = recv(sock, reinterpret_cast<char*>(data), len, 0);
+    if (len < 4)
+        return 0;
+
+    unsigned int i = 4;
+    for (unsigned int n = 0; n < buf[3]; n++) {
+        if (i >= len)
+            return 0;
+        unsigned int param_len = buf[i];
+        switch (param_len & 0xC0) {
+            case 0x00:
+            case 0x80:
+                param_len &= 0x3F;
+                break;
+            case 0x40:
+                param_len = (param_len & 0x3F) * 4;
+                break;
+            case 0xC0:
+                param_len = (param_len & 0x3F) * 512;
+                break;
+        }
+        i += 1 + param_len;
+    }
 
-    if (err == SOCKET_ERROR) {
-        report_net_error("recv()");
-        len = 0;
-        return LC_ERROR_OS_NET;
-    } 
+    return i <= len ? i : 0;
+}
 
-    len = static_cast<unsigned int>(err);
-    debug("%i bytes received", len);
+/*
+ * TCP is free to split or merge the remote's messages, so receive until the
+ * buffer holds at least one whole message and point 'msg' at it. The view
+ * stays valid until the next call; anything received past it is kept for
+ * later calls, so one recv() can serve several messages.
+ */
+int UsbLan_ReadMessage(uint8_t *&msg, unsigned int &len)
+{
+    unsigned int msg_len;
+
+    while (!(msg_len = message_len(rx_buf + rx_head, rx_tail - rx_head))) {
+        if (rx_tail == USBLAN_RX_BUF_SIZE) {
+            if (!rx_head) {
+                debug("No message in %i received bytes", rx_tail);
+                rx_tail = 0;
+                return LC_ERROR_INVALID_DATA_FROM_REMOTE;
+            }
+            memmove(rx_buf, rx_buf + rx_head, rx_tail - rx_head);
+            rx_tail -= rx_head;
+            rx_head = 0;
+        }
+
+        int err = recv(sock, reinterpret_cast<char*>(rx_buf + rx_tail),
+                       USBLAN_RX_BUF_SIZE - rx_tail, 0);
+        if (err == SOCKET_ERROR) {
+            report_net_error("recv()");
+            return LC_ERROR_OS_NET;
+        }
+        if (!err) {
+            debug("Connection closed by remote");
+            return LC_ERROR_READ;
+        }
+        debug("%i bytes received", err);
+        rx_tail += err;
+    }
+
+    msg = rx_buf + rx_head;
+    len = msg_len;
+    Stats_Received(msg_len);
+    Capture_Report(CAPTURE_IN, msg, msg_len);
+    rx_head += msg_len;
+    if (rx_head == rx_tail)
+        rx_head = rx_tail = 0;
 
     return 0;
 }
@@ -198,15 +417,9 @@ int GetXMLUserRFSetting(char **data)
     int web_sock;
     char buf[4096];
 
-    hostent* addr = gethostbyname(remote_ip_address);
-
-    if (!addr) {
-        report_net_error("gethostbyname()");
-        return LC_ERROR_OS_NET;
-    }
-
     sockaddr_in sa;
-    memcpy(&(sa.sin_addr), addr->h_addr, addr->h_length);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_addr.s_addr = inet_addr(remote_ip_address);
     sa.sin_family = AF_INET;        // TCP/IP
     sa.sin_port = htons(80);                // Web Server port
 
@@ -251,3 +464,5 @@ int GetXMLUserRFSetting(char **data)
 
     return 0;
 }
+
+#endif
@@ -26,8 +26,14 @@
 int InitializeUsbLan(void);
 int ShutdownUsbLan(void);
 int FindUsbLanRemote(void);
+int StartUsbLanConnect(void);
+int FinishUsbLanConnect(void);
+void CancelUsbLanConnect(void);
+int StartUsbLanProbe(void);
+int FinishUsbLanProbe(void);
+void CancelUsbLanProbe(void);
 int UsbLan_Write(unsigned int len, uint8_t *data);
-int UsbLan_Read(unsigned int &len, uint8_t *data);
+int UsbLan_ReadMessage(uint8_t *&msg, unsigned int &len);
 int GetXMLUserRFSetting(char **data);
 
 #endif
@@ -20,12 +20,14 @@
  */
 
 #include <stdarg.h>
+#include <ctype.h>
 #include <string.h>
 #include <curl/curl.h>
 #include "libconcord.h"
 #include "lc_internal.h"
 #include "hid.h"
 #include "remote.h"
+#include "web.h"
 #include "xml_headers.h"
 
 static const uint8_t urlencodemap[32]={
@@ -148,7 +150,7 @@ static int Zap(string &server, string &path, string &cookie, string &post)
 // <ELEMENT A="B" C="D"/> and you search for a tag called "ELEMENT" the
 // function will return A="B" C="D".
 int GetTag(const char *find, uint8_t* data, uint32_t data_size, uint8_t *&found,
-           string *s=NULL, bool find_attributes=false)
+           string *s, bool find_attributes)
 {
     char tag_name_end = '>';
     char tag_start = '<';
@@ -224,6 +226,145 @@ int GetTag(const char *find, uint8_t* data, uint32_t data_size, uint8_t *&found,
     }
 }
 
+static string upper_case(const uint8_t *str, uint32_t len)
+{
+    string upper(reinterpret_cast<const char*>(str), len);
+    for (uint32_t i = 0; i < len; i++)
+        upper[i] = toupper(upper[i]);
+    return upper;
+}
+
+/*
+ * Tokenize the way GetTag() scans: from each '<', the tag name runs up to
+ * the first '>' or space, and the next tag is looked for after the '>'.
+ */
+void XmlIndex::Build(uint8_t *data, uint32_t data_size)
+{
+    xml = data;
+    xml_size = data_size;
+    tags.clear();
+    names.clear();
+
+    uint32_t i = 0;
+    while (1) {
+        while (i < data_size && data[i] != '<')
+            i++;
+        if (i >= data_size)
+            break;
+
+        TTag tag;
+        tag.start = i++;
+        while (i < data_size && data[i] != '>' && data[i] != ' ')
+            i++;
+        if (i >= data_size)
+            break;
+        tag.name_len = i - tag.start - 1;
+
+        /* GetTag() only finds tags without attributes */
+        const bool attributes = data[i] == ' ';
+        while (i < data_size && data[i] != '>')
+            i++;
+        if (i >= data_size)
+            break;
+
+        /* the text up to the next tag */
+        uint32_t end = ++i;
+        while (end < data_size && data[end] && data[end] != '<')
+            end++;
+        tag.content_end = end;
+
+        if (attributes)
+            continue;
+        names[upper_case(data + tag.start + 1, tag.name_len)].push_back(
+            tags.size());
+        tags.push_back(tag);
+    }
+    debug("indexed %u tags", (unsigned int)tags.size());
+}
+
+/* The first tag named find that GetTag() would find in the range, or NULL */
+const XmlIndex::TTag *XmlIndex::Find(const char *find, uint8_t *data,
+                                     uint32_t data_size) const
+{
+    const uint32_t find_len = strlen(find);
+    map<string, vector<uint32_t> >::const_iterator it =
+        names.find(upper_case(reinterpret_cast<const uint8_t*>(find),
+                              find_len));
+    if (it == names.end())
+        return NULL;
+
+    /* the first such tag at or after data */
+    const vector<uint32_t> &list = it->second;
+    uint32_t lo = 0, hi = list.size();
+    const uint32_t from = data - xml;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (tags[list[mid]].start < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == list.size())
+        return NULL;
+
+    const TTag &tag = tags[list[lo]];
+    if (tag.start + find_len + 2 > from + data_size)
+        return NULL;
+
+    return &tag;
+}
+
+bool XmlIndex::Covers(uint8_t *data, uint32_t data_size) const
+{
+    return xml && data >= xml && data + data_size <= xml + xml_size;
+}
+
+int XmlIndex::GetTag(const char *find, uint8_t *data, uint32_t data_size,
+                     uint8_t *&found, string *s, bool find_attributes) const
+{
+    if (find_attributes || !Covers(data, data_size))
+        return ::GetTag(find, data, data_size, found, s, find_attributes);
+
+    const TTag *tag = Find(find, data, data_size);
+    if (!tag)
+        return -1;
+
+    found = xml + tag->start + tag->name_len + 2;
+    if (s) {
+        /* like GetTag(), take at least one character even at the end */
+        const uint32_t end = data + data_size - xml;
+        const uint32_t limit = end > found - xml ? end : found - xml + 1;
+        const uint32_t content_end =
+            tag->content_end < limit ? tag->content_end : limit;
+        s->assign(reinterpret_cast<const char*>(found),
+                  xml + content_end - found);
+    }
+    return 0;
+}
+
+int XmlIndex::GetTagContent(const char *find, uint8_t *data,
+                            uint32_t data_size, uint8_t *&found,
+                            uint32_t &content_len) const
+{
+    if (!Covers(data, data_size)) {
+        string s;
+        if (::GetTag(find, data, data_size, found, &s))
+            return -1;
+        content_len = s.size();
+        return 0;
+    }
+
+    const TTag *tag = Find(find, data, data_size);
+    if (!tag)
+        return -1;
+
+    found = xml + tag->start + tag->name_len + 2;
+    const uint32_t end = data + data_size - xml;
+    content_len = (tag->content_end < end ? tag->content_end : end) -
+        (found - xml);
+    return 0;
+}
+
 // Given a set of XML attributes, e.g., ATTR1="VALUE1" ATTR2="VALUE2", this
 // function will find a given attribute and return its value.
 int GetAttribute(const char *find, string data, string *result)
@@ -295,26 +436,27 @@ void add_usbnet_headers(char *post_data, TRemoteInfo &ri)
     sprintf(post_data+strlen(post_data), "%s", post_xml_usbnet3);
 }
 
-int Post(uint8_t *xml, uint32_t xml_size, const char *root, TRemoteInfo &ri,
+int Post(const XmlIndex &xml, const char *root, TRemoteInfo &ri,
          bool has_userid, bool add_cookiekeyval, bool z_post, string *learn_seq,
          string *learn_key)
 {
-    uint8_t *x = xml;
+    uint8_t *const xml_end = xml.GetXml() + xml.GetXmlSize();
+    uint8_t *x;
     int err;
-    if ((err = GetTag(root, x, xml_size - (x - xml), x)))
+    if ((err = xml.GetTag(root, x)))
         return err;
 
     string server, path, cookie, userid;
 
-    if ((err = GetTag("SERVER", x, xml_size - (x - xml), x, &server)))
+    if ((err = xml.GetTag("SERVER", x, xml_end - x, x, &server)))
         return err;
-    if ((err = GetTag("PATH", x, xml_size - (x - xml), x, &path)))
+    if ((err = xml.GetTag("PATH", x, xml_end - x, x, &path)))
         return err;
-    if ((err = GetTag("VALUE", x, xml_size - (x - xml), x, &cookie)))
+    if ((err = xml.GetTag("VALUE", x, xml_end - x, x, &cookie)))
         return err;
     if (has_userid) {
         uint8_t *n = 0;
-        if ((err = GetTag("VALUE", x, xml_size - (x - xml), n, &userid)))
+        if ((err = xml.GetTag("VALUE", x, xml_end - x, n, &userid)))
             return err;
     }
 
@@ -21,6 +21,8 @@
 #ifndef WEB_H
 #define WEB_H
 
+#include <map>
+#include <vector>
 #include "remote.h"
 
 int GetTag(const char *find, uint8_t* data, uint32_t data_size, uint8_t *&found,
@@ -28,10 +30,58 @@ int GetTag(const char *find, uint8_t* data, uint32_t data_size, uint8_t *&found,
 
 int GetAttribute(const char *find, string data, string *result);
 
+/*
+ * Every tag in an XML buffer, found in a single pass when the buffer is
+ * indexed, so that looking up tags doesn't mean scanning the buffer again
+ * each time. GetTag() gives the same results as the GetTag() above on the
+ * same range of the buffer, which must be the indexed one or part of it.
+ * Anything else, and attribute lookups, are passed on to the plain
+ * GetTag().
+ */
+class XmlIndex {
+private:
+    struct TTag {
+        /* offset of the '<' */
+        uint32_t start;
+        uint32_t name_len;
+        /* offset of the end of the text after the tag */
+        uint32_t content_end;
+    };
+    uint8_t *xml;
+    uint32_t xml_size;
+    vector<TTag> tags;
+    /* indices into tags, by upper case tag name */
+    map<string, vector<uint32_t> > names;
+    const TTag *Find(const char *find, uint8_t *data,
+                     uint32_t data_size) const;
+    bool Covers(uint8_t *data, uint32_t data_size) const;
+
+public:
+    XmlIndex() : xml(NULL), xml_size(0) {}
+    void Build(uint8_t *data, uint32_t data_size);
+    int GetTag(const char *find, uint8_t *data, uint32_t data_size,
+               uint8_t *&found, string *s = NULL,
+               bool find_attributes = false) const;
+    /* GetTag() over the whole indexed buffer */
+    int GetTag(const char *find, uint8_t *&found, string *s = NULL,
+               bool find_attributes = false) const
+    {
+        return GetTag(find, xml, xml_size, found, s, find_attributes);
+    }
+    /*
+     * Like GetTag(), but giving the length of the tag's content (up to the
+     * next tag) instead of copying it.
+     */
+    int GetTagContent(const char *find, uint8_t *data, uint32_t data_size,
+                      uint8_t *&found, uint32_t &content_len) const;
+    uint8_t *GetXml() const {return xml;}
+    uint32_t GetXmlSize() const {return xml_size;}
+};
+
 int encode_ir_signal(uint32_t carrier_clock, uint32_t *ir_signal,
                      uint32_t ir_signal_length, string *learn_seq);
 
-int Post(uint8_t *xml, uint32_t xml_size, const char *root, TRemoteInfo &ri,
+int Post(const XmlIndex &xml, const char *root, TRemoteInfo &ri,
          bool has_userid, bool add_cookiekeyval = false, bool z_post = false,
          string *learn_seq=NULL, string *learn_key=NULL);
 
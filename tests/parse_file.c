@@ -0,0 +1,73 @@
+/*
+ * vim:tw=80:ai:tabstop=4:softtabstop=4:shiftwidth=4:expandtab
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks that read_and_parse_file() takes XML-only files that end right
+ * at, or one byte after, </INFORMATION> for what they are, rather than
+ * looking for a binary past the end of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libconcord.h"
+
+static const char *connectivity_xml =
+    "<INFORMATION>\r\n"
+    "<KEY>GETZAPSONLY</KEY>\r\n"
+    "</INFORMATION>";
+
+static int check(const char *name, const char *tail)
+{
+    char file_name[] = "/tmp/lc_parse_XXXXXX";
+    int type = -1;
+    int err;
+
+    int fd = mkstemp(file_name);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    FILE *f = fdopen(fd, "wb");
+    fputs(connectivity_xml, f);
+    fputs(tail, f);
+    fclose(f);
+
+    err = read_and_parse_file(file_name, &type);
+    unlink(file_name);
+    if (err || type != LC_FILE_TYPE_CONNECTIVITY) {
+        printf("FAIL %s: err %d (%s), type %d\n", name, err,
+               lc_strerror(err), type);
+        return 1;
+    }
+    delete_opfile_obj();
+    printf("ok   %s\n", name);
+    return 0;
+}
+
+int main()
+{
+    int failures = 0;
+
+    failures += check("ends at </INFORMATION>", "");
+    failures += check("ends one byte after </INFORMATION>", "\n");
+    failures += check("ends with CR LF after </INFORMATION>", "\r\n");
+
+    return failures ? 1 : 0;
+}